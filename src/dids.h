@@ -24,9 +24,53 @@
 #include <stdio.h>
 #include <libpq-fe.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define BUFFER_SIZE 2048
 
+// Number of bits that differ between two perceptual hashes, 0 to 64.
+#define PHASH_DISTANCE(a, b) __builtin_popcountll((a) ^ (b))
+
+// Bytes of compare ordered data between checks of the error so far. A multiple of 3.
+#define COMPARE_CHECKPOINT_BYTES 12
+
+// Which matches CompareToList reports, see Compare_Options.
+#define COMPARE_MODE_BEST 0
+#define COMPARE_MODE_ALL  1
+#define COMPARE_MODE_TOPK 2
+#define COMPARE_TOPK_MAX  100
+#define COMPARE_DEADLINE_MS_MAX 600000
+
+// Most pivot images kept, for pruning pairs by the triangle inequality.
+#define PIVOT_MAX 16
+
+// Most shards a fullcompare can be split into.
+#define SHARD_MAX 1024
+
+// FNV-1a hashing, for pixel hashes and checkpoint fingerprints.
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME        1099511628211ULL
+
+// fullcompare checkpoints, see ppm_checkpoint.c.
+#define CHECKPOINT_ID_MAX 32
+#define CHECKPOINT_FILE_TEMPLATE "/var/tmp/dids_fullcompare_%s.checkpoint"
+#define CHECKPOINT_SYNC_SECONDS 10
+
+// The journal of adds and dels, written to SQL behind the replies, see ppm_journal.c.
+#define JOURNAL_HEADER "dids_journal 1"
+#define JOURNAL_BATCH_MAX 256 // Most entries written to SQL in one transaction.
+#define JOURNAL_RETRY_SECONDS 5 // After SQL failed, wait this long before trying again.
+
+// The shared corpus, read by the reader processes, see ppm_shared.c.
+#define SHARED_CORPUS_TEMPLATE "/dev/shm/dids_corpus_port_%d"
+#define SHARED_CORPUS_MAGIC 0x3153524f43534444ULL
+#define SHARED_CORPUS_MIN_BYTES (1024 * 1024)
+#define SHARED_RECORD_ADD 1
+#define SHARED_RECORD_DELETE 2
+
 typedef struct Color {
     unsigned char r;
     unsigned char g;
@@ -56,6 +100,17 @@ typedef struct Similar_but_different {
     struct Similar_but_different *next;
 } Similar_but_different;
 
+/*
+ * Coarse versions of a thumbnail, 4x4 and 8x8 cells, for comparing coarse-to-fine.
+ * Each cell holds the sum of each colour over its pixels.
+ */
+typedef struct PPM_Levels {
+    unsigned short cell_pixels_4; // Pixels in each cell, or 0 if this level is not available.
+    unsigned short cell_pixels_8;
+    unsigned short sums_4[3 * 4 * 4];
+    unsigned short sums_8[3 * 8 * 8];
+} PPM_Levels;
+
 /*
  * Define a link in a single linked list of PPMs.
  */
@@ -66,40 +121,557 @@ typedef struct PicInfo {
     // A list of false positives we will need to ignore.
     Similar_but_different *similar_but_different;
     PPM_Info *picinf;
+    // Hash of the pixels in picinf. Equal pixels give equal hashes.
+    unsigned long long pixel_hash;
+    // Perceptual hash of picinf. Similar images give hashes with few bits different.
+    unsigned long long phash;
+    // Coarse versions of picinf.
+    PPM_Levels levels;
+    // The pixels of picinf in compare order, see ppm_info_compare_order(). NULL if not available.
+    unsigned char *compare_data;
+    // sqrt(error) from picinf to each pivot image, valid while pivot_version matches the Pivot_Table.
+    unsigned int pivot_version;
+    float pivot_distances[PIVOT_MAX];
+    // When the image was added, from dids_ppm.created. For fullcompare since=.
+    time_t created;
+    // Position in the list, set by fullcompare for clusters.
+    unsigned long list_index;
+    // References held on the image: one by the list, and one by each corpus copy sharing its data.
+    int refs;
+    // For a copy in a corpus, see ppm_snapshot.c: the image copied, and the versions of the list
+    // the copy was added and deleted in, 0 if not deleted. NULL and 0 for the list's own images.
+    struct PicInfo *original;
+    unsigned long version_added;
+    unsigned long version_deleted;
 } PicInfo;
 
+// The next image, read so the copies a corpus has just published are seen whole.
+#define PICINFO_NEXT(pic) __atomic_load_n(&(pic)->next, __ATOMIC_ACQUIRE)
+// True if the image is in that version of the list. Every image is in version 0.
+// version_deleted 0 less 1 wraps round to the highest version.
+#define PICINFO_IN_VERSION(pic, version) (!(version) || (((pic)->version_added <= (version)) \
+        && (__atomic_load_n(&(pic)->version_deleted, __ATOMIC_RELAXED) - 1 >= (version))))
+
+/*
+ * Groups of matched images, as a union-find over their list_index.
+ * Worker threads join groups at once without a lock, see ppm_cluster.c.
+ */
+typedef struct Cluster_Set {
+    unsigned long count;
+    unsigned long *parent;  // The root of a group is its own parent.
+    unsigned int *err_min;  // Lowest and highest err of the matches joined from each image.
+    unsigned int *err_max;
+} Cluster_Set;
+
+/*
+ * Pivot images. sqrt(error) between thumbnails is a Euclidean distance, so for
+ * any pivot p the distance between a and b is at least |d(a,p) - d(b,p)|.
+ * The pivots are copies, so they stay valid when the images are deleted.
+ */
+typedef struct Pivot_Table {
+    unsigned int version; // Changes whenever the pivots do. 0 is never used.
+    int count;
+    PPM_Info *pivots[PIVOT_MAX];
+    unsigned long image_count; // Images when the pivots were chosen.
+    unsigned long changes;     // Images added or deleted since.
+} Pivot_Table;
+
+/*
+ * A hash table of PicInfo, keyed on pixel_hash.
+ * Used to find exact duplicates without comparing all the pixels.
+ */
+typedef struct Exact_Entry {
+    PicInfo *pic;
+    struct Exact_Entry *next;
+} Exact_Entry;
+
+typedef struct Exact_Index {
+    unsigned long bucket_count; // Always a power of two.
+    unsigned long entry_count;
+    Exact_Entry **buckets;
+} Exact_Index;
+
+/*
+ * A pool of worker threads, kept for the life of the server, see ppm_pool.c.
+ */
+typedef void *(*Pool_Function)(void *arg);
+
+// Classes of task, taken from the queue in this order, each with its own limits, see worker_pool_limit().
+#define POOL_CLASS_INTERACTIVE 0 // quickcompare, a client is waiting.
+#define POOL_CLASS_BATCH 1       // fullcompare.
+#define POOL_CLASS_COUNT 2
+
+typedef struct Pool_Task {
+    Pool_Function function;
+    void *arg;
+    int *pending; // NULL, or the count of the batch this task is in.
+    int pool_class;
+    struct timespec queued_at;
+    struct Pool_Task *next;
+} Pool_Task;
+
+typedef struct Pool_Class {
+    Pool_Task *first;  // The queue of tasks of the class waiting for a thread.
+    Pool_Task *last;
+    unsigned long queued;
+    unsigned long queued_max;  // 0, or the most tasks waiting before more are refused.
+    int busy;          // Tasks of the class being run.
+    int busy_max;      // The most threads running tasks of the class at once.
+    unsigned long long tasks_run;
+    unsigned long long refused;
+    double wait_seconds;  // Time the tasks run waited for a thread, in total and the longest.
+    double wait_seconds_max;
+} Pool_Class;
+
+typedef struct Worker_Pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t task_queued;
+    pthread_cond_t task_done;
+    Pool_Class classes[POOL_CLASS_COUNT];
+    unsigned long queued;
+    int busy;          // Tasks being run.
+    unsigned long long tasks_run;
+    int thread_count;
+    pthread_t *threads;
+    int stopping;
+} Worker_Pool;
+
+/*
+ * Copies of the images, read by compares on other threads while add and del
+ * change the list. Copies are only ever added, each marked with the versions of
+ * the list it is in, and published with atomic stores, so every version still
+ * pinned by a Snapshot can be read as it was. The copies share the thumbnails of
+ * the images, and are freed with the corpus when its last reference is released.
+ * See ppm_snapshot.c.
+ */
+typedef struct Corpus {
+    int refs;
+    unsigned long version;     // The latest version of the list published.
+    PicInfo *first;            // The copies in list order, including those deleted.
+    unsigned long count;       // Copies in the latest version.
+    unsigned long deleted;     // Copies only in earlier versions.
+    PicInfo *copies;           // The copies made with the corpus. Those added later are allocated singly.
+    unsigned long copies_count;
+    Exact_Index *exact_index;  // Of the copies. It is not let grow, so can be read while copies are added.
+    Pivot_Table *pivot_table;  // NULL, or a copy of the pivots when the corpus was made.
+} Corpus;
+
+/*
+ * One version of the list of images, pinned for a compare. It does not change
+ * however the list does. See ppm_snapshot.c.
+ */
+typedef struct Snapshot {
+    Corpus *corpus;            // Holding a reference.
+    unsigned long version;     // Compares skip copies not in this version, see PICINFO_IN_VERSION.
+    unsigned long count;       // Images in this version.
+    PicInfo *list;
+    Exact_Index *exact_index;
+    Pivot_Table *pivot_table;
+    PicInfo *flat;             // NULL, or the array holding list, see snapshot_flatten().
+} Snapshot;
+
+/*
+ * The images in a file mapped by several processes: the server writes it, and
+ * the reader processes compare with it. It is a header, then records of the
+ * images added and deleted, in the order the list changed. Records are only
+ * appended, and published by the header, so readers never see one half written.
+ * When the file is full, or mostly deleted images, a new file replaces it.
+ * See ppm_shared.c.
+ */
+typedef struct Shared_Header {
+    unsigned long long magic;
+    unsigned long generation;  // Counts the files that have replaced each other.
+    unsigned long capacity;    // Bytes in the file.
+    unsigned long used;        // Bytes of records published, from the start of the file.
+    unsigned long version;     // Of the list, once the records published are read.
+    int replaced;              // Set once a new file has replaced this one.
+} Shared_Header;
+
+typedef struct Shared_Record {
+    unsigned long size;        // Bytes, with what follows it, a multiple of 8.
+    int type;                  // SHARED_RECORD_ADD or SHARED_RECORD_DELETE.
+    int external_ref_bytes;    // With the terminating 0.
+    // The rest are for SHARED_RECORD_ADD, but pixel_hash, which a delete has too, so readers find
+    // the image in their exact index. After the record are the external_ref, the 'similar
+    // but different' external_refs, each with a terminating 0, then from the next multiple
+    // of 8, the pixels, then the pixels in compare order if has_compare_data.
+    int similar_but_different_bytes;
+    int width;
+    int height;
+    int has_compare_data;
+    unsigned long long pixel_hash;
+    unsigned long long phash;
+    long long created;
+    PPM_Levels levels;
+} Shared_Record;
+
+// The server's side of the shared corpus.
+typedef struct Shared_Corpus {
+    char filename[256];
+    int fd;
+    Shared_Header *header;     // The file, mapped.
+    unsigned long deleted_bytes; // Of the records of images since deleted, and their deletes.
+} Shared_Corpus;
+
+// A reader process's side: the images are its own list, with the pixels in the file.
+typedef struct Shared_Reader {
+    char filename[256];
+    int fd;
+    Shared_Header *header;     // NULL until the server has written the file.
+    unsigned long mapped;      // Bytes mapped.
+    unsigned long offset;      // Of the next record to read.
+    PicInfo *list;             // In external_ref order.
+    PicInfo *tail;             // The last of list, as records of a new file are added in order.
+    unsigned long count;
+    unsigned long deleted;     // Images deleted, but still in list until the end of the refresh.
+    Exact_Index *exact_index;
+    Pivot_Table *pivot_table;  // NULL for no pivots.
+    int pivot_count;
+} Shared_Reader;
+
+/*
+ * The framed binary protocol, see dids_frame.c. A connection whose first bytes are
+ * FRAME_MAGIC sends request frames, and is sent reply frames, rather than text lines.
+ * Each frame is a header, then length bytes of payload. Integers are in network byte order.
+ * Header: magic (4), type (2), status (2), request_id (4), length (4).
+ * Every reply has the request_id of its request. Replies to different requests may be mixed.
+ */
+#define FRAME_MAGIC 0x44494442 // "DIDB"
+#define FRAME_HEADER_BYTES 16
+#define FRAME_PAYLOAD_MAX (BUFFER_SIZE - FRAME_HEADER_BYTES - 1)
+// Requests.
+#define FRAME_QUICKCOMPARE_THUMB 1 // Payload: a thumbnail, see frame_thumb_encode().
+#define FRAME_ADD_THUMB 2          // Payload: a thumbnail, see frame_thumb_encode().
+#define FRAME_DEL 3                // Payload: the external_ref.
+// Replies.
+#define FRAME_MATCH 16             // Payload: err (4), then the external_ref of the image matched.
+#define FRAME_DONE 17              // The request succeeded, no more replies to it. No payload.
+#define FRAME_ERROR 18             // The request failed, with status its code. Payload: the error messages.
+
+typedef struct Frame_Header {
+    unsigned int type;
+    unsigned int status;
+    unsigned int request_id;
+    unsigned int length;
+} Frame_Header;
+
+// A thumbnail request, see frame_thumb_encode().
+typedef struct Frame_Thumb {
+    int mode;                  // COMPARE_MODE_BEST, COMPARE_MODE_ALL or COMPARE_MODE_TOPK.
+    int topk;
+    char *external_ref;
+    PPM_Info *ppm;
+} Frame_Thumb;
+
+// A connection using frames, shared by the server thread and the compares replying on it.
+typedef struct Frame_Connection {
+    int fd;                    // A dup() of the client's socket, closed with the last reference.
+    int refs;
+    pthread_mutex_t mutex;     // Held while writing a frame, so frames written by different threads aren't mixed.
+} Frame_Connection;
+
+// Where to reply to a request with frames.
+typedef struct Frame_Reply {
+    Frame_Connection *connection;
+    unsigned int request_id;
+} Frame_Reply;
+
+/*
+ * Counts of how pairs of images were compared, or rejected without comparing every pixel.
+ */
+typedef struct Compare_Stats {
+    unsigned long long pairs;            // Pairs of images considered.
+    unsigned long long exact_skipped;    // Exact duplicates, already reported from the index.
+    unsigned long long phash_rejected;   // Perceptual hashes too far apart.
+    unsigned long long pivot_rejected;   // Distances to a pivot too different.
+    unsigned long long level_4_rejected; // Lower bound from the 4x4 level too high.
+    unsigned long long level_8_rejected; // Lower bound from the 8x8 level too high.
+    unsigned long long full_compares;    // Compared pixel by pixel.
+    unsigned long long bytes_compared;   // Bytes of pixels read by those compares, from each image.
+    unsigned long long deadline_skipped; // Not considered, as the deadline had passed.
+} Compare_Stats;
+
+/*
+ * Options for comparing images, as asked for by a command.
+ * Pass NULL for the defaults, or set them with compare_options_init().
+ */
+typedef struct Compare_Options {
+    // Exact duplicates have already been reported from this index, so skip them when comparing pixels.
+    Exact_Index *exact_index;
+    // Only report exact duplicates, don't compare pixels. (fullcompare)
+    int exact_only;
+    // Skip pairs whose perceptual hashes differ in more bits than this. -1 compares every pair.
+    int phash_max_distance;
+    // NULL, or where to count how pairs were compared.
+    Compare_Stats *stats;
+    // NULL, or pivots to rule out pairs by the triangle inequality.
+    Pivot_Table *pivot_table;
+    // COMPARE_MODE_BEST, COMPARE_MODE_ALL or COMPARE_MODE_TOPK, keeping the closest topk.
+    int mode;
+    int topk;
+    // 0, or only compare pairs where at least one image was created at or after this time. (fullcompare)
+    time_t since;
+    // "", or the checkpoint to write, or with resume to carry on from. (fullcompare)
+    char checkpoint_id[CHECKPOINT_ID_MAX];
+    int resume;
+    // With shard_count, only do shard (0 to shard_count - 1) of the work. (fullcompare)
+    int shard;
+    int shard_count;
+    // Report groups of matched images, rather than each match. (fullcompare)
+    int clusters;
+    // NULL, or where matches are joined into groups rather than reported. Set by fullcompare.
+    Cluster_Set *cluster_set;
+    // NULL, or the pool whose threads fullcompare uses, rather than starting its own.
+    Worker_Pool *worker_pool;
+    // NULL, or set non-zero to stop fullcompare handing out more work.
+    int *cancel;
+    // 0, or only compare with the images in this version of a snapshot's list.
+    unsigned long version;
+    // NULL, or reply with a frame for each match, rather than a text line. (quickcompare)
+    Frame_Reply *frame_reply;
+    // 0, or stop comparing at deadline, deadline_ms after the options were parsed, reporting the
+    // matches so far. The images are compared closest first, as far as can be told cheaply. (quickcompare)
+    long deadline_ms;
+    struct timespec deadline;
+} Compare_Options;
+
+/*
+ * The checkpoint of a fullcompare. A journal file of the work units finished,
+ * each with the matches it reported.
+ */
+typedef struct Checkpoint {
+    FILE *fh;
+    char filename[256];
+    unsigned long unit_count;
+    unsigned char *units_done; // For each work unit, true once it is in the journal.
+    unsigned long units_done_count;
+    time_t synced; // When the journal was last synced to disk.
+} Checkpoint;
+
+/*
+ * A write to dids_ppm, one of a batch, see ppm_write_batch().
+ * An add replaces any row with the same external_ref. A del has no thumbnail.
+ */
+typedef struct PPM_Write {
+    int add;
+    char *external_ref;
+    long created;  // In seconds since 1970.
+    int width;
+    int height;
+    char *hexdata;
+} PPM_Write;
+
+/*
+ * An add SQL refused, after it was replied to, so the server takes it out of RAM.
+ */
+typedef struct Journal_Refused {
+    struct Journal_Refused *next;
+    time_t created;  // Of the add, so a later add of the same external_ref is kept.
+    char external_ref[];
+} Journal_Refused;
+
+/*
+ * The journal of adds and dels. Each is appended, and synced to disk, before
+ * the reply, then a writer thread writes the entries to SQL in batches.
+ * An entry SQL refuses on its own is moved to the refused file, FILENAME.refused.
+ * Offsets are in bytes from the start of the file.
+ */
+typedef struct Journal {
+    char filename[256];
+    char refused_filename[264];
+    FILE *refused_fh;  // Appended to by the writer thread, opened when first needed.
+    Journal_Refused *refused;  // Adds refused, not yet taken out of RAM, see journal_refused_take().
+    FILE *fh;       // Appended to by the server thread.
+    FILE *read_fh;  // Read by the writer thread.
+    char *sql_info;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    long header_bytes;
+    long end;       // Where the next entry is appended.
+    long written;   // The entries before this are in SQL.
+    int holds;      // While non-zero the journal is not started again, see journal_hold().
+    int stop;
+    unsigned long long entries_written;
+    unsigned long long batches;
+    unsigned long long entries_failed; // Refused by SQL, so moved to the refused file.
+    unsigned long long sql_errors;
+} Journal;
+
+/*
+ * The state of one fullcompare, shared by its worker threads.
+ */
+typedef struct Fullcompare_Run {
+    pthread_mutex_t mutex;
+    PicInfo *worklist;
+    // All the images, for modes that compare each image with all the others.
+    PicInfo *full_list;
+    // The next work unit number. Each image is one work unit.
+    unsigned long unit_next;
+    // NULL, or where finished work units are recorded, so a stopped fullcompare can be resumed.
+    Checkpoint *checkpoint;
+    // The work units of this shard, from first up to but not including end.
+    unsigned long unit_first;
+    unsigned long unit_end;
+    // NULL, or the pairs compared before each work unit, when not every pair is compared once,
+    // see fullcompare_shard_units(). Then progress is of these pairs.
+    long double *pairs_before;
+    // How many image comparison sets will be done, and remain to do.
+    unsigned long long set_count;
+    unsigned long long set_count_remaining;
+    // How many image comparisons we are expecting to do, and how many remained when last reported.
+    long double compare_total;
+    long double compare_remaining_reported;
+    // NULL, or stop handing out work once set non-zero.
+    int *cancel;
+} Fullcompare_Run;
+
 // dids_util.c
 void error(FILE *sock_fh, const char *fmt, ...);
 void debug(FILE *sock_fh, const char *fmt, ...);
+socklen_t unix_socket_address(struct sockaddr_un *address, char *path);
 
 // ppm_info.c
 PPM_Info *ppm_info_allocate(int width, int height);
 void ppm_info_free(PPM_Info *ppm);
+unsigned long long ppm_info_hash(PPM_Info *ppm);
+unsigned long long ppm_info_phash(PPM_Info *ppm);
+void ppm_info_levels(PPM_Info *ppm, PPM_Levels *levels);
+unsigned char *ppm_info_compare_order(PPM_Info *ppm);
+unsigned int ppm_data_compare(unsigned char *data1, unsigned char *data2, int length, int checkpoint,
+        unsigned int err_limit, unsigned long long *bytes_ptr);
 
 // ppm_sql.c
 PGconn *ppm_sql_connect(FILE *sock_fh, char *sql_info);
 void ppm_sql_disconnect(FILE *sock_fh, PGconn *psql);
 PGresult *pq_query(PGconn *psql, const char *format, ...);
 
-// ppm_dao.c
+// ppm_hexdata.c
 int xtod(char c);
 char *ppm_to_hexdata(PPM_Info *ppm);
+void hexdata_to_ppm(PPM_Info *ppm, char *hexstring);
+PPM_Info *ppm_from_hexdata(FILE *sock_fh, char *hexstring, int width, int height);
+
+// ppm_dao.c
+int ppm_sql_prepare(FILE *sock_fh, PGconn *psql);
 int ppm_store(FILE *sock_fh, PGconn *psql, char *external_ref, PPM_Info *ppm);
 int ppm_del(FILE *sock_fh, PGconn *psql, char *external_ref);
+int ppm_write_batch(FILE *sock_fh, PGconn *psql, PPM_Write *writes, int count);
 PPM_Info *tuple_to_ppm(FILE *sock_fh, PGresult *result, int tuple);
 PPM_Info *ppm_load_from_sql(FILE *sock_fh, PGconn *psql, char *external_ref);
 int ppm_load_all_from_sql(FILE *sock_fh, PGconn *psql, PicInfo **list_ref);
 
+// ppm_pivot.c
+Pivot_Table *pivot_table_create();
+void pivot_table_free(Pivot_Table *table);
+int pivot_table_build(FILE *sock_fh, Pivot_Table *table, PicInfo *list, int pivot_count);
+void pivot_table_distances(Pivot_Table *table, PicInfo *pic);
+int pivot_table_changed(Pivot_Table *table);
+Pivot_Table *pivot_table_copy(Pivot_Table *table);
+
+// ppm_checkpoint.c
+unsigned long long checkpoint_fingerprint(PicInfo *list, unsigned int maxerr, Compare_Options *options);
+int checkpoint_id_valid(char *id);
+Checkpoint *checkpoint_open(FILE *sock_fh, char *id, unsigned long long fingerprint, unsigned long unit_count,
+        int resume);
+void checkpoint_unit(Checkpoint *checkpoint, FILE *sock_fh, unsigned long unit, char *output, size_t length);
+void checkpoint_close(Checkpoint *checkpoint, int finished);
+
+// ppm_journal.c
+Journal *journal_open(FILE *sock_fh, char *filename, char *sql_info);
+int journal_add(FILE *sock_fh, Journal *journal, char *external_ref, PPM_Info *ppm, time_t created);
+int journal_del(FILE *sock_fh, Journal *journal, char *external_ref);
+long journal_hold(Journal *journal);
+int journal_replay(FILE *sock_fh, Journal *journal, long offset, PicInfo **list_ref);
+Journal_Refused *journal_refused_take(Journal *journal);
+void journal_close(Journal *journal);
+
+// ppm_cluster.c
+Cluster_Set *cluster_set_create(unsigned long count);
+void cluster_set_free(Cluster_Set *set);
+unsigned long cluster_set_find(Cluster_Set *set, unsigned long image);
+void cluster_set_union(Cluster_Set *set, unsigned long image_1, unsigned long image_2, unsigned int err);
+long cluster_set_report(FILE *sock_fh, Cluster_Set *set, PicInfo *list);
+
+// ppm_pool.c
+Worker_Pool *worker_pool_create(FILE *sock_fh, int thread_count);
+void worker_pool_free(Worker_Pool *pool);
+void worker_pool_limit(Worker_Pool *pool, int pool_class, int busy_max, unsigned long queued_max);
+int worker_pool_submit(Worker_Pool *pool, int pool_class, Pool_Function function, void *arg, int *pending);
+void worker_pool_wait(Worker_Pool *pool, int *pending);
+
+// ppm_shared.c
+Shared_Corpus *shared_corpus_create(FILE *sock_fh, char *filename, PicInfo *list, unsigned long version,
+        Shared_Corpus *old);
+int shared_corpus_add(FILE *sock_fh, Shared_Corpus *shared, PicInfo *pic, unsigned long version);
+int shared_corpus_delete(FILE *sock_fh, Shared_Corpus *shared, PicInfo *pic, unsigned long version);
+void shared_corpus_free(Shared_Corpus *shared, int remove);
+Shared_Reader *shared_reader_create(char *filename, int pivot_count);
+int shared_reader_refresh(FILE *sock_fh, Shared_Reader *reader);
+void shared_reader_free(Shared_Reader *reader);
+
+// ppm_snapshot.c
+Corpus *corpus_create(FILE *sock_fh, PicInfo *list, Pivot_Table *pivot_table, unsigned long version);
+int corpus_add(FILE *sock_fh, Corpus *corpus, PicInfo *pic, unsigned long version);
+int corpus_delete(Corpus *corpus, char *external_ref, unsigned long version);
+void corpus_release(Corpus *corpus);
+Snapshot *snapshot_pin(FILE *sock_fh, Corpus *corpus);
+Snapshot *snapshot_flatten(FILE *sock_fh, Snapshot *snapshot);
+void snapshot_release(Snapshot *snapshot);
+
+// dids_frame.c
+void frame_header_encode(unsigned char *buffer, Frame_Header *header);
+int frame_header_decode(unsigned char *buffer, Frame_Header *header);
+int frame_write(int fd, unsigned int type, unsigned int status, unsigned int request_id, void *payload,
+        unsigned int length);
+int frame_read(int fd, Frame_Header *header, unsigned char *payload);
+unsigned char *frame_thumb_encode(Frame_Thumb *thumb, unsigned int *length_ptr);
+int frame_thumb_decode(unsigned char *payload, unsigned int length, Frame_Thumb *thumb);
+void frame_thumb_free(Frame_Thumb *thumb);
+Frame_Connection *frame_connection_create(int fd);
+void frame_connection_release(Frame_Connection *connection);
+int frame_reply(Frame_Reply *reply, unsigned int type, unsigned int status, void *payload, unsigned int length);
+int frame_reply_match(Frame_Reply *reply, char *external_ref, unsigned int err);
+int frame_reply_done(Frame_Reply *reply, int status, char *text);
+
+// ppm_merge.c
+long match_merge(FILE *sock_fh, FILE *out, FILE **inputs, int input_count);
+
 // ppm_compare.c
-PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsigned int maxerr);
+void compare_options_init(Compare_Options *options);
+int compare_options_parse(FILE *sock_fh, Compare_Options *options, char *word);
+void compare_stats_add(Compare_Stats *total, Compare_Stats *stats);
+void compare_stats_report(FILE *sock_fh, Compare_Stats *stats);
+void compare_report_match(FILE *sock_fh, Compare_Options *options, PicInfo *pic, PicInfo *other, unsigned int err);
+PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsigned int maxerr,
+    Compare_Options *options);
 
 // ppm_fullcompare.c
-void fullcompare_set_work_list(PicInfo *list);
-PicInfo *fullcompare_get_work_item(FILE *sock_fh);
+void fullcompare_set_work_list(Fullcompare_Run *run, PicInfo *list);
+PicInfo *fullcompare_get_work_item(Fullcompare_Run *run, FILE *sock_fh, unsigned long *unit_ptr);
 void *fullcompare_worker(void *threadarg);
-int fullcompare(FILE *sock_fh, PicInfo *full_list, unsigned int maxerr, int thread_count);
+int fullcompare(FILE *sock_fh, PicInfo *full_list, unsigned int maxerr, int thread_count,
+    Compare_Options *options);
+long double fullcompare_pairs(PicInfo *full_list, Compare_Options *options);
 int quickcompare(FILE *sock_fh, PicInfo *picinfo_list, unsigned int maxerr, char *filename, char *external_ref,
-    int compare_size);
+    int compare_size, Compare_Options *options);
+int quickcompare_ppm(FILE *sock_fh, PicInfo *picinfo_list, unsigned int maxerr, PPM_Info *ppm, char *external_ref,
+    Compare_Options *options);
+int quickcompare_ref(FILE *sock_fh, PicInfo *picinfo_list, unsigned int maxerr, char *external_ref,
+    Compare_Options *options);
+
+// ppm_exact.c
+Exact_Index *exact_index_create();
+void exact_index_clear(Exact_Index *index);
+void exact_index_free(Exact_Index *index);
+int exact_index_add(Exact_Index *index, PicInfo *pic);
+void exact_index_remove(Exact_Index *index, PicInfo *pic);
+PicInfo *exact_index_find(Exact_Index *index, unsigned long long pixel_hash, char *external_ref);
+int exact_index_build(Exact_Index *index, PicInfo *list);
+int picinfo_exact_duplicate(PicInfo *p1, PicInfo *p2);
+int exact_index_report(FILE *sock_fh, Exact_Index *index, PicInfo *pic, Compare_Options *options);
+unsigned long exact_index_report_groups(FILE *sock_fh, Exact_Index *index, PicInfo *list, time_t since,
+        Cluster_Set *cluster_set);
 
 // ppm.c
 PPM_Info *ppm_miniature_from_filename(FILE *sock_fh, char *filename, int compare_size);
@@ -111,14 +683,24 @@ void PPM_SetBWPixel(PPM_Info *ppm, int x, int y, unsigned char l);
 void PPM_GetPixel(PPM_Info *ppm, int x, int y, Color *c);
 unsigned char PPM_GetBWPixel(PPM_Info *ppm, int x, int y, unsigned char *c);
 void SetColor(Color *c, unsigned char r, unsigned char g, unsigned char b);
+void ppm_set_raw_preview(int enabled);
+void ppm_set_exif_thumbnail(int enabled);
+
+// ppm_preview.c
+int preview_is_raw_filename(char *filename);
+unsigned char *preview_from_raw_filename(FILE *sock_fh, char *filename, int min_size, size_t *length_ptr);
+unsigned char *preview_from_exif_filename(FILE *sock_fh, char *filename, int min_size, size_t *length_ptr);
 
 // ppm_list.c
 PicInfo *PicInfoBuild(char *external_ref, PPM_Info *pic,Similar_but_different *similar_but_different);
 void PicInfoDelete(PicInfo *pic);
+void PicInfoRelease(PicInfo *pic);
 void PicInfoAddToList(FILE *sock_fh, PicInfo **list_ref, PicInfo *hlp);
 int PicInfoDeleteFromList(PicInfo **list_ref, char *external_ref);
+PicInfo *PicInfoFindInList(PicInfo *list, char *external_ref);
 
 // similar_but_different_dao.c
 int picinfo_list_refresh_similar_but_different(FILE *sock_fh, PGconn *psql, PicInfo *picinfo_list_ref);
 Similar_but_different *similar_but_different_search(Similar_but_different *sbd_ptr,char *external_ref);
+int similar_but_different_pair(PicInfo *pic, PicInfo *other);
 
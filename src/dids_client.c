@@ -1,6 +1,7 @@
 /*
  * This is the DIDS (Duplicate Image Detection System) command line client.
- * It communication with server by TCP/IP.
+ * It communicates with the server by TCP/IP, or a Unix domain socket.
+ * It can also make the thumbnails itself, so the server need not decode images.
  * Please see the README file for further details.
  *
  *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
@@ -25,13 +26,21 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <getopt.h>
+#include <wand/MagickWand.h>
 
-void error(const char *msg) {
+// Custom
+#include "dids.h"
+
+#define COMPARE_SIZE  16
+#define BINARY_WINDOW 32 // With --binary, the most requests waiting for their replies at once.
+
+void error_exit(const char *msg) {
     perror(msg);
     exit(0);
 }
@@ -39,15 +48,46 @@ void error(const char *msg) {
 void help(char *argv[]) {
     fprintf(stderr, "\n");
     fprintf(stderr, "usage %s --hostname localhost --port 10000 COMMAND ARGS \n", argv[0]);
+    fprintf(stderr, "      %s --socket PATH COMMAND ARGS \n", argv[0]);
+    fprintf(stderr, "      %s --binary add_thumb|quickcompare_thumb [options] external_ref_1 filename_1 ...\n", argv[0]);
+    fprintf(stderr, "      %s --binary del external_ref_1 ...\n", argv[0]);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "   --socket PATH : Connect to the server's Unix domain socket, rather than by TCP/IP.\n");
+    fprintf(stderr, "                   A PATH starting with @ is in the abstract namespace.\n");
+    fprintf(stderr, "   --binary      : Send a batch of add_thumb, quickcompare_thumb or del requests\n");
+    fprintf(stderr, "                   on one connection, in the framed binary protocol.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "COMMAND and ARGS:\n");
     fprintf(stderr, "     quit            : Stop listening for commands.\n");
     fprintf(stderr, "     add             : Learn a new image file by putting a new PPM into SQL and RAM.\n");
+    fprintf(stderr, "     add_thumb       : As add, but the PPM is made here by the client.\n");
+    fprintf(stderr, "     add_compare     : As quickcompare then add, with the file decoded only once.\n");
     fprintf(stderr, "     del             : Forget a PPM from both SQL and RAM.\n");
     fprintf(stderr, "     info            : Print statistics on e.g. how many PPMs in RAM, number of CPUs.\n");
     fprintf(stderr, "     load            : Load all PPM images from SQL into RAM.\n");
     fprintf(stderr, "     quickcompare    : Compare a single file to all PPMs in RAM and report potential duplicates.\n");
+    fprintf(stderr, "     quickcompare_thumb : As quickcompare, but the PPM is made here by the client.\n");
+    fprintf(stderr, "     quickcompare_ref : As quickcompare, for an image already added, by its external_ref.\n");
     fprintf(stderr, "     fullcompare     : Compare all PPMs in RAM and report potential duplicates.\n");
+    fprintf(stderr, "                       'fullcompare exact_only' only reports exact duplicates, which is much faster.\n");
+    fprintf(stderr, "     quickcompare, quickcompare_thumb, quickcompare_ref, add_compare and fullcompare\n");
+    fprintf(stderr, "     take options before their ARGS:\n");
+    fprintf(stderr, "                       mode=best : (default) Report each match as close as the closest so far.\n");
+    fprintf(stderr, "                       mode=all  : Report every match under maxerr.\n");
+    fprintf(stderr, "                       topk=N    : Report the N closest matches to each image.\n");
+    fprintf(stderr, "                       deadline_ms=N : (quickcompare, add_compare) Stop after N ms,\n");
+    fprintf(stderr, "                                   comparing the most likely images first,\n");
+    fprintf(stderr, "                                   and report the matches so far.\n");
+    fprintf(stderr, "                       since=T   : (fullcompare) Only compare images added since time T,\n");
+    fprintf(stderr, "                                   e.g. fullcompare_started from the last fullcompare.\n");
+    fprintf(stderr, "                       resume=ID : (fullcompare) Carry on from fullcompare_checkpoint ID.\n");
+    fprintf(stderr, "                       shard=I/N : (fullcompare) Only do shard I (0 to N-1) of N. See dids_merge.\n");
+    fprintf(stderr, "                       clusters  : (fullcompare) Report each group of matched images on one line.\n");
+    fprintf(stderr, "     fullcompare job [options] : Run fullcompare in the background, and print its job id.\n");
+    fprintf(stderr, "     job_status [JOB_ID]       : Show the progress of each job, or just JOB_ID.\n");
+    fprintf(stderr, "     job_results JOB_ID [OFFSET] : Print the results of a job so far, from OFFSET.\n");
+    fprintf(stderr, "                       Ask again from next_offset until more=0 and status is not running.\n");
+    fprintf(stderr, "     job_cancel JOB_ID         : Stop a job.\n");
     fprintf(stderr, "     refresh_similar_but_different : Refresh details that help avoid false matches.\n");
     fprintf(stderr, "     unload          : Free all PPM images from RAM.\n");
     fprintf(stderr, "     debug_sleep     : fork() then sleep for 60 seconds. Used to test fork()\n");
@@ -65,7 +105,7 @@ void read_and_print_reply(int sockfd){
         bzero(buffer, buff_size);
         n = read(sockfd, buffer, buff_size);
         if (n < 0){
-            error("ERROR reading from socket");
+            error_exit("ERROR reading from socket");
         }
         if (n > 0){
             buffer[n]='\0';
@@ -74,6 +114,190 @@ void read_and_print_reply(int sockfd){
     }
 }
 
+// Make the thumbnail of filename here in the client, exactly as the server would,
+// then put the command, external_ref and thumbnail as hex into the buffer.
+//
+// Return 0 on success, non-zero on failure.
+int thumb_command(char *buffer, int buff_size, char *command, char *external_ref, char *filename) {
+    MagickWandGenesis();
+    PPM_Info *ppm = ppm_miniature_from_filename(stderr, filename, COMPARE_SIZE);
+    MagickWandTerminus();
+    if (!ppm) {
+        return 1;
+    }
+    char *hexdata = ppm_to_hexdata(ppm);
+    ppm_info_free(ppm);
+    if (!hexdata) {
+        return 2;
+    }
+    int len = snprintf(buffer, buff_size, "%s %s %s\n", command, external_ref, hexdata);
+    free(hexdata);
+    if (len >= buff_size) {
+        return 3;
+    }
+    return 0;
+}
+
+// Append the compare options, e.g. mode=all, at the start of args to the command in buffer.
+//
+// Return the number of options.
+int compare_options_append(char *buffer, int buff_size, int arg_count, char **args) {
+    int option_count = 0;
+    while ((option_count < arg_count) && strchr(args[option_count], '=')) {
+        strncat(buffer, " ", buff_size - strlen(buffer) - 1);
+        strncat(buffer, args[option_count], buff_size - strlen(buffer) - 1);
+        option_count++;
+    }
+    return option_count;
+}
+
+// Set a compare option of a --binary quickcompare_thumb, mode=best, mode=all or topk=N.
+//
+// Return 0 on success, non-zero if not an option these requests take.
+int binary_option_parse(Frame_Thumb *options, char *word) {
+    if (strcmp(word, "mode=best") == 0) {
+        options->mode = COMPARE_MODE_BEST;
+    } else if (strcmp(word, "mode=all") == 0) {
+        options->mode = COMPARE_MODE_ALL;
+    } else if (strncmp(word, "topk=", 5) == 0) {
+        char *end;
+        long topk = strtol(word + 5, &end, 10);
+        if (*end || (topk < 1) || (topk > COMPARE_TOPK_MAX)) {
+            return 2;
+        }
+        options->mode = COMPARE_MODE_TOPK;
+        options->topk = topk;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+// Send one request of a --binary batch as a frame. The thumbnail is made here, as for add_thumb.
+//
+// Return 0 on success, non-zero after printing why the request was not sent.
+int binary_request_send(int sockfd, char *command, Frame_Thumb *options, char *external_ref, char *filename,
+        unsigned int request_id) {
+    if (strcmp(command, "del") == 0) {
+        if (frame_write(sockfd, FRAME_DEL, 0, request_id, external_ref, strlen(external_ref))) {
+            error_exit("ERROR writing to socket");
+        }
+        return 0;
+    }
+    Frame_Thumb thumb = *options;
+    thumb.external_ref = external_ref;
+    thumb.ppm = ppm_miniature_from_filename(stderr, filename, COMPARE_SIZE);
+    if (!thumb.ppm) {
+        fprintf(stderr, "ERROR failed to make thumbnail from filename %s\n", filename);
+        return 1;
+    }
+    unsigned int length;
+    unsigned char *payload = frame_thumb_encode(&thumb, &length);
+    ppm_info_free(thumb.ppm);
+    if (!payload) {
+        fprintf(stderr, "ERROR external_ref too long, or no memory, for filename %s\n", filename);
+        return 2;
+    }
+    int rc = frame_write(sockfd, (strcmp(command, "add_thumb") == 0) ? FRAME_ADD_THUMB : FRAME_QUICKCOMPARE_THUMB,
+            0, request_id, payload, length);
+    free(payload);
+    if (rc) {
+        error_exit("ERROR writing to socket");
+    }
+    return 0;
+}
+
+// With --binary, send a batch of requests as frames on the one connection, and print
+// the replies as they come, in the same lines as the text commands. Request N of the
+// batch has request id N, starting from 1; the replies to different requests may interleave.
+//   add_thumb          external_ref_1 filename_1 external_ref_2 filename_2 ...
+//   quickcompare_thumb [mode=all|best] [topk=N] external_ref_1 filename_1 ...
+//   del                external_ref_1 external_ref_2 ...
+//
+// Return the number of requests that failed.
+int binary_batch(int sockfd, char *command, int arg_count, char **args) {
+    Frame_Thumb options = { COMPARE_MODE_BEST, 0, NULL, NULL };
+    int option_count = 0;
+    if (strcmp(command, "quickcompare_thumb") == 0) {
+        while ((option_count < arg_count) && strchr(args[option_count], '=')) {
+            if (binary_option_parse(&options, args[option_count])) {
+                fprintf(stderr, "ERROR invalid option %s\n", args[option_count]);
+                return 1;
+            }
+            option_count++;
+        }
+    }
+    int per_request = (strcmp(command, "del") == 0) ? 1 : 2;
+    char **request_args = args + option_count;
+    int count = (arg_count - option_count) / per_request;
+    if (!count || ((arg_count - option_count) % per_request)) {
+        fprintf(stderr, "ERROR expecting %s\n", (per_request == 2) ? "pairs of external_ref and filename"
+                : "external_refs");
+        return 1;
+    }
+    char reply_name[32];
+    size_t i;
+    for (i = 0; command[i] && (i < sizeof reply_name - 1); i++) {
+        reply_name[i] = toupper(command[i]);
+    }
+    reply_name[i] = 0;
+
+    if (per_request == 2) {
+        MagickWandGenesis();
+    }
+    unsigned char payload[FRAME_PAYLOAD_MAX + 1];
+    int sent = 0, done = 0, waiting = 0, failed = 0;
+    while (done < count) {
+        while ((sent < count) && (waiting < BINARY_WINDOW)) {
+            char **request = request_args + sent * per_request;
+            if (binary_request_send(sockfd, command, &options, request[0], request[per_request - 1], sent + 1)) {
+                failed++;
+                done++;
+            } else {
+                waiting++;
+            }
+            sent++;
+        }
+        if (!waiting) {
+            continue;
+        }
+        Frame_Header header;
+        if (frame_read(sockfd, &header, payload)) {
+            fprintf(stderr, "ERROR connection closed with %d requests not done\n", count - done);
+            failed += count - done;
+            break;
+        }
+        if ((header.request_id < 1) || (header.request_id > (unsigned int) sent)) {
+            fprintf(stderr, "ERROR %s\n", payload);
+            failed += count - done;
+            break;
+        }
+        char *external_ref = request_args[(header.request_id - 1) * per_request];
+        if ((header.type == FRAME_MATCH) && (header.length > 4)) {
+            unsigned int err;
+            memcpy(&err, payload, 4);
+            printf("Match: %s, %s, %u\n", external_ref, payload + 4, ntohl(err));
+        } else if (header.type == FRAME_DONE) {
+            printf("%s SUCCESS %s\n", reply_name, external_ref);
+            waiting--;
+            done++;
+        } else if (header.type == FRAME_ERROR) {
+            char *line = strtok((char *) payload, "\n");
+            for (; line; line = strtok(NULL, "\n")) {
+                printf("ERROR: %s\n", line);
+            }
+            printf("%s FAILED, code %u\n", reply_name, header.status);
+            waiting--;
+            done++;
+            failed++;
+        }
+    }
+    if (per_request == 2) {
+        MagickWandTerminus();
+    }
+    return failed;
+}
+
 /* Flag set by ‘--verbose’. Not currently supported. */
 static int verbose_flag;
 
@@ -82,6 +306,8 @@ int main(int argc, char **argv) {
     struct hostent *server = gethostbyname("localhost");  // default host
     int n;
     struct sockaddr_in serv_addr;
+    char *socket_path = NULL; // Unix domain socket, rather than TCP/IP.
+    int binary = 0; // Send frames rather than text, see binary_batch().
     char *command;
     int sockfd;
 
@@ -93,12 +319,14 @@ int main(int argc, char **argv) {
         We distinguish them by their indices. */
         {"hostname",  required_argument, 0, 'h'},
         {"port",  required_argument, 0, 'p'},
+        {"socket",  required_argument, 0, 's'},
+        {"binary",  no_argument, 0, 'b'},
         {0, 0, 0, 0}
     };
     while (1){
         /* getopt_long stores the option index here. */
         int option_index = 0;
-        int c = getopt_long (argc, argv, "h:p:", long_options, &option_index);
+        int c = getopt_long (argc, argv, "bh:p:s:", long_options, &option_index);
 
         /* Detect the end of the options. */
         if (c == -1)
@@ -113,6 +341,14 @@ int main(int argc, char **argv) {
                 portno = atoi(optarg);
                 break;
 
+            case 's':
+                socket_path = optarg;
+                break;
+
+            case 'b':
+                binary = 1;
+                break;
+
             case '?':
                 /* getopt_long already printed an error message. */
                 break;
@@ -142,44 +378,107 @@ int main(int argc, char **argv) {
         exit(0);
     }
 
-    // Setup the socket
-    if (server == NULL) {
-        fprintf(stderr, "ERROR, no such host\n");
-        exit(0);
+    int buff_size = 4096;
+    char command_and_args_buffer[buff_size];
+
+    if (binary && (strcmp(command, "add_thumb") != 0) && (strcmp(command, "quickcompare_thumb") != 0)
+            && (strcmp(command, "del") != 0)) {
+        fprintf(stderr, "ERROR --binary is only for add_thumb, quickcompare_thumb and del\n");
+        exit(1);
     }
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0){
-        error("ERROR opening socket");
-        exit(0);
+
+    // Make the PPM before connecting, so no server connection is held while decoding.
+    // With --binary, each PPM of the batch is made while the server works on those sent before.
+    if (!binary && ((strcmp(command, "add_thumb") == 0)
+            || (strcmp(command, "quickcompare_thumb") == 0))) {
+        char command_and_options[256];
+        snprintf(command_and_options, sizeof command_and_options, "%s", command);
+        int option_count = 0;
+        if (strcmp(command, "quickcompare_thumb") == 0) {
+            option_count = compare_options_append(command_and_options, sizeof command_and_options,
+                    arg_count - 1, argv + optind + 1);
+        }
+        if (arg_count - option_count < 3) {
+            fprintf(stderr,
+                    "usage %s [options] %s external_ref_1 filename_1\n",
+                    argv[0], command);
+            exit(0);
+        }
+        char *external_ref = argv[optind + option_count + 1];
+        char *filename     = argv[optind + option_count + 2];
+        if (thumb_command(command_and_args_buffer, buff_size, command_and_options, external_ref, filename)) {
+            fprintf(stderr, "ERROR failed to make thumbnail from filename %s\n", filename);
+            exit(1);
+        }
     }
 
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *) server->h_addr, (char *) &serv_addr.sin_addr.s_addr,
-            server->h_length);
-    serv_addr.sin_port = htons(portno);
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
-        error("ERROR connecting");
+    // Setup the socket
+    if (socket_path) {
+        struct sockaddr_un serv_addr_unix;
+        socklen_t address_length = unix_socket_address(&serv_addr_unix, socket_path);
+        if (!address_length) {
+            fprintf(stderr, "ERROR, socket path too long\n");
+            exit(0);
+        }
+        sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sockfd < 0){
+            error_exit("ERROR opening socket");
+        }
+        if (connect(sockfd, (struct sockaddr *) &serv_addr_unix, address_length) < 0)
+            error_exit("ERROR connecting");
+    } else {
+        if (server == NULL) {
+            fprintf(stderr, "ERROR, no such host\n");
+            exit(0);
+        }
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sockfd < 0){
+            error_exit("ERROR opening socket");
+            exit(0);
+        }
 
-    int buff_size = 4096;
-    char command_and_args_buffer[buff_size];
+        bzero((char *) &serv_addr, sizeof(serv_addr));
+        serv_addr.sin_family = AF_INET;
+        bcopy((char *) server->h_addr, (char *) &serv_addr.sin_addr.s_addr,
+                server->h_length);
+        serv_addr.sin_port = htons(portno);
+        if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
+            error_exit("ERROR connecting");
+    }
+
+    if (binary) {
+        int failed = binary_batch(sockfd, command, arg_count - 1, argv + optind + 1);
+        close(sockfd);
+        return failed ? 1 : 0;
+    }
 
     // Commands without arguments:
-    // info, quit, load, fullcompare, unload, debug_show_tree, debug_sleep.
+    // info, quit, load, fullcompare, job_status, job_results, job_cancel, unload, debug_show_tree, debug_sleep.
+    int args_passed = (strcmp(command, "fullcompare") == 0)
+            || (strcmp(command, "job_status") == 0)
+            || (strcmp(command, "job_results") == 0)
+            || (strcmp(command, "job_cancel") == 0);
     if ((strcmp(command, "info") == 0)
             || (strcmp(command, "quit") == 0)
             || (strcmp(command, "load") == 0)
-            || (strcmp(command, "fullcompare") == 0)
+            || args_passed
             || (strcmp(command, "unload") == 0)
             || (strcmp(command, "debug_sleep") == 0)
             || (strcmp(command, "debug_show_tree") == 0)) {
 
-        snprintf(command_and_args_buffer, buff_size, "%s\n", command);
+        snprintf(command_and_args_buffer, buff_size, "%s", command);
+        // fullcompare may be given options, e.g. exact_only or mode=all, and the job commands a job id.
+        int arg;
+        for (arg = optind + 1; args_passed && (arg < argc); arg++) {
+            strncat(command_and_args_buffer, " ", buff_size - strlen(command_and_args_buffer) - 1);
+            strncat(command_and_args_buffer, argv[arg], buff_size - strlen(command_and_args_buffer) - 1);
+        }
+        strncat(command_and_args_buffer, "\n", buff_size - strlen(command_and_args_buffer) - 1);
 
         // Send to server
         n = write(sockfd, command_and_args_buffer, strlen(command_and_args_buffer));
         if (n < 0)
-            error("ERROR writing to socket");
+            error_exit("ERROR writing to socket");
 
         read_and_print_reply(sockfd);
     }
@@ -202,7 +501,7 @@ int main(int argc, char **argv) {
         // Send to server
         n = write(sockfd, command_and_args_buffer, strlen(command_and_args_buffer));
         if (n < 0)
-            error("ERROR writing to socket");
+            error_exit("ERROR writing to socket");
 
         read_and_print_reply(sockfd);
     }
@@ -222,7 +521,7 @@ int main(int argc, char **argv) {
         // Send to server
         n = write(sockfd, command_and_args_buffer, strlen(command_and_args_buffer));
         if (n < 0)
-            error("ERROR writing to socket");
+            error_exit("ERROR writing to socket");
 
         read_and_print_reply(sockfd);
     }
@@ -230,19 +529,84 @@ int main(int argc, char **argv) {
     // Compare a file to existing PPMs in SQL.
     else if (strcmp(command, "quickcompare") == 0) {
 
-        if (arg_count < 2) {
-            fprintf(stderr, "usage %s [options] quickcompare filename\n",
+        snprintf(command_and_args_buffer, buff_size, "%s", command);
+        int option_count = compare_options_append(command_and_args_buffer, buff_size,
+                arg_count - 1, argv + optind + 1);
+        if (arg_count - option_count < 3) {
+            fprintf(stderr, "usage %s [options] quickcompare [mode=all|best] [topk=N] external_ref filename\n",
                     argv[0]);
             exit(0);
         }
-        char *filename = argv[optind + 1];
+        char *external_ref = argv[optind + option_count + 1];
+        char *filename     = argv[optind + option_count + 2];
 
-        snprintf(command_and_args_buffer, buff_size, "%s %s\n", command, filename);
+        snprintf(command_and_args_buffer + strlen(command_and_args_buffer),
+                buff_size - strlen(command_and_args_buffer), " %s %s\n", external_ref, filename);
 
         // Send to server
         n = write(sockfd, command_and_args_buffer, strlen(command_and_args_buffer));
         if (n < 0)
-            error("ERROR writing to socket");
+            error_exit("ERROR writing to socket");
+
+        read_and_print_reply(sockfd);
+    }
+
+    // Compare a file to existing PPMs, then add it, with one decode on the server.
+    else if (strcmp(command, "add_compare") == 0) {
+
+        snprintf(command_and_args_buffer, buff_size, "%s", command);
+        int option_count = compare_options_append(command_and_args_buffer, buff_size,
+                arg_count - 1, argv + optind + 1);
+        if (arg_count - option_count < 3) {
+            fprintf(stderr, "usage %s [options] add_compare [mode=all|best] [topk=N] external_ref filename\n",
+                    argv[0]);
+            exit(0);
+        }
+        char *external_ref = argv[optind + option_count + 1];
+        char *filename     = argv[optind + option_count + 2];
+
+        snprintf(command_and_args_buffer + strlen(command_and_args_buffer),
+                buff_size - strlen(command_and_args_buffer), " %s %s\n", external_ref, filename);
+
+        // Send to server
+        n = write(sockfd, command_and_args_buffer, strlen(command_and_args_buffer));
+        if (n < 0)
+            error_exit("ERROR writing to socket");
+
+        read_and_print_reply(sockfd);
+    }
+
+    // Compare an image the server already has, with no file.
+    else if (strcmp(command, "quickcompare_ref") == 0) {
+
+        snprintf(command_and_args_buffer, buff_size, "%s", command);
+        int option_count = compare_options_append(command_and_args_buffer, buff_size,
+                arg_count - 1, argv + optind + 1);
+        if (arg_count - option_count < 2) {
+            fprintf(stderr, "usage %s [options] quickcompare_ref [mode=all|best] [topk=N] external_ref\n",
+                    argv[0]);
+            exit(0);
+        }
+        char *external_ref = argv[optind + option_count + 1];
+
+        snprintf(command_and_args_buffer + strlen(command_and_args_buffer),
+                buff_size - strlen(command_and_args_buffer), " %s\n", external_ref);
+
+        // Send to server
+        n = write(sockfd, command_and_args_buffer, strlen(command_and_args_buffer));
+        if (n < 0)
+            error_exit("ERROR writing to socket");
+
+        read_and_print_reply(sockfd);
+    }
+
+    // Add or compare a PPM made here rather than on the server.
+    else if ((strcmp(command, "add_thumb") == 0)
+            || (strcmp(command, "quickcompare_thumb") == 0)) {
+        // Send to server, the PPM was made before connecting.
+        n = write(sockfd, command_and_args_buffer, strlen(command_and_args_buffer));
+        if (n < 0)
+            error_exit("ERROR writing to socket");
 
         read_and_print_reply(sockfd);
     } else {
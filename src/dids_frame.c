@@ -0,0 +1,318 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module reads and writes the frames of the binary protocol, an
+ * alternative to the text protocol for clients sending many requests.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "dids.h"
+
+#define FRAME_THUMB_BYTES 8 // Of a thumbnail payload, before the external_ref.
+
+static void _put_16(unsigned char *buffer, unsigned int value) {
+    buffer[0] = value >> 8;
+    buffer[1] = value;
+}
+
+static void _put_32(unsigned char *buffer, unsigned int value) {
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+static unsigned int _get_16(unsigned char *buffer) {
+    return (buffer[0] << 8) | buffer[1];
+}
+
+static unsigned int _get_32(unsigned char *buffer) {
+    return ((unsigned int) buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) | buffer[3];
+}
+
+/*
+ * frame_header_encode
+ *
+ * Write the FRAME_HEADER_BYTES of the header to buffer.
+ */
+void frame_header_encode(unsigned char *buffer, Frame_Header *header) {
+    _put_32(buffer, FRAME_MAGIC);
+    _put_16(buffer + 4, header->type);
+    _put_16(buffer + 6, header->status);
+    _put_32(buffer + 8, header->request_id);
+    _put_32(buffer + 12, header->length);
+}
+
+/*
+ * frame_header_decode
+ *
+ * Read the FRAME_HEADER_BYTES of a header from buffer.
+ *
+ * Return 0 on success, non-zero if it is not a frame, or too long.
+ */
+int frame_header_decode(unsigned char *buffer, Frame_Header *header) {
+    if (_get_32(buffer) != FRAME_MAGIC) {
+        return 1;
+    }
+    header->type = _get_16(buffer + 4);
+    header->status = _get_16(buffer + 6);
+    header->request_id = _get_32(buffer + 8);
+    header->length = _get_32(buffer + 12);
+    return header->length > FRAME_PAYLOAD_MAX;
+}
+
+/*
+ * frame_write
+ *
+ * Write a frame to fd, in one write() where possible.
+ * A payload longer than FRAME_PAYLOAD_MAX is cut short.
+ *
+ * Return 0 on success, non-zero on failure, with errno set.
+ */
+int frame_write(int fd, unsigned int type, unsigned int status, unsigned int request_id, void *payload,
+        unsigned int length) {
+    unsigned char buffer[FRAME_HEADER_BYTES + FRAME_PAYLOAD_MAX];
+    if (length > FRAME_PAYLOAD_MAX) {
+        length = FRAME_PAYLOAD_MAX;
+    }
+    Frame_Header header = { type, status, request_id, length };
+    frame_header_encode(buffer, &header);
+    if (length) {
+        memcpy(buffer + FRAME_HEADER_BYTES, payload, length);
+    }
+    unsigned int written = 0;
+    while (written < FRAME_HEADER_BYTES + length) {
+        ssize_t rc = write(fd, buffer + written, FRAME_HEADER_BYTES + length - written);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        written += rc;
+    }
+    return 0;
+}
+
+// Read exactly length bytes. Return 0 on success, non-zero at the end of the input, or on error.
+static int _read_all(int fd, unsigned char *buffer, unsigned int length) {
+    unsigned int done = 0;
+    while (done < length) {
+        ssize_t rc = read(fd, buffer + done, length - done);
+        if ((rc < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (rc <= 0) {
+            return 1;
+        }
+        done += rc;
+    }
+    return 0;
+}
+
+/*
+ * frame_read
+ *
+ * Read a frame from fd, waiting for all of it. payload must have room for
+ * FRAME_PAYLOAD_MAX bytes and a terminating 0, which is added, so text
+ * payloads can be used as strings.
+ *
+ * Return 0 on success, non-zero at the end of the input, on error, or if not a frame.
+ */
+int frame_read(int fd, Frame_Header *header, unsigned char *payload) {
+    unsigned char buffer[FRAME_HEADER_BYTES];
+    if (_read_all(fd, buffer, FRAME_HEADER_BYTES) || frame_header_decode(buffer, header)
+            || _read_all(fd, payload, header->length)) {
+        return 1;
+    }
+    payload[header->length] = 0;
+    return 0;
+}
+
+/*
+ * frame_thumb_encode
+ *
+ * Make the payload of a thumbnail request:
+ *   mode (1), topk (1), external_ref length (2), width (2), height (2),
+ *   the external_ref, then 3 * width * height bytes of RGB pixels, row by row.
+ * The pixels are sent as they are, rather than as hex digits as add_thumb does.
+ *
+ * Return the payload, which the caller must free, or NULL if too long or out of memory.
+ */
+unsigned char *frame_thumb_encode(Frame_Thumb *thumb, unsigned int *length_ptr) {
+    unsigned int ref_length = strlen(thumb->external_ref);
+    unsigned int pixel_bytes = 3 * thumb->ppm->width * thumb->ppm->height;
+    unsigned int length = FRAME_THUMB_BYTES + ref_length + pixel_bytes;
+    if (length > FRAME_PAYLOAD_MAX) {
+        return NULL;
+    }
+    unsigned char *payload = (unsigned char *) malloc(length);
+    if (!payload) {
+        return NULL;
+    }
+    payload[0] = thumb->mode;
+    payload[1] = thumb->topk;
+    _put_16(payload + 2, ref_length);
+    _put_16(payload + 4, thumb->ppm->width);
+    _put_16(payload + 6, thumb->ppm->height);
+    memcpy(payload + FRAME_THUMB_BYTES, thumb->external_ref, ref_length);
+    int y;
+    for (y = 0; y < thumb->ppm->height; y++) {
+        memcpy(payload + FRAME_THUMB_BYTES + ref_length + 3 * thumb->ppm->width * y,
+                thumb->ppm->data + thumb->ppm->modval * y, 3 * thumb->ppm->width);
+    }
+    *length_ptr = length;
+    return payload;
+}
+
+/*
+ * frame_thumb_decode
+ *
+ * Read the payload of a thumbnail request, see frame_thumb_encode().
+ * On success the caller must free the thumbnail with frame_thumb_free().
+ *
+ * Return 0 on success, 1 if the payload is not a thumbnail, 2 if out of memory.
+ */
+int frame_thumb_decode(unsigned char *payload, unsigned int length, Frame_Thumb *thumb) {
+    memset(thumb, 0, sizeof(Frame_Thumb));
+    if (length < FRAME_THUMB_BYTES) {
+        return 1;
+    }
+    unsigned int ref_length = _get_16(payload + 2);
+    unsigned int width = _get_16(payload + 4);
+    unsigned int height = _get_16(payload + 6);
+    if (!ref_length || !width || !height || (width > FRAME_PAYLOAD_MAX) || (height > FRAME_PAYLOAD_MAX)
+            || (length != FRAME_THUMB_BYTES + ref_length + 3 * width * height)
+            || memchr(payload + FRAME_THUMB_BYTES, 0, ref_length)) {
+        return 1;
+    }
+    thumb->mode = payload[0];
+    thumb->topk = payload[1];
+    if (!(thumb->external_ref = strndup((char *) payload + FRAME_THUMB_BYTES, ref_length))
+            || !(thumb->ppm = ppm_info_allocate(width, height))) {
+        frame_thumb_free(thumb);
+        return 2;
+    }
+    memcpy(thumb->ppm->data, payload + FRAME_THUMB_BYTES + ref_length, 3 * width * height);
+    return 0;
+}
+
+void frame_thumb_free(Frame_Thumb *thumb) {
+    free(thumb->external_ref);
+    thumb->external_ref = NULL;
+    ppm_info_free(thumb->ppm);
+    thumb->ppm = NULL;
+}
+
+/*
+ * frame_connection_create
+ *
+ * A connection for replies with frames, from any thread, on a dup() of fd.
+ * The caller holds the one reference.
+ *
+ * Return the connection, or NULL on failure.
+ */
+Frame_Connection *frame_connection_create(int fd) {
+    Frame_Connection *connection = (Frame_Connection *) calloc(1, sizeof(Frame_Connection));
+    if (!connection) {
+        return NULL;
+    }
+    if ((connection->fd = dup(fd)) < 0) {
+        free(connection);
+        return NULL;
+    }
+    connection->refs = 1;
+    pthread_mutex_init(&connection->mutex, NULL);
+    return connection;
+}
+
+/*
+ * frame_connection_release
+ *
+ * Release a reference to the connection, closing it when the last is released.
+ * Safe to call from any thread.
+ */
+void frame_connection_release(Frame_Connection *connection) {
+    if (connection && (__atomic_sub_fetch(&connection->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+        close(connection->fd);
+        pthread_mutex_destroy(&connection->mutex);
+        free(connection);
+    }
+}
+
+/*
+ * frame_reply
+ *
+ * Write a reply frame, whole, even if other threads reply on the same connection.
+ *
+ * Return 0 on success, non-zero on failure, e.g. the client has gone away.
+ */
+int frame_reply(Frame_Reply *reply, unsigned int type, unsigned int status, void *payload, unsigned int length) {
+    pthread_mutex_lock(&reply->connection->mutex);
+    int rc = frame_write(reply->connection->fd, type, status, reply->request_id, payload, length);
+    pthread_mutex_unlock(&reply->connection->mutex);
+    return rc;
+}
+
+/*
+ * frame_reply_match
+ *
+ * Reply with a FRAME_MATCH, for the image with external_ref.
+ */
+int frame_reply_match(Frame_Reply *reply, char *external_ref, unsigned int err) {
+    unsigned char payload[FRAME_PAYLOAD_MAX];
+    unsigned int ref_length = strlen(external_ref);
+    if (ref_length > FRAME_PAYLOAD_MAX - 4) {
+        ref_length = FRAME_PAYLOAD_MAX - 4;
+    }
+    _put_32(payload, err);
+    memcpy(payload + 4, external_ref, ref_length);
+    return frame_reply(reply, FRAME_MATCH, 0, payload, 4 + ref_length);
+}
+
+/*
+ * frame_reply_done
+ *
+ * Finish the reply to a request: FRAME_DONE if status is 0, otherwise
+ * FRAME_ERROR with the "ERROR: " lines of the text the request wrote.
+ */
+int frame_reply_done(Frame_Reply *reply, int status, char *text) {
+    if (!status) {
+        return frame_reply(reply, FRAME_DONE, 0, NULL, 0);
+    }
+    char payload[FRAME_PAYLOAD_MAX];
+    unsigned int length = 0;
+    char *line = text;
+    while (line && *line) {
+        char *end = strchr(line, '\n');
+        size_t line_length = end ? (size_t) (end - line) : strlen(line);
+        if ((strncmp(line, "ERROR: ", 7) == 0) && (length + line_length - 7 + 1 <= sizeof payload)) {
+            memcpy(payload + length, line + 7, line_length - 7);
+            length += line_length - 7;
+            payload[length++] = '\n';
+        }
+        line = end ? end + 1 : NULL;
+    }
+    return frame_reply(reply, FRAME_ERROR, status, payload, length);
+}
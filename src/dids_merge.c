@@ -0,0 +1,62 @@
+/*
+ * This is the DIDS (Duplicate Image Detection System) merge tool.
+ * It merges the output of several fullcompare runs, e.g. one for each
+ * 'fullcompare shard=i/n', into one canonical sorted list of matches.
+ * Please see the README file for further details.
+ *
+ * Usage:
+ *
+ *  dids_merge [FILE] ...
+ *
+ *  dids_merge shard_0.txt shard_1.txt shard_2.txt shard_3.txt > matches.txt
+ *
+ * With no FILE, standard input is read.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Custom
+#include "dids.h"
+
+int main(int argc, char *argv[]) {
+    int input_count = argc > 1 ? argc - 1 : 1;
+    FILE **inputs = (FILE **) calloc(input_count, sizeof(FILE *));
+    if (!inputs) {
+        fprintf(stderr, "ERROR: Out of memory. Quitting\n");
+        exit(1);
+    }
+    if (argc == 1) {
+        inputs[0] = stdin;
+    }
+    int arg;
+    for (arg = 1; arg < argc; arg++) {
+        inputs[arg - 1] = fopen(argv[arg], "r");
+        if (!inputs[arg - 1]) {
+            fprintf(stderr, "ERROR: Failed to open %s. Quitting\n", argv[arg]);
+            exit(1);
+        }
+    }
+    long match_count = match_merge(stderr, stdout, inputs, input_count);
+    if (match_count < 0) {
+        exit(1);
+    }
+    exit(0);
+}
@@ -1,6 +1,9 @@
 // This is the DIDS (Duplicate Image Detection System) server.
 //
-// Will fork() for longer running operations such as fullcompare and quickcompare.
+// Runs longer operations such as fullcompare and quickcompare on a pool of worker
+// threads, against a snapshot of the images, so add and del carry on meanwhile.
+// add and del publish each change to the copies snapshots are read from, rather
+// than the images being copied again for the next compare.
 //
 // Will multi-thread when doing fullcompare to make the most of available CPU.
 //
@@ -25,10 +28,18 @@
 #define CLIENT_MAX 100  // Note first two slots are for new incoming connections of IPv4 and IPv6.
 #define COMPARE_SIZE  16
 #define COMPARE_THRESHOLD 70000 // Lower means images must be more similar to match.
+#define PIVOT_COUNT 8 // Pivot images for ruling out pairs, 0 for none.
 #define CPU_INFO_FILENAME  "/proc/cpuinfo"
 #define LOCK_FILE_TEMPLATE "/var/run/dids/lockfile_port_%d"
 #define COMMAND_LISTEN_TIMEOUT 60 // How long to wait for incoming command.
 #define CLIENT_SLOT_FREE -1
+#define JOB_MAX 50 // Child processes, and finished jobs kept for their results.
+#define JOB_SPOOL_TEMPLATE "/var/tmp/dids_job_%d.spool"
+#define JOB_RESULTS_MAX_BYTES (1024 * 1024) // Most sent by one job_results, ask again from next_offset.
+#define READER_MAX 64 // Reader processes, see _reader_loop().
+#define READER_RESTART_SECONDS 10 // Least time between starts of a reader process, if it keeps stopping.
+#define READER_READ_TIMEOUT 10 // How long a reader process waits for a command once connected.
+#define QUEUED_MAX 256 // Compares of each class waiting for a thread, before more are refused.
 #define max(a,b) \
    ({ __typeof__ (a) _a = (a); \
        __typeof__ (b) _b = (b); \
@@ -49,7 +60,10 @@
 #include <netinet/in.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <sys/prctl.h>
 #include <wand/MagickWand.h>
 
 // Custom
@@ -61,14 +75,89 @@ typedef struct Client_Info {
    char command_buffer[BUFFER_SIZE];
    int cmd_offset;
    pid_t pid;  // Process ID or 0 for no process.
+   Frame_Connection *frames;  // NULL, or the connection sends frames rather than text, see _frames_process().
 // TODO struct timeval connection_timeout;
 } Client_Info;
 
+// Each running job, and each finished job still holding results, has a slot in the job table.
+// A job is a fullcompare on the worker pool, or a child process.
+typedef struct Job_Info {
+   int id;  // Or 0 for a free slot.
+   int active;  // Until the job has finished, or the process exited.
+   pid_t pid;  // A child process, or 0.
+   int cancel;  // Set to stop a job on the worker pool.
+   char command[32];  // e.g. 'fullcompare'.
+   char status[16];  // running, done, failed or cancelled.
+   time_t started;
+   time_t finished;
+   int spooled;  // Results are written to the spool file, rather than the client.
+   long double pairs_total;  // Pairs a fullcompare compares, with since= and shard=, for its throughput.
+   // Read so far from the spool.
+   long scanned_offset;
+   double progress_percent;
+   unsigned long long result_count;
+} Job_Info;
+
+// A reader process, started by the server, see _reader_loop().
+typedef struct Reader_Info {
+   pid_t pid;  // 0 if not running.
+   time_t started;
+} Reader_Info;
+
+// A compare run on the worker pool, so the server carries on with other commands meanwhile.
+typedef struct Compare_Task {
+   char command[32];  // quickcompare, quickcompare_thumb, quickcompare_ref, add_compare or fullcompare.
+   FILE *out_fh;  // The client, from a dup() of its socket, or the spool file of a job.
+   Snapshot *snapshot;  // The version of the images when the command arrived.
+   Compare_Options options;
+   Compare_Stats stats;
+   unsigned int maxerr;
+   int compare_size;
+   char *external_ref;  // quickcompare
+   char *argument;  // The filename, or hexdata.
+   PPM_Info *ppm;  // Or the thumbnail, sent in a frame.
+   Job_Info *job;  // fullcompare
+   time_t started;
+   Frame_Reply frame_reply;  // For a request sent in a frame, where the matches and result are sent.
+   char *frame_text;  // The text output of a request sent in a frame, for its errors.
+   size_t frame_text_size;
+} Compare_Task;
+
+// Forward declarations
+int _add_ppm(FILE *sock_fh, PGconn *psql, PicInfo **ppm_list_ref, PPM_Info *ppm_miniature, char *external_ref,
+      Frame_Reply *frame_reply, Compare_Task *compare);
+int _compare_task_submit(FILE *sock_fh, Compare_Task *task, PicInfo *list, int out_fd);
+
 // Globals
 int global_cpu_count = 0;
 int global_child_process_count = 0; // Current count of living child processes.
 int global_active_connection_count = 0; // Current count of active clients.
 Client_Info global_client_detail[CLIENT_MAX];
+Exact_Index *global_exact_index = NULL; // Hash of the pixels of every image loaded, for exact duplicates.
+int global_phash_max_distance = -1; // Perceptual hash screen, -1 to compare every pair.
+Pivot_Table *global_pivot_table = NULL; // Pivot images for ruling out pairs by the triangle inequality.
+int global_pivot_count = PIVOT_COUNT;
+Compare_Stats global_compare_stats; // Totals for compares done in this process, for info.
+time_t global_fullcompare_started = 0; // When the last fullcompare started, for fullcompare since=.
+Job_Info global_jobs[JOB_MAX]; // Running and spooled jobs, see _job_add().
+int global_job_id_last = 0;
+Worker_Pool *global_worker_pool = NULL; // Threads for compares, started once the images are loaded.
+int global_batch_threads = 0; // Threads fullcompares may use at once, 0 for all but one.
+unsigned long global_queued_max = QUEUED_MAX;
+unsigned long global_list_version = 1; // Changes whenever the list of images does.
+Corpus *global_corpus = NULL; // Copies of the images that snapshots are pinned in, see _snapshot_current().
+unsigned long global_corpus_builds = 0;
+int global_reader_count = 0; // Reader processes to keep running.
+int global_reader_port = 0;
+Reader_Info global_readers[READER_MAX];
+char global_shared_filename[256]; // The images shared with the reader processes.
+Shared_Corpus *global_shared_corpus = NULL;
+char **global_argv = NULL; // To run this program again as a reader process.
+char *global_socket_path = NULL; // Unix domain socket to listen on too, NULL for none.
+char *global_journal_filename = NULL; // Journal of adds and dels written to SQL behind, NULL to write them first.
+Journal *global_journal = NULL;
+// Held by the worker pool and server thread for the job table and global_compare_stats.
+pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // return the number of CPUs on the system
 int _get_cpu_count    (FILE *sock_fh) {
@@ -91,16 +180,212 @@ int _get_cpu_count    (FILE *sock_fh) {
    return cpu_count;
 }
 
+// Note a change to the images that is not made to the corpus, e.g. loading them.
+// A new corpus is made for the next compare. The old one is freed once compares using it have finished.
+void _corpus_changed() {
+   corpus_release(global_corpus);
+   global_corpus = NULL;
+}
+
+// Write the images for the reader processes to a new file, e.g. after load, or once the file is full.
+// If that fails, the readers report the images as not available until the next time.
+void _shared_corpus_write(FILE *sock_fh, PicInfo *list) {
+   if (global_reader_count) {
+      global_shared_corpus = shared_corpus_create(sock_fh, global_shared_filename, list, global_list_version,
+            global_shared_corpus);
+   }
+}
+
+// Choose the pivot images, and the distances of each image to them.
+// Without pivots, comparisons are just slower, so failure is not an error.
+void _pivots_build(FILE *sock_fh, PicInfo *list) {
+   if (!global_pivot_table) {
+      global_pivot_table = pivot_table_create();
+   }
+   if (global_pivot_table) {
+      pivot_table_build(sock_fh, global_pivot_table, list, global_pivot_count);
+   }
+   _corpus_changed(); // Its copies have the distances to the old pivots.
+}
+
+// Note an image was added or deleted, choosing new pivots once there have been enough changes.
+void _pivots_changed(FILE *sock_fh, PicInfo *list) {
+   if (global_pivot_table && pivot_table_changed(global_pivot_table)) {
+      _pivots_build(sock_fh, list);
+   }
+}
+
+// The spool file of a job.
+void _job_spool_filename(char *filename, size_t size, int id) {
+   snprintf(filename, size, JOB_SPOOL_TEMPLATE, id);
+}
+
+// Add a job to the job table.
+// If the table is full, the oldest finished job is forgotten, and its spool file removed.
+//
+// Return the job, or NULL if every slot holds a running job.
+Job_Info *_job_add(char *command, int spooled) {
+   Job_Info *job = NULL;
+   int slot;
+   pthread_mutex_lock(&global_mutex);
+   for (slot = 0; slot < JOB_MAX; slot++) {
+      if (!global_jobs[slot].id) {
+         job = &global_jobs[slot];
+         break;
+      }
+      if (!global_jobs[slot].active && (!job || (global_jobs[slot].finished < job->finished))) {
+         job = &global_jobs[slot];
+      }
+   }
+   if (!job) {
+      pthread_mutex_unlock(&global_mutex);
+      return NULL;
+   }
+   if (job->id && job->spooled) {
+      char filename[256];
+      _job_spool_filename(filename, sizeof filename, job->id);
+      unlink(filename);
+   }
+   memset(job, 0, sizeof(Job_Info));
+   job->id = ++global_job_id_last;
+   snprintf(job->command, sizeof job->command, "%s", command);
+   strcpy(job->status, "running");
+   job->started = time(NULL);
+   job->spooled = spooled;
+   job->active = 1;
+   pthread_mutex_unlock(&global_mutex);
+   return job;
+}
+
+// Find a job by id. Only the server thread adds jobs, so the slot stays the job's
+// until the next _job_add(), unless the job is not spooled and finishes.
+Job_Info *_job_find(int id) {
+   Job_Info *job = NULL;
+   int slot;
+   pthread_mutex_lock(&global_mutex);
+   for (slot = 0; (slot < JOB_MAX) && id; slot++) {
+      if (global_jobs[slot].id == id) {
+         job = &global_jobs[slot];
+         break;
+      }
+   }
+   pthread_mutex_unlock(&global_mutex);
+   return job;
+}
+
+// Note a job has finished. Jobs without a spool are forgotten.
+// The caller must hold global_mutex.
+void _job_finished(Job_Info *job, int failed) {
+   job->active = 0;
+   job->pid = 0;
+   job->finished = time(NULL);
+   if (!job->spooled) {
+      job->id = 0;
+   } else if (strcmp(job->status, "cancelled") != 0) {
+      strcpy(job->status, failed ? "failed" : "done");
+   }
+}
+
+// Note a child process has exited.
+void _job_exited(pid_t pid, int wait_status) {
+   int slot;
+   pthread_mutex_lock(&global_mutex);
+   for (slot = 0; slot < JOB_MAX; slot++) {
+      Job_Info *job = &global_jobs[slot];
+      if (job->id && job->pid && (job->pid == pid)) {
+         _job_finished(job, !WIFEXITED(wait_status) || (WEXITSTATUS(wait_status) != 0));
+         break;
+      }
+   }
+   pthread_mutex_unlock(&global_mutex);
+}
+
+// Read the lines added to a job's spool since last time, for its progress and how many results.
+void _job_scan(Job_Info *job) {
+   char filename[256];
+   char *line = NULL;  // A Group line may be longer than BUFFER_SIZE.
+   size_t line_size = 0;
+   ssize_t length;
+   _job_spool_filename(filename, sizeof filename, job->id);
+   FILE *spool_fh = fopen(filename, "r");
+   if (!spool_fh) {
+      return;
+   }
+   if (fseek(spool_fh, job->scanned_offset, SEEK_SET) == 0) {
+      while (((length = getline(&line, &line_size, spool_fh)) > 0) && (line[length - 1] == '\n')) {
+         double percent;
+         if (sscanf(line, "fullcompare_progress: %lf%%", &percent) == 1) {
+            job->progress_percent = percent;
+         } else if ((strncmp(line, "Match: ", 7) == 0) || (strncmp(line, "Group: ", 7) == 0)) {
+            job->result_count++;
+         }
+         job->scanned_offset = ftell(spool_fh);
+      }
+   }
+   free(line);
+   fclose(spool_fh);
+}
+
+// Print one line about a job, for info and job_status. The caller must hold global_mutex.
+void _job_print(FILE *sock_fh, char *prefix, Job_Info *job) {
+   time_t end = job->active ? time(NULL) : job->finished;
+   long elapsed = end - job->started;
+   fprintf(sock_fh, "%sjob: id=%d pid=%d command=%s status=%s elapsed=%ld", prefix, job->id, (int) job->pid,
+         job->command, job->status, elapsed);
+   if (job->spooled) {
+      _job_scan(job);
+      fprintf(sock_fh, " progress_percent=%.2f results=%llu spool_bytes=%ld pairs_per_second=%.0Lf",
+            job->progress_percent, job->result_count, job->scanned_offset,
+            elapsed ? job->pairs_total * job->progress_percent / 100 / elapsed : 0.0L);
+   }
+   fprintf(sock_fh, "\n");
+}
+
+// The list of images as it is now, pinned for the caller.
+// add and del keep the corpus up to date, so it is only made when there is none.
+//
+// Return the snapshot, or NULL if out of memory.
+Snapshot *_snapshot_current(FILE *sock_fh, PicInfo *list) {
+   if (!global_corpus) {
+      if (!(global_corpus = corpus_create(sock_fh, list, global_pivot_table, global_list_version))) {
+         return NULL;
+      }
+      global_corpus_builds++;
+   }
+   return snapshot_pin(sock_fh, global_corpus);
+}
+
 // load - Read in all the PPM from SQL, one at a time.
+// Then index them by the hash of their pixels, to find exact duplicates quickly.
 //
 // Return 0 on success
 // non-zero on failure.
 int load(FILE *sock_fh, PGconn *psql, PicInfo **picinfo_list_ref) {
+   global_list_version++;
+   _corpus_changed();
+   long journal_offset = global_journal ? journal_hold(global_journal) : 0;
    int rc = ppm_load_all_from_sql(sock_fh, psql, picinfo_list_ref);
+   // The adds and dels that were not in SQL yet.
+   if (global_journal && journal_replay(sock_fh, global_journal, journal_offset, picinfo_list_ref) && !rc) {
+      rc = 5;
+   }
    if ((rc == 0) && (*picinfo_list_ref != NULL)) {
       rc = picinfo_list_refresh_similar_but_different(sock_fh, psql,
             *picinfo_list_ref);
    }
+   if (rc == 0) {
+      if (!global_exact_index) {
+         global_exact_index = exact_index_create();
+      }
+      if (!global_exact_index || exact_index_build(global_exact_index, *picinfo_list_ref)) {
+         error(sock_fh, "load - out of memory building the exact duplicate index");
+         rc = 3;
+      }
+   }
+   if (rc == 0) {
+      _pivots_build(sock_fh, *picinfo_list_ref);
+      _shared_corpus_write(sock_fh, *picinfo_list_ref);
+   }
    return rc;
 }
 
@@ -124,12 +409,83 @@ int _add(FILE *sock_fh, PGconn *psql, PicInfo **ppm_list_ref, char *filename, ch
       error(sock_fh, "add - ppm_miniature_from_filename failed");
       return 1;
    }
+   return _add_ppm(sock_fh, psql, ppm_list_ref, ppm_miniature, external_ref, NULL, NULL);
+}
+
+// add_thumb - Add a thumbnail made by the client to both sql and into memory.
+//
+// hexdata is the thumbnail pixels as RGB hex digits, the same as stored in SQL.
+// The server only checks, stores and keeps the thumbnail. No image decoding is done.
+//
+// Return zero on success, non-zero on failure.
+int _add_thumb(FILE *sock_fh, PGconn *psql, PicInfo **ppm_list_ref, char *hexdata, char *external_ref, int new_size) {
+   debug(sock_fh, "add_thumb external_ref '%s'", external_ref);
+   PPM_Info *ppm_miniature = ppm_from_hexdata(sock_fh, hexdata, new_size, new_size);
+   if (!ppm_miniature) {
+      error(sock_fh, "add_thumb - ppm_from_hexdata failed");
+      return 1;
+   }
+   return _add_ppm(sock_fh, psql, ppm_list_ref, ppm_miniature, external_ref, NULL, NULL);
+}
+
+// add_compare - As quickcompare then add, but the file is decoded and resized only once.
+//
+// The thumbnail is stored and added to the list in memory on this thread, as add is. Then
+// compare, with a copy of it and a snapshot of the images from before it was added, is queued
+// on the worker pool, which reports every match, exact duplicates too, and the result.
+// The task is the caller's until queued.
+//
+// Return zero once queued, 1 if not added, 2 if added but not queued, after reporting an error.
+int _add_compare(FILE *sock_fh, PGconn *psql, PicInfo **ppm_list_ref, char *filename, char *external_ref,
+      Compare_Task *compare, int out_fd) {
+   debug(sock_fh, "add_compare external_ref '%s'", external_ref);
+   PPM_Info *ppm_miniature = ppm_miniature_from_filename(sock_fh, filename, compare->compare_size);
+   if (!ppm_miniature) {
+      error(sock_fh, "add_compare - ppm_miniature_from_filename failed");
+      return 1;
+   }
+   unsigned long bytes = 3 * ppm_miniature->width * ppm_miniature->height;
+   if (!(compare->ppm = ppm_info_allocate(ppm_miniature->width, ppm_miniature->height))
+         || !(compare->external_ref = strdup(external_ref)) || !(compare->argument = strdup(filename))
+         || !(compare->snapshot = _snapshot_current(sock_fh, *ppm_list_ref))) {
+      error(sock_fh, "add_compare - out of memory");
+      ppm_info_free(ppm_miniature);
+      return 1;
+   }
+   memcpy(compare->ppm->data, ppm_miniature->data, bytes);
+   if (_add_ppm(sock_fh, psql, ppm_list_ref, ppm_miniature, external_ref, NULL, compare)) {
+      return 1;
+   }
+   fflush(sock_fh);
+   return _compare_task_submit(sock_fh, compare, *ppm_list_ref, out_fd) ? 2 : 0;
+}
 
-   // store it in SQL
-   int rc = ppm_store(sock_fh, psql, external_ref, ppm_miniature);
+// add_ppm - Store a thumbnail in sql then add it to the list in memory.
+// With the journal, it is stored there, and written to sql later.
+//
+// Any image already loaded with exactly the same thumbnail is reported as a Match,
+// or with frame_reply, a frame. With compare, they are left for it, see _add_compare().
+//
+// The list takes ownership of ppm_miniature on success, otherwise it is free'ed.
+//
+// Return zero on success, non-zero on failure.
+int _add_ppm(FILE *sock_fh, PGconn *psql, PicInfo **ppm_list_ref, PPM_Info *ppm_miniature, char *external_ref,
+      Frame_Reply *frame_reply, Compare_Task *compare) {
+
+   // SQL refuses an external_ref it already has, which the journal can't tell until written.
+   if (global_journal && PicInfoFindInList(*ppm_list_ref, external_ref)) {
+      error(sock_fh, "add - external_ref '%s' is already added", external_ref);
+      ppm_info_free(ppm_miniature);
+      return 1;
+   }
+
+   // store it in SQL, or the journal
+   time_t created = time(NULL);
+   int rc = global_journal ? journal_add(sock_fh, global_journal, external_ref, ppm_miniature, created)
+         : ppm_store(sock_fh, psql, external_ref, ppm_miniature);
    if (rc) {
-      error(sock_fh, "add - ppm_store for external_ref '%s' and filename %s, code %d",
-            external_ref, filename, rc);
+      error(sock_fh, "add - %s for external_ref '%s', code %d",
+            global_journal ? "journal_add" : "ppm_store", external_ref, rc);
       ppm_info_free(ppm_miniature);
       return 1;
    }
@@ -141,7 +497,64 @@ int _add(FILE *sock_fh, PGconn *psql, PicInfo **ppm_list_ref, char *filename, ch
       return 1;
 
    }
+   hlp->created = created;
+   Compare_Options exact_options;
+   compare_options_init(&exact_options);
+   exact_options.frame_reply = frame_reply;
+   if (global_exact_index && !compare) {
+      exact_index_report(sock_fh, global_exact_index, hlp, &exact_options);
+   }
+   if (global_pivot_table) {
+      pivot_table_distances(global_pivot_table, hlp);
+   }
+   if (global_exact_index) {
+      exact_index_add(global_exact_index, hlp);
+   }
    PicInfoAddToList(sock_fh, ppm_list_ref, hlp);
+   global_list_version++;
+   if (global_corpus && (corpus_add(sock_fh, global_corpus, hlp, global_list_version) == 1)) {
+      _corpus_changed();
+   }
+   if (global_reader_count && (!global_shared_corpus
+         || shared_corpus_add(sock_fh, global_shared_corpus, hlp, global_list_version))) {
+      _shared_corpus_write(sock_fh, *ppm_list_ref);
+   }
+   _pivots_changed(sock_fh, *ppm_list_ref);
+   return 0;
+}
+
+// Delete an image from the list in RAM, and the index and copies of it.
+//
+// Return 0 on success, or if it was not in RAM, non-zero on failure.
+int _del_from_list(FILE *sock_fh, PicInfo **ppm_list_ref, char *external_ref) {
+   PicInfo *pic = PicInfoFindInList(*ppm_list_ref, external_ref);
+   if (pic && global_exact_index) {
+      exact_index_remove(global_exact_index, pic);
+   }
+   int shared_write = pic && global_reader_count && (!global_shared_corpus
+         || shared_corpus_delete(sock_fh, global_shared_corpus, pic, global_list_version + 1));
+   int rc = PicInfoDeleteFromList(ppm_list_ref, external_ref);
+   global_list_version++;
+   if (shared_write) {
+      _shared_corpus_write(sock_fh, *ppm_list_ref);
+   }
+   // code 2 : Deleted from SQL, but not in RAM to delete.
+   if (rc){
+      if (rc == 2) {
+         debug(sock_fh, "del could not find external_ref '%s'", external_ref);
+      }
+      else{
+         error(sock_fh,
+            "del - PicInfoDeleteFromList for external_ref '%s', code %d", external_ref, rc);
+         return 2;
+      }
+   }
+   else {
+      if (global_corpus && corpus_delete(global_corpus, external_ref, global_list_version)) {
+         _corpus_changed();
+      }
+      _pivots_changed(sock_fh, *ppm_list_ref);
+   }
    return 0;
 }
 
@@ -155,30 +568,289 @@ int _del(FILE *sock_fh, PGconn *psql, PicInfo **ppm_list_ref, char *external_ref
 
    debug(sock_fh, "del external_ref '%s'", external_ref);
 
-   // remove from SQL
-   int rc = ppm_del(sock_fh, psql, external_ref);
+   // remove from SQL, or with the journal, later
+   int rc = global_journal ? journal_del(sock_fh, global_journal, external_ref)
+         : ppm_del(sock_fh, psql, external_ref);
    if (rc) {
-      error(sock_fh, "del - ppm_del for external_ref '%s', code %d",
-            external_ref, rc);
+      error(sock_fh, "del - %s for external_ref '%s', code %d",
+            global_journal ? "journal_del" : "ppm_del", external_ref, rc);
       return 1;
    }
 
-   // del from the list in RAM
-   rc = PicInfoDeleteFromList(ppm_list_ref, external_ref);
-   // code 2 : Deleted from SQL, but not in RAM to delete.
-   if (rc){
-      if (rc == 2) {
-         debug(sock_fh, "del could not find external_ref '%s'", external_ref);
+   // del from the list in RAM, and the index of it.
+   return _del_from_list(sock_fh, ppm_list_ref, external_ref);
+}
+
+// Take the adds SQL refused out of RAM, so it agrees with SQL. They are kept in the refused file.
+void _journal_refused_remove(FILE *sock_fh, PicInfo **ppm_list_ref) {
+   Journal_Refused *refused = global_journal ? journal_refused_take(global_journal) : NULL;
+   while (refused) {
+      Journal_Refused *next = refused->next;
+      PicInfo *pic = PicInfoFindInList(*ppm_list_ref, refused->external_ref);
+      if (pic && (pic->created == refused->created)) {
+         error(sock_fh, "SQL refused the add of external_ref '%s', so it is deleted, see %s", refused->external_ref,
+               global_journal->refused_filename);
+         _del_from_list(sock_fh, ppm_list_ref, refused->external_ref);
       }
-      else{
-         error(sock_fh,
-            "del - PicInfoDeleteFromList for external_ref '%s', code %d", external_ref, rc);
-         return 2;
+      free(refused);
+      refused = next;
+   }
+}
+
+// Set the options used for comparing images, counting into stats.
+void _compare_options(Compare_Options *options, Compare_Stats *stats) {
+   compare_options_init(options);
+   memset(stats, 0, sizeof(Compare_Stats));
+   options->stats = stats;
+   options->exact_index = global_exact_index;
+   options->phash_max_distance = global_phash_max_distance;
+   options->pivot_table = global_pivot_table;
+}
+
+// Read compare options, e.g. mode=all, from the words of a command, using strtok.
+// *word_ptr is the first word, and is left at the first word that is not an option, or NULL.
+//
+// Return 0 on success, non-zero if an option is not valid.
+int _compare_options_words(FILE *sock_fh, Compare_Options *options, char **word_ptr) {
+   int rc;
+   while (*word_ptr && ((rc = compare_options_parse(sock_fh, options, *word_ptr)) != 1)) {
+      if (rc) {
+         return rc;
       }
+      *word_ptr = strtok(NULL, " \n");
    }
    return 0;
 }
 
+// A compare for a client, or a job, set up from the words of the command.
+// The options are parsed into the task before it is queued with _compare_task_submit().
+//
+// Return the task, or NULL if out of memory.
+Compare_Task *_compare_task_create(char *command, unsigned int maxerr, int compare_size) {
+   Compare_Task *task = (Compare_Task *) calloc(1, sizeof(Compare_Task));
+   if (task) {
+      snprintf(task->command, sizeof task->command, "%s", command);
+      _compare_options(&task->options, &task->stats);
+      task->maxerr = maxerr;
+      task->compare_size = compare_size;
+      task->started = time(NULL);
+   }
+   return task;
+}
+
+void _compare_task_free(Compare_Task *task) {
+   if (!task) {
+      return;
+   }
+   if (task->out_fh) {
+      fclose(task->out_fh);
+   }
+   snapshot_release(task->snapshot);
+   free(task->external_ref);
+   free(task->argument);
+   ppm_info_free(task->ppm);
+   frame_connection_release(task->frame_reply.connection);
+   free(task->frame_text);
+   free(task);
+}
+
+// The name of a quickcompare command in its reply, from the command, or a command line.
+char *_quickcompare_reply_name(char *command) {
+   if (strstr(command, "quickcompare_thumb") == command) {
+      return "QUICKCOMPARE_THUMB";
+   }
+   if (strstr(command, "quickcompare_ref") == command) {
+      return "QUICKCOMPARE_REF";
+   }
+   return "QUICKCOMPARE";
+}
+
+// Read a quickcompare, quickcompare_thumb or quickcompare_ref command into a task:
+//   quickcompare [options] external_ref filename
+//   quickcompare_thumb [options] external_ref hexdata
+//   quickcompare_ref [options] external_ref
+//
+// Return the task, or NULL after replying with why the command failed.
+Compare_Task *_quickcompare_task_parse(FILE *sock_fh, char *cmd_buffer, unsigned int maxerr, int compare_size) {
+   int thumb = (strstr(cmd_buffer, "quickcompare_thumb ") == cmd_buffer);
+   int ref = (strstr(cmd_buffer, "quickcompare_ref ") == cmd_buffer);
+   char *command = thumb ? "quickcompare_thumb" : (ref ? "quickcompare_ref" : "quickcompare");
+   char *reply = _quickcompare_reply_name(command);
+   Compare_Task *task = _compare_task_create(command, maxerr, compare_size);
+   char *external_ref = strtok(cmd_buffer + strlen(command) + 1, " \n");
+   char *argument = NULL;
+   if (!task) {
+      fprintf(sock_fh, "%s FAILED, no memory\n", reply);
+      return NULL;
+   }
+   if (_compare_options_words(sock_fh, &task->options, &external_ref)) {
+      fprintf(sock_fh, "%s FAILED, invalid option\n", reply);
+   }
+   // no space for quickcompare, as filenames can contain spaces.
+   else if (!external_ref || (!ref && !(argument = strtok(NULL, thumb ? " \n" : "\n")))) {
+      fprintf(sock_fh, "%s FAILED, expecting external_ref%s\n", reply,
+            ref ? "" : (thumb ? " and hexdata" : " and filename"));
+   } else if (!(task->external_ref = strdup(external_ref)) // strtok reuses memory
+         || (argument && !(task->argument = strdup(argument)))) {
+      fprintf(sock_fh, "%s FAILED, no memory\n", reply);
+   } else {
+      return task;
+   }
+   _compare_task_free(task);
+   return NULL;
+}
+
+// Run a quickcompare, quickcompare_thumb, quickcompare_ref or add_compare task against list, replying to out_fh.
+//
+// Return 0 on success.
+int _quickcompare_task_output(FILE *out_fh, Compare_Task *task, PicInfo *list) {
+   int rc = 1;
+   if (strcmp(task->command, "quickcompare") == 0) {
+      fprintf(out_fh, "QUICKCOMPARE\n");
+      rc = quickcompare(out_fh, list, task->maxerr, task->argument, task->external_ref,
+            task->compare_size, &task->options);
+      if (rc) {
+         fprintf(out_fh, "QUICKCOMPARE FAILED, code %d\n", rc);
+      } else {
+         compare_stats_report(out_fh, &task->stats);
+         fprintf(out_fh, "QUICKCOMPARE SUCCESS %s %s\n", task->external_ref, task->argument);
+      }
+   } else if (strcmp(task->command, "quickcompare_thumb") == 0) {
+      fprintf(out_fh, "QUICKCOMPARE_THUMB\n");
+      PPM_Info *ppm_miniature = task->ppm;
+      if (!ppm_miniature) {
+         ppm_miniature = ppm_from_hexdata(out_fh, task->argument, task->compare_size, task->compare_size);
+      }
+      if (ppm_miniature) {
+         rc = quickcompare_ppm(out_fh, list, task->maxerr, ppm_miniature, task->external_ref, &task->options);
+         if (ppm_miniature != task->ppm) {
+            ppm_info_free(ppm_miniature);
+         }
+      }
+      if (rc) {
+         fprintf(out_fh, "QUICKCOMPARE_THUMB FAILED, code %d\n", rc);
+      } else {
+         compare_stats_report(out_fh, &task->stats);
+         fprintf(out_fh, "QUICKCOMPARE_THUMB SUCCESS %s\n", task->external_ref);
+      }
+   } else if (strcmp(task->command, "add_compare") == 0) {
+      // ADD_COMPARE was sent, and the image added, by the server thread.
+      rc = quickcompare_ppm(out_fh, list, task->maxerr, task->ppm, task->external_ref, &task->options);
+      if (rc) {
+         fprintf(out_fh, "ADD_COMPARE FAILED, added, but compare failed with code %d\n", rc);
+      } else {
+         compare_stats_report(out_fh, &task->stats);
+         fprintf(out_fh, "ADD_COMPARE SUCCESS %s %s\n", task->external_ref, task->argument);
+      }
+   } else if (strcmp(task->command, "quickcompare_ref") == 0) {
+      fprintf(out_fh, "QUICKCOMPARE_REF\n");
+      rc = quickcompare_ref(out_fh, list, task->maxerr, task->external_ref, &task->options);
+      if (rc) {
+         fprintf(out_fh, "QUICKCOMPARE_REF FAILED, code %d\n", rc);
+      } else {
+         compare_stats_report(out_fh, &task->stats);
+         fprintf(out_fh, "QUICKCOMPARE_REF SUCCESS %s\n", task->external_ref);
+      }
+   }
+   return rc;
+}
+
+// Run a compare on a thread of the worker pool. The output is the same as when
+// the server compared on its own thread, or in a child process for fullcompare.
+void *_compare_task_run(void *arg) {
+   Compare_Task *task = (Compare_Task *) arg;
+   FILE *out_fh = task->out_fh;
+   Compare_Options *options = &task->options;
+   options->exact_index = task->snapshot->exact_index;
+   options->pivot_table = task->snapshot->pivot_table;
+   options->version = task->snapshot->version;
+   int rc = 1;
+   if (strcmp(task->command, "fullcompare") != 0) {
+      rc = _quickcompare_task_output(out_fh, task, task->snapshot->list);
+   } else {
+      fprintf(out_fh, "FULLCOMPARE\n");
+      // Images added from now on are new to the next 'fullcompare since=started'.
+      fprintf(out_fh, "fullcompare_started: %ld\n", (long) task->started);
+      // If stopped, e.g. the server restarts, 'fullcompare resume=<id>' carries on from the checkpoint.
+      if (!options->resume && !options->exact_only && !options->clusters) {
+         snprintf(options->checkpoint_id, CHECKPOINT_ID_MAX, "%ld_%d", (long) task->started, task->job->id);
+      }
+      if (options->checkpoint_id[0]) {
+         fprintf(out_fh, "fullcompare_checkpoint: %s\n", options->checkpoint_id);
+      }
+      fflush(out_fh);
+      options->worker_pool = global_worker_pool;
+      options->cancel = &task->job->cancel;
+      // fullcompare works through the list in order, so has just the images of this version.
+      Snapshot *flat = snapshot_flatten(out_fh, task->snapshot);
+      if (flat) {
+         snapshot_release(task->snapshot);
+         task->snapshot = flat;
+         options->exact_index = flat->exact_index;
+         options->version = 0;
+         long double pairs_total = fullcompare_pairs(flat->list, options);
+         pthread_mutex_lock(&global_mutex);
+         task->job->pairs_total = pairs_total;
+         pthread_mutex_unlock(&global_mutex);
+         rc = fullcompare(out_fh, flat->list, task->maxerr, global_batch_threads, options);
+      }
+      if (rc) {
+         fprintf(out_fh, "FULLCOMPARE FAILED, code %d\n", rc);
+      } else {
+         compare_stats_report(out_fh, &task->stats);
+         fprintf(out_fh, "FULLCOMPARE SUCCESS\n");
+      }
+   }
+   fflush(out_fh);
+   if (task->frame_reply.connection) {
+      frame_reply_done(&task->frame_reply, rc, task->frame_text);
+   }
+
+   pthread_mutex_lock(&global_mutex);
+   compare_stats_add(&global_compare_stats, &task->stats);
+   if (task->job) {
+      _job_finished(task->job, rc);
+   }
+   pthread_mutex_unlock(&global_mutex);
+   _compare_task_free(task);
+   return NULL;
+}
+
+// Queue a compare on the worker pool, with a snapshot of the list, unless it has one, and where to write.
+// quickcompares are run before fullcompares, which only use global_batch_threads of the threads.
+// With out_fd, the output goes to the client, which is sent nothing more by the server thread.
+// The task is freed once run, or now on failure.
+//
+// Return 0 on success, non-zero on failure, after reporting an error.
+int _compare_task_submit(FILE *sock_fh, Compare_Task *task, PicInfo *list, int out_fd) {
+   int task_fd = -1;
+   int pool_class = (strcmp(task->command, "fullcompare") == 0) ? POOL_CLASS_BATCH : POOL_CLASS_INTERACTIVE;
+   int rc = 0;
+   if (!task->snapshot && !(task->snapshot = _snapshot_current(sock_fh, list))) {
+      error(sock_fh, "%s - out of memory making a snapshot of the images", task->command);
+   } else if ((out_fd >= 0) && (((task_fd = dup(out_fd)) < 0) || !(task->out_fh = fdopen(task_fd, "w")))) {
+      error(sock_fh, "%s - failed to pass the client to the worker pool. errno=%d, error=%s", task->command,
+            errno, strerror(errno));
+      if (task_fd >= 0) {
+         close(task_fd);
+      }
+   } else if ((rc = worker_pool_submit(global_worker_pool, pool_class, _compare_task_run, task, NULL)) == 2) {
+      error(sock_fh, "%s - server busy, %lu compares already waiting, try again later", task->command,
+            global_queued_max);
+   } else if (rc) {
+      error(sock_fh, "%s - out of memory queueing the compare", task->command);
+   } else {
+      return 0;
+   }
+   if (task->job) {
+      pthread_mutex_lock(&global_mutex);
+      _job_finished(task->job, 1);
+      pthread_mutex_unlock(&global_mutex);
+   }
+   _compare_task_free(task);
+   return 1;
+}
+
 // debug_show_tree
 void debug_show_tree(FILE *sock_fh, PicInfo *list) {
    PicInfo *current_pic = list;
@@ -209,39 +881,263 @@ int _info(FILE *sock_fh, PicInfo *list, unsigned int maxerr) {
    fprintf(sock_fh, "property: child_process_count: %d\n", global_child_process_count);
    fprintf(sock_fh, "property: active_connection_count: %d\n", global_active_connection_count);
    fprintf(sock_fh, "property: maxerr: %d\n", maxerr);
+   fprintf(sock_fh, "property: phash_max_distance: %d\n", global_phash_max_distance);
+   fprintf(sock_fh, "property: pivot_count: %d\n", global_pivot_table ? global_pivot_table->count : 0);
+   fprintf(sock_fh, "property: fullcompare_started: %ld\n", (long) global_fullcompare_started);
+   fprintf(sock_fh, "property: list_version: %lu\n", global_list_version);
+   fprintf(sock_fh, "property: corpus_builds: %lu\n", global_corpus_builds);
+   fprintf(sock_fh, "property: corpus_deleted: %lu\n", global_corpus ? global_corpus->deleted : 0);
+   fprintf(sock_fh, "property: readers: %d\n", global_reader_count);
+   if (global_reader_count) {
+      fprintf(sock_fh, "property: reader_port: %d\n", global_reader_port);
+      fprintf(sock_fh, "property: shared_corpus_generation: %lu\n",
+            global_shared_corpus ? global_shared_corpus->header->generation : 0);
+      fprintf(sock_fh, "property: shared_corpus_bytes: %lu\n",
+            global_shared_corpus ? global_shared_corpus->header->used : 0);
+   }
+   if (global_journal) {
+      pthread_mutex_lock(&global_journal->mutex);
+      fprintf(sock_fh, "property: journal_pending_bytes: %ld\n", global_journal->end - global_journal->written);
+      fprintf(sock_fh, "property: journal_entries_written: %llu\n", global_journal->entries_written);
+      fprintf(sock_fh, "property: journal_batches: %llu\n", global_journal->batches);
+      fprintf(sock_fh, "property: journal_entries_failed: %llu\n", global_journal->entries_failed);
+      fprintf(sock_fh, "property: journal_refused_file: %s\n", global_journal->refused_filename);
+      fprintf(sock_fh, "property: journal_sql_errors: %llu\n", global_journal->sql_errors);
+      pthread_mutex_unlock(&global_journal->mutex);
+   }
+   if (global_worker_pool) {
+      pthread_mutex_lock(&global_worker_pool->mutex);
+      fprintf(sock_fh, "property: worker_pool_threads: %d\n", global_worker_pool->thread_count);
+      fprintf(sock_fh, "property: worker_pool_busy: %d\n", global_worker_pool->busy);
+      fprintf(sock_fh, "property: worker_pool_queued: %lu\n", global_worker_pool->queued);
+      fprintf(sock_fh, "property: worker_pool_tasks_run: %llu\n", global_worker_pool->tasks_run);
+      int pool_class;
+      for (pool_class = 0; pool_class < POOL_CLASS_COUNT; pool_class++) {
+         Pool_Class *queue = &global_worker_pool->classes[pool_class];
+         char *name = (pool_class == POOL_CLASS_INTERACTIVE) ? "interactive" : "batch";
+         fprintf(sock_fh, "property: pool_%s_threads_max: %d\n", name, queue->busy_max);
+         fprintf(sock_fh, "property: pool_%s_busy: %d\n", name, queue->busy);
+         fprintf(sock_fh, "property: pool_%s_queued: %lu\n", name, queue->queued);
+         fprintf(sock_fh, "property: pool_%s_tasks_run: %llu\n", name, queue->tasks_run);
+         fprintf(sock_fh, "property: pool_%s_refused: %llu\n", name, queue->refused);
+         fprintf(sock_fh, "property: pool_%s_wait_ms_mean: %.1f\n", name,
+               queue->tasks_run ? 1000.0 * queue->wait_seconds / queue->tasks_run : 0.0);
+         fprintf(sock_fh, "property: pool_%s_wait_ms_max: %.1f\n", name, 1000.0 * queue->wait_seconds_max);
+      }
+      pthread_mutex_unlock(&global_worker_pool->mutex);
+   }
+   int slot;
+   pthread_mutex_lock(&global_mutex);
+   for (slot = 0; slot < JOB_MAX; slot++) {
+      if (global_jobs[slot].id) {
+         _job_print(sock_fh, "property: ", &global_jobs[slot]);
+      }
+   }
+   // Counted when each compare on the worker pool finishes.
+   Compare_Stats compare_stats = global_compare_stats;
+   pthread_mutex_unlock(&global_mutex);
+   Compare_Stats *stats = &compare_stats;
+   fprintf(sock_fh, "property: compare_pairs: %llu\n", stats->pairs);
+   fprintf(sock_fh, "property: compare_pivot_rejected: %llu\n", stats->pivot_rejected);
+   fprintf(sock_fh, "property: compare_pivot_rejected_percent: %.1f\n",
+         stats->pairs ? 100.0 * stats->pivot_rejected / stats->pairs : 0.0);
+   fprintf(sock_fh, "property: compare_level_rejected: %llu\n",
+         stats->level_4_rejected + stats->level_8_rejected);
+   fprintf(sock_fh, "property: compare_full_compares: %llu\n", stats->full_compares);
+   fprintf(sock_fh, "property: compare_deadline_skipped: %llu\n", stats->deadline_skipped);
    return 0;
 }
 
 // Free the linked list of images from RAM.
 void unload(PicInfo **list) {
+   global_list_version++;
+   _corpus_changed();
+   _shared_corpus_write(stderr, NULL);
+   if (global_exact_index) {
+      exact_index_clear(global_exact_index);
+   }
+   pivot_table_free(global_pivot_table);
+   global_pivot_table = NULL;
    PicInfo *current_pic = *list;
    PicInfo *next;
    while (current_pic) {
-      ppm_info_free(current_pic->picinf);
       next = current_pic->next;
-      free(current_pic);
+      PicInfoRelease(current_pic); // Freed once no corpus holds it.
       current_pic = next;
    }
    *list = NULL;
 }
 
+// Queue a FRAME_QUICKCOMPARE_THUMB request on the worker pool, which replies once it has run.
+// The task takes the thumbnail.
+//
+// Return 0 on success, non-zero after writing the error to text_fh.
+int _frame_quickcompare_submit(FILE *text_fh, Frame_Reply *reply, Frame_Thumb *thumb, PicInfo *list,
+      int compare_size, unsigned int maxerr) {
+   if ((thumb->mode == COMPARE_MODE_TOPK) ? ((thumb->topk < 1) || (thumb->topk > COMPARE_TOPK_MAX))
+         : ((thumb->mode != COMPARE_MODE_BEST) && (thumb->mode != COMPARE_MODE_ALL))) {
+      error(text_fh, "mode must be best, all, or topk from 1 to %d", COMPARE_TOPK_MAX);
+      return 2;
+   }
+   Compare_Task *task = _compare_task_create("quickcompare_thumb", maxerr, compare_size);
+   if (!task || !(task->out_fh = open_memstream(&task->frame_text, &task->frame_text_size))) {
+      error(text_fh, "no memory");
+      _compare_task_free(task);
+      return 1;
+   }
+   task->options.mode = thumb->mode;
+   task->options.topk = thumb->topk;
+   task->external_ref = thumb->external_ref;
+   task->ppm = thumb->ppm;
+   thumb->external_ref = NULL;
+   thumb->ppm = NULL;
+   task->frame_reply = *reply;
+   task->options.frame_reply = &task->frame_reply;
+   __atomic_add_fetch(&reply->connection->refs, 1, __ATOMIC_RELAXED);
+   return _compare_task_submit(text_fh, task, list, -1);
+}
+
+// Perform a request sent in a frame, replying with frames. See the framed binary protocol in dids.h.
+//
+// REQUESTS:
+// FRAME_QUICKCOMPARE_THUMB : As quickcompare_thumb, with the pixels rather than hexdata.
+//                            On the worker pool, replying with a FRAME_MATCH for each match.
+// FRAME_ADD_THUMB          : As add_thumb, with the pixels rather than hexdata.
+// FRAME_DEL                : As del.
+//
+// Each request is finished with FRAME_DONE, or FRAME_ERROR with the errors.
+void _frame_command_process(Frame_Connection *connection, Frame_Header *header, unsigned char *payload,
+      PicInfo **picinfo_list_ptr, PGconn *psql, int compare_size, unsigned int maxerr) {
+   Frame_Reply reply = { connection, header->request_id };
+   // Errors are written as text, as for the text protocol, then sent in FRAME_ERROR.
+   char *text = NULL;
+   size_t text_size = 0;
+   FILE *text_fh = open_memstream(&text, &text_size);
+   if (!text_fh) {
+      frame_reply(&reply, FRAME_ERROR, 1, "no memory\n", 10);
+      return;
+   }
+   Frame_Thumb thumb;
+   int rc = 1;
+   if ((header->type == FRAME_QUICKCOMPARE_THUMB) || (header->type == FRAME_ADD_THUMB)) {
+      rc = frame_thumb_decode(payload, header->length, &thumb);
+      if (rc) {
+         error(text_fh, "thumbnail frame not valid, or no memory");
+      } else if ((thumb.ppm->width != compare_size) || (thumb.ppm->height != compare_size)) {
+         error(text_fh, "thumbnail must be %d by %d", compare_size, compare_size);
+         rc = 2;
+      }
+   }
+   int replied = 0; // By the worker pool.
+   if (header->type == FRAME_QUICKCOMPARE_THUMB) {
+      if (!rc) {
+         rc = _frame_quickcompare_submit(text_fh, &reply, &thumb, *picinfo_list_ptr, compare_size, maxerr);
+         replied = !rc;
+      }
+   } else if (header->type == FRAME_ADD_THUMB) {
+      if (!rc) {
+         debug(text_fh, "add_thumb external_ref '%s'", thumb.external_ref);
+         rc = _add_ppm(text_fh, psql, picinfo_list_ptr, thumb.ppm, thumb.external_ref, &reply, NULL);
+         thumb.ppm = NULL; // Kept by the list, or freed.
+      }
+   } else if (header->type == FRAME_DEL) {
+      char *external_ref = strndup((char *) payload, header->length);
+      if (!external_ref || !header->length || memchr(payload, 0, header->length)) {
+         error(text_fh, "del frame not valid, or no memory");
+      } else {
+         rc = _del(text_fh, psql, picinfo_list_ptr, external_ref);
+      }
+      free(external_ref);
+   } else {
+      error(text_fh, "BAD REQUEST: frame type %u", header->type);
+   }
+   if ((header->type == FRAME_QUICKCOMPARE_THUMB) || (header->type == FRAME_ADD_THUMB)) {
+      frame_thumb_free(&thumb);
+   }
+   fclose(text_fh);
+   if (!replied) {
+      frame_reply_done(&reply, rc, text);
+   }
+   free(text);
+}
+
+// Perform the requests of a client sending frames, once each has been read whole.
+// The bytes of a request not yet read whole are kept for the next time.
+//
+// Return non-zero if the connection should be closed, as what was sent is not a frame.
+int _frames_process(Client_Info *client, PicInfo **picinfo_list_ptr, PGconn *psql, int compare_size,
+      unsigned int maxerr) {
+   unsigned char *buffer = (unsigned char *) client->command_buffer;
+   if (!client->frames && !(client->frames = frame_connection_create(client->fd))) {
+      return 1;
+   }
+   int offset = 0;
+   Frame_Header header;
+   while (client->cmd_offset - offset >= FRAME_HEADER_BYTES) {
+      if (frame_header_decode(buffer + offset, &header)) {
+         Frame_Reply reply = { client->frames, 0 };
+         frame_reply(&reply, FRAME_ERROR, 1, "not a frame, or too long\n", 25);
+         return 1;
+      }
+      if ((unsigned int) (client->cmd_offset - offset) < FRAME_HEADER_BYTES + header.length) {
+         break;
+      }
+      _frame_command_process(client->frames, &header, buffer + offset + FRAME_HEADER_BYTES, picinfo_list_ptr,
+            psql, compare_size, maxerr);
+      offset += FRAME_HEADER_BYTES + header.length;
+   }
+   memmove(buffer, buffer + offset, client->cmd_offset - offset);
+   client->cmd_offset -= offset;
+   return 0;
+}
+
+// True if the client is sending frames, as its first bytes are FRAME_MAGIC, "DIDB", rather than a text command.
+int _frames_wanted(Client_Info *client) {
+   return client->frames || ((client->cmd_offset >= 4) && (memcmp(client->command_buffer, "DIDB", 4) == 0));
+}
+
 // Respond to commands requests and perform the commands:
 //
 // COMMANDS:
 // quit            : Stop listening for commands.
 // add             : Learn a new image file by putting a new PPM into SQL and RAM.
+// add_thumb       : As add, but the client has already made the PPM and sends it as hex.
+// add_compare     : As quickcompare then add, decoding the file only once.
 // del             : Forget a PPM from both SQL and RAM.
 // info            : Print statistics on e.g. how many PPMs in RAM, number of CPUs.
 // load            : Load all PPM images from SQL into RAM.
 // quickcompare    : Compare a single file to all PPMs in RAM and report potential duplicates.
+// quickcompare_thumb : As quickcompare, but the client has already made the PPM and sends it as hex.
+// quickcompare_ref : As quickcompare, for an image already in RAM, by its external_ref. Nothing is decoded.
 // fullcompare     : Compare all PPMs in RAM and report potential duplicates.
+//                   'fullcompare exact_only' reports only exact duplicates, which is much faster.
+//
+// quickcompare, quickcompare_thumb, quickcompare_ref, add_compare and fullcompare take options before their
+// arguments:
+//   mode=best : (default) Report each match as close as the closest so far.
+//   mode=all  : Report every match under maxerr.
+//   topk=N    : Report the N closest matches to each image.
+//   deadline_ms=N : (quickcompare, add_compare) Stop after N ms, closest images first, reporting the matches
+//               so far.
+//   since=T   : (fullcompare) Only compare pairs with an image added at or after T, in seconds since 1970.
+//               e.g. fullcompare_started from the last fullcompare, also shown by info.
+//   resume=ID : (fullcompare) Carry on from the fullcompare_checkpoint ID of a fullcompare that was stopped.
+//               The other options must be the same, and the images not changed.
+//   shard=I/N : (fullcompare) Only do shard I (0 to N-1) of N, each about the same work, e.g. on N servers.
+//               Combine the outputs with dids_merge.
+//   clusters  : (fullcompare) Report each group of matched images on one line, rather than each match.
+// fullcompare job [options] : Run fullcompare in the background, replying with its job id.
+//               The results are kept in a spool file, for job_results.
+// job_status [job_id]         : Show the progress of each job, or just job_id.
+// job_results job_id [offset] : Send the results of a job so far, from offset, and the next_offset.
+// job_cancel job_id           : Stop a job.
 // refresh_similar_but_different : Refresh details that help avoid false matches.
 // unload          : Free all PPM images from RAM.
 // debug_sleep     : fork() then sleep for 60 seconds. Used to test fork()
 // debug_show_tree : Show the memory structure of the PPM tree. Used to check structure.
 // help            : Show this message.
 //
-// Will fork() for longer running operations such as fullcompare and quickcompare.
+// Runs longer operations such as fullcompare and quickcompare on the worker pool.
 //
 // Will lazy load all PPMs into RAM, only when needed.
 //
@@ -270,8 +1166,13 @@ void command_process(int new_sockfd, char *cmd_buffer,
    if ( (strcmp(cmd_buffer, "load") == 0) || (
          (!*picinfo_list_ptr)
          && ((strcmp(cmd_buffer, "fullcompare") == 0)
+               || (strstr(cmd_buffer, "fullcompare ") == cmd_buffer)
                || (strstr(cmd_buffer, "add ") == cmd_buffer)
-               || (strstr(cmd_buffer, "quickcompare ") == cmd_buffer)))) {
+               || (strstr(cmd_buffer, "add_thumb ") == cmd_buffer)
+               || (strstr(cmd_buffer, "add_compare ") == cmd_buffer)
+               || (strstr(cmd_buffer, "quickcompare ") == cmd_buffer)
+               || (strstr(cmd_buffer, "quickcompare_thumb ") == cmd_buffer)
+               || (strstr(cmd_buffer, "quickcompare_ref ") == cmd_buffer)))) {
 
       // If command was to load, then report starting to load.
       if (strcmp(cmd_buffer, "load") == 0) {
@@ -315,60 +1216,161 @@ void command_process(int new_sockfd, char *cmd_buffer,
       fflush(new_sockfh);
    }
 
-   // quickcompare external_ref filename
-   else if (strstr(cmd_buffer, "quickcompare ") == cmd_buffer) {
-      char *external_ref = strtok(cmd_buffer + strlen("quickcompare "), " \n");
-      external_ref = strdup(external_ref); // strtok reuses memory
-      if (!external_ref) {
-         fprintf(new_sockfh, "QUICKCOMPARE FAILED, no memory\n");
+   // quickcompare [options] external_ref filename
+   // quickcompare_thumb [options] external_ref hexdata
+   // quickcompare_ref [options] external_ref
+   // Run on the worker pool, which replies to the client.
+   else if ((strstr(cmd_buffer, "quickcompare ") == cmd_buffer)
+         || (strstr(cmd_buffer, "quickcompare_thumb ") == cmd_buffer)
+         || (strstr(cmd_buffer, "quickcompare_ref ") == cmd_buffer)) {
+      Compare_Task *task = _quickcompare_task_parse(new_sockfh, cmd_buffer, maxerr, compare_size);
+      if (task && (fflush(new_sockfh), _compare_task_submit(new_sockfh, task, *picinfo_list_ptr, new_sockfd))) {
+         fprintf(new_sockfh, "%s FAILED, not queued\n", _quickcompare_reply_name(cmd_buffer));
+      }
+   }
+
+   // fullcompare [job] [options]
+   // Run on the worker pool, which replies to the client, or with job, writes to a spool file.
+   else if ((strcmp(cmd_buffer, "fullcompare") == 0)
+         || (strstr(cmd_buffer, "fullcompare ") == cmd_buffer)) {
+      Compare_Task *task = _compare_task_create("fullcompare", maxerr, compare_size);
+      char *word = strtok(cmd_buffer + strlen("fullcompare"), " \n");
+      // As a job, the results go to a spool file, and the client is told the job id straight away.
+      int spooled = word && (strcmp(word, "job") == 0);
+      if (spooled) {
+         word = strtok(NULL, " \n");
+      }
+      int options_rc = task ? _compare_options_words(new_sockfh, &task->options, &word) : 0;
+      Job_Info *job = NULL;
+      char spool_filename[256];
+      time_t started = 0;
+      int exact_only = 0;
+      if (!task) {
+         fprintf(new_sockfh, "FULLCOMPARE FAILED, no memory\n");
+      } else if (options_rc || word) {
+         fprintf(new_sockfh, "FULLCOMPARE FAILED, invalid option %s\n", word ? word : "");
+         _compare_task_free(task);
+      } else if (!(job = _job_add("fullcompare", spooled))) {
+         fprintf(new_sockfh, "FULLCOMPARE FAILED, too many jobs running\n");
+         _compare_task_free(task);
+      } else if (spooled && (_job_spool_filename(spool_filename, sizeof spool_filename, job->id),
+            !(task->out_fh = fopen(spool_filename, "w")))) {
+         error(new_sockfh, "FULLCOMPARE FAILED, can't create spool file %s", spool_filename);
+         _compare_task_free(task);
+      } else if ((task->job = job, started = task->started, exact_only = task->options.exact_only,
+            fflush(new_sockfh),
+            _compare_task_submit(new_sockfh, task, *picinfo_list_ptr, spooled ? -1 : new_sockfd))) {
+         fprintf(new_sockfh, "FULLCOMPARE FAILED, not queued\n");
       } else {
-         // no space as filenames can contain spaces.
-         char *filename = strtok(NULL, "\n");
-         if (!filename) {
-            free(external_ref);
-            fprintf(new_sockfh, "QUICKCOMPARE FAILED, no memory\n");
-         } else {
-            filename = strdup(filename); // strtok reuses memory
-            if (!filename) {
-               free(external_ref);
-               fprintf(new_sockfh, "QUICKCOMPARE FAILED, no memory\n");
-            } else {
-               fprintf(new_sockfh, "QUICKCOMPARE\n");
-               int rc = quickcompare(new_sockfh, *picinfo_list_ptr, maxerr, filename, external_ref, compare_size);
-               if (rc) {
-                  fprintf(new_sockfh, "QUICKCOMPARE FAILED, code %d\n", rc);
-               } else {
-                  fprintf(new_sockfh, "QUICKCOMPARE SUCCESS %s %s\n", external_ref, filename);
-               }
-               free(filename);
-               free(external_ref);
+         // The task may have finished already, so is not used from here.
+         if (!exact_only) {
+            global_fullcompare_started = started;
+         }
+         if (spooled) {
+            fprintf(new_sockfh, "FULLCOMPARE JOB %d\n", job->id);
+         }
+         job = NULL; // The task finishes the job.
+      }
+      if (job) {
+         pthread_mutex_lock(&global_mutex);
+         _job_finished(job, 1);
+         pthread_mutex_unlock(&global_mutex);
+      }
+   }
+
+   // job_status [job_id]
+   else if ((strcmp(cmd_buffer, "job_status") == 0) || (strstr(cmd_buffer, "job_status ") == cmd_buffer)) {
+      char *id_text = strtok(cmd_buffer + strlen("job_status"), " \n");
+      Job_Info *job = id_text ? _job_find(atoi(id_text)) : NULL;
+      if (id_text && !job) {
+         fprintf(new_sockfh, "JOB_STATUS FAILED, no job %s\n", id_text);
+      } else {
+         fprintf(new_sockfh, "JOB_STATUS\n");
+         int slot;
+         pthread_mutex_lock(&global_mutex);
+         for (slot = 0; slot < JOB_MAX; slot++) {
+            if (global_jobs[slot].id && (!job || (job == &global_jobs[slot]))) {
+               _job_print(new_sockfh, "", &global_jobs[slot]);
             }
          }
+         pthread_mutex_unlock(&global_mutex);
+         fprintf(new_sockfh, "JOB_STATUS SUCCESS\n");
       }
    }
 
-   // fullcompare ( detatches )
-   else if (strcmp(cmd_buffer, "fullcompare") == 0) {
-      pid_t fork_rc = fork();
-      if (fork_rc < 0) {
-         error(new_sockfh,
-               "FULLCOMPARE FAILED, fork() failed. errno=%d, error=%s",
-               errno, strerror(errno));
-      } else if (fork_rc == 0) { // Child
-         fprintf(new_sockfh, "FULLCOMPARE\n");
-         fflush(new_sockfh);
-         // double the CPU count
-         int rc = fullcompare(new_sockfh, *picinfo_list_ptr, maxerr, global_cpu_count);
-         if (rc) {
-            fprintf(new_sockfh, "FULLCOMPARE FAILED, code %d\n", rc);
+   // job_results job_id [offset]
+   // Sends whole lines of the spool from offset, up to JOB_RESULTS_MAX_BYTES.
+   // Ask again from next_offset until the status is no longer running and more=0.
+   else if (strstr(cmd_buffer, "job_results ") == cmd_buffer) {
+      char *id_text = strtok(cmd_buffer + strlen("job_results "), " \n");
+      char *offset_text = strtok(NULL, " \n");
+      long offset = offset_text ? atol(offset_text) : 0;
+      Job_Info *job = id_text ? _job_find(atoi(id_text)) : NULL;
+      char spool_filename[256];
+      FILE *spool_fh = NULL;
+      if (!job || !job->spooled) {
+         fprintf(new_sockfh, "JOB_RESULTS FAILED, no spooled job %s\n", id_text ? id_text : "");
+      } else if ((offset < 0)
+            || (_job_spool_filename(spool_filename, sizeof spool_filename, job->id),
+                  !(spool_fh = fopen(spool_filename, "r")))
+            || fseek(spool_fh, offset, SEEK_SET)) {
+         fprintf(new_sockfh, "JOB_RESULTS FAILED, can't read spool from offset %ld\n", offset);
+      } else {
+         // Read the status first, so if the job was finished, everything it wrote is read.
+         char status[16];
+         pthread_mutex_lock(&global_mutex);
+         strcpy(status, job->status);
+         pthread_mutex_unlock(&global_mutex);
+         char *chunk = (char *) malloc(JOB_RESULTS_MAX_BYTES);
+         size_t length = chunk ? fread(chunk, 1, JOB_RESULTS_MAX_BYTES, spool_fh) : 0;
+         int more = (length == JOB_RESULTS_MAX_BYTES) || (fgetc(spool_fh) != EOF);
+         // Only whole lines, the rest is sent next time.
+         while ((length > 0) && (chunk[length - 1] != '\n')) {
+            length--;
+            more = 1;
+         }
+         // A line longer than JOB_RESULTS_MAX_BYTES, e.g. a large Group, is sent whole, once written.
+         char *line = NULL;
+         size_t line_size = 0;
+         ssize_t line_length;
+         if (chunk && !length && more && !fseek(spool_fh, offset, SEEK_SET)
+               && ((line_length = getline(&line, &line_size, spool_fh)) > 0) && (line[line_length - 1] == '\n')) {
+            free(chunk);
+            chunk = line;
+            length = line_length;
+            more = fgetc(spool_fh) != EOF;
          } else {
-            fprintf(new_sockfh, "FULLCOMPARE SUCCESS\n");
+            free(line);
          }
-         pthread_exit(NULL);
-         exit(0);
-      } else { // Parent
-         global_child_process_count++;
+         fprintf(new_sockfh, "JOB_RESULTS %d\n", job->id);
+         fwrite(chunk, 1, length, new_sockfh);
+         fprintf(new_sockfh, "JOB_RESULTS SUCCESS %d next_offset=%ld status=%s more=%d\n", job->id,
+               offset + (long) length, status, more);
+         free(chunk);
+      }
+      if (spool_fh) {
+         fclose(spool_fh);
+      }
+   }
+
+   // job_cancel job_id
+   else if (strstr(cmd_buffer, "job_cancel ") == cmd_buffer) {
+      char *id_text = strtok(cmd_buffer + strlen("job_cancel "), " \n");
+      Job_Info *job = id_text ? _job_find(atoi(id_text)) : NULL;
+      pthread_mutex_lock(&global_mutex);
+      if (!job || !job->id) {
+         fprintf(new_sockfh, "JOB_CANCEL FAILED, no job %s\n", id_text ? id_text : "");
+      } else if (!job->active) {
+         fprintf(new_sockfh, "JOB_CANCEL FAILED, job %d is already %s\n", job->id, job->status);
+      } else if (job->pid && kill(job->pid, SIGTERM)) {
+         error(new_sockfh, "JOB_CANCEL FAILED, kill() failed. errno=%d, error=%s", errno, strerror(errno));
+      } else {
+         // A job on the worker pool stops once its threads finish the images they are comparing.
+         __atomic_store_n(&job->cancel, 1, __ATOMIC_RELAXED);
+         strcpy(job->status, "cancelled");
+         fprintf(new_sockfh, "JOB_CANCEL SUCCESS %d\n", job->id);
       }
+      pthread_mutex_unlock(&global_mutex);
    }
 
    // add external_ref filename
@@ -404,6 +1406,55 @@ void command_process(int new_sockfd, char *cmd_buffer,
       }
    }
 
+   // add_thumb external_ref hexdata
+   else if (strstr(cmd_buffer, "add_thumb ") == cmd_buffer) {
+      char *external_ref = strtok(cmd_buffer + strlen("add_thumb "), " \n");
+      char *hexdata = strtok(NULL, " \n");
+      if (!external_ref || !hexdata) {
+         fprintf(new_sockfh, "ADD_THUMB FAILED, expecting external_ref and hexdata\n");
+      } else {
+         fprintf(new_sockfh, "ADD_THUMB\n");
+         int rc = _add_thumb(new_sockfh, psql, picinfo_list_ptr, hexdata,
+               external_ref, compare_size);
+         if (rc) {
+            fprintf(new_sockfh, "ADD_THUMB FAILED, code %d\n", rc);
+         } else {
+            fprintf(new_sockfh, "ADD_THUMB SUCCESS %s\n", external_ref);
+         }
+      }
+   }
+
+   // add_compare [options] external_ref filename
+   // Added on this thread, as add is, then compared on the worker pool, which replies to the client.
+   else if (strstr(cmd_buffer, "add_compare ") == cmd_buffer) {
+      Compare_Task *task = _compare_task_create("add_compare", maxerr, compare_size);
+      char *external_ref = strtok(cmd_buffer + strlen("add_compare "), " \n");
+      char *filename = NULL;
+      if (!task) {
+         fprintf(new_sockfh, "ADD_COMPARE FAILED, no memory\n");
+      } else if (_compare_options_words(new_sockfh, &task->options, &external_ref)) {
+         fprintf(new_sockfh, "ADD_COMPARE FAILED, invalid option\n");
+      } else if (task->options.since) {
+         fprintf(new_sockfh, "ADD_COMPARE FAILED, since is only for fullcompare\n");
+      }
+      // no space as filenames can contain spaces.
+      else if (!external_ref || !(filename = strtok(NULL, "\n"))) {
+         fprintf(new_sockfh, "ADD_COMPARE FAILED, expecting external_ref and filename\n");
+      } else {
+         fprintf(new_sockfh, "ADD_COMPARE\n");
+         int rc = _add_compare(new_sockfh, psql, picinfo_list_ptr, filename, external_ref, task, new_sockfd);
+         if (rc == 2) {
+            fprintf(new_sockfh, "ADD_COMPARE FAILED, added, but not compared\n");
+         } else if (rc) {
+            fprintf(new_sockfh, "ADD_COMPARE FAILED, code %d\n", rc);
+         }
+         if (rc != 1) {
+            task = NULL; // Queued, or freed when it could not be, by _compare_task_submit().
+         }
+      }
+      _compare_task_free(task);
+   }
+
    // del external_ref_1
    else if (strstr(cmd_buffer, "del ") == cmd_buffer) {
       char *external_ref = strtok(cmd_buffer + strlen("del "), " \n");
@@ -439,7 +1490,9 @@ void command_process(int new_sockfd, char *cmd_buffer,
       int rc = 0;
       if (*picinfo_list_ptr) {
          rc = picinfo_list_refresh_similar_but_different(new_sockfh, psql, *picinfo_list_ptr);
-
+         global_list_version++;
+         _corpus_changed();
+         _shared_corpus_write(new_sockfh, *picinfo_list_ptr);
       }
       if (rc){
          fprintf(new_sockfh, "REFRESH_SIMILAR_BUT_DIFFERENT FAILED, code %d\n", rc);
@@ -469,8 +1522,14 @@ void command_process(int new_sockfd, char *cmd_buffer,
    // sleep
    // Only used for testing e.g. fork()
    else if (strstr(cmd_buffer, "debug_sleep") == cmd_buffer) {
-      pid_t fork_rc = fork();
-      if (fork_rc < 0) {
+      Job_Info *job = _job_add("debug_sleep", 0);
+      pid_t fork_rc = job ? fork() : -1;
+      if (!job) {
+         fprintf(new_sockfh, "DEBUG_SLEEP FAILED, too many jobs running\n");
+      } else if (fork_rc < 0) {
+         pthread_mutex_lock(&global_mutex);
+         _job_finished(job, 1);
+         pthread_mutex_unlock(&global_mutex);
          error(new_sockfh, "fork() failed. errno=%d, error=%s", errno,
                strerror(errno));
       } else if (fork_rc == 0) { // Child
@@ -482,6 +1541,7 @@ void command_process(int new_sockfd, char *cmd_buffer,
          exit(0);
       } else { // Parent
          global_child_process_count++;
+         job->pid = fork_rc;
       }
    }
 
@@ -565,6 +1625,36 @@ int create_port_listen_v6(FILE *log_fh, int portno) {
    return listening_socketfd_v6;
 }
 
+// Setup a Unix domain socket to listen on, for clients on this host.
+// Any socket file left by a server that stopped is replaced, as the lockfile shows none is running.
+int create_unix_listen(FILE *log_fh, char *path) {
+   struct sockaddr_un serv_addr_unix;
+   socklen_t address_length = unix_socket_address(&serv_addr_unix, path);
+   if (!address_length) {
+      error(log_fh, "socket path '%s' is too long, or empty", path);
+      return 0;
+   }
+   int listening_socketfd_unix = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listening_socketfd_unix == -1) {
+      error(log_fh, "opening socket() unix failed, errno=%d, error=%s", errno, strerror(errno));
+      return 0;
+   }
+   if (path[0] != '@') {
+      unlink(path);
+   }
+   if (bind(listening_socketfd_unix, (struct sockaddr *) &serv_addr_unix, address_length) == -1) {
+      error(log_fh, "bind() unix '%s' failed, errno=%d, error=%s", path, errno, strerror(errno));
+      close(listening_socketfd_unix);
+      return 0;
+   }
+   if (listen(listening_socketfd_unix, 10) == -1) {
+      error(log_fh, "listen() unix failed, errno=%d, error=%s", errno, strerror(errno));
+      close(listening_socketfd_unix);
+      return 0;
+   }
+   return listening_socketfd_unix;
+}
+
 // Check for an instance already running, and wanting this port.
 // returns true if already running, or error.
 int is_already_running(FILE *log_fh, int port){
@@ -594,10 +1684,208 @@ int is_already_running(FILE *log_fh, int port){
    return 0;
 }
 
+// Start the reader processes that aren't running, unless one only just stopped.
+// Each runs this program again, with --reader-process, so it has none of the server's
+// connections or threads, and is stopped if the server stops.
+// The server has other threads, so the child only calls async-signal-safe functions,
+// e.g. not malloc(), and everything it needs is made before fork().
+void _readers_start(FILE *log_fh) {
+   int argc;
+   for (argc = 0; global_argv[argc]; argc++)
+      ;
+   char **argv = (char **) calloc(argc + 2, sizeof(char *));
+   if (!argv) {
+      error(log_fh, "Failed to start reader processes, out of memory");
+      return;
+   }
+   argv[0] = global_argv[0];
+   argv[1] = "--reader-process";
+   memcpy(&argv[2], &global_argv[1], argc * sizeof(char *)); // Including the NULL.
+   long open_max = sysconf(_SC_OPEN_MAX);
+   int slot;
+   time_t now = time(NULL);
+   for (slot = 0; slot < global_reader_count; slot++) {
+      Reader_Info *reader = &global_readers[slot];
+      if (reader->pid || (reader->started && (now - reader->started < READER_RESTART_SECONDS))) {
+         continue;
+      }
+      reader->started = now;
+      fflush(log_fh);
+      pid_t pid = fork();
+      if (pid == 0) {
+         prctl(PR_SET_PDEATHSIG, SIGTERM);
+         int fd;
+         for (fd = 3; fd < open_max; fd++) {
+            close(fd);
+         }
+         execv("/proc/self/exe", argv);
+         _exit(1);
+      }
+      if (pid < 0) {
+         error(log_fh, "fork() of reader process failed, errno=%d, error=%s", errno, strerror(errno));
+         continue;
+      }
+      reader->pid = pid;
+      global_child_process_count++;
+   }
+   free(argv);
+}
+
+// Note a reader process has exited, so it is started again.
+void _reader_exited(pid_t pid) {
+   int slot;
+   for (slot = 0; slot < global_reader_count; slot++) {
+      if (global_readers[slot].pid == pid) {
+         global_readers[slot].pid = 0;
+         break;
+      }
+   }
+}
+
+// Stop the reader processes, and remove the file of images shared with them.
+void _readers_stop() {
+   int slot;
+   for (slot = 0; slot < global_reader_count; slot++) {
+      pid_t pid = global_readers[slot].pid;
+      if (pid) {
+         kill(pid, SIGTERM);
+         if (waitpid(pid, NULL, 0) == pid) {
+            global_child_process_count--;
+         }
+         global_readers[slot].pid = 0;
+      }
+   }
+   global_reader_count = 0;
+   shared_corpus_free(global_shared_corpus, 1);
+   global_shared_corpus = NULL;
+}
+
+// Perform a command sent to a reader process:
+//
+// quickcompare       : As the server's, with the images shared by the server.
+// quickcompare_thumb : As the server's, with the images shared by the server.
+// quickcompare_ref   : As the server's, with the images shared by the server.
+// info               : Print information about the reader process.
+void _reader_command_process(int client_fd, char *cmd_buffer, Shared_Reader *reader, int compare_size,
+      unsigned int maxerr) {
+   FILE *sock_fh = fdopen(client_fd, "w");
+   if (!sock_fh) {
+      close(client_fd);
+      return;
+   }
+   if ((strstr(cmd_buffer, "quickcompare ") == cmd_buffer)
+         || (strstr(cmd_buffer, "quickcompare_thumb ") == cmd_buffer)
+         || (strstr(cmd_buffer, "quickcompare_ref ") == cmd_buffer)) {
+      Compare_Task *task = _quickcompare_task_parse(sock_fh, cmd_buffer, maxerr, compare_size);
+      if (task) {
+         // Catch up with the adds and dels the server has made since the last command.
+         if (shared_reader_refresh(sock_fh, reader)) {
+            fprintf(sock_fh, "%s FAILED, images not available\n", _quickcompare_reply_name(task->command));
+         } else {
+            task->options.exact_index = reader->exact_index;
+            task->options.pivot_table = reader->pivot_table;
+            _quickcompare_task_output(sock_fh, task, reader->list);
+         }
+         _compare_task_free(task);
+      }
+   } else if (strcmp(cmd_buffer, "info") == 0) {
+      shared_reader_refresh(sock_fh, reader);
+      fprintf(sock_fh, "INFO\n");
+      fprintf(sock_fh, "property: version: 2.31\n");
+      fprintf(sock_fh, "property: reader_pid: %d\n", (int) getpid());
+      fprintf(sock_fh, "property: image_loaded_count: %lu\n", reader->count);
+      fprintf(sock_fh, "property: shared_corpus_generation: %lu\n",
+            reader->header ? reader->header->generation : 0);
+      fprintf(sock_fh, "property: list_version: %lu\n",
+            reader->header ? __atomic_load_n(&reader->header->version, __ATOMIC_ACQUIRE) : 0);
+      fprintf(sock_fh, "property: pivot_count: %d\n", reader->pivot_table ? reader->pivot_table->count : 0);
+      fprintf(sock_fh, "INFO SUCCESS\n");
+   } else {
+      error(sock_fh, "BAD COMMAND: %s", cmd_buffer);
+   }
+   fclose(sock_fh);
+}
+
+// The loop of a reader process, started by the server with --readers.
+// The reader listens on the reader port, shared by all the readers, and answers
+// quickcompare against the images the server shares in a file in /dev/shm.
+// Each reader has its own list of the images, but their pixels are only in the file.
+// It takes one connection at a time, so there should be about one reader per CPU.
+//
+// Return non-zero if the reader can't start.
+int _reader_loop(FILE *log_fh, int reader_port, int compare_size, unsigned int maxerr) {
+   int listening_fds[2];
+   int listening_count = 0;
+   int fd = create_port_listen_v4(log_fh, reader_port);
+   if (fd > 0) {
+      listening_fds[listening_count++] = fd;
+   }
+   fd = create_port_listen_v6(log_fh, reader_port);
+   if (fd > 0) {
+      listening_fds[listening_count++] = fd;
+   }
+   if (listening_count == 0) {
+      error(log_fh, "Reader failed to start listening on network. Quitting.");
+      return 2;
+   }
+   Shared_Reader *reader = shared_reader_create(global_shared_filename, global_pivot_count);
+   if (!reader) {
+      error(log_fh, "Reader out of memory. Quitting.");
+      return 1;
+   }
+   shared_reader_refresh(log_fh, reader);
+   fd_set my_fd_set;
+   char cmd_buffer[BUFFER_SIZE];
+   while (1) {
+      FD_ZERO(&my_fd_set);
+      int fd_max = 0;
+      int index;
+      for (index = 0; index < listening_count; index++) {
+         FD_SET(listening_fds[index], &my_fd_set);
+         fd_max = max(fd_max, listening_fds[index]);
+      }
+      if (TEMP_FAILURE_RETRY(select(fd_max + 1, &my_fd_set, NULL, NULL, NULL)) < 0) {
+         error(log_fh, "Reader select() failed. errno=%d, error=%s", errno, strerror(errno));
+         continue;
+      }
+      for (index = 0; index < listening_count; index++) {
+         if (!FD_ISSET(listening_fds[index], &my_fd_set)) {
+            continue;
+         }
+         // Another reader may have taken the connection.
+         int client_fd = accept(listening_fds[index], NULL, NULL);
+         if (client_fd < 0) {
+            continue;
+         }
+         // Don't wait for ever on a client that doesn't finish its command.
+         struct timeval timeout = { READER_READ_TIMEOUT, 0 };
+         setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+         int cmd_offset = 0;
+         int read_bytes = 1;
+         cmd_buffer[0] = 0;
+         while ((read_bytes > 0) && (cmd_offset < BUFFER_SIZE - 1) && !strpbrk(cmd_buffer, "\r\n")) {
+            read_bytes = read(client_fd, &cmd_buffer[cmd_offset], BUFFER_SIZE - 1 - cmd_offset);
+            if (read_bytes > 0) {
+               cmd_offset += read_bytes;
+               cmd_buffer[cmd_offset] = 0;
+            }
+         }
+         int command_end = strcspn(cmd_buffer, "\r\n");
+         if ((command_end > 0) && cmd_buffer[command_end]) {
+            cmd_buffer[command_end] = 0; // Strip trailing LF, CR, CRLF, LFCR, ...
+            _reader_command_process(client_fd, cmd_buffer, reader, compare_size, maxerr);
+         } else {
+            close(client_fd);
+         }
+      }
+   }
+   return 0;
+}
+
 // Respond to commands requests and perform the commands:
 // For a list of commands see command_process().
 //
-// Will fork() for longer running operations such as fullcompare and quickcompare.
+// Runs longer operations such as fullcompare and quickcompare on the worker pool.
 //
 // Will load all PPMs into RAM before listening for commands.
 //
@@ -636,6 +1924,21 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
    }
    // Done setting up IPv4 and/or IPv6 listening ports.
 
+   // Setup a Unix domain socket to listen on, if asked for.
+   if (global_socket_path) {
+      listening_socket = create_unix_listen(log_fh, global_socket_path);
+      if (listening_socket <= 0) {
+         error(log_fh, "Failed to start listening on socket '%s'. Quitting.", global_socket_path);
+         int listening_index;
+         for (listening_index = 0; listening_index < first_real_client_index; listening_index++) {
+            close(global_client_detail[listening_index].fd);
+         }
+         return 2;
+      }
+      global_client_detail[first_real_client_index].fd = listening_socket;
+      first_real_client_index++;
+   }
+
    // Connect to SQL database
    PGconn *psql = ppm_sql_connect(log_fh, sql_info);
    if (!psql) {
@@ -644,6 +1947,19 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
             sql_info);
       return 1;
    }
+   if (ppm_sql_prepare(log_fh, psql)) {
+      ppm_sql_disconnect(log_fh, psql);
+      return 1;
+   }
+
+   // Adds and dels are journalled, and written to SQL behind, if asked for.
+   // Entries from before a restart are written first, and applied by load().
+   if (global_journal_filename
+         && !(global_journal = journal_open(log_fh, global_journal_filename, sql_info))) {
+      error(log_fh, "Failed to open the journal '%s'. Quitting.", global_journal_filename);
+      ppm_sql_disconnect(log_fh, psql);
+      return 1;
+   }
 
    // All PPMs in RAM. Loaded from SQL.
    PicInfo *picinfo_list = NULL;
@@ -652,10 +1968,29 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
    int rc = load(log_fh, psql, &picinfo_list);
    if (rc) {
       error(log_fh, "LOAD failed with code %d", rc);
+      journal_close(global_journal);
       ppm_sql_disconnect(log_fh, psql);
       return 1;
    }
 
+   // Threads for compares, kept until the server stops.
+   global_worker_pool = worker_pool_create(log_fh, global_cpu_count);
+   if (!global_worker_pool) {
+      unload(&picinfo_list);
+      journal_close(global_journal);
+      ppm_sql_disconnect(log_fh, psql);
+      return 1;
+   }
+   // fullcompares leave a thread for quickcompares, which are taken first.
+   if (!global_batch_threads || (global_batch_threads > global_cpu_count)) {
+      global_batch_threads = max(global_cpu_count - 1, 1);
+   }
+   worker_pool_limit(global_worker_pool, POOL_CLASS_INTERACTIVE, global_cpu_count, global_queued_max);
+   worker_pool_limit(global_worker_pool, POOL_CLASS_BATCH, global_batch_threads, global_queued_max);
+
+   // Reader processes, comparing with the images shared with them.
+   _readers_start(log_fh);
+
    // Setup an array of incoming file descriptors.
    int index;
    for (index = first_real_client_index; index < CLIENT_MAX; index++) {
@@ -712,8 +2047,11 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
       // Housekeeping
       // Reaper: Clean up any child processes which have exited.
       pid_t late_pid;
-      while ((late_pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+      int wait_status;
+      while ((late_pid = waitpid(-1, &wait_status, WNOHANG)) > 0) {
          global_child_process_count--;
+         _job_exited(late_pid, wait_status);
+         _reader_exited(late_pid);
          // Find the late client by pid then record it as dead.
          for (index = first_real_client_index; index < CLIENT_MAX; index++){
             if ((global_client_detail[index].fd != CLIENT_SLOT_FREE)
@@ -724,6 +2062,14 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
          }
       }
 
+      // Housekeeping
+      // Start reader processes again if they stopped.
+      _readers_start(log_fh);
+
+      // Housekeeping
+      // Take the adds SQL refused out of RAM.
+      _journal_refused_remove(log_fh, &picinfo_list);
+
       // Housekeeping
       // TODO check for any stale client connections
       // TODO add a mechanism so that we expire connections (other than socked for new v4 and v6)
@@ -768,6 +2114,7 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
             else {
                global_client_detail[free_slot].fd = new_sockfd;
                global_client_detail[free_slot].pid = 0;
+               global_client_detail[free_slot].frames = NULL;
                bzero(global_client_detail[free_slot].command_buffer,
                BUFFER_SIZE);
                global_client_detail[free_slot].cmd_offset = 0;
@@ -781,20 +2128,36 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
             char *cmd_buffer = global_client_detail[index].command_buffer;
             int cmd_offset = global_client_detail[index].cmd_offset;
             // Read data.
-            int read_bytes = read(client_fd, &cmd_buffer[cmd_offset], BUFFER_SIZE - cmd_offset);
+            // Keep the last byte free so the buffer is always a terminated string.
+            int read_bytes = read(client_fd, &cmd_buffer[cmd_offset], BUFFER_SIZE - 1 - cmd_offset);
             if (read_bytes < 0) {
                // kill the connection as client has most likely gone away.
                error(log_fh,
                      "Failed to read from client, closing the FD.");
                close(client_fd);
+               frame_connection_release(global_client_detail[index].frames);
+               global_client_detail[index].frames = NULL;
                global_client_detail[index].fd = CLIENT_SLOT_FREE;
                continue;
             }
             global_client_detail[index].cmd_offset += read_bytes;
+            // A client sending frames keeps the connection for as many requests as it likes.
+            if (_frames_wanted(&global_client_detail[index])) {
+               if ((read_bytes == 0) || _frames_process(&global_client_detail[index], &picinfo_list, psql,
+                     compare_size, maxerr)) {
+                  close(client_fd);
+                  frame_connection_release(global_client_detail[index].frames);
+                  global_client_detail[index].frames = NULL;
+                  global_client_detail[index].fd = CLIENT_SLOT_FREE;
+                  global_active_connection_count--;
+               }
+               continue;
+            }
             // TODO update timeout.
             // Check if a command has been completed.
+            // Only once the line end arrives, as a long command such as add_thumb may take several reads.
             int command_end = strcspn(cmd_buffer, "\r\n");
-            if (command_end > 0) {
+            if ((command_end > 0) && cmd_buffer[command_end]) {
                cmd_buffer[command_end] = 0; // Strip trailing LF, CR, CRLF, LFCR, ...
                command_process(client_fd, cmd_buffer, &picinfo_list, psql,
                      &server_loop, compare_size, maxerr);
@@ -802,17 +2165,43 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
                global_client_detail[index].fd = CLIENT_SLOT_FREE;
                global_active_connection_count--;
             }
+            // Client went away, or sent more than a command can hold, before finishing the line.
+            else if ((read_bytes == 0) || (global_client_detail[index].cmd_offset >= BUFFER_SIZE - 1)) {
+               error(log_fh, "Incomplete command from client, closing the FD.");
+               close(client_fd);
+               global_client_detail[index].fd = CLIENT_SLOT_FREE;
+               global_active_connection_count--;
+            }
          }
       }
    }
+   // Stop the jobs, then wait for the compares still running on the worker pool.
+   pthread_mutex_lock(&global_mutex);
+   for (index = 0; index < JOB_MAX; index++) {
+      if (global_jobs[index].active && !global_jobs[index].pid) {
+         __atomic_store_n(&global_jobs[index].cancel, 1, __ATOMIC_RELAXED);
+      }
+   }
+   pthread_mutex_unlock(&global_mutex);
+   worker_pool_free(global_worker_pool);
+   global_worker_pool = NULL;
+   _corpus_changed();
+   _readers_stop();
    if (picinfo_list) {
       unload(&picinfo_list);
    }
 
-   // close all sockets, including for new IPv4 and IPv6 connections.
+   // close all sockets, including for new IPv4, IPv6 and Unix domain connections.
    for (index = 0; index < CLIENT_MAX; index++)
       if (global_client_detail[index].fd != CLIENT_SLOT_FREE)
          close(global_client_detail[index].fd);
+   if (global_socket_path && (global_socket_path[0] != '@')) {
+      unlink(global_socket_path);
+   }
+
+   // Entries not written to SQL yet are written after the next start.
+   journal_close(global_journal);
+   global_journal = NULL;
 
    // End of server loop
    ppm_sql_disconnect(log_fh, psql);
@@ -823,7 +2212,29 @@ int _server_loop(FILE *log_fh, char *sql_info, int portno, int compare_size,
 void usage(FILE *log_fh) {
    fprintf(log_fh, "\n");
    fprintf(log_fh,
-         "Usage: \"dbname = 'MyDatabase' user = 'MyUser' connect_timeout = '10'\" port\n");
+         "Usage: [OPTIONS] \"dbname = 'MyDatabase' user = 'MyUser' connect_timeout = '10'\" port\n");
+   fprintf(log_fh, "\n");
+   fprintf(log_fh, "OPTIONS:\n");
+   fprintf(log_fh, "   --exif-thumbnail : Make thumbnails of JPEG files from their EXIF thumbnail, when big enough.\n");
+   fprintf(log_fh, "                      Faster, but the EXIF thumbnail may be stale if the image was edited.\n");
+   fprintf(log_fh, "   --phash-distance N : Only compare images whose perceptual hashes differ in at most N of 64 bits.\n");
+   fprintf(log_fh, "                      Faster, but may miss matches. Use test/build/dids_phash_benchmark to choose N.\n");
+   fprintf(log_fh, "                      Default -1, compare every pair.\n");
+   fprintf(log_fh, "   --pivots N       : Pivot images used to rule out pairs without comparing pixels, 0 to %d.\n",
+         PIVOT_MAX);
+   fprintf(log_fh, "                      Default %d.\n", PIVOT_COUNT);
+   fprintf(log_fh, "   --readers N      : Reader processes answering quickcompare on the reader port, 0 to %d.\n",
+         READER_MAX);
+   fprintf(log_fh, "                      They share the images in RAM with the server. Default 0.\n");
+   fprintf(log_fh, "   --reader-port P  : Port the reader processes listen on. Default the port plus 1.\n");
+   fprintf(log_fh, "   --socket PATH    : Also listen on this Unix domain socket, for clients on this host.\n");
+   fprintf(log_fh, "                      A PATH starting with @ is in the abstract namespace.\n");
+   fprintf(log_fh, "   --batch-threads N : Threads fullcompares may use at once. quickcompares are run first.\n");
+   fprintf(log_fh, "                      Default all but one, so quickcompares always have a thread.\n");
+   fprintf(log_fh, "   --max-queued N   : quickcompares, or fullcompares, waiting for a thread before more are\n");
+   fprintf(log_fh, "                      refused as the server is busy. 0 for no limit. Default %d.\n", QUEUED_MAX);
+   fprintf(log_fh, "   --journal FILE   : Reply to add and del once they are in this journal on local disk, and\n");
+   fprintf(log_fh, "                      write them to SQL behind, in batches. Default off, SQL is written first.\n");
    fprintf(log_fh, "\n");
 }
 
@@ -833,27 +2244,116 @@ void usage(FILE *log_fh) {
 //
 // Arg 1:  SQL connection string  "dbname = 'my_database_name' user = 'my_sql_user' connect_timeout = '10'"
 // Arg 2:  Network port to listen on for commands.
+//
+// For options see usage().
 int main(int argc, char *argv[]) {
    int compare_size = COMPARE_SIZE;
    unsigned int maxerr = COMPARE_THRESHOLD;
-   if (argc < 3) {
+   static int exif_thumbnail_flag = 0;
+   static int reader_process_flag = 0; // Set when the server starts this as a reader process.
+   static struct option long_options[] = {
+      {"exif-thumbnail", no_argument, &exif_thumbnail_flag, 1},
+      {"phash-distance", required_argument, 0, 'p'},
+      {"pivots", required_argument, 0, 'v'},
+      {"readers", required_argument, 0, 'r'},
+      {"reader-port", required_argument, 0, 'P'},
+      {"reader-process", no_argument, &reader_process_flag, 1},
+      {"socket", required_argument, 0, 's'},
+      {"batch-threads", required_argument, 0, 'b'},
+      {"max-queued", required_argument, 0, 'q'},
+      {"journal", required_argument, 0, 'j'},
+      {0, 0, 0, 0}
+   };
+   global_argv = argv;
+   while (1) {
+      int option_index = 0;
+      int c = getopt_long(argc, argv, "", long_options, &option_index);
+      if (c == -1)
+         break;
+      if (c == 'p') {
+         global_phash_max_distance = atoi(optarg);
+         if ((global_phash_max_distance < -1) || (global_phash_max_distance > 64)) {
+            fprintf(stderr, "\nERROR: --phash-distance must be from -1 to 64\n");
+            usage(stderr);
+            exit(1);
+         }
+      }
+      else if (c == 'v') {
+         global_pivot_count = atoi(optarg);
+         if ((global_pivot_count < 0) || (global_pivot_count > PIVOT_MAX)) {
+            fprintf(stderr, "\nERROR: --pivots must be from 0 to %d\n", PIVOT_MAX);
+            usage(stderr);
+            exit(1);
+         }
+      }
+      else if (c == 'r') {
+         global_reader_count = atoi(optarg);
+         if ((global_reader_count < 0) || (global_reader_count > READER_MAX)) {
+            fprintf(stderr, "\nERROR: --readers must be from 0 to %d\n", READER_MAX);
+            usage(stderr);
+            exit(1);
+         }
+      }
+      else if (c == 'P') {
+         global_reader_port = atoi(optarg);
+         if (!global_reader_port) {
+            fprintf(stderr, "\nERROR: Invalid reader port\n");
+            usage(stderr);
+            exit(1);
+         }
+      }
+      else if (c == 's') {
+         global_socket_path = optarg;
+      }
+      else if (c == 'b') {
+         global_batch_threads = atoi(optarg);
+         if (global_batch_threads < 1) {
+            fprintf(stderr, "\nERROR: --batch-threads must be at least 1\n");
+            usage(stderr);
+            exit(1);
+         }
+      }
+      else if (c == 'q') {
+         global_queued_max = strtoul(optarg, NULL, 10);
+      }
+      else if (c == 'j') {
+         global_journal_filename = optarg;
+      }
+      else if (c == '?') {
+         usage(stderr);
+         exit(1);
+      }
+   }
+   if (argc - optind < 2) {
       fprintf(stderr, "\nERROR: Not enough arguments\n");
       usage(stderr);
       exit(1);
    }
-   char *sql_info = argv[1];
-   int portno = atoi(argv[2]);
+   char *sql_info = argv[optind];
+   int portno = atoi(argv[optind + 1]);
    if (!portno) {
       fprintf(stderr, "\nERROR: Invalid port\n");
       usage(stderr);
       exit(1);
    }
+   if (!global_reader_port) {
+      global_reader_port = portno + 1;
+   }
+   snprintf(global_shared_filename, sizeof(global_shared_filename), SHARED_CORPUS_TEMPLATE, portno);
+   ppm_set_exif_thumbnail(exif_thumbnail_flag);
    global_cpu_count = _get_cpu_count(stdout);    // Work out how many CPUs we have. Default to 2
    if (global_cpu_count == 0) {
       global_cpu_count = 2;
    }
+   // A client going away while the worker pool writes to it must not stop the server.
+   signal(SIGPIPE, SIG_IGN);
    MagickWandGenesis();
-   _server_loop(stdout, sql_info, portno, compare_size, maxerr);
+   if (reader_process_flag) {
+      global_reader_count = 0;
+      _reader_loop(stdout, global_reader_port, compare_size, maxerr);
+   } else {
+      _server_loop(stdout, sql_info, portno, compare_size, maxerr);
+   }
    MagickWandTerminus();
    pthread_exit(NULL); /* The final thing that main() should do */
    exit(0);
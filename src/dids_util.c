@@ -1,5 +1,7 @@
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <stddef.h>
 #include "dids.h"
 /*
  * Print error to socket.
@@ -34,3 +36,24 @@ void debug(FILE *sock_fh, const char *format, ...) {
    fprintf(sock_fh, "DEBUG: %s\n", buffer);
    fflush(sock_fh);
 }
+
+/*
+ * Set address to the Unix domain socket path.
+ * A path starting with '@' is in the abstract namespace, so is never a file,
+ * and goes when the server stops.
+ *
+ * Return the length of the address, or 0 if the path is too long.
+ */
+socklen_t unix_socket_address(struct sockaddr_un *address, char *path) {
+   size_t length = strlen(path);
+   memset(address, 0, sizeof(struct sockaddr_un));
+   address->sun_family = AF_UNIX;
+   if ((length == 0) || (length >= sizeof(address->sun_path))) {
+      return 0;
+   }
+   memcpy(address->sun_path, path, length);
+   if (path[0] == '@') {
+      address->sun_path[0] = 0;
+   }
+   return offsetof(struct sockaddr_un, sun_path) + length + (path[0] == '@' ? 0 : 1);
+}
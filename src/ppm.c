@@ -153,6 +153,21 @@ unsigned int PPM_compare(FILE *sock_fh, PPM_Info *p1, PPM_Info *p2,
     return diff;
 }
 
+// Use the JPEG preview embedded in camera RAW files rather than processing the raw data.
+int ppm_raw_preview_enabled = 1;
+
+void ppm_set_raw_preview(int enabled) {
+    ppm_raw_preview_enabled = enabled;
+}
+
+// Use the EXIF thumbnail of JPEG files rather than decoding the full image.
+// Off by default, as the EXIF thumbnail can be stale after an edit.
+int ppm_exif_thumbnail_enabled = 0;
+
+void ppm_set_exif_thumbnail(int enabled) {
+    ppm_exif_thumbnail_enabled = enabled;
+}
+
 void ReportWandException(MagickWand *wand, FILE *sock_fh) {
     ExceptionType severity;
     char *description = MagickGetException(wand, &severity);
@@ -182,7 +197,33 @@ PPM_Info *ppm_miniature_from_filename(FILE *sock_fh, char *filename,
      Read an image.
      */
 
-    if (MagickReadImage(magick_wand, filename) == MagickFalse) {
+    // Camera RAW files hold a JPEG preview. Decoding that is far quicker than demosaicing
+    // the raw data, and either way the result is shrunk to new_size.
+    // Fall back to reading the whole RAW file if there is no usable preview.
+    // Likewise for the EXIF thumbnail of a JPEG, when enabled.
+    char *source = NULL;
+    size_t preview_length;
+    unsigned char *preview = NULL;
+    char *preview_source = NULL;
+    if (ppm_raw_preview_enabled && preview_is_raw_filename(filename)) {
+        preview = preview_from_raw_filename(sock_fh, filename, new_size, &preview_length);
+        preview_source = "raw_preview";
+    } else if (ppm_exif_thumbnail_enabled) {
+        preview = preview_from_exif_filename(sock_fh, filename, new_size, &preview_length);
+        preview_source = "exif_thumbnail";
+    }
+    if (preview) {
+        if (MagickReadImageBlob(magick_wand, preview, preview_length) == MagickTrue) {
+            source = preview_source;
+        } else {
+            ClearMagickWand(magick_wand);
+        }
+        free(preview);
+    }
+
+    if (source) {
+        debug(sock_fh, "Thumbnail: %s, %s", filename, source);
+    } else if (MagickReadImage(magick_wand, filename) == MagickFalse) {
         error(sock_fh, "ppm_miniature_from_filename: MagickReadImage failed for filename: %s", filename);
         ReportWandException(magick_wand, sock_fh);
         magick_wand = DestroyMagickWand(magick_wand);
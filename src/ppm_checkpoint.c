@@ -0,0 +1,254 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module keeps a checkpoint of a fullcompare: a journal of the work
+ * units finished, with the matches each reported. A fullcompare that was
+ * stopped part way can then be resumed without redoing the finished units.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#define CHECKPOINT_HEADER "dids_fullcompare_checkpoint 1"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "dids.h"
+
+static unsigned long long _fnv_add(unsigned long long hash, const void *data, size_t length) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    size_t offset;
+    for (offset = 0; offset < length; offset++) {
+        hash ^= bytes[offset];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * checkpoint_fingerprint
+ *
+ * A hash of everything that changes what fullcompare reports: the images,
+ * their 'similar but different' lists, maxerr and the options.
+ * A checkpoint can only be resumed if the fingerprint is the same.
+ */
+unsigned long long checkpoint_fingerprint(PicInfo *list, unsigned int maxerr, Compare_Options *options) {
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    hash = _fnv_add(hash, &maxerr, sizeof maxerr);
+    if (options) {
+        hash = _fnv_add(hash, &options->exact_only, sizeof options->exact_only);
+        hash = _fnv_add(hash, &options->phash_max_distance, sizeof options->phash_max_distance);
+        hash = _fnv_add(hash, &options->mode, sizeof options->mode);
+        hash = _fnv_add(hash, &options->topk, sizeof options->topk);
+        hash = _fnv_add(hash, &options->since, sizeof options->since);
+        hash = _fnv_add(hash, &options->shard, sizeof options->shard);
+        hash = _fnv_add(hash, &options->shard_count, sizeof options->shard_count);
+    }
+    for (; list; list = list->next) {
+        hash = _fnv_add(hash, list->external_ref, strlen(list->external_ref) + 1);
+        hash = _fnv_add(hash, &list->pixel_hash, sizeof list->pixel_hash);
+        hash = _fnv_add(hash, &list->created, sizeof list->created);
+        Similar_but_different *similar_but_different;
+        for (similar_but_different = list->similar_but_different; similar_but_different;
+                similar_but_different = similar_but_different->next) {
+            hash = _fnv_add(hash, similar_but_different->external_ref,
+                    strlen(similar_but_different->external_ref) + 1);
+        }
+    }
+    return hash;
+}
+
+/*
+ * checkpoint_id_valid
+ *
+ * The id is part of a filename, so only letters, digits, '_' and '-' are allowed.
+ */
+int checkpoint_id_valid(char *id) {
+    size_t length = strlen(id);
+    if ((length == 0) || (length >= CHECKPOINT_ID_MAX)) {
+        return 0;
+    }
+    return strspn(id, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") == length;
+}
+
+// Read the finished units from the journal, reporting their matches again.
+// A unit only partly written, e.g. when the server stopped, is dropped from the journal.
+//
+// Return 0 on success, non-zero if the journal is not for this fullcompare.
+static int _checkpoint_replay(FILE *sock_fh, Checkpoint *checkpoint, unsigned long long fingerprint) {
+    char line[BUFFER_SIZE];
+    unsigned long long fingerprint_journal = 0;
+    unsigned long unit_count_journal = 0;
+    if (!fgets(line, sizeof line, checkpoint->fh) || strncmp(line, CHECKPOINT_HEADER "\n", sizeof line)
+            || !fgets(line, sizeof line, checkpoint->fh)
+            || (sscanf(line, "fingerprint %llx units %lu", &fingerprint_journal, &unit_count_journal) != 2)) {
+        error(sock_fh, "checkpoint %s is not a fullcompare checkpoint", checkpoint->filename);
+        return 1;
+    }
+    if ((fingerprint_journal != fingerprint) || (unit_count_journal != checkpoint->unit_count)) {
+        error(sock_fh, "checkpoint %s - the images or options have changed since it was written",
+                checkpoint->filename);
+        return 2;
+    }
+    long complete_offset = ftell(checkpoint->fh);
+
+    // Each unit is "unit <unit> <line count>", then its lines.
+    char *unit_output = NULL;
+    size_t unit_output_length = 0;
+    FILE *unit_fh = NULL;
+    unsigned long unit = 0;
+    unsigned long lines_remaining = 0;
+    int unit_open = 0;
+    // The lines of a unit, e.g. a group of clusters, may be longer than BUFFER_SIZE.
+    char *unit_line = NULL;
+    size_t unit_line_size = 0;
+    ssize_t length;
+    while ((length = getline(&unit_line, &unit_line_size, checkpoint->fh)) > 0) {
+        if (unit_line[length - 1] != '\n') {
+            break; // Only part of it was written.
+        }
+        if (!unit_open) {
+            if ((sscanf(unit_line, "unit %lu %lu", &unit, &lines_remaining) != 2)
+                    || (unit >= checkpoint->unit_count)
+                    || !(unit_fh = open_memstream(&unit_output, &unit_output_length))) {
+                break;
+            }
+            unit_open = 1;
+        } else {
+            fwrite(unit_line, 1, length, unit_fh);
+            lines_remaining--;
+        }
+        if (unit_open && (lines_remaining == 0)) {
+            fclose(unit_fh);
+            fwrite(unit_output, 1, unit_output_length, sock_fh);
+            free(unit_output);
+            unit_output = NULL;
+            unit_open = 0;
+            if (!checkpoint->units_done[unit]) {
+                checkpoint->units_done[unit] = 1;
+                checkpoint->units_done_count++;
+            }
+            complete_offset = ftell(checkpoint->fh);
+        }
+    }
+    if (unit_open) {
+        fclose(unit_fh);
+        free(unit_output);
+    }
+    free(unit_line);
+    fflush(sock_fh);
+
+    // New units are written after the last complete one.
+    if (fseek(checkpoint->fh, complete_offset, SEEK_SET) || ftruncate(fileno(checkpoint->fh), complete_offset)) {
+        error(sock_fh, "checkpoint %s - failed to truncate", checkpoint->filename);
+        return 3;
+    }
+    return 0;
+}
+
+/*
+ * checkpoint_open
+ *
+ * Start the checkpoint of a fullcompare, with unit_count work units.
+ * When resuming, the matches of the finished units are reported again to sock_fh.
+ *
+ * Return the checkpoint, or NULL on failure, after reporting an error.
+ */
+Checkpoint *checkpoint_open(FILE *sock_fh, char *id, unsigned long long fingerprint, unsigned long unit_count,
+        int resume) {
+    if (!checkpoint_id_valid(id)) {
+        error(sock_fh, "checkpoint id '%s' is not valid", id);
+        return NULL;
+    }
+    Checkpoint *checkpoint = (Checkpoint *) calloc(1, sizeof(Checkpoint));
+    if (!checkpoint || !(checkpoint->units_done = (unsigned char *) calloc(unit_count + 1, 1))) {
+        error(sock_fh, "checkpoint_open - out of memory");
+        free(checkpoint);
+        return NULL;
+    }
+    snprintf(checkpoint->filename, sizeof checkpoint->filename, CHECKPOINT_FILE_TEMPLATE, id);
+    checkpoint->unit_count = unit_count;
+    checkpoint->synced = time(NULL);
+    checkpoint->fh = fopen(checkpoint->filename, resume ? "r+" : "w");
+    if (!checkpoint->fh) {
+        error(sock_fh, "checkpoint %s - failed to open", checkpoint->filename);
+        checkpoint_close(checkpoint, 0);
+        return NULL;
+    }
+    if (resume) {
+        if (_checkpoint_replay(sock_fh, checkpoint, fingerprint)) {
+            checkpoint_close(checkpoint, 0);
+            return NULL;
+        }
+        debug(sock_fh, "checkpoint %s resumed with %lu of %lu units done", checkpoint->filename,
+                checkpoint->units_done_count, unit_count);
+    } else {
+        fprintf(checkpoint->fh, CHECKPOINT_HEADER "\nfingerprint %llx units %lu\n", fingerprint, unit_count);
+        fflush(checkpoint->fh);
+    }
+    return checkpoint;
+}
+
+/*
+ * checkpoint_unit
+ *
+ * Report the output of a finished work unit, and write it to the journal.
+ * The caller must hold the lock, so units are written whole.
+ * The journal is flushed every unit, and synced to disk every CHECKPOINT_SYNC_SECONDS.
+ */
+void checkpoint_unit(Checkpoint *checkpoint, FILE *sock_fh, unsigned long unit, char *output, size_t length) {
+    fwrite(output, 1, length, sock_fh);
+    fflush(sock_fh);
+
+    unsigned long line_count = 0;
+    size_t offset;
+    for (offset = 0; offset < length; offset++) {
+        if (output[offset] == '\n') {
+            line_count++;
+        }
+    }
+    fprintf(checkpoint->fh, "unit %lu %lu\n", unit, line_count);
+    fwrite(output, 1, length, checkpoint->fh);
+    fflush(checkpoint->fh);
+    if (time(NULL) - checkpoint->synced >= CHECKPOINT_SYNC_SECONDS) {
+        fsync(fileno(checkpoint->fh));
+        checkpoint->synced = time(NULL);
+    }
+    checkpoint->units_done[unit] = 1;
+    checkpoint->units_done_count++;
+}
+
+/*
+ * checkpoint_close
+ *
+ * When the fullcompare finished, the checkpoint is no longer needed, so is removed.
+ */
+void checkpoint_close(Checkpoint *checkpoint, int finished) {
+    if (!checkpoint) {
+        return;
+    }
+    if (checkpoint->fh) {
+        fclose(checkpoint->fh);
+        if (finished) {
+            unlink(checkpoint->filename);
+        }
+    }
+    free(checkpoint->units_done);
+    free(checkpoint);
+}
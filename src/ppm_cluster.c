@@ -0,0 +1,192 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module joins matched images into groups (clusters), so fullcompare
+ * can report one line per group of duplicates rather than one per pair.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#define CLUSTER_NONE ((unsigned long) -1)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "dids.h"
+
+/*
+ * cluster_set_create
+ *
+ * Return a set of count images, each in a group of its own, or NULL if out of memory.
+ */
+Cluster_Set *cluster_set_create(unsigned long count) {
+    Cluster_Set *set = (Cluster_Set *) calloc(1, sizeof(Cluster_Set));
+    if (!set) {
+        return NULL;
+    }
+    set->count = count;
+    set->parent = (unsigned long *) malloc((count + 1) * sizeof(unsigned long));
+    set->err_min = (unsigned int *) malloc((count + 1) * sizeof(unsigned int));
+    set->err_max = (unsigned int *) calloc(count + 1, sizeof(unsigned int));
+    if (!set->parent || !set->err_min || !set->err_max) {
+        cluster_set_free(set);
+        return NULL;
+    }
+    unsigned long image;
+    for (image = 0; image < count; image++) {
+        set->parent[image] = image;
+        set->err_min[image] = UINT_MAX;
+    }
+    return set;
+}
+
+void cluster_set_free(Cluster_Set *set) {
+    if (!set) {
+        return;
+    }
+    free(set->parent);
+    free(set->err_min);
+    free(set->err_max);
+    free(set);
+}
+
+/*
+ * cluster_set_find
+ *
+ * Return the image at the root of the group. Safe to call from many threads at once.
+ * Path halving: each image visited is pointed at its grandparent, so later finds are quicker.
+ */
+unsigned long cluster_set_find(Cluster_Set *set, unsigned long image) {
+    while (1) {
+        unsigned long parent = __atomic_load_n(&set->parent[image], __ATOMIC_ACQUIRE);
+        if (parent == image) {
+            return image;
+        }
+        unsigned long grandparent = __atomic_load_n(&set->parent[parent], __ATOMIC_ACQUIRE);
+        if (grandparent != parent) {
+            // If another thread got here first, its change is just as good.
+            __atomic_compare_exchange_n(&set->parent[image], &parent, grandparent, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        }
+        image = grandparent;
+    }
+}
+
+/*
+ * cluster_set_union
+ *
+ * Join the groups of two matched images. Safe to call from many threads at once,
+ * without a lock: a root is only linked under another root, by compare and swap.
+ * err is kept on image_1, and combined for the whole group by cluster_set_report().
+ */
+void cluster_set_union(Cluster_Set *set, unsigned long image_1, unsigned long image_2, unsigned int err) {
+    unsigned int err_old = __atomic_load_n(&set->err_min[image_1], __ATOMIC_RELAXED);
+    while ((err < err_old) && !__atomic_compare_exchange_n(&set->err_min[image_1], &err_old, err, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    err_old = __atomic_load_n(&set->err_max[image_1], __ATOMIC_RELAXED);
+    while ((err > err_old) && !__atomic_compare_exchange_n(&set->err_max[image_1], &err_old, err, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+
+    while (1) {
+        unsigned long root_1 = cluster_set_find(set, image_1);
+        unsigned long root_2 = cluster_set_find(set, image_2);
+        if (root_1 == root_2) {
+            return;
+        }
+        // The lower image stays the root, so the result doesn't depend on the order of unions.
+        if (root_1 > root_2) {
+            unsigned long root = root_1;
+            root_1 = root_2;
+            root_2 = root;
+        }
+        unsigned long expected = root_2;
+        if (__atomic_compare_exchange_n(&set->parent[root_2], &expected, root_1, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+    }
+}
+
+/*
+ * cluster_set_report
+ *
+ * Report each group of two or more images, in the order of their first image in the list:
+ *   Group: <image count>, <lowest err>, <highest err>, <external_ref>, <external_ref>, ...
+ * The errors are of the matches found, so images in a group need not all match each other.
+ * Call once all the unions are done.
+ *
+ * Return the number of groups reported, or -1 if out of memory.
+ */
+long cluster_set_report(FILE *sock_fh, Cluster_Set *set, PicInfo *list) {
+    PicInfo **pics = (PicInfo **) malloc((set->count + 1) * sizeof(PicInfo *));
+    unsigned long *member_next = (unsigned long *) malloc((set->count + 1) * sizeof(unsigned long));
+    unsigned long *first = (unsigned long *) malloc((set->count + 1) * sizeof(unsigned long));
+    unsigned long *size = (unsigned long *) calloc(set->count + 1, sizeof(unsigned long));
+    unsigned int *err_min = (unsigned int *) malloc((set->count + 1) * sizeof(unsigned int));
+    unsigned int *err_max = (unsigned int *) calloc(set->count + 1, sizeof(unsigned int));
+    long group_count = -1;
+    unsigned long image;
+    if (!pics || !member_next || !first || !size || !err_min || !err_max) {
+        error(sock_fh, "cluster_set_report - out of memory");
+    } else {
+        for (image = 0; (image < set->count) && list; image++, list = list->next) {
+            pics[image] = list;
+            first[image] = CLUSTER_NONE;
+            err_min[image] = UINT_MAX;
+        }
+
+        // Chain the members of each group from its root, working backwards so the chain is in list order.
+        for (image = set->count; image-- > 0;) {
+            unsigned long root = cluster_set_find(set, image);
+            member_next[image] = first[root];
+            first[root] = image;
+            size[root]++;
+            if (set->err_min[image] < err_min[root]) {
+                err_min[root] = set->err_min[image];
+            }
+            if (set->err_max[image] > err_max[root]) {
+                err_max[root] = set->err_max[image];
+            }
+        }
+
+        // The root is the lowest image of its group, so groups come out in list order.
+        group_count = 0;
+        for (image = 0; image < set->count; image++) {
+            if ((set->parent[image] != image) || (size[image] < 2)) {
+                continue;
+            }
+            fprintf(sock_fh, "Group: %lu, %u, %u", size[image], err_min[image], err_max[image]);
+            unsigned long member;
+            for (member = first[image]; member != CLUSTER_NONE; member = member_next[member]) {
+                fprintf(sock_fh, ", %s", pics[member]->external_ref);
+            }
+            fprintf(sock_fh, "\n");
+            group_count++;
+        }
+        fflush(sock_fh);
+    }
+
+    free(pics);
+    free(member_next);
+    free(first);
+    free(size);
+    free(err_min);
+    free(err_max);
+    return group_count;
+}
@@ -24,11 +24,16 @@
 
 #define FULLCOMPARE_REPORT_COMPARE_INTERVAL 5000
 #define FULLCOMPARE_THREAD_COUNT     8
+#define PIVOT_MARGIN 0.01 // Allow for rounding in the float pivot distances.
+#define DEADLINE_CHECK_INTERVAL 16 // Images considered between looks at the clock, with a deadline.
 
 // Standard
 #include <pthread.h>
 #include <stdio.h>
 #include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -42,100 +47,112 @@ struct fullcompare_thread_data {
     int thread_id;
     FILE *sock_fh;
     unsigned int maxerr;
+    Compare_Options *options;
+    Fullcompare_Run *run;
 };
 
-pthread_mutex_t fullcompare_mutex;
-
-PicInfo *fullcompare_worklist;
-
-// How many image comparison sets will be done.
-unsigned long long fullcompare_set_count;
-
-// How many image comparison sets remain to do.
-unsigned long long fullcompare_set_count_remaining;
-
-// How many image comparisons we are expecting to do.
-long double fullcompare_compare_total;
-
-// How many image comparison we have repored
-long double fullcompare_compare_remaining_reported;
-
 /*
  *  fullcompare_set_work_list
  *  Set the working list to do a full compare on.
  *
+ *  run  - the fullcompare
  *  list - the list of thumb nails to process
  */
 
-void fullcompare_set_work_list(PicInfo *list) {
-    pthread_mutex_lock(&fullcompare_mutex);
-    fullcompare_worklist = list;
+void fullcompare_set_work_list(Fullcompare_Run *run, PicInfo *list) {
+    pthread_mutex_lock(&run->mutex);
+    run->worklist = list;
+    run->unit_next = 0;
 
     // count how many work items.
-    fullcompare_set_count = 0L;
+    run->set_count = 0L;
     PicInfo *current_pic = list;
     while (current_pic) {
-        fullcompare_set_count++;
+        run->set_count++;
         current_pic = current_pic->next;
     }
-    fullcompare_set_count_remaining = fullcompare_set_count;
+    run->set_count_remaining = run->set_count;
     // If there are N images, then there will be N-1 image sets to compare.
     // Each image set of will compare one less than the number of images in the set.
     // Hint: consider an Nx(N-1) grid and the triangle formed by comparing N images, with the remaining N-1 images, only once.
-    fullcompare_compare_total = fullcompare_set_count
-            * (fullcompare_set_count - 1) / 2;
-    // We ensure we report the 100% by increasing the fullcompare_compare_remaining_reported over the INTERVAL.
-    fullcompare_compare_remaining_reported = fullcompare_compare_total + FULLCOMPARE_REPORT_COMPARE_INTERVAL + 1;
-    pthread_mutex_unlock(&fullcompare_mutex);
+    run->compare_total = run->set_count
+            * (run->set_count - 1) / 2;
+    // We ensure we report the 100% by increasing the compare_remaining_reported over the INTERVAL.
+    run->compare_remaining_reported = run->compare_total + FULLCOMPARE_REPORT_COMPARE_INTERVAL + 1;
+    pthread_mutex_unlock(&run->mutex);
 }
 
 /*
  * fullcompare_get_work_item
  * give a work unit to a worker thread.
  *
- * sock_fh - error channel
+ * run      - the fullcompare
+ * sock_fh  - error channel
+ * unit_ptr - set to the work unit number.
  *
  * Return
  *    a list of thumb nails to process.
- *    NULL if no work remaining to process.
+ *    NULL if no work remaining to process, or the fullcompare was cancelled.
  *
  */
 
+// The percent of the pairs of this run, see fullcompare_shard_units(), compared by the units before unit.
+static long double fullcompare_percent(Fullcompare_Run *run, unsigned long unit) {
+    long double first = run->pairs_before[run->unit_first];
+    long double total = run->pairs_before[run->unit_end] - first;
+    long double done = run->pairs_before[unit] - first;
+    if (done < 0) {
+        done = 0;
+    } else if (done > total) {
+        done = total;
+    }
+    return total ? 100 * done / total : 100;
+}
+
 PicInfo *
-fullcompare_get_work_item(FILE *sock_fh) {
+fullcompare_get_work_item(Fullcompare_Run *run, FILE *sock_fh, unsigned long *unit_ptr) {
     PicInfo *ret = NULL;
-    pthread_mutex_lock(&fullcompare_mutex);
-    if (fullcompare_worklist) {
+    pthread_mutex_lock(&run->mutex);
+    if (run->cancel && __atomic_load_n(run->cancel, __ATOMIC_RELAXED)) {
+        run->worklist = NULL;
+    }
+    if (run->worklist) {
 
         // Get a work item.
-        ret = fullcompare_worklist;
-        fullcompare_worklist = fullcompare_worklist->next;
+        ret = run->worklist;
+        run->worklist = run->worklist->next;
+        *unit_ptr = run->unit_next++;
 
 
         // Hint consider an NxN grid and the triangle formed by comparing any two images exactly once.
         long double fullcompare_compare_remaining =
-            fullcompare_set_count_remaining * (fullcompare_set_count_remaining - 1) / 2;
+            run->set_count_remaining * (run->set_count_remaining - 1) / 2;
 
-            if ( (fullcompare_compare_remaining_reported - fullcompare_set_count_remaining) > FULLCOMPARE_REPORT_COMPARE_INTERVAL ){
-            fullcompare_compare_remaining_reported = fullcompare_set_count_remaining;
+            if ( (run->compare_remaining_reported - run->set_count_remaining) > FULLCOMPARE_REPORT_COMPARE_INTERVAL ){
+            run->compare_remaining_reported = run->set_count_remaining;
 
-            long double percent_complete = 100.0
-                - (fullcompare_compare_remaining / fullcompare_compare_total * 100);
+            long double percent_complete = run->pairs_before ? fullcompare_percent(run, *unit_ptr)
+                : (100.0 - (fullcompare_compare_remaining / run->compare_total * 100));
             fprintf(sock_fh,
                 "fullcompare_progress: %6.2Lf%% complete, sets remaining=%llu/%llu\n",
-                percent_complete, fullcompare_set_count_remaining,
-                fullcompare_set_count);
+                percent_complete, run->set_count_remaining,
+                run->set_count);
             fflush(sock_fh);
         }
 
         // Reduce the set count
-        --fullcompare_set_count_remaining;
+        --run->set_count_remaining;
+    }
+    else if (run->set_count_remaining) {
+        fprintf(sock_fh, "fullcompare_progress: cancelled, sets remaining=%llu/%llu\n",
+                run->set_count_remaining, run->set_count);
+        fflush(sock_fh);
     }
     else {
         fprintf(sock_fh, "fullcompare_progress: 100.00%% complete\n");
         fflush(sock_fh);
     }
-    pthread_mutex_unlock(&fullcompare_mutex);
+    pthread_mutex_unlock(&run->mutex);
     return ret;
 }
 
@@ -151,16 +168,193 @@ void *fullcompare_worker(void *threadarg) {
     int thread_id = my_data->thread_id;
     FILE *sock_fh = my_data->sock_fh;
     unsigned int maxerr = my_data->maxerr;
+    Fullcompare_Run *run = my_data->run;
+
+    // Each thread counts into its own stats, then adds them to the total when done.
+    Compare_Options options;
+    Compare_Stats stats = { 0 };
+    if (my_data->options) {
+        options = *my_data->options;
+    } else {
+        compare_options_init(&options);
+    }
+    options.stats = &stats;
 
     debug(sock_fh, "fullcompare_worker: Start %d", thread_id);
     fflush(sock_fh);
     PicInfo *current_pic;
-    while ((current_pic = fullcompare_get_work_item(sock_fh)) && current_pic->next) {
-        CompareToList(sock_fh, current_pic, current_pic->next, maxerr);
+    unsigned long unit;
+    while ((current_pic = fullcompare_get_work_item(run, sock_fh, &unit))) {
+        if (options.since && (current_pic->created < options.since)) {
+            continue; // Compared with the new images when they are the work item.
+        }
+        if ((unit < run->unit_first) || (unit >= run->unit_end)) {
+            continue; // Another shard's work.
+        }
+        if (run->checkpoint && run->checkpoint->units_done[unit]) {
+            continue; // Reported again from the checkpoint.
+        }
+        // With a checkpoint, the unit's matches are kept until the unit is done, then reported and recorded.
+        char *unit_output = NULL;
+        size_t unit_output_length = 0;
+        FILE *unit_fh = run->checkpoint ? open_memstream(&unit_output, &unit_output_length) : NULL;
+        if (options.since || (options.mode == COMPARE_MODE_TOPK)) {
+            // The closest to each image may be before or after it in the list.
+            CompareToList(unit_fh ? unit_fh : sock_fh, current_pic, run->full_list, maxerr, &options);
+        } else if (current_pic->next) {
+            CompareToList(unit_fh ? unit_fh : sock_fh, current_pic, current_pic->next, maxerr, &options);
+        }
+        if (unit_fh) {
+            fclose(unit_fh);
+            pthread_mutex_lock(&run->mutex);
+            checkpoint_unit(run->checkpoint, sock_fh, unit, unit_output, unit_output_length);
+            pthread_mutex_unlock(&run->mutex);
+            free(unit_output);
+        }
+    }
+    if (my_data->options && my_data->options->stats) {
+        pthread_mutex_lock(&run->mutex);
+        compare_stats_add(my_data->options->stats, &stats);
+        pthread_mutex_unlock(&run->mutex);
     }
     debug(sock_fh, "fullcompare_worker: Stop %d", thread_id);
     fflush(sock_fh);
-    pthread_exit(NULL);
+    return NULL; // Not pthread_exit(), as the thread may be one of a Worker_Pool.
+}
+
+/*
+ * fullcompare_pairs_before
+ *
+ * The pairs compared by the work units before each unit, as fullcompare_worker does them,
+ * and at [unit_count] by all of them.
+ *
+ * Return the array, which the caller must free, or NULL if out of memory.
+ */
+static long double *fullcompare_pairs_before(PicInfo *full_list, unsigned long unit_count,
+        Compare_Options *options) {
+    time_t since = options ? options->since : 0;
+    int topk = options && (options->mode == COMPARE_MODE_TOPK);
+    long double pairs_total = 0;
+    long double *pairs_before = (long double *) malloc((unit_count + 1) * sizeof(long double));
+    if (!pairs_before) {
+        return NULL;
+    }
+    unsigned long unit = 0;
+    unsigned long new_before = 0;
+    PicInfo *pic;
+    for (pic = full_list; pic && (unit < unit_count); pic = pic->next, unit++) {
+        pairs_before[unit] = pairs_total;
+        if (since && (pic->created < since)) {
+            continue;
+        }
+        // With since, a pair of new images is compared by the lower external_ref, which is first in the list.
+        if (topk) {
+            pairs_total += unit_count - 1;
+        } else if (since) {
+            pairs_total += unit_count - 1 - new_before++;
+        } else {
+            pairs_total += unit_count - 1 - unit;
+        }
+    }
+    pairs_before[unit_count] = pairs_total;
+    return pairs_before;
+}
+
+/*
+ * fullcompare_shard_units
+ *
+ * Split the work units into shard_count shards, each a run of units with about
+ * the same number of pairs to compare, and set the units of this shard.
+ * The split only depends on the list and options, so is the same on every host.
+ * If pairs is not NULL, it is set to the pairs the units of this shard compare.
+ * When not every pair is compared once, e.g. with since, run->pairs_before is set,
+ * and the caller must free it.
+ *
+ * Return 0 on success, non-zero if out of memory.
+ */
+static int fullcompare_shard_units(Fullcompare_Run *run, PicInfo *full_list, unsigned long unit_count,
+        Compare_Options *options, long double *pairs) {
+    run->unit_first = 0;
+    run->unit_end = unit_count;
+    int sharded = options && options->shard_count;
+    int every_pair_once = !options || (!sharded && !options->since && (options->mode != COMPARE_MODE_TOPK));
+    if (every_pair_once && !pairs) {
+        return 0;
+    }
+    long double *pairs_before = fullcompare_pairs_before(full_list, unit_count, options);
+    if (!pairs_before) {
+        return 1;
+    }
+
+    // Shard i starts at the first unit with at least i / shard_count of the pairs before it.
+    if (sharded) {
+        long double pairs_total = pairs_before[unit_count];
+        long double first_pairs = pairs_total * options->shard / options->shard_count;
+        long double end_pairs = pairs_total * (options->shard + 1) / options->shard_count;
+        while ((run->unit_first < unit_count) && (pairs_before[run->unit_first] < first_pairs)) {
+            run->unit_first++;
+        }
+        run->unit_end = run->unit_first;
+        while ((run->unit_end < unit_count)
+                && ((options->shard + 1 == options->shard_count) || (pairs_before[run->unit_end] < end_pairs))) {
+            run->unit_end++;
+        }
+    }
+    if (pairs) {
+        *pairs = pairs_before[run->unit_end] - pairs_before[run->unit_first];
+    }
+    if (every_pair_once) {
+        free(pairs_before);
+    } else {
+        run->pairs_before = pairs_before;
+    }
+    return 0;
+}
+
+/*
+ * fullcompare_pairs
+ *
+ * The pairs a fullcompare of full_list with these options compares, e.g. for its throughput.
+ * Only the new images with since, and only this shard's with shard_count.
+ *
+ * Return the number of pairs, or 0 if out of memory.
+ */
+long double fullcompare_pairs(PicInfo *full_list, Compare_Options *options) {
+    if (options && options->exact_only && options->exact_index && (options->shard == 0)) {
+        return 0;
+    }
+    unsigned long unit_count = 0;
+    PicInfo *pic;
+    for (pic = full_list; pic; pic = pic->next) {
+        unit_count++;
+    }
+    Fullcompare_Run run;
+    memset(&run, 0, sizeof(Fullcompare_Run));
+    long double pairs = 0;
+    fullcompare_shard_units(&run, full_list, unit_count, options, &pairs);
+    free(run.pairs_before);
+    return pairs;
+}
+
+/*
+ * fullcompare_report_clusters
+ *
+ * When fullcompare is joining matches into clusters, report the groups and free them.
+ *
+ * Return 0 on success, non-zero if out of memory.
+ */
+static int fullcompare_report_clusters(FILE *sock_fh, PicInfo *full_list, Compare_Options *options) {
+    if (!options || !options->cluster_set) {
+        return 0;
+    }
+    long group_count = cluster_set_report(sock_fh, options->cluster_set, full_list);
+    cluster_set_free(options->cluster_set);
+    options->cluster_set = NULL;
+    if (group_count < 0) {
+        return 4;
+    }
+    debug(sock_fh, "fullcompare found %ld groups", group_count);
+    return 0;
 }
 
 /*
@@ -169,26 +363,124 @@ void *fullcompare_worker(void *threadarg) {
  * sock_fh     - error channel
  * full_list   - The list of thumbnails to look for possible duplicates within.
  * maxerr      - If the difference between two thumbnails is lower than maxerr, the files are considered similar.
+ * options     - NULL, or how to compare.
+ *               With an exact_index, exact duplicates are reported first, in one pass over the list.
+ *               With since, only pairs with an image created at or after since are compared,
+ *               i.e. the new images with all the images, taking time in proportion to N not N*N.
+ *               With a checkpoint_id, finished work units are recorded in a checkpoint, which is
+ *               removed when done. With resume too, the units already in the checkpoint are not redone.
+ *               With shard_count, only this shard's work units are done, see fullcompare_shard_units().
+ *               With clusters, one Group line is reported for each group of matched images,
+ *               see cluster_set_report(), rather than a Match line for each pair.
+ *               With a worker_pool, thread_count tasks, at most one for each of its threads, do the
+ *               work on its threads rather than thread_count new threads.
+ *               With cancel, no more work is handed out once it is set, and 6 is returned.
  *
  * Return 0        on success.
  *        non-zero on error.
  */
 
 int fullcompare(FILE *sock_fh, PicInfo *full_list, unsigned int maxerr,
-        int thread_count) {
+        int thread_count, Compare_Options *options) {
 
     if (full_list == NULL) {
         fprintf(sock_fh, "ERROR: fullcompare passed empty list\n");
         fflush(sock_fh);
         return 2;
     }
+    if (options && options->deadline_ms) {
+        fprintf(sock_fh, "ERROR: fullcompare - deadline_ms is only for quickcompare\n");
+        fflush(sock_fh);
+        return 2;
+    }
+
+    // For clusters, the matches are joined into groups, and the groups reported at the end.
+    Compare_Options cluster_options;
+    if (options && options->clusters) {
+        if (options->shard_count || options->checkpoint_id[0]) {
+            fprintf(sock_fh, "ERROR: fullcompare - clusters can't be used with shard or resume\n");
+            fflush(sock_fh);
+            return 5;
+        }
+        cluster_options = *options;
+        options = &cluster_options;
+        unsigned long list_index = 0;
+        PicInfo *pic;
+        for (pic = full_list; pic; pic = pic->next, list_index++) {
+            // A flattened snapshot's images are already numbered.
+            if (pic->list_index != list_index) {
+                pic->list_index = list_index;
+            }
+        }
+        if (!(options->cluster_set = cluster_set_create(list_index))) {
+            fprintf(sock_fh, "ERROR: fullcompare - out of memory\n");
+            fflush(sock_fh);
+            return 4;
+        }
+    }
 
-    // Set up work to do.
-    fullcompare_set_work_list(full_list);
+    // Exact duplicates, found by hash rather than by comparing every pair. The first shard reports them all.
+    if (options && options->exact_index && (options->shard == 0)) {
+        unsigned long exact_count = exact_index_report_groups(sock_fh, options->exact_index, full_list,
+                options->since, options->cluster_set);
+        debug(sock_fh, "fullcompare found %lu exact duplicates", exact_count);
+        if (options->exact_only) {
+            fprintf(sock_fh, "fullcompare_progress: 100.00%% complete\n");
+            fflush(sock_fh);
+            return fullcompare_report_clusters(sock_fh, full_list, options);
+        }
+    }
+
+    if (options && options->since) {
+        unsigned long new_count = 0;
+        PicInfo *pic;
+        for (pic = full_list; pic; pic = pic->next) {
+            if (pic->created >= options->since) {
+                new_count++;
+            }
+        }
+        debug(sock_fh, "fullcompare since %ld, %lu new images", (long) options->since, new_count);
+    }
+
+    // Set up work to do. Each fullcompare has its own, so several can run at once in one process.
+    Fullcompare_Run run;
+    memset(&run, 0, sizeof(Fullcompare_Run));
+    pthread_mutex_init(&run.mutex, NULL);
+    run.full_list = full_list;
+    run.cancel = options ? options->cancel : NULL;
+    fullcompare_set_work_list(&run, full_list);
+    int rc = 0;
+    if (fullcompare_shard_units(&run, full_list, run.set_count, options, NULL)) {
+        fprintf(sock_fh, "ERROR: fullcompare - out of memory\n");
+        fflush(sock_fh);
+        rc = 4;
+    }
+    if (!rc && options && options->shard_count) {
+        debug(sock_fh, "fullcompare shard %d/%d is units %lu to %lu of %llu", options->shard, options->shard_count,
+                run.unit_first, run.unit_end, run.set_count);
+    }
+    if (!rc && options && options->checkpoint_id[0]) {
+        run.checkpoint = checkpoint_open(sock_fh, options->checkpoint_id,
+                checkpoint_fingerprint(full_list, maxerr, options), run.set_count, options->resume);
+        if (!run.checkpoint) {
+            rc = 3;
+        }
+    }
+    if (rc) {
+        cluster_set_free(options->cluster_set);
+        free(run.pairs_before);
+        pthread_mutex_destroy(&run.mutex);
+        return rc;
+    }
 
-    // Set up threads
+    // Set up threads, or with a worker pool, tasks for its threads.
+    Worker_Pool *pool = options ? options->worker_pool : NULL;
+    if (pool && (thread_count > pool->thread_count)) {
+        thread_count = pool->thread_count;
+    }
     struct fullcompare_thread_data thread_data_array[thread_count];
     pthread_t threads[thread_count];
+    int pending = 0;
     int thread_id;
     for (thread_id = 0; thread_id < thread_count; thread_id++) {
         debug(sock_fh, "In main: creating thread %d", thread_id);
@@ -196,39 +488,447 @@ int fullcompare(FILE *sock_fh, PicInfo *full_list, unsigned int maxerr,
         thread_data_array[thread_id].thread_id = thread_id;
         thread_data_array[thread_id].sock_fh = sock_fh;
         thread_data_array[thread_id].maxerr = maxerr;
+        thread_data_array[thread_id].options = options;
+        thread_data_array[thread_id].run = &run;
 
-        int rc = pthread_create(&threads[thread_id], NULL, fullcompare_worker,
-                (void *) &thread_data_array[thread_id]);
+        if (pool) {
+            rc = worker_pool_submit(pool, POOL_CLASS_BATCH, fullcompare_worker, (void *) &thread_data_array[thread_id],
+                    &pending);
+        } else {
+            rc = pthread_create(&threads[thread_id], NULL, fullcompare_worker,
+                    (void *) &thread_data_array[thread_id]);
+        }
         if (rc) {
-            fprintf(sock_fh, "ERROR: return code from pthread_create() is %d\n",
-                    rc);
+            fprintf(sock_fh, "ERROR: return code from %s is %d\n",
+                    pool ? "worker_pool_submit()" : "pthread_create()", rc);
             fflush(sock_fh);
-            return 1;
+            // The threads already started are using the run, so are stopped and waited for.
+            pthread_mutex_lock(&run.mutex);
+            run.worklist = NULL;
+            pthread_mutex_unlock(&run.mutex);
+            rc = 1;
+            break;
         }
     }
     // wait for threads.
-    for (thread_id = 0; thread_id < thread_count; thread_id++) {
-        debug(sock_fh, "In main: thread %d finished", thread_id);
+    if (pool) {
+        worker_pool_wait(pool, &pending);
+    } else {
+        int started = thread_id;
+        for (thread_id = 0; thread_id < started; thread_id++) {
+            debug(sock_fh, "In main: thread %d finished", thread_id);
+            fflush(sock_fh);
+            pthread_join(threads[thread_id], NULL);
+        }
+    }
+    // A cancelled fullcompare keeps its checkpoint, so it can be resumed.
+    int cancelled = run.cancel && __atomic_load_n(run.cancel, __ATOMIC_RELAXED);
+    checkpoint_close(run.checkpoint, !rc && !cancelled);
+    free(run.pairs_before);
+    pthread_mutex_destroy(&run.mutex);
+    if (rc) {
+        cluster_set_free(options ? options->cluster_set : NULL);
+        return rc;
+    }
+    if (cancelled) {
+        cluster_set_free(options->cluster_set);
+        fprintf(sock_fh, "ERROR: fullcompare - cancelled\n");
         fflush(sock_fh);
-        pthread_join(threads[thread_id], NULL);
+        return 6;
+    }
+    return fullcompare_report_clusters(sock_fh, full_list, options);
+}
+
+/*
+ * compare_options_parse
+ *
+ * Set an option from a word of a command, e.g. mode=all, topk=5, deadline_ms=200, since=1700000000,
+ * resume=<id>, shard=0/4, clusters or exact_only.
+ *
+ * Return 0 if the word was an option,
+ *        1 if it is not an option,
+ *        2 if it is an option but the value is not valid. An error is reported.
+ */
+int compare_options_parse(FILE *sock_fh, Compare_Options *options, char *word) {
+    if (strcmp(word, "exact_only") == 0) {
+        options->exact_only = 1;
+    } else if (strcmp(word, "clusters") == 0) {
+        options->clusters = 1;
+    } else if (strcmp(word, "mode=best") == 0) {
+        options->mode = COMPARE_MODE_BEST;
+    } else if (strcmp(word, "mode=all") == 0) {
+        options->mode = COMPARE_MODE_ALL;
+    } else if (strncmp(word, "topk=", 5) == 0) {
+        char *end;
+        long topk = strtol(word + 5, &end, 10);
+        if (*end || (topk < 1) || (topk > COMPARE_TOPK_MAX)) {
+            error(sock_fh, "topk must be from 1 to %d, not '%s'", COMPARE_TOPK_MAX, word + 5);
+            return 2;
+        }
+        options->mode = COMPARE_MODE_TOPK;
+        options->topk = topk;
+    } else if (strncmp(word, "deadline_ms=", 12) == 0) {
+        char *end;
+        long deadline_ms = strtol(word + 12, &end, 10);
+        if (*end || (deadline_ms < 1) || (deadline_ms > COMPARE_DEADLINE_MS_MAX)) {
+            error(sock_fh, "deadline_ms must be from 1 to %d, not '%s'", COMPARE_DEADLINE_MS_MAX, word + 12);
+            return 2;
+        }
+        // From now, when the command arrived, so time waiting for a thread counts too.
+        options->deadline_ms = deadline_ms;
+        clock_gettime(CLOCK_MONOTONIC, &options->deadline);
+        options->deadline.tv_sec += deadline_ms / 1000;
+        options->deadline.tv_nsec += (deadline_ms % 1000) * 1000000;
+        if (options->deadline.tv_nsec >= 1000000000) {
+            options->deadline.tv_sec++;
+            options->deadline.tv_nsec -= 1000000000;
+        }
+    } else if (strncmp(word, "since=", 6) == 0) {
+        char *end;
+        long long since = strtoll(word + 6, &end, 10);
+        if (*end || (since < 1)) {
+            error(sock_fh, "since must be a time in seconds since 1970, not '%s'", word + 6);
+            return 2;
+        }
+        options->since = (time_t) since;
+    } else if (strncmp(word, "resume=", 7) == 0) {
+        if (!checkpoint_id_valid(word + 7)) {
+            error(sock_fh, "resume must be the id of a fullcompare_checkpoint, not '%s'", word + 7);
+            return 2;
+        }
+        strcpy(options->checkpoint_id, word + 7);
+        options->resume = 1;
+    } else if (strncmp(word, "shard=", 6) == 0) {
+        int shard, shard_count, length = 0;
+        if ((sscanf(word + 6, "%d/%d%n", &shard, &shard_count, &length) != 2) || word[6 + length]
+                || (shard_count < 1) || (shard_count > SHARD_MAX) || (shard < 0) || (shard >= shard_count)) {
+            error(sock_fh, "shard must be i/n, with i from 0 to n-1 and n up to %d, not '%s'", SHARD_MAX, word + 6);
+            return 2;
+        }
+        options->shard = shard;
+        options->shard_count = shard_count;
+    } else if (strncmp(word, "mode=", 5) == 0) {
+        error(sock_fh, "mode must be best or all, or use topk=N, not '%s'", word + 5);
+        return 2;
+    } else {
+        return 1;
     }
     return 0;
 }
 
+/*
+ * compare_options_init
+ *
+ * Set the options to the defaults, which compare every pair of images.
+ */
+void compare_options_init(Compare_Options *options) {
+    options->exact_index = NULL;
+    options->exact_only = 0;
+    options->phash_max_distance = -1;
+    options->stats = NULL;
+    options->pivot_table = NULL;
+    options->mode = COMPARE_MODE_BEST;
+    options->topk = 0;
+    options->since = 0;
+    options->checkpoint_id[0] = '\0';
+    options->resume = 0;
+    options->shard = 0;
+    options->shard_count = 0;
+    options->clusters = 0;
+    options->cluster_set = NULL;
+    options->worker_pool = NULL;
+    options->cancel = NULL;
+    options->version = 0;
+    options->frame_reply = NULL;
+    options->deadline_ms = 0;
+    options->deadline.tv_sec = 0;
+    options->deadline.tv_nsec = 0;
+}
+
+void compare_stats_add(Compare_Stats *total, Compare_Stats *stats) {
+    total->pairs += stats->pairs;
+    total->exact_skipped += stats->exact_skipped;
+    total->phash_rejected += stats->phash_rejected;
+    total->pivot_rejected += stats->pivot_rejected;
+    total->level_4_rejected += stats->level_4_rejected;
+    total->level_8_rejected += stats->level_8_rejected;
+    total->full_compares += stats->full_compares;
+    total->bytes_compared += stats->bytes_compared;
+    total->deadline_skipped += stats->deadline_skipped;
+}
+
+void compare_stats_report(FILE *sock_fh, Compare_Stats *stats) {
+    fprintf(sock_fh, "compare_stats: pairs=%llu exact_skipped=%llu phash_rejected=%llu pivot_rejected=%llu"
+            " level_4_rejected=%llu level_8_rejected=%llu full_compares=%llu bytes_compared=%llu"
+            " deadline_skipped=%llu\n",
+            stats->pairs, stats->exact_skipped, stats->phash_rejected, stats->pivot_rejected,
+            stats->level_4_rejected, stats->level_8_rejected, stats->full_compares, stats->bytes_compared,
+            stats->deadline_skipped);
+    fflush(sock_fh);
+}
+
+/*
+ * A lower bound on the error (sum of squared differences) between two images,
+ * from the colour sums of one level of their coarse versions.
+ *
+ * For a cell of n pixels, by Cauchy-Schwarz:
+ *    sum((a - b)^2) >= (sum(a) - sum(b))^2 / n
+ * so the sum of this over every cell and colour can't exceed the full error.
+ * Finer levels give higher (better) lower bounds.
+ */
+static unsigned long long _level_lower_bound(unsigned short *sums_a, unsigned short *sums_b, int count,
+        int cell_pixels) {
+    unsigned long long total = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        long long diff = (long long) sums_a[i] - sums_b[i];
+        total += diff * diff;
+    }
+    return total / cell_pixels;
+}
+
+/*
+ * The closest topk matches for one image, as a max heap: the worst is at entries[0].
+ */
+typedef struct Topk_Entry {
+    unsigned int err;
+    PicInfo *pic;
+} Topk_Entry;
+
+typedef struct Topk_Heap {
+    int size;  // How many to keep.
+    int count;
+    Topk_Entry entries[COMPARE_TOPK_MAX];
+} Topk_Heap;
+
+static void _topk_swap(Topk_Heap *heap, int i, int j) {
+    Topk_Entry entry = heap->entries[i];
+    heap->entries[i] = heap->entries[j];
+    heap->entries[j] = entry;
+}
+
+// Keep the match if it is one of the closest so far. The caller checks it is closer than the worst kept.
+static void _topk_push(Topk_Heap *heap, PicInfo *pic, unsigned int err) {
+    int i;
+    if (heap->count < heap->size) {
+        // Add at the end and sift up.
+        i = heap->count++;
+        heap->entries[i].err = err;
+        heap->entries[i].pic = pic;
+        while ((i > 0) && (heap->entries[(i - 1) / 2].err < heap->entries[i].err)) {
+            _topk_swap(heap, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+        return;
+    }
+    // Replace the worst and sift down.
+    heap->entries[0].err = err;
+    heap->entries[0].pic = pic;
+    i = 0;
+    while (1) {
+        int largest = i;
+        int child;
+        for (child = 2 * i + 1; (child <= 2 * i + 2) && (child < heap->count); child++) {
+            if (heap->entries[child].err > heap->entries[largest].err) {
+                largest = child;
+            }
+        }
+        if (largest == i) {
+            break;
+        }
+        _topk_swap(heap, i, largest);
+        i = largest;
+    }
+}
+
+static int _topk_entry_cmp(const void *a, const void *b) {
+    const Topk_Entry *entry_a = (const Topk_Entry *) a;
+    const Topk_Entry *entry_b = (const Topk_Entry *) b;
+    if (entry_a->err != entry_b->err) {
+        return entry_a->err < entry_b->err ? -1 : 1;
+    }
+    return strcmp(entry_a->pic->external_ref, entry_b->pic->external_ref);
+}
+
+/*
+ * compare_report_match
+ *
+ * Report a match as a text line, or with a frame_reply as a frame,
+ * or with a cluster_set, join the images' groups.
+ */
+void compare_report_match(FILE *sock_fh, Compare_Options *options, PicInfo *pic, PicInfo *other, unsigned int err) {
+    if (options && options->cluster_set) {
+        cluster_set_union(options->cluster_set, pic->list_index, other->list_index, err);
+        return;
+    }
+    if (options && options->frame_reply) {
+        frame_reply_match(options->frame_reply, other->external_ref, err);
+        return;
+    }
+    fprintf(sock_fh, "Match: %s, %s, %u\n", pic->external_ref, other->external_ref, err);
+    fflush(sock_fh);
+}
+
+// Report the matches kept, closest first.
+static void _topk_report(FILE *sock_fh, Compare_Options *options, Topk_Heap *heap, PicInfo *pic) {
+    qsort(heap->entries, heap->count, sizeof(Topk_Entry), _topk_entry_cmp);
+    int i;
+    for (i = 0; i < heap->count; i++) {
+        compare_report_match(sock_fh, options, pic, heap->entries[i].pic, heap->entries[i].err);
+    }
+}
+
+/*
+ * Return true if, for some pivot, the distances of the two images to it differ
+ * by more than radius. Then the images are more than radius apart.
+ */
+static int _pivot_reject(PicInfo *p1, PicInfo *p2, int pivot_count, double radius) {
+    int pivot;
+    for (pivot = 0; pivot < pivot_count; pivot++) {
+        if (fabs(p1->pivot_distances[pivot] - p2->pivot_distances[pivot]) > radius) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// An image to compare with, and how close it may be, as far as can be told cheaply.
+typedef struct Candidate {
+    PicInfo *pic;
+    double pivot_bound;  // A lower bound on the distance, from the pivots, or 0 without them.
+    int phash_distance;
+} Candidate;
+
+static int _candidate_cmp(const void *a, const void *b) {
+    const Candidate *c1 = (const Candidate *) a;
+    const Candidate *c2 = (const Candidate *) b;
+    if (c1->pivot_bound != c2->pivot_bound) {
+        return (c1->pivot_bound < c2->pivot_bound) ? -1 : 1;
+    }
+    return c1->phash_distance - c2->phash_distance;
+}
+
+static int _deadline_passed(struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec > deadline->tv_sec)
+            || ((now.tv_sec == deadline->tv_sec) && (now.tv_nsec >= deadline->tv_nsec));
+}
+
+// Move the candidate at index down the heap, below any more promising.
+static void _candidate_sift_down(Candidate *heap, size_t count, size_t index) {
+    Candidate candidate = heap[index];
+    size_t child;
+    while ((child = 2 * index + 1) < count) {
+        if ((child + 1 < count) && (_candidate_cmp(&heap[child + 1], &heap[child]) < 0)) {
+            child++;
+        }
+        if (_candidate_cmp(&heap[child], &candidate) >= 0) {
+            break;
+        }
+        heap[index] = heap[child];
+        index = child;
+    }
+    heap[index] = candidate;
+}
+
+/*
+ * The images in list that pic is compared with, as a heap with the most promising first: lowest
+ * bound on the distance from the pivots, then closest perceptual hash. Only the candidates taken
+ * from it by _candidate_next() are put in order, so a short deadline does not wait for a sort.
+ * Return the heap, which the caller must free, with the number of candidates in count_ptr,
+ * and in heap_count_ptr how many are in the heap, fewer if the deadline passed meanwhile.
+ * Return NULL if out of memory.
+ */
+static Candidate *_candidates_order(PicInfo *pic, PicInfo *list, unsigned long version, Pivot_Table *pivot_table,
+        struct timespec *deadline, size_t *count_ptr, size_t *heap_count_ptr) {
+    size_t size = 1; // Not 0, for malloc().
+    PicInfo *other;
+    for (other = list; other; other = PICINFO_NEXT(other)) {
+        size++;
+    }
+    Candidate *order = (Candidate *) malloc(size * sizeof(Candidate));
+    if (!order) {
+        return NULL;
+    }
+    size_t count = 0;
+    size_t heap_count = 0;
+    int passed = 0;
+    // Adds may link in more images meanwhile, which are newer than the version anyway.
+    for (other = list; other && (count < size); other = PICINFO_NEXT(other)) {
+        if ((other == pic) || !PICINFO_IN_VERSION(other, version)) {
+            continue;
+        }
+        if (!(count++ % (DEADLINE_CHECK_INTERVAL * 16)) && !passed) {
+            passed = _deadline_passed(deadline);
+        }
+        if (passed) {
+            continue; // Only counted.
+        }
+        Candidate *candidate = &order[heap_count++];
+        candidate->pic = other;
+        candidate->pivot_bound = 0;
+        candidate->phash_distance = PHASH_DISTANCE(pic->phash, other->phash);
+        if (pivot_table && (other->pivot_version == pivot_table->version)) {
+            int pivot;
+            for (pivot = 0; pivot < pivot_table->count; pivot++) {
+                double bound = fabs(pic->pivot_distances[pivot] - other->pivot_distances[pivot]);
+                if (bound > candidate->pivot_bound) {
+                    candidate->pivot_bound = bound;
+                }
+            }
+        }
+    }
+    size_t index;
+    for (index = heap_count / 2; index-- > 0;) {
+        _candidate_sift_down(order, heap_count, index);
+    }
+    *count_ptr = count;
+    *heap_count_ptr = heap_count;
+    return order;
+}
+
+// Take the most promising candidate from the heap, or NULL if none are left.
+static PicInfo *_candidate_take(Candidate *heap, size_t *heap_count) {
+    if (!*heap_count) {
+        return NULL;
+    }
+    PicInfo *pic = heap[0].pic;
+    heap[0] = heap[--*heap_count];
+    _candidate_sift_down(heap, *heap_count, 0);
+    return pic;
+}
+
+// The next image to compare with: from the heap if given, otherwise the next in the list.
+static PicInfo *_candidate_next(PicInfo *current, Candidate *order, size_t *heap_count, size_t *order_index) {
+    if (!order) {
+        return PICINFO_NEXT(current);
+    }
+    ++*order_index;
+    return _candidate_take(order, heap_count);
+}
+
 /*
  *   compare an image to the list
  *
+ *   options - NULL, or how to compare. See Compare_Options.
+ *
  *   return
  *       closest ppm that is below maxerr
  *       otherwise NULL.
  *
  *   side effects
  *       report images under maxerr. Used by fuzzy duplicate processing.
+ *       Which ones depends on options->mode:
+ *         COMPARE_MODE_BEST - each match as close as the closest so far, so the last is the best.
+ *         COMPARE_MODE_ALL  - every match under maxerr.
+ *         COMPARE_MODE_TOPK - the closest options->topk matches, closest first, at the end.
+ *       With options->deadline_ms, the images are compared most promising first, and no more
+ *       once the deadline has passed. A quickcompare_deadline line reports how many were.
  */
-// TODO consider adding a flag for reporting all matches under maxerr, not just the best.
-// When flag set then don't use err_best_so_far in call to PPM_compare, use maxerr
 
-PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsigned int maxerr) {
+PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsigned int maxerr,
+        Compare_Options *options) {
 
     // Some quick sanity checks
     if (!picinfo_list) {
@@ -254,16 +954,129 @@ PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsig
     unsigned int err_this_compare;
     unsigned int err_best_so_far = UINT_MAX;
     PicInfo *best_match = NULL;
+    Compare_Stats stats = { 0 };
+    int levels = pic->levels.cell_pixels_4 && pic->levels.cell_pixels_8;
+    int mode = options ? options->mode : COMPARE_MODE_BEST;
+    Topk_Heap topk;
+    topk.size = (mode == COMPARE_MODE_TOPK) ? options->topk : 0;
+    topk.count = 0;
+    Pivot_Table *pivot_table = options ? options->pivot_table : NULL;
+    if (pivot_table && (pic->pivot_version != pivot_table->version)) {
+        pivot_table = NULL;
+    }
+    unsigned long long err_limit_pivot = ULLONG_MAX; // err_limit when pivot_radius was set.
+    double pivot_radius = 0;
+    unsigned long version = options ? options->version : 0;
+
+    // With a deadline, the images are compared most promising first, until it passes.
+    Candidate *order = NULL;
+    size_t order_count = 0;
+    size_t order_index = 0;
+    size_t heap_count = 0;
+    if (options && options->deadline_ms) {
+        if (!(order = _candidates_order(pic, picinfo_list, version, pivot_table, &options->deadline, &order_count,
+                &heap_count))) {
+            fprintf(sock_fh, "ERROR: CompareToList out of memory\n");
+            fflush(sock_fh);
+            return NULL;
+        }
+        picinfo_list = _candidate_take(order, &heap_count);
+        if (heap_count + (picinfo_list != NULL) < order_count) {
+            // The deadline passed while looking at the candidates.
+            stats.deadline_skipped = order_count;
+            picinfo_list = NULL;
+        }
+    }
 
     // Even when we can't find a better match we keep processing because we want
     // to supply a list of close matches to fuzzy duplicate processing.
     while (picinfo_list) {
-        // TODO replace err_best_so_far in next line with maxerr if we TRUELY want to
-        // find all similar images under maxerr.
-        err_this_compare = PPM_compare(sock_fh, pic->picinf, picinfo_list->picinf, err_best_so_far);
+        if (order && !(order_index % DEADLINE_CHECK_INTERVAL) && _deadline_passed(&options->deadline)) {
+            stats.deadline_skipped = order_count - order_index;
+            break;
+        }
+        // With since, a pair of new images is compared when the lower external_ref is the work item.
+        if ((picinfo_list == pic) || !PICINFO_IN_VERSION(picinfo_list, version)
+                || (options && options->since && (mode != COMPARE_MODE_TOPK)
+                        && (picinfo_list->created >= options->since)
+                        && (strcmp(picinfo_list->external_ref, external_ref) < 0))) {
+            picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
+            continue;
+        }
+        stats.pairs++;
+
+        // Exact duplicates were already reported from the index.
+        if (options && options->exact_index && picinfo_exact_duplicate(pic, picinfo_list)) {
+            stats.exact_skipped++;
+            picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
+            continue;
+        }
+
+        // Images with very different perceptual hashes are assumed not to be similar.
+        if (options && (options->phash_max_distance >= 0)
+                && (PHASH_DISTANCE(pic->phash, picinfo_list->phash) > options->phash_max_distance)) {
+            stats.phash_rejected++;
+            picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
+            continue;
+        }
+
+        // The highest error that could still be reported. If a lower bound on the
+        // error is already higher, comparing every pixel would not change the result.
+        unsigned int err_limit = maxerr - 1;
+        if ((mode == COMPARE_MODE_BEST) && (err_best_so_far < err_limit)) {
+            err_limit = err_best_so_far;
+        } else if ((mode == COMPARE_MODE_TOPK) && (topk.count == topk.size)) {
+            if (topk.entries[0].err == 0) {
+                break; // Already have topk exact matches, nothing can be better.
+            }
+            if (topk.entries[0].err - 1 < err_limit) {
+                err_limit = topk.entries[0].err - 1;
+            }
+        }
+
+        // Triangle inequality, using the distances to the pivots.
+        if (pivot_table && (picinfo_list->pivot_version == pivot_table->version)) {
+            if (err_limit != err_limit_pivot) {
+                err_limit_pivot = err_limit;
+                pivot_radius = sqrt((double) err_limit) + PIVOT_MARGIN;
+            }
+            if (_pivot_reject(pic, picinfo_list, pivot_table->count, pivot_radius)) {
+                stats.pivot_rejected++;
+                picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
+                continue;
+            }
+        }
+
+        // Coarse-to-fine.
+        if (levels && (pic->levels.cell_pixels_4 == picinfo_list->levels.cell_pixels_4)
+                && (pic->levels.cell_pixels_8 == picinfo_list->levels.cell_pixels_8)) {
+            if (_level_lower_bound(pic->levels.sums_4, picinfo_list->levels.sums_4, 3 * 4 * 4,
+                    pic->levels.cell_pixels_4) > err_limit) {
+                stats.level_4_rejected++;
+                picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
+                continue;
+            }
+            if (_level_lower_bound(pic->levels.sums_8, picinfo_list->levels.sums_8, 3 * 8 * 8,
+                    pic->levels.cell_pixels_8) > err_limit) {
+                stats.level_8_rejected++;
+                picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
+                continue;
+            }
+        }
+
+        stats.full_compares++;
+        if (pic->compare_data && picinfo_list->compare_data
+                && (pic->picinf->width == picinfo_list->picinf->width)
+                && (pic->picinf->height == picinfo_list->picinf->height)) {
+            err_this_compare = ppm_data_compare(pic->compare_data, picinfo_list->compare_data,
+                    3 * pic->picinf->width * pic->picinf->height, COMPARE_CHECKPOINT_BYTES,
+                    err_limit, &stats.bytes_compared);
+        } else {
+            err_this_compare = PPM_compare(sock_fh, pic->picinf, picinfo_list->picinf, err_limit);
+        }
 
-        // If this compare is closer than maxerr AND better than any previous comparisons.
-        if (err_this_compare < maxerr){
+        // If this compare is closer than maxerr, and close enough for the mode.
+        if (err_this_compare <= err_limit){
 
             /*
             *   As we want DIDS to report close matches, DIDS needs to
@@ -271,16 +1084,20 @@ PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsig
             *   to compare two images. Waiting until later and weeding out the
             *   results won't work as the next closest image won't be reported.
             */
-            Similar_but_different *sbd = similar_but_different_search(pic->similar_but_different, picinfo_list->external_ref);
-            if (sbd) {
-                debug(sock_fh, "ignoring previous similar_but_different: %s, %s", external_ref, sbd->external_ref);
+            // Each pair is stored on only one of the two images, so both are looked in.
+            if (similar_but_different_pair(pic, picinfo_list)) {
+                debug(sock_fh, "ignoring previous similar_but_different: %s, %s", external_ref,
+                        picinfo_list->external_ref);
                 fflush(sock_fh);
-                picinfo_list = picinfo_list->next;
+                picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
                 continue;
             }
 
-            fprintf(sock_fh, "Match: %s, %s, %u\n", external_ref, picinfo_list->external_ref, err_this_compare);
-            fflush(sock_fh);
+            if (mode == COMPARE_MODE_TOPK) {
+                _topk_push(&topk, picinfo_list, err_this_compare);
+            } else {
+                compare_report_match(sock_fh, options, pic, picinfo_list, err_this_compare);
+            }
 
             if (err_this_compare < err_best_so_far) {
                 err_best_so_far = err_this_compare;
@@ -288,7 +1105,21 @@ PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsig
             }
 
         }
-        picinfo_list = picinfo_list->next;
+        picinfo_list = _candidate_next(picinfo_list, order, &heap_count, &order_index);
+    }
+    if (mode == COMPARE_MODE_TOPK) {
+        _topk_report(sock_fh, options, &topk, pic);
+    }
+    if (order) {
+        fprintf(sock_fh, "quickcompare_deadline: deadline_ms=%ld reached=%d examined=%llu candidates=%lu"
+                " examined_fraction=%.3f\n", options->deadline_ms, stats.deadline_skipped > 0,
+                order_count - stats.deadline_skipped, (unsigned long) order_count,
+                order_count ? (double) (order_count - stats.deadline_skipped) / order_count : 1.0);
+        fflush(sock_fh);
+        free(order);
+    }
+    if (options && options->stats) {
+        compare_stats_add(options->stats, &stats);
     }
     return best_match;
 }
@@ -302,7 +1133,7 @@ PicInfo *CompareToList(FILE *sock_fh, PicInfo *pic, PicInfo *picinfo_list, unsig
  */
 
 int quickcompare(FILE *sock_fh, PicInfo *picinfo_list, unsigned int maxerr, char *filename, char *external_ref,
-    int compare_size) {
+    int compare_size, Compare_Options *options) {
 
     int result = access (filename, R_OK); // for readable
     if ( result != 0 ){
@@ -318,15 +1149,95 @@ int quickcompare(FILE *sock_fh, PicInfo *picinfo_list, unsigned int maxerr, char
         return 1;
     }
 
+    debug(sock_fh, "quickcompare calling quickcompare_ppm with filename '%s'", filename);
+    int rc = quickcompare_ppm(sock_fh, picinfo_list, maxerr, ppm_miniature, external_ref, options);
+    ppm_info_free(ppm_miniature);
+    return rc;
+}
+
+/*
+ * quickcompare_ppm
+ *
+ * Look for files in the database similar to an already made thumbnail.
+ * e.g. a thumbnail made by the client, so the server need not decode the image.
+ * The supplied thumbnail WONT be added to the database, and remains owned by the caller.
+ * With an exact_index in options, exact duplicates are reported first from a hash lookup.
+ * Return 0 on success
+ */
+
+int quickcompare_ppm(FILE *sock_fh, PicInfo *picinfo_list, unsigned int maxerr, PPM_Info *ppm, char *external_ref,
+        Compare_Options *options) {
+
+    if (options && options->since) {
+        fprintf(sock_fh, "ERROR: quickcompare - since is only for fullcompare\n");
+        fflush(sock_fh);
+        return 2;
+    }
+
     // Compare to existing PPMs in list
-    debug(sock_fh, "quickcompare calling CompareToList with filename '%s'", filename);
     debug(sock_fh, "quickcompare maxerr %u, external ref '%s'", maxerr, external_ref);
     fflush(sock_fh);
-    PicInfo *pic = PicInfoBuild(external_ref, ppm_miniature, NULL);
-    CompareToList(sock_fh, pic, picinfo_list, maxerr);
+    PicInfo *pic = PicInfoBuild(external_ref, ppm, NULL);
+    if (!pic) {
+        fprintf(sock_fh, "ERROR: quickcompare - PicInfoBuild failed\n");
+        fflush(sock_fh);
+        return 1;
+    }
+    if (options && options->exact_index) {
+        exact_index_report(sock_fh, options->exact_index, pic, options);
+    }
+    if (options && options->pivot_table) {
+        pivot_table_distances(options->pivot_table, pic);
+    }
+    CompareToList(sock_fh, pic, picinfo_list, maxerr, options);
 
-    ppm_info_free(ppm_miniature);
+    pic->picinf = NULL; // Still owned by the caller.
+    PicInfoDelete(pic);
     debug(sock_fh, "quickcompare done");
     fflush(sock_fh);
     return 0;
 }
+
+/*
+ * quickcompare_ref
+ *
+ * Look for the images similar to one already in the list, by external_ref, using its
+ * thumbnail in RAM, so nothing is decoded and the original file is not needed.
+ * Its 'similar but different' pairs are not reported, as for fullcompare.
+ * The list is in external_ref order, so the search stops at the first image after it.
+ * Return 0 on success
+ *        1 if there is no image with external_ref in the list, or in options->version of it.
+ */
+
+int quickcompare_ref(FILE *sock_fh, PicInfo *picinfo_list, unsigned int maxerr, char *external_ref,
+        Compare_Options *options) {
+
+    if (options && options->since) {
+        fprintf(sock_fh, "ERROR: quickcompare - since is only for fullcompare\n");
+        fflush(sock_fh);
+        return 2;
+    }
+    unsigned long version = options ? options->version : 0;
+    PicInfo *pic;
+    int cmp = -1;
+    for (pic = picinfo_list; pic && ((cmp = strcmp(pic->external_ref, external_ref)) <= 0);
+            pic = PICINFO_NEXT(pic)) {
+        if ((cmp == 0) && PICINFO_IN_VERSION(pic, version)) {
+            break;
+        }
+    }
+    if (!pic || cmp) {
+        fprintf(sock_fh, "ERROR: quickcompare_ref - no image with external_ref '%s'\n", external_ref);
+        fflush(sock_fh);
+        return 1;
+    }
+    debug(sock_fh, "quickcompare_ref maxerr %u, external ref '%s'", maxerr, external_ref);
+    if (options && options->exact_index) {
+        exact_index_report(sock_fh, options->exact_index, pic, options);
+    }
+    // With pivots, pic already has its distances to them, if made with the same pivots.
+    CompareToList(sock_fh, pic, picinfo_list, maxerr, options);
+    debug(sock_fh, "quickcompare_ref done");
+    fflush(sock_fh);
+    return 0;
+}
@@ -49,102 +49,43 @@
 
  */
 
-/*
- * ppm_to_hexdata
- *
- * convert the ppm image into a hex string.
- * e.g. so a ppm can be stored in an SQL database.
- *
- * Note: free the result when you are finished with it.
- *
- * On success return a string of hex digits.
- * On failure returns NULL;
- *
- */
-
-char *ppm_to_hexdata(PPM_Info *ppm) {
-    char *hexdata = NULL;
-    int x, y, h, w, offset;
-    Color c;
-    char hexchar[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A',
-            'B', 'C', 'D', 'E', 'F' };
-
-    h = ppm->height;
-    w = ppm->width;
-    // allocate 6 characters for each pixel i.e. two hex chars per each R,G and B.
-    // plus one for the string terminator
-    hexdata = (char *) malloc((6 * w * h) + 1);
-    if (!hexdata) {
-        fprintf(stderr, "Error: failed to allocate memory for ppm_to_hexdata");
-        return NULL;
-    }
-    hexdata[6 * w * h] = '\0';
-    // Set the hex chars that correspond to each pixel.
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            PPM_GetPixel(ppm, x, y, &c);
-            offset = 6 * ((y * w) + x);
-            hexdata[offset + 0] = hexchar[((unsigned int) c.r) / 16];
-            hexdata[offset + 1] = hexchar[((unsigned int) c.r) % 16];
-            hexdata[offset + 2] = hexchar[((unsigned int) c.g) / 16];
-            hexdata[offset + 3] = hexchar[((unsigned int) c.g) % 16];
-            hexdata[offset + 4] = hexchar[((unsigned int) c.b) / 16];
-            hexdata[offset + 5] = hexchar[((unsigned int) c.b) % 16];
-        }
-    }
-    return hexdata;
-}
+// The statements prepared on each connection by ppm_sql_prepare(), so are only parsed once.
+#define PPM_STORE_STATEMENT "dids_ppm_store"
+#define PPM_REPLACE_STATEMENT "dids_ppm_replace"
+#define PPM_DEL_STATEMENT "dids_ppm_del"
 
 /*
- * xtod : Hex to decimal conversion
+ * ppm_sql_prepare
  *
- */
-int xtod(char c) {
-    return ((c >= '0' && c <= '9') ?
-            c - '0' :
-            ((c >= 'A' && c <= 'F') ?
-                    c - 'A' + 10 : ((c >= 'a' && c <= 'f') ? c - 'a' + 10 : 0)));
-}
-
-/*
- * hexdata_to_ppm
- *
- * convert the ppm hex-string into plain ppm data.
- * e.g. retrieve a ppm from an SQL database.
+ * Prepare the statements used to write dids_ppm, once after connecting,
+ * before ppm_store(), ppm_del() or ppm_write_batch().
  *
- * Note: You are responsible for attaching the data to the ppm.
- *       free the result when you are finished with it.
+ * sock_fh      - error channel
  *
- * On success returns ppm data.
- * On failure returns NULL;
+ * return 0 on success
+ * return non-zero on failure.
  *
- * Limitation : hexstring must only contain hex characters.
- *   No errors will be throw for invalid input data.
  */
 
-void hexdata_to_ppm(PPM_Info *ppm, char *hexstring) {
-    int x, y, h, w, offset;
-    Color c;
-
-    h = ppm->height;
-    w = ppm->width;
-    // Set the hex chars that correspond to each pixel.
-    for (y = 0; y < h; y++) {
-        for (x = 0; x < w; x++) {
-            offset = 6 * ((y * w) + x);
-            // red
-            c.r = 16 * xtod(hexstring[offset + 0])
-                    + xtod(hexstring[offset + 1]);
-            // green
-            c.g = 16 * xtod(hexstring[offset + 2])
-                    + xtod(hexstring[offset + 3]);
-            // blue
-            c.b = 16 * xtod(hexstring[offset + 4])
-                    + xtod(hexstring[offset + 5]);
-            PPM_SetPixel(ppm, x, y, c);
+int ppm_sql_prepare(FILE *sock_fh, PGconn *psql) {
+    const char *statements[][2] = {
+        { PPM_STORE_STATEMENT, "INSERT INTO dids_ppm (width,height,hexdata,external_ref) values ($1,$2,$3,$4);" },
+        { PPM_REPLACE_STATEMENT, "INSERT INTO dids_ppm (width,height,hexdata,external_ref,created)"
+                " values ($1,$2,$3,$4,to_timestamp($5::bigint)::timestamp);" },
+        { PPM_DEL_STATEMENT, "DELETE FROM dids_ppm WHERE external_ref = $1;" },
+    };
+    size_t index;
+    for (index = 0; index < sizeof statements / sizeof statements[0]; index++) {
+        PGresult *result = PQprepare(psql, statements[index][0], statements[index][1], 0, NULL);
+        if (PQresultStatus(result) != PGRES_COMMAND_OK) {
+            fprintf(sock_fh, "ERROR: ppm_sql_prepare: libpq command failed for %s: %s\n", statements[index][0],
+                    PQerrorMessage(psql));
+            PQclear(result);
+            return 1;
         }
+        PQclear(result);
     }
-    return;
+    return 0;
 }
 
 /*
@@ -168,16 +109,18 @@ int ppm_store(FILE *sock_fh, PGconn *psql, char *external_ref, PPM_Info *ppm) {
         return 1;
     }
 
-    result =
-            pq_query(psql,
-                    "INSERT INTO dids_ppm (width,height,hexdata,external_ref) values (%d,%d,'%s','%s');",
-                    ppm->width, ppm->height, hexdata, external_ref);
+    char width[16], height[16];
+    snprintf(width, sizeof width, "%d", ppm->width);
+    snprintf(height, sizeof height, "%d", ppm->height);
+    const char *values[] = { width, height, hexdata, external_ref };
+    result = PQexecPrepared(psql, PPM_STORE_STATEMENT, 4, values, NULL, NULL, 0);
 
     free(hexdata);
 
     if (PQresultStatus(result) != PGRES_COMMAND_OK) {
         fprintf(sock_fh, "ppm_store: libpq command failed: %s",
                 PQerrorMessage(psql));
+        PQclear(result);
         return 1;
     }
     PQclear(result);
@@ -195,18 +138,94 @@ int ppm_store(FILE *sock_fh, PGconn *psql, char *external_ref, PPM_Info *ppm) {
  */
 
 int ppm_del(FILE *sock_fh, PGconn *psql, char *external_ref) {
-    PGresult *result = pq_query(psql,
-            "DELETE FROM dids_ppm WHERE external_ref = '%s';", external_ref);
+    const char *values[] = { external_ref };
+    PGresult *result = PQexecPrepared(psql, PPM_DEL_STATEMENT, 1, values, NULL, NULL, 0);
 
     if (PQresultStatus(result) != PGRES_COMMAND_OK) {
-        fprintf(sock_fh, "ppm_store: libpq command failed: %s",
+        fprintf(sock_fh, "ppm_del: libpq command failed: %s",
                 PQerrorMessage(psql));
+        PQclear(result);
         return 1;
     }
     PQclear(result);
     return 0; //success
 }
 
+/*
+ * ppm_write_batch
+ *
+ * Write a batch of adds and dels to dids_ppm, in order, in one transaction.
+ * The statements are sent in libpq pipeline mode, without waiting for each
+ * result, so the batch takes about one round trip rather than one per row.
+ * An add replaces any row with its external_ref, so a write may be repeated.
+ * The results are only read once all is sent, so keep count to a few hundred,
+ * e.g. JOURNAL_BATCH_MAX, or the server may block writing them.
+ *
+ * sock_fh      - error channel
+ *
+ * return 0 on success
+ *        1 if SQL could not be reached, e.g. the connection was lost
+ *        2 if SQL refused the data of the batch, SQLSTATE class 22 or 23, e.g. a constraint,
+ *          so none of it was written. Other errors, e.g. a deadlock, return 1, to try again.
+ *
+ */
+
+int ppm_write_batch(FILE *sock_fh, PGconn *psql, PPM_Write *writes, int count) {
+    if (!PQenterPipelineMode(psql)) {
+        fprintf(sock_fh, "ERROR: ppm_write_batch: libpq pipeline mode failed: %s\n", PQerrorMessage(psql));
+        return 1;
+    }
+    int sent = 1;
+    int index;
+    for (index = 0; sent && (index < count); index++) {
+        PPM_Write *entry = &writes[index];
+        const char *del_values[] = { entry->external_ref };
+        sent = PQsendQueryPrepared(psql, PPM_DEL_STATEMENT, 1, del_values, NULL, NULL, 0);
+        if (sent && entry->add) {
+            char width[16], height[16], created[24];
+            snprintf(width, sizeof width, "%d", entry->width);
+            snprintf(height, sizeof height, "%d", entry->height);
+            snprintf(created, sizeof created, "%ld", entry->created);
+            const char *values[] = { width, height, entry->hexdata, entry->external_ref, created };
+            sent = PQsendQueryPrepared(psql, PPM_REPLACE_STATEMENT, 5, values, NULL, NULL, 0);
+        }
+    }
+    // Up to the sync is one implicit transaction. After an error the rest are not run.
+    sent = sent && PQpipelineSync(psql);
+    int rc = sent ? 0 : 1;
+    if (!sent) {
+        fprintf(sock_fh, "ERROR: ppm_write_batch: libpq send failed: %s\n", PQerrorMessage(psql));
+    }
+
+    // Read every result up to the sync, so the connection is ready for the next batch.
+    while (sent) {
+        PGresult *result = PQgetResult(psql);
+        if (!result) {
+            if (PQstatus(psql) != CONNECTION_OK) {
+                rc = 1;
+                break;
+            }
+            continue; // Between the results of two statements.
+        }
+        ExecStatusType status = PQresultStatus(result);
+        if (status == PGRES_PIPELINE_SYNC) {
+            sent = 0;
+        } else if ((status == PGRES_FATAL_ERROR) && !rc) {
+            fprintf(sock_fh, "ERROR: ppm_write_batch: libpq command failed: %s\n", PQresultErrorMessage(result));
+            // Only the data itself is refused, e.g. a constraint. Anything else, e.g. a deadlock,
+            // timeout or read only server, may pass, so the batch is tried again.
+            char *sqlstate = PQresultErrorField(result, PG_DIAG_SQLSTATE);
+            int data_refused = sqlstate && ((strncmp(sqlstate, "22", 2) == 0) || (strncmp(sqlstate, "23", 2) == 0));
+            rc = (data_refused && (PQstatus(psql) == CONNECTION_OK)) ? 2 : 1;
+        }
+        PQclear(result);
+    }
+    if (!PQexitPipelineMode(psql) && !rc) {
+        rc = 1;
+    }
+    return rc;
+}
+
 /*
  * tuple_to_ppm
  *
@@ -347,7 +366,8 @@ int ppm_load_all_from_sql(FILE *sock_fh, PGconn *psql,
         PicInfo **picinfo_list_ref) {
 
     PGresult *pq_result = pq_query(psql,
-            "SELECT * FROM dids_ppm order by external_ref;");
+            "SELECT *, extract(epoch from created::timestamptz)::bigint AS created_epoch"
+            " FROM dids_ppm order by external_ref;");
 
     if ((PQresultStatus(pq_result) != PGRES_COMMAND_OK)
             && (PQresultStatus(pq_result) != PGRES_TUPLES_OK)) {
@@ -365,6 +385,7 @@ int ppm_load_all_from_sql(FILE *sock_fh, PGconn *psql,
     }
     // Get the field number
     int external_ref_fnum = PQfnumber(pq_result, "external_ref");
+    int created_epoch_fnum = PQfnumber(pq_result, "created_epoch");
 
     // Fetch the tuples
     PicInfo *last_added = NULL;
@@ -384,6 +405,7 @@ int ppm_load_all_from_sql(FILE *sock_fh, PGconn *psql,
             fprintf(sock_fh, "ERROR: PicInfoBuild failed\n");
             return 4;
         }
+        hlp->created = (time_t) atoll(PQgetvalue(pq_result, tuple, created_epoch_fnum));
         if (last_added) {
             PicInfoAddToList(sock_fh, &last_added, hlp);
         } else {
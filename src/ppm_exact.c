@@ -0,0 +1,268 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module provides a hash table of PPMs, keyed on a hash of their pixels.
+ * Many duplicates have identical thumbnails, and these can be found with a
+ * hash lookup rather than comparing every pixel of every image.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#define EXACT_INDEX_INITIAL_BUCKETS 1024 // Must be a power of two.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dids.h"
+
+/*
+ * exact_index_create
+ *
+ * Return an empty index, or NULL if out of memory.
+ */
+Exact_Index *exact_index_create() {
+    Exact_Index *index = (Exact_Index *) malloc(sizeof(Exact_Index));
+    if (!index) {
+        return NULL;
+    }
+    index->bucket_count = EXACT_INDEX_INITIAL_BUCKETS;
+    index->entry_count = 0;
+    index->buckets = (Exact_Entry **) calloc(index->bucket_count, sizeof(Exact_Entry *));
+    if (!index->buckets) {
+        free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/*
+ * Remove all entries, leaving the index empty.
+ * The PicInfo entries themselves are not free'ed.
+ */
+void exact_index_clear(Exact_Index *index) {
+    unsigned long bucket;
+    for (bucket = 0; bucket < index->bucket_count; bucket++) {
+        Exact_Entry *entry = index->buckets[bucket];
+        while (entry) {
+            Exact_Entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        index->buckets[bucket] = NULL;
+    }
+    index->entry_count = 0;
+}
+
+void exact_index_free(Exact_Index *index) {
+    if (!index) {
+        return;
+    }
+    exact_index_clear(index);
+    free(index->buckets);
+    free(index);
+}
+
+/*
+ * Double the number of buckets, so chains stay short as the corpus grows.
+ * If out of memory the index keeps working, just slower.
+ */
+static void _exact_index_grow(Exact_Index *index) {
+    unsigned long bucket_count = index->bucket_count * 2;
+    Exact_Entry **buckets = (Exact_Entry **) calloc(bucket_count, sizeof(Exact_Entry *));
+    if (!buckets) {
+        return;
+    }
+    unsigned long bucket;
+    for (bucket = 0; bucket < index->bucket_count; bucket++) {
+        Exact_Entry *entry = index->buckets[bucket];
+        while (entry) {
+            Exact_Entry *next = entry->next;
+            unsigned long new_bucket = entry->pic->pixel_hash & (bucket_count - 1);
+            entry->next = buckets[new_bucket];
+            buckets[new_bucket] = entry;
+            entry = next;
+        }
+    }
+    free(index->buckets);
+    index->buckets = buckets;
+    index->bucket_count = bucket_count;
+}
+
+/*
+ * exact_index_add
+ *
+ * Return 0 on success, non-zero if out of memory.
+ */
+int exact_index_add(Exact_Index *index, PicInfo *pic) {
+    if (!pic->picinf) {
+        return 0;
+    }
+    Exact_Entry *entry = (Exact_Entry *) malloc(sizeof(Exact_Entry));
+    if (!entry) {
+        return 1;
+    }
+    if (index->entry_count >= index->bucket_count) {
+        _exact_index_grow(index);
+    }
+    unsigned long bucket = pic->pixel_hash & (index->bucket_count - 1);
+    entry->pic = pic;
+    entry->next = index->buckets[bucket];
+    // Published whole, so a corpus index can be read by compares meanwhile, see ppm_snapshot.c.
+    __atomic_store_n(&index->buckets[bucket], entry, __ATOMIC_RELEASE);
+    index->entry_count++;
+    return 0;
+}
+
+/*
+ * exact_index_remove
+ *
+ * Remove this PicInfo (the same pointer) from the index.
+ */
+void exact_index_remove(Exact_Index *index, PicInfo *pic) {
+    unsigned long bucket = pic->pixel_hash & (index->bucket_count - 1);
+    Exact_Entry *entry = index->buckets[bucket];
+    Exact_Entry *last_entry = NULL;
+    while (entry && (entry->pic != pic)) {
+        last_entry = entry;
+        entry = entry->next;
+    }
+    if (!entry) {
+        return;
+    }
+    if (last_entry) {
+        last_entry->next = entry->next;
+    } else {
+        index->buckets[bucket] = entry->next;
+    }
+    free(entry);
+    index->entry_count--;
+}
+
+/*
+ * exact_index_find
+ *
+ * Return the PicInfo with these pixels and external_ref, or NULL if not in the index.
+ */
+PicInfo *exact_index_find(Exact_Index *index, unsigned long long pixel_hash, char *external_ref) {
+    Exact_Entry *entry;
+    for (entry = index->buckets[pixel_hash & (index->bucket_count - 1)]; entry; entry = entry->next) {
+        if ((entry->pic->pixel_hash == pixel_hash) && (strcmp(entry->pic->external_ref, external_ref) == 0)) {
+            return entry->pic;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * exact_index_build
+ *
+ * Index every PicInfo in the list, replacing anything already in the index.
+ *
+ * Return 0 on success, non-zero if out of memory.
+ */
+int exact_index_build(Exact_Index *index, PicInfo *list) {
+    exact_index_clear(index);
+    while (list) {
+        if (exact_index_add(index, list)) {
+            return 1;
+        }
+        list = list->next;
+    }
+    return 0;
+}
+
+/*
+ * Return true if both have identical pixels. Cheap if the hashes differ.
+ */
+int picinfo_exact_duplicate(PicInfo *p1, PicInfo *p2) {
+    return p1->picinf && p2->picinf
+            && (p1->pixel_hash == p2->pixel_hash)
+            && (p1->picinf->width == p2->picinf->width)
+            && (p1->picinf->height == p2->picinf->height)
+            && (memcmp(p1->picinf->data, p2->picinf->data, 3 * p1->picinf->width * p1->picinf->height) == 0);
+}
+
+/*
+ * exact_index_report
+ *
+ * Report a Match, with an error of zero, for every image in the index with
+ * exactly the same pixels as pic. 'similar but different' pairs are not reported.
+ * options is NULL, or has the version of the list to report from, for the index of a
+ * corpus, and where to report, see compare_report_match().
+ *
+ * Return the number of matches reported.
+ */
+int exact_index_report(FILE *sock_fh, Exact_Index *index, PicInfo *pic, Compare_Options *options) {
+    unsigned long version = options ? options->version : 0;
+    int match_count = 0;
+    unsigned long bucket = pic->pixel_hash & (index->bucket_count - 1);
+    Exact_Entry *entry;
+    for (entry = __atomic_load_n(&index->buckets[bucket], __ATOMIC_ACQUIRE); entry; entry = entry->next) {
+        PicInfo *other = entry->pic;
+        if ((other == pic) || !PICINFO_IN_VERSION(other, version) || !picinfo_exact_duplicate(pic, other)) {
+            continue;
+        }
+        if (strcmp(pic->external_ref, other->external_ref) == 0) {
+            continue;
+        }
+        if (similar_but_different_pair(pic, other)) {
+            continue;
+        }
+        compare_report_match(sock_fh, options, pic, other, 0);
+        match_count++;
+    }
+    fflush(sock_fh);
+    return match_count;
+}
+
+/*
+ * exact_index_report_groups
+ *
+ * Report every pair of exact duplicates in the list, with an error of zero.
+ * Each pair is reported once, lower external_ref first, as fullcompare would.
+ * This takes time in proportion to the number of images, rather than the
+ * number of pairs of images.
+ * If since is not 0, only pairs with an image created at or after since are reported.
+ * With a cluster_set, the pairs are joined into groups rather than reported.
+ *
+ * Return the number of matches found.
+ */
+unsigned long exact_index_report_groups(FILE *sock_fh, Exact_Index *index, PicInfo *list, time_t since,
+        Cluster_Set *cluster_set) {
+    unsigned long match_count = 0;
+    for (; list; list = list->next) {
+        unsigned long bucket = list->pixel_hash & (index->bucket_count - 1);
+        Exact_Entry *entry;
+        for (entry = index->buckets[bucket]; entry; entry = entry->next) {
+            PicInfo *other = entry->pic;
+            if ((strcmp(list->external_ref, other->external_ref) >= 0)
+                    || (since && (list->created < since) && (other->created < since))
+                    || !picinfo_exact_duplicate(list, other)
+                    || similar_but_different_pair(list, other)) {
+                continue;
+            }
+            if (cluster_set) {
+                cluster_set_union(cluster_set, list->list_index, other->list_index, 0);
+            } else {
+                fprintf(sock_fh, "Match: %s, %s, %u\n", list->external_ref, other->external_ref, 0);
+            }
+            match_count++;
+        }
+    }
+    fflush(sock_fh);
+    return match_count;
+}
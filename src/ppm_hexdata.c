@@ -0,0 +1,166 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module converts PPMs to and from strings of hex digits.
+ * The hex form is used both for storage in SQL and for sending
+ * thumbnails made by a client over the network.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "dids.h"
+
+/*
+ * ppm_to_hexdata
+ *
+ * convert the ppm image into a hex string.
+ * e.g. so a ppm can be stored in an SQL database.
+ *
+ * Note: free the result when you are finished with it.
+ *
+ * On success return a string of hex digits.
+ * On failure returns NULL;
+ *
+ */
+
+char *ppm_to_hexdata(PPM_Info *ppm) {
+    char *hexdata = NULL;
+    int x, y, h, w, offset;
+    Color c;
+    char hexchar[] = { '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A',
+            'B', 'C', 'D', 'E', 'F' };
+
+    h = ppm->height;
+    w = ppm->width;
+    // allocate 6 characters for each pixel i.e. two hex chars per each R,G and B.
+    // plus one for the string terminator
+    hexdata = (char *) malloc((6 * w * h) + 1);
+    if (!hexdata) {
+        fprintf(stderr, "Error: failed to allocate memory for ppm_to_hexdata");
+        return NULL;
+    }
+    hexdata[6 * w * h] = '\0';
+    // Set the hex chars that correspond to each pixel.
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            PPM_GetPixel(ppm, x, y, &c);
+            offset = 6 * ((y * w) + x);
+            hexdata[offset + 0] = hexchar[((unsigned int) c.r) / 16];
+            hexdata[offset + 1] = hexchar[((unsigned int) c.r) % 16];
+            hexdata[offset + 2] = hexchar[((unsigned int) c.g) / 16];
+            hexdata[offset + 3] = hexchar[((unsigned int) c.g) % 16];
+            hexdata[offset + 4] = hexchar[((unsigned int) c.b) / 16];
+            hexdata[offset + 5] = hexchar[((unsigned int) c.b) % 16];
+        }
+    }
+    return hexdata;
+}
+
+/*
+ * xtod : Hex to decimal conversion
+ *
+ */
+int xtod(char c) {
+    return ((c >= '0' && c <= '9') ?
+            c - '0' :
+            ((c >= 'A' && c <= 'F') ?
+                    c - 'A' + 10 : ((c >= 'a' && c <= 'f') ? c - 'a' + 10 : 0)));
+}
+
+/*
+ * hexdata_to_ppm
+ *
+ * convert the ppm hex-string into plain ppm data.
+ * e.g. retrieve a ppm from an SQL database.
+ *
+ * Note: You are responsible for attaching the data to the ppm.
+ *       free the result when you are finished with it.
+ *
+ * On success returns ppm data.
+ * On failure returns NULL;
+ *
+ * Limitation : hexstring must only contain hex characters.
+ *   No errors will be throw for invalid input data.
+ */
+
+void hexdata_to_ppm(PPM_Info *ppm, char *hexstring) {
+    int x, y, h, w, offset;
+    Color c;
+
+    h = ppm->height;
+    w = ppm->width;
+    // Set the hex chars that correspond to each pixel.
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            offset = 6 * ((y * w) + x);
+            // red
+            c.r = 16 * xtod(hexstring[offset + 0])
+                    + xtod(hexstring[offset + 1]);
+            // green
+            c.g = 16 * xtod(hexstring[offset + 2])
+                    + xtod(hexstring[offset + 3]);
+            // blue
+            c.b = 16 * xtod(hexstring[offset + 4])
+                    + xtod(hexstring[offset + 5]);
+            PPM_SetPixel(ppm, x, y, c);
+        }
+    }
+    return;
+}
+
+/*
+ * ppm_from_hexdata
+ *
+ * Build a ppm of width x height from a hex string, checking the string first.
+ * Used for thumbnails that arrive over the network, which can't be trusted.
+ *
+ * sock_fh      - error channel
+ *
+ * Note: free the result when you are finished with it.
+ *
+ * On success returns a ppm.
+ * On failure returns NULL;
+ */
+
+PPM_Info *ppm_from_hexdata(FILE *sock_fh, char *hexstring, int width, int height) {
+    size_t expected_len = 6 * width * height;
+    size_t hexstring_len = strlen(hexstring);
+    if (hexstring_len != expected_len) {
+        error(sock_fh, "ppm_from_hexdata: expected %zu hex digits for %dx%d, but got %zu",
+                expected_len, width, height, hexstring_len);
+        return NULL;
+    }
+    size_t offset;
+    for (offset = 0; offset < hexstring_len; offset++) {
+        if (!isxdigit((unsigned char) hexstring[offset])) {
+            error(sock_fh, "ppm_from_hexdata: invalid hex digit at offset %zu", offset);
+            return NULL;
+        }
+    }
+
+    PPM_Info *ppm = ppm_info_allocate(width, height);
+    if (!ppm) {
+        error(sock_fh, "ppm_from_hexdata: failed to allocate memory for %dx%d", width, height);
+        return NULL;
+    }
+    hexdata_to_ppm(ppm, hexstring);
+    return ppm;
+}
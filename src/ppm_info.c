@@ -21,6 +21,8 @@
  *
  */
 #include <stdlib.h>
+#include <limits.h>
+#include <string.h>
 #include "dids.h"
 
 /*
@@ -46,9 +48,184 @@ PPM_Info *ppm_info_allocate(int width, int height) {
  * free ppm struct from mem
  */
 void ppm_info_free(PPM_Info *ppm) {
+    if (!ppm) {
+        return;
+    }
     if (ppm->data) {
         free(ppm->data);
     }
     free(ppm);
 }
 
+
+/*
+ * Hash the pixels of a ppm (64 bit FNV-1a).
+ * Identical pixels always give the same hash, so this finds exact duplicates.
+ */
+unsigned long long ppm_info_hash(PPM_Info *ppm) {
+    unsigned long long hash = FNV_OFFSET_BASIS;
+    int length = 3 * ppm->width * ppm->height;
+    int offset;
+    for (offset = 0; offset < length; offset++) {
+        hash ^= ppm->data[offset];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * Perceptual hash of a ppm (64 bit average hash).
+ *
+ * The image is divided into an 8x8 grid of cells. Each bit is set when the
+ * brightness of that cell is above the average brightness of all the cells.
+ * Similar images give hashes that differ in only a few bits, which can be
+ * counted far quicker than comparing all the pixels.
+ */
+unsigned long long ppm_info_phash(PPM_Info *ppm) {
+    unsigned long cell_sum[64] = { 0 };
+    unsigned long cell_count[64] = { 0 };
+    int x, y;
+    for (y = 0; y < ppm->height; y++) {
+        unsigned char *pixel = ppm->data + y * ppm->modval;
+        int cell_row = 8 * (y * 8 / ppm->height);
+        for (x = 0; x < ppm->width; x++, pixel += 3) {
+            int cell = cell_row + x * 8 / ppm->width;
+            cell_sum[cell] += pixel[0] + pixel[1] + pixel[2];
+            cell_count[cell]++;
+        }
+    }
+    unsigned long cell_average[64];
+    unsigned long total = 0;
+    int cell;
+    for (cell = 0; cell < 64; cell++) {
+        cell_average[cell] = cell_count[cell] ? cell_sum[cell] / cell_count[cell] : 0;
+        total += cell_average[cell];
+    }
+    unsigned long long phash = 0;
+    for (cell = 0; cell < 64; cell++) {
+        if (cell_average[cell] * 64 > total) {
+            phash |= 1ULL << cell;
+        }
+    }
+    return phash;
+}
+
+/*
+ * Sum each colour over cells x cells cells of the ppm.
+ * Return the number of pixels in each cell, or 0 if the ppm does not divide
+ * evenly into cells, or the sums would not fit.
+ */
+static unsigned short _ppm_info_level(PPM_Info *ppm, int cells, unsigned short *sums) {
+    if ((ppm->width % cells) || (ppm->height % cells)) {
+        return 0;
+    }
+    int cell_width = ppm->width / cells;
+    int cell_height = ppm->height / cells;
+    if (cell_width * cell_height * 255 > USHRT_MAX) {
+        return 0;
+    }
+    memset(sums, 0, 3 * cells * cells * sizeof(unsigned short));
+    int x, y;
+    for (y = 0; y < ppm->height; y++) {
+        unsigned char *pixel = ppm->data + y * ppm->modval;
+        unsigned short *cell_row = sums + 3 * cells * (y / cell_height);
+        for (x = 0; x < ppm->width; x++, pixel += 3) {
+            unsigned short *cell = cell_row + 3 * (x / cell_width);
+            cell[0] += pixel[0];
+            cell[1] += pixel[1];
+            cell[2] += pixel[2];
+        }
+    }
+    return cell_width * cell_height;
+}
+
+/*
+ * Make the coarse 4x4 and 8x8 versions of a ppm, for comparing coarse-to-fine.
+ */
+void ppm_info_levels(PPM_Info *ppm, PPM_Levels *levels) {
+    levels->cell_pixels_4 = _ppm_info_level(ppm, 4, levels->sums_4);
+    levels->cell_pixels_8 = _ppm_info_level(ppm, 8, levels->sums_8);
+}
+
+// Reverse the lowest bit_count bits of value.
+static unsigned int _reverse_bits(unsigned int value, int bit_count) {
+    unsigned int reversed = 0;
+    int bit;
+    for (bit = 0; bit < bit_count; bit++) {
+        reversed = (reversed << 1) | ((value >> bit) & 1);
+    }
+    return reversed;
+}
+
+/*
+ * Copy the pixels of a ppm into compare order.
+ *
+ * Neighbouring pixels are alike, so in raster order the error between two
+ * images grows slowly at first. In compare order the first pixels are spread
+ * over the whole image, so the error so far soon shows whether two images differ,
+ * and the compare can stop. The order is the bit reversed Morton (Z) order:
+ * the first 4 pixels are one in each quarter, the first 16 one in each sixteenth,
+ * and so on. Images that are not square with a power of two side stay in raster order.
+ *
+ * Return the pixels, which the caller must free, or NULL if out of memory.
+ */
+unsigned char *ppm_info_compare_order(PPM_Info *ppm) {
+    int pixel_count = ppm->width * ppm->height;
+    unsigned char *data = (unsigned char *) malloc(3 * pixel_count);
+    if (!data) {
+        return NULL;
+    }
+    int side_bits = 0;
+    while ((1 << side_bits) < ppm->width) {
+        side_bits++;
+    }
+    if ((ppm->width != ppm->height) || ((1 << side_bits) != ppm->width)) {
+        memcpy(data, ppm->data, 3 * pixel_count);
+        return data;
+    }
+    int x, y;
+    for (y = 0; y < ppm->height; y++) {
+        for (x = 0; x < ppm->width; x++) {
+            unsigned int morton = 0;
+            int bit;
+            for (bit = 0; bit < side_bits; bit++) {
+                morton |= ((x >> bit) & 1) << (2 * bit);
+                morton |= ((y >> bit) & 1) << (2 * bit + 1);
+            }
+            unsigned int position = _reverse_bits(morton, 2 * side_bits);
+            memcpy(data + 3 * position, ppm->data + y * ppm->modval + 3 * x, 3);
+        }
+    }
+    return data;
+}
+
+/*
+ * ppm_data_compare
+ *
+ * The error (sum of squared differences) between two sets of pixels.
+ * Every checkpoint bytes the error so far is checked, and once it is over
+ * err_limit the compare stops, as the error can only grow.
+ *
+ * bytes_ptr - NULL, or the count of bytes read from each is added to it.
+ *
+ * Return the error, or UINT_MAX if it is more than err_limit.
+ */
+unsigned int ppm_data_compare(unsigned char *data1, unsigned char *data2, int length, int checkpoint,
+        unsigned int err_limit, unsigned long long *bytes_ptr) {
+    unsigned int diff = 0;
+    int offset = 0;
+    while (offset < length) {
+        int end = offset + checkpoint < length ? offset + checkpoint : length;
+        for (; offset < end; offset++) {
+            int d = data1[offset] - data2[offset];
+            diff += d * d;
+        }
+        if (diff > err_limit) {
+            break;
+        }
+    }
+    if (bytes_ptr) {
+        *bytes_ptr += offset;
+    }
+    return diff > err_limit ? UINT_MAX : diff;
+}
@@ -0,0 +1,490 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module keeps a journal of the adds and dels, so the server can reply
+ * once an entry is on local disk, while a writer thread writes the entries
+ * to SQL behind, in batches. At start the entries not known to be in SQL are
+ * written again, and applied to the images loaded from SQL. An entry SQL
+ * refuses is kept in the refused file, so no acknowledged write is lost.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <libpq-fe.h>
+#include "dids.h"
+
+// Read an entry of the journal from its line, in place. Each is one line:
+//   add external_ref created width height hexdata
+//   del external_ref
+//
+// Return 0 if valid, non-zero if not, e.g. only part of it was written.
+static int _journal_entry_parse(char *line, PPM_Write *entry) {
+    memset(entry, 0, sizeof(PPM_Write));
+    size_t length = strlen(line);
+    if (!length || (line[length - 1] != '\n')) {
+        return 1;
+    }
+    line[length - 1] = 0;
+    char *save = NULL;
+    char *command = strtok_r(line, " ", &save);
+    entry->external_ref = strtok_r(NULL, " ", &save);
+    if (!command || !entry->external_ref) {
+        return 1;
+    }
+    if (strcmp(command, "del") == 0) {
+        return strtok_r(NULL, " ", &save) != NULL;
+    }
+    char *created = strtok_r(NULL, " ", &save);
+    char *width = strtok_r(NULL, " ", &save);
+    char *height = strtok_r(NULL, " ", &save);
+    entry->hexdata = strtok_r(NULL, " ", &save);
+    if ((strcmp(command, "add") != 0) || !entry->hexdata || strtok_r(NULL, " ", &save)) {
+        return 1;
+    }
+    entry->add = 1;
+    entry->created = atol(created);
+    entry->width = atoi(width);
+    entry->height = atoi(height);
+    return (entry->width <= 0) || (entry->height <= 0)
+            || (strlen(entry->hexdata) != 6 * (size_t) entry->width * entry->height);
+}
+
+// Wait for JOURNAL_RETRY_SECONDS, or until stopped. The caller holds the lock.
+static void _journal_retry_wait(Journal *journal) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += JOURNAL_RETRY_SECONDS;
+    while (!journal->stop && (pthread_cond_timedwait(&journal->cond, &journal->mutex, &until) != ETIMEDOUT)) {
+        ;
+    }
+}
+
+// Keep an entry SQL refused on its own, line as in the journal, in the refused file, synced to disk.
+// For an add, *refused_ref is set to what the server takes out of RAM, see journal_refused_take().
+// Only the writer thread uses the refused file.
+//
+// Return 0 on success, non-zero on failure, after reporting an error.
+static int _journal_refuse(Journal *journal, char *line, PPM_Write *entry, Journal_Refused **refused_ref) {
+    *refused_ref = NULL;
+    if (!journal->refused_fh && !(journal->refused_fh = fopen(journal->refused_filename, "a"))) {
+        error(stderr, "journal %s - failed to open. errno=%d, error=%s", journal->refused_filename, errno,
+                strerror(errno));
+        return 1;
+    }
+    if ((fputs(line, journal->refused_fh) < 0) || fflush(journal->refused_fh)
+            || fdatasync(fileno(journal->refused_fh))) {
+        error(stderr, "journal %s - failed to write. errno=%d, error=%s", journal->refused_filename, errno,
+                strerror(errno));
+        clearerr(journal->refused_fh);
+        return 2;
+    }
+    if (entry->add && (*refused_ref = malloc(sizeof(Journal_Refused) + strlen(entry->external_ref) + 1))) {
+        (*refused_ref)->created = (time_t) entry->created;
+        strcpy((*refused_ref)->external_ref, entry->external_ref);
+    } else if (entry->add) {
+        error(stderr, "journal %s - out of memory, so '%s' stays in RAM", journal->filename, entry->external_ref);
+    }
+    return 0;
+}
+
+// The writer thread. Writes the entries to SQL, up to JOURNAL_BATCH_MAX in each transaction,
+// see ppm_write_batch(). An entry may be written again after a restart, which is harmless,
+// as an add replaces any row for its external_ref. If SQL can't be reached, or fails for a
+// reason that may pass, e.g. a deadlock, the batch is tried again later. If SQL refuses the
+// data of a batch, its entries are tried one at a time, and an entry refused on its own is
+// moved to the refused file, so it does not hold up the rest.
+// Once every entry is in SQL the journal is started again, keeping it short.
+static void *_journal_writer(void *arg) {
+    Journal *journal = (Journal *) arg;
+    PGconn *psql = NULL;
+    char *line = NULL;
+    size_t line_size = 0;
+    long single_until = 0; // After a batch was refused, the entries up to here are written one at a time.
+    PPM_Write writes[JOURNAL_BATCH_MAX];
+    char *lines[JOURNAL_BATCH_MAX]; // The entries of the batch, which writes point into.
+    pthread_mutex_lock(&journal->mutex);
+    while (!journal->stop) {
+        if (journal->written == journal->end) {
+            if ((journal->end > journal->header_bytes) && !journal->holds
+                    && !ftruncate(fileno(journal->fh), journal->header_bytes)) {
+                journal->end = journal->header_bytes;
+                journal->written = journal->header_bytes;
+            }
+            pthread_cond_wait(&journal->cond, &journal->mutex);
+            continue;
+        }
+        long offset = journal->written;
+        int batch_max = (offset < single_until) ? 1 : JOURNAL_BATCH_MAX;
+        int count = 0;
+        int write_count = 0;
+        ssize_t length;
+        if (!fseek(journal->read_fh, offset, SEEK_SET)) {
+            while ((count < batch_max) && (offset < journal->end)
+                    && ((length = getline(&line, &line_size, journal->read_fh)) > 0)
+                    && (lines[count] = strdup(line))) {
+                // Each entry was checked when appended, or opened.
+                if (!_journal_entry_parse(lines[count], &writes[write_count])) {
+                    write_count++;
+                }
+                offset += length;
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&journal->mutex);
+
+        // 1 if SQL could not be reached or failed, 2 if it refused the data of the batch.
+        int rc = count ? 0 : 1;
+        if (write_count) {
+            if (psql && (PQstatus(psql) != CONNECTION_OK)) {
+                ppm_sql_disconnect(stderr, psql);
+                psql = NULL;
+            }
+            // The statements are prepared once for each connection.
+            if (!psql && (psql = ppm_sql_connect(stderr, journal->sql_info)) && ppm_sql_prepare(stderr, psql)) {
+                ppm_sql_disconnect(stderr, psql);
+                psql = NULL;
+            }
+            rc = psql ? ppm_write_batch(stderr, psql, writes, write_count) : 1;
+            if (rc) {
+                error(stderr, "journal %s - writing %d entries to SQL failed, code %d", journal->filename,
+                        write_count, rc);
+            }
+            // Connected again next time, in case the connection is not usable, e.g. lost its prepared statements.
+            if (psql && (rc == 1)) {
+                ppm_sql_disconnect(stderr, psql);
+                psql = NULL;
+            }
+        }
+        // Refused on its own, so line still holds the entry, as read.
+        Journal_Refused *refused = NULL;
+        int refuse_rc = ((rc == 2) && (count == 1)) ? _journal_refuse(journal, line, &writes[0], &refused) : 1;
+        int line_index;
+        for (line_index = 0; line_index < count; line_index++) {
+            free(lines[line_index]);
+        }
+
+        pthread_mutex_lock(&journal->mutex);
+        if (rc == 0) {
+            journal->written = offset;
+            journal->entries_written += count;
+            journal->batches++;
+        } else if ((rc == 2) && (write_count > 1)) {
+            journal->sql_errors++;
+            single_until = offset;
+        } else if ((rc == 2) && !refuse_rc) {
+            error(stderr, "journal %s - SQL refused the entry at offset %ld, so it is moved to %s", journal->filename,
+                    journal->written, journal->refused_filename);
+            journal->sql_errors++;
+            journal->entries_failed++;
+            journal->written = offset;
+            if (refused) {
+                refused->next = journal->refused;
+                journal->refused = refused;
+            }
+        } else {
+            journal->sql_errors++;
+            _journal_retry_wait(journal);
+        }
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    free(line);
+    if (psql) {
+        ppm_sql_disconnect(stderr, psql);
+    }
+    return NULL;
+}
+
+// Check the entries of the journal, from the header on, finding where the next is appended.
+// The last entry is dropped if only part of it was written, as it was never replied to.
+//
+// Return 0 on success, non-zero if the file is not a journal, or an entry is damaged.
+static int _journal_check(FILE *sock_fh, Journal *journal) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length = getline(&line, &line_size, journal->read_fh);
+    journal->header_bytes = strlen(JOURNAL_HEADER "\n");
+    int rc = 0;
+    if (length <= 0) {
+        if ((fprintf(journal->fh, JOURNAL_HEADER "\n") < 0) || fflush(journal->fh)
+                || fdatasync(fileno(journal->fh))) {
+            error(sock_fh, "journal %s - failed to write. errno=%d, error=%s", journal->filename, errno,
+                    strerror(errno));
+            rc = 1;
+        }
+    } else if (strcmp(line, JOURNAL_HEADER "\n") != 0) {
+        error(sock_fh, "journal %s is not a DIDS journal", journal->filename);
+        rc = 2;
+    }
+    long offset = journal->header_bytes;
+    PPM_Write entry;
+    while (!rc && ((length = getline(&line, &line_size, journal->read_fh)) > 0)) {
+        if (!_journal_entry_parse(line, &entry)) {
+            offset += length;
+        } else if (getline(&line, &line_size, journal->read_fh) > 0) {
+            error(sock_fh, "journal %s - damaged entry at offset %ld", journal->filename, offset);
+            rc = 3;
+        } else if (ftruncate(fileno(journal->fh), offset)) {
+            error(sock_fh, "journal %s - failed to truncate", journal->filename);
+            rc = 4;
+        } else {
+            debug(sock_fh, "journal %s - dropped a partly written entry at offset %ld", journal->filename, offset);
+        }
+    }
+    free(line);
+    journal->end = offset;
+    journal->written = journal->header_bytes;
+    return rc;
+}
+
+/*
+ * journal_open
+ *
+ * Open the journal, creating it if new, then start the writer thread, which first
+ * writes to SQL any entries from before. sql_info must last until journal_close().
+ *
+ * Return the journal, or NULL on failure, after reporting an error.
+ */
+Journal *journal_open(FILE *sock_fh, char *filename, char *sql_info) {
+    Journal *journal = (Journal *) calloc(1, sizeof(Journal));
+    if (!journal) {
+        error(sock_fh, "journal_open - out of memory");
+        return NULL;
+    }
+    snprintf(journal->filename, sizeof journal->filename, "%s", filename);
+    snprintf(journal->refused_filename, sizeof journal->refused_filename, "%s.refused", journal->filename);
+    journal->sql_info = sql_info;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    if (!(journal->fh = fopen(filename, "a")) || !(journal->read_fh = fopen(filename, "r"))) {
+        error(sock_fh, "journal %s - failed to open. errno=%d, error=%s", filename, errno, strerror(errno));
+    } else if (_journal_check(sock_fh, journal)) {
+        ;
+    } else if (pthread_create(&journal->thread, NULL, _journal_writer, journal)) {
+        error(sock_fh, "journal %s - failed to start the writer thread", filename);
+    } else {
+        debug(sock_fh, "journal %s has %ld bytes of entries to write to SQL", filename,
+                journal->end - journal->header_bytes);
+        return journal;
+    }
+    if (journal->fh) {
+        fclose(journal->fh);
+    }
+    if (journal->read_fh) {
+        fclose(journal->read_fh);
+    }
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_cond_destroy(&journal->cond);
+    free(journal);
+    return NULL;
+}
+
+// Append an entry, of length bytes, already printed to the journal, then sync it to disk.
+// If that failed, it is taken off again. The caller holds the lock.
+//
+// Return 0 on success, non-zero on failure, after reporting an error.
+static int _journal_append(FILE *sock_fh, Journal *journal, int length) {
+    if ((length < 0) || fflush(journal->fh) || fdatasync(fileno(journal->fh))) {
+        error(sock_fh, "journal %s - failed to write. errno=%d, error=%s", journal->filename, errno,
+                strerror(errno));
+        clearerr(journal->fh);
+        if (ftruncate(fileno(journal->fh), journal->end)) {
+            error(sock_fh, "journal %s - failed to truncate", journal->filename);
+        }
+        return 1;
+    }
+    journal->end += length;
+    pthread_cond_signal(&journal->cond);
+    return 0;
+}
+
+// An external_ref is one word of an entry, on one line. It is only ever passed to SQL as a
+// parameter of a prepared statement, see ppm_write_batch(), so is never quoted.
+static int _journal_external_ref_valid(FILE *sock_fh, char *external_ref) {
+    char *c;
+    for (c = external_ref; *c; c++) {
+        if ((*c == ' ') || iscntrl((unsigned char) *c)) {
+            break;
+        }
+    }
+    if (!*external_ref || *c) {
+        error(sock_fh, "journal - external_ref can't be empty or contain spaces or control characters");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * journal_add
+ *
+ * Record an add, on disk, before it is replied to. It is written to SQL later.
+ *
+ * Return 0 on success, non-zero on failure, after reporting an error.
+ */
+int journal_add(FILE *sock_fh, Journal *journal, char *external_ref, PPM_Info *ppm, time_t created) {
+    if (!_journal_external_ref_valid(sock_fh, external_ref)) {
+        return 2;
+    }
+    char *hexdata = ppm_to_hexdata(ppm);
+    if (!hexdata) {
+        error(sock_fh, "journal_add - out of memory");
+        return 1;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    int length = fprintf(journal->fh, "add %s %ld %d %d %s\n", external_ref, (long) created, ppm->width,
+            ppm->height, hexdata);
+    int rc = _journal_append(sock_fh, journal, length);
+    pthread_mutex_unlock(&journal->mutex);
+    free(hexdata);
+    return rc;
+}
+
+/*
+ * journal_del
+ *
+ * Record a del, on disk, before it is replied to. It is written to SQL later.
+ *
+ * Return 0 on success, non-zero on failure, after reporting an error.
+ */
+int journal_del(FILE *sock_fh, Journal *journal, char *external_ref) {
+    if (!_journal_external_ref_valid(sock_fh, external_ref)) {
+        return 2;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    int length = fprintf(journal->fh, "del %s\n", external_ref);
+    int rc = _journal_append(sock_fh, journal, length);
+    pthread_mutex_unlock(&journal->mutex);
+    return rc;
+}
+
+/*
+ * journal_hold
+ *
+ * Call before loading the images from SQL. Entries not yet in SQL are kept in the
+ * journal, for journal_replay(), which must be called after, to apply them.
+ *
+ * Return the offset of the first entry that may not be in SQL yet.
+ */
+long journal_hold(Journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    journal->holds++;
+    long offset = journal->written;
+    pthread_mutex_unlock(&journal->mutex);
+    return offset;
+}
+
+/*
+ * journal_replay
+ *
+ * Apply the entries from offset, which were not in SQL when the images were loaded,
+ * to the list, in order. An entry already in SQL changes nothing, so it does not
+ * matter if the writer thread wrote some meanwhile. Ends the hold of journal_hold().
+ *
+ * Return 0 on success, non-zero on failure, after reporting an error.
+ */
+int journal_replay(FILE *sock_fh, Journal *journal, long offset, PicInfo **list_ref) {
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t length;
+    unsigned long count = 0;
+    int rc = 0;
+    pthread_mutex_lock(&journal->mutex);
+    if (fseek(journal->read_fh, offset, SEEK_SET)) {
+        error(sock_fh, "journal %s - failed to read", journal->filename);
+        rc = 1;
+    }
+    while (!rc && (offset < journal->end) && ((length = getline(&line, &line_size, journal->read_fh)) > 0)) {
+        offset += length;
+        PPM_Write entry;
+        if (_journal_entry_parse(line, &entry)) {
+            continue;
+        }
+        PicInfoDeleteFromList(list_ref, entry.external_ref);
+        if (entry.add) {
+            PPM_Info *ppm = ppm_from_hexdata(sock_fh, entry.hexdata, entry.width, entry.height);
+            PicInfo *pic = ppm ? PicInfoBuild(entry.external_ref, ppm, NULL) : NULL;
+            if (!pic) {
+                error(sock_fh, "journal_replay - out of memory");
+                ppm_info_free(ppm);
+                rc = 2;
+                break;
+            }
+            pic->created = (time_t) entry.created;
+            PicInfoAddToList(sock_fh, list_ref, pic);
+        }
+        count++;
+    }
+    journal->holds--;
+    pthread_mutex_unlock(&journal->mutex);
+    free(line);
+    debug(sock_fh, "journal %s - applied %lu entries not yet in SQL", journal->filename, count);
+    return rc;
+}
+
+/*
+ * journal_refused_take
+ *
+ * For the server thread, to take out of RAM the adds SQL refused, which were kept in the
+ * refused file, so RAM agrees with SQL. Only remove an image if its created matches, as it
+ * may have been deleted and added again since.
+ *
+ * Return the adds refused since last called, each to free(), or NULL if none.
+ */
+Journal_Refused *journal_refused_take(Journal *journal) {
+    pthread_mutex_lock(&journal->mutex);
+    Journal_Refused *refused = journal->refused;
+    journal->refused = NULL;
+    pthread_mutex_unlock(&journal->mutex);
+    return refused;
+}
+
+/*
+ * journal_close
+ *
+ * Stop the writer thread, once it has finished its batch. Entries it has not
+ * written to SQL stay in the journal, for the next journal_open().
+ */
+void journal_close(Journal *journal) {
+    if (!journal) {
+        return;
+    }
+    pthread_mutex_lock(&journal->mutex);
+    journal->stop = 1;
+    pthread_cond_broadcast(&journal->cond);
+    pthread_mutex_unlock(&journal->mutex);
+    pthread_join(journal->thread, NULL);
+    fclose(journal->fh);
+    fclose(journal->read_fh);
+    if (journal->refused_fh) {
+        fclose(journal->refused_fh);
+    }
+    while (journal->refused) {
+        Journal_Refused *next = journal->refused->next;
+        free(journal->refused);
+        journal->refused = next;
+    }
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_cond_destroy(&journal->cond);
+    free(journal);
+}
@@ -39,6 +39,22 @@ PicInfo *PicInfoBuild(char *external_ref, PPM_Info *pic,
     hlp->external_ref = strdup(external_ref);
     hlp->picinf = pic;
     hlp->similar_but_different = similar_but_different;
+    hlp->pixel_hash = pic ? ppm_info_hash(pic) : 0;
+    hlp->phash = pic ? ppm_info_phash(pic) : 0;
+    hlp->pivot_version = 0;
+    hlp->created = time(NULL); // As SQL does for a new image. Loading from SQL sets it after.
+    hlp->list_index = 0;
+    hlp->refs = 1; // The list's.
+    hlp->original = NULL;
+    hlp->version_added = 0;
+    hlp->version_deleted = 0;
+    if (pic) {
+        ppm_info_levels(pic, &hlp->levels);
+        hlp->compare_data = ppm_info_compare_order(pic); // Compares are just slower if NULL.
+    } else {
+        memset(&hlp->levels, 0, sizeof(PPM_Levels));
+        hlp->compare_data = NULL;
+    }
     return hlp;
 }
 
@@ -62,9 +78,22 @@ void PicInfoDelete(PicInfo *hlp) {
     if (hlp->picinf) {
         ppm_info_free(hlp->picinf);
     }
+    if (hlp->compare_data) {
+        free(hlp->compare_data);
+    }
     free(hlp);
 }
 
+/*
+ * Release a reference to a PicInfo, deleting it when the last is released.
+ * The copies in a corpus share the data of the images, so hold references too.
+ */
+void PicInfoRelease(PicInfo *pic) {
+    if (pic && (__atomic_sub_fetch(&pic->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+        PicInfoDelete(pic);
+    }
+}
+
 /*
  * add the picture info to the  linked list.
  * Linked list is sorted in order of assending external_ref.
@@ -118,7 +147,7 @@ void PicInfoAddToList(FILE *sock_fh, PicInfo **list_ref, PicInfo *picinfo_new) {
  *
  * PicInfoDelFromList(sock_fh, list, external_ref);
  *
- * Note: Will free the memory of the PicInfo it Deletes
+ * Note: Will release the PicInfo it Deletes, freeing its memory unless a corpus copy holds it.
  *
  * return
  *   0 - success
@@ -154,11 +183,28 @@ int PicInfoDeleteFromList(PicInfo **list_ref, char *external_ref) {
         // update head if removed link was first link in list.
         *list_ref = ptr->next;
     }
-    // Free the memory
-    PicInfoDelete(ptr);
+    // Free the memory, once no corpus copy holds it.
+    PicInfoRelease(ptr);
     return 0;
 }
 
+/*
+ * find the PicInfo in the list.
+ *
+ * return
+ *   the PicInfo with external_ref
+ *   NULL if not in list.
+ */
+PicInfo *PicInfoFindInList(PicInfo *list, char *external_ref) {
+    while (list && strcmp(list->external_ref, external_ref) < 0) {
+        list = list->next;
+    }
+    if (list && (strcmp(list->external_ref, external_ref) == 0)) {
+        return list;
+    }
+    return NULL;
+}
+
 /*
  * add the external ref of the 'similar but different'
  */
@@ -0,0 +1,123 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module merges the Match lines of several fullcompare outputs, e.g. one
+ * from each shard, into one canonical sorted result.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#define MATCH_MERGE_INITIAL 1024
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dids.h"
+
+typedef struct Match_Line {
+    char *external_ref;
+    char *external_ref_other;
+    unsigned int err;
+} Match_Line;
+
+static int _match_line_cmp(const void *a, const void *b) {
+    const Match_Line *line_a = (const Match_Line *) a;
+    const Match_Line *line_b = (const Match_Line *) b;
+    int cmp = strcmp(line_a->external_ref, line_b->external_ref);
+    if (cmp == 0) {
+        cmp = strcmp(line_a->external_ref_other, line_b->external_ref_other);
+    }
+    if (cmp == 0) {
+        cmp = (line_a->err > line_b->err) - (line_a->err < line_b->err);
+    }
+    return cmp;
+}
+
+/*
+ * match_merge
+ *
+ * Read the "Match: a, b, err" lines from each input, ignoring any other lines.
+ * Write them to out with the lower external_ref first, sorted, and each only once.
+ *
+ * Return the number of matches written, or -1 if out of memory.
+ */
+long match_merge(FILE *sock_fh, FILE *out, FILE **inputs, int input_count) {
+    Match_Line *lines = NULL;
+    long line_count = 0;
+    long line_max = 0;
+    char buffer[BUFFER_SIZE];
+    int input;
+    long rc = 0;
+    for (input = 0; (input < input_count) && (rc == 0); input++) {
+        while (fgets(buffer, sizeof buffer, inputs[input])) {
+            char *external_ref = buffer + strlen("Match: ");
+            char *external_ref_other;
+            char *err_text;
+            if ((strncmp(buffer, "Match: ", strlen("Match: ")) != 0)
+                    || !(external_ref_other = strstr(external_ref, ", "))
+                    || !(err_text = strrchr(external_ref_other + 2, ','))) {
+                continue;
+            }
+            *external_ref_other = '\0';
+            external_ref_other += 2;
+            *err_text = '\0';
+            if (line_count == line_max) {
+                line_max = line_max ? 2 * line_max : MATCH_MERGE_INITIAL;
+                Match_Line *more = (Match_Line *) realloc(lines, line_max * sizeof(Match_Line));
+                if (!more) {
+                    rc = -1;
+                    break;
+                }
+                lines = more;
+            }
+            // The lower external_ref first, so a pair found from either image is the same line.
+            int swap = strcmp(external_ref, external_ref_other) > 0;
+            Match_Line *line = &lines[line_count];
+            line->external_ref = strdup(swap ? external_ref_other : external_ref);
+            line->external_ref_other = strdup(swap ? external_ref : external_ref_other);
+            line->err = strtoul(err_text + 1, NULL, 10);
+            if (!line->external_ref || !line->external_ref_other) {
+                free(line->external_ref);
+                free(line->external_ref_other);
+                rc = -1;
+                break;
+            }
+            line_count++;
+        }
+    }
+
+    if (rc == 0) {
+        qsort(lines, line_count, sizeof(Match_Line), _match_line_cmp);
+    } else {
+        error(sock_fh, "match_merge - out of memory");
+    }
+    long line;
+    for (line = 0; line < line_count; line++) {
+        if ((rc >= 0) && ((line == 0) || _match_line_cmp(&lines[line - 1], &lines[line]))) {
+            fprintf(out, "Match: %s, %s, %u\n", lines[line].external_ref, lines[line].external_ref_other,
+                    lines[line].err);
+            rc++;
+        }
+    }
+    for (line = 0; line < line_count; line++) {
+        free(lines[line].external_ref);
+        free(lines[line].external_ref_other);
+    }
+    free(lines);
+    fflush(out);
+    return rc;
+}
@@ -0,0 +1,215 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module chooses pivot images, and the distance of each image to them.
+ * The triangle inequality then rules out many pairs of images without
+ * comparing their pixels.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#define PIVOT_REFRESH_MIN 16 // Always allow this many changes before choosing new pivots.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include "dids.h"
+
+// Never 0, so a PicInfo with pivot_version 0 has no distances.
+static unsigned int pivot_version_last = 0;
+
+/*
+ * pivot_table_create
+ *
+ * Return an empty table, or NULL if out of memory.
+ */
+Pivot_Table *pivot_table_create() {
+    Pivot_Table *table = (Pivot_Table *) calloc(1, sizeof(Pivot_Table));
+    return table;
+}
+
+static void _pivot_table_clear(Pivot_Table *table) {
+    int pivot;
+    for (pivot = 0; pivot < table->count; pivot++) {
+        ppm_info_free(table->pivots[pivot]);
+        table->pivots[pivot] = NULL;
+    }
+    table->count = 0;
+    table->image_count = 0;
+    table->changes = 0;
+    table->version = 0;
+}
+
+void pivot_table_free(Pivot_Table *table) {
+    if (!table) {
+        return;
+    }
+    _pivot_table_clear(table);
+    free(table);
+}
+
+static PPM_Info *_ppm_info_copy(PPM_Info *ppm) {
+    PPM_Info *copy = ppm_info_allocate(ppm->width, ppm->height);
+    if (copy) {
+        memcpy(copy->data, ppm->data, 3 * ppm->width * ppm->height);
+    }
+    return copy;
+}
+
+// Distance between two thumbnails, or -1 if they can't be compared.
+static float _pivot_distance(PPM_Info *p1, PPM_Info *p2) {
+    if ((p1->width != p2->width) || (p1->height != p2->height)) {
+        return -1;
+    }
+    return sqrt((double) PPM_compare(stderr, p1, p2, UINT_MAX));
+}
+
+/*
+ * pivot_table_build
+ *
+ * Choose up to pivot_count pivots from the list, and set the distance from
+ * every image in the list to each of them.
+ *
+ * Pivots are chosen farthest first: each new pivot is the image farthest from
+ * the pivots already chosen. Pivots spread out like this rule out more pairs.
+ * This takes pivot_count comparisons per image.
+ *
+ * Return 0 on success, non-zero if out of memory. On failure there are no pivots.
+ */
+int pivot_table_build(FILE *sock_fh, Pivot_Table *table, PicInfo *list, int pivot_count) {
+    _pivot_table_clear(table);
+    if (pivot_count > PIVOT_MAX) {
+        pivot_count = PIVOT_MAX;
+    }
+    if (++pivot_version_last == 0) {
+        pivot_version_last = 1;
+    }
+    table->version = pivot_version_last;
+
+    PicInfo *pic;
+    for (pic = list; pic; pic = pic->next) {
+        pic->pivot_version = pic->picinf ? table->version : 0;
+        table->image_count++;
+    }
+
+    // The first image starts off the pivots.
+    PicInfo *next_pivot = list;
+    while (next_pivot && !next_pivot->picinf) {
+        next_pivot = next_pivot->next;
+    }
+    while (next_pivot && (table->count < pivot_count)) {
+        PPM_Info *pivot_ppm = _ppm_info_copy(next_pivot->picinf);
+        if (!pivot_ppm) {
+            error(sock_fh, "pivot_table_build - out of memory");
+            _pivot_table_clear(table);
+            return 1;
+        }
+        int pivot = table->count++;
+        table->pivots[pivot] = pivot_ppm;
+
+        // Set the distance to the new pivot, and find the image farthest from all the pivots.
+        float farthest = 0;
+        next_pivot = NULL;
+        for (pic = list; pic; pic = pic->next) {
+            if (pic->pivot_version != table->version) {
+                continue;
+            }
+            float distance = _pivot_distance(pivot_ppm, pic->picinf);
+            if (distance < 0) {
+                pic->pivot_version = 0;
+                continue;
+            }
+            pic->pivot_distances[pivot] = distance;
+            float nearest = distance;
+            int other;
+            for (other = 0; other < pivot; other++) {
+                if (pic->pivot_distances[other] < nearest) {
+                    nearest = pic->pivot_distances[other];
+                }
+            }
+            if (nearest > farthest) {
+                farthest = nearest;
+                next_pivot = pic;
+            }
+        }
+    }
+    debug(sock_fh, "pivot_table_build chose %d pivots for %lu images", table->count, table->image_count);
+    return 0;
+}
+
+/*
+ * pivot_table_distances
+ *
+ * Set the distance from a new image, e.g. one just added, to each pivot.
+ */
+void pivot_table_distances(Pivot_Table *table, PicInfo *pic) {
+    pic->pivot_version = 0;
+    if (!table->count || !pic->picinf) {
+        return;
+    }
+    int pivot;
+    for (pivot = 0; pivot < table->count; pivot++) {
+        float distance = _pivot_distance(table->pivots[pivot], pic->picinf);
+        if (distance < 0) {
+            return;
+        }
+        pic->pivot_distances[pivot] = distance;
+    }
+    pic->pivot_version = table->version;
+}
+
+/*
+ * pivot_table_changed
+ *
+ * Note that an image was added or deleted. The pivots stay correct, but
+ * once the images have changed enough they no longer spread out well.
+ *
+ * Return true when it is time to build the table again.
+ */
+int pivot_table_changed(Pivot_Table *table) {
+    table->changes++;
+    return table->changes > (table->image_count / 4) + PIVOT_REFRESH_MIN;
+}
+
+/*
+ * pivot_table_copy
+ *
+ * Copy a table, with the same version, so images with distances to the pivots
+ * of the table can be compared using the copy after the table is built again.
+ *
+ * Return the copy, or NULL if out of memory.
+ */
+Pivot_Table *pivot_table_copy(Pivot_Table *table) {
+    Pivot_Table *copy = pivot_table_create();
+    if (!copy) {
+        return NULL;
+    }
+    int pivot;
+    for (pivot = 0; pivot < table->count; pivot++) {
+        if (!(copy->pivots[pivot] = _ppm_info_copy(table->pivots[pivot]))) {
+            pivot_table_free(copy);
+            return NULL;
+        }
+        copy->count++;
+    }
+    copy->version = table->version;
+    copy->image_count = table->image_count;
+    copy->changes = table->changes;
+    return copy;
+}
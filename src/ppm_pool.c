@@ -0,0 +1,265 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module is a pool of worker threads, started once and kept, that run
+ * tasks from a queue for each class of task, interactive before batch. The
+ * server runs its compares on it, rather than forking and starting new
+ * threads for each one.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "dids.h"
+
+// Take the first task of the first class with a task waiting and a thread to spare,
+// or with pending, the first task of that batch, as the caller is already one of the
+// threads of its class. The caller must hold the lock.
+static Pool_Task *_worker_pool_take(Worker_Pool *pool, int *pending) {
+    int pool_class;
+    for (pool_class = 0; pool_class < POOL_CLASS_COUNT; pool_class++) {
+        Pool_Class *queue = &pool->classes[pool_class];
+        if (!pending && (queue->busy >= queue->busy_max)) {
+            continue;
+        }
+        Pool_Task *previous = NULL;
+        Pool_Task *task;
+        for (task = queue->first; task; previous = task, task = task->next) {
+            if (!pending || (task->pending == pending)) {
+                break;
+            }
+        }
+        if (!task) {
+            continue;
+        }
+        if (previous) {
+            previous->next = task->next;
+        } else {
+            queue->first = task->next;
+        }
+        if (queue->last == task) {
+            queue->last = previous;
+        }
+        queue->queued--;
+        pool->queued--;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double wait_seconds = (now.tv_sec - task->queued_at.tv_sec) + (now.tv_nsec - task->queued_at.tv_nsec) / 1e9;
+        queue->wait_seconds += wait_seconds;
+        if (wait_seconds > queue->wait_seconds_max) {
+            queue->wait_seconds_max = wait_seconds;
+        }
+        return task;
+    }
+    return NULL;
+}
+
+// Run a task, with the lock not held, then count it done. The caller must hold the lock.
+// A nested task is run by a thread waiting for its batch, so is not another thread of its class.
+static void _worker_pool_run(Worker_Pool *pool, Pool_Task *task, int nested) {
+    Pool_Class *queue = &pool->classes[task->pool_class];
+    pool->busy++;
+    if (!nested) {
+        queue->busy++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    task->function(task->arg);
+    pthread_mutex_lock(&pool->mutex);
+    pool->busy--;
+    if (!nested) {
+        queue->busy--;
+    }
+    pool->tasks_run++;
+    queue->tasks_run++;
+    if (task->pending) {
+        (*task->pending)--;
+        pthread_cond_broadcast(&pool->task_done);
+    }
+    free(task);
+}
+
+static void *_worker_pool_thread(void *arg) {
+    Worker_Pool *pool = (Worker_Pool *) arg;
+    pthread_mutex_lock(&pool->mutex);
+    while (!pool->stopping) {
+        Pool_Task *task = _worker_pool_take(pool, NULL);
+        if (task) {
+            _worker_pool_run(pool, task, 0);
+        } else {
+            pthread_cond_wait(&pool->task_queued, &pool->mutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+/*
+ * worker_pool_create
+ *
+ * Start a pool of thread_count threads. Each class of task may use them all, with
+ * no limit on the tasks waiting, until set with worker_pool_limit().
+ *
+ * Return the pool, or NULL on failure, after reporting an error.
+ */
+Worker_Pool *worker_pool_create(FILE *sock_fh, int thread_count) {
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+    Worker_Pool *pool = (Worker_Pool *) calloc(1, sizeof(Worker_Pool));
+    if (!pool || !(pool->threads = (pthread_t *) calloc(thread_count, sizeof(pthread_t)))) {
+        error(sock_fh, "worker_pool_create - out of memory");
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->task_queued, NULL);
+    pthread_cond_init(&pool->task_done, NULL);
+    int pool_class;
+    for (pool_class = 0; pool_class < POOL_CLASS_COUNT; pool_class++) {
+        pool->classes[pool_class].busy_max = thread_count;
+    }
+    for (pool->thread_count = 0; pool->thread_count < thread_count; pool->thread_count++) {
+        int rc = pthread_create(&pool->threads[pool->thread_count], NULL, _worker_pool_thread, pool);
+        if (rc) {
+            error(sock_fh, "worker_pool_create - pthread_create() returned %d", rc);
+            worker_pool_free(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/*
+ * worker_pool_free
+ *
+ * Stop the threads, once each has finished the task it is running, and free the pool.
+ * Tasks still queued are not run.
+ */
+void worker_pool_free(Worker_Pool *pool) {
+    if (!pool) {
+        return;
+    }
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->task_queued);
+    pthread_mutex_unlock(&pool->mutex);
+    int thread;
+    for (thread = 0; thread < pool->thread_count; thread++) {
+        pthread_join(pool->threads[thread], NULL);
+    }
+    int pool_class;
+    for (pool_class = 0; pool_class < POOL_CLASS_COUNT; pool_class++) {
+        Pool_Task *task = pool->classes[pool_class].first;
+        while (task) {
+            Pool_Task *next = task->next;
+            free(task);
+            task = next;
+        }
+    }
+    pthread_cond_destroy(&pool->task_done);
+    pthread_cond_destroy(&pool->task_queued);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+/*
+ * worker_pool_limit
+ *
+ * Limit a class of task to busy_max threads at once, from 1 to all of them, so
+ * the other classes have threads to spare. With queued_max, more tasks of the
+ * class are refused while that many are waiting for a thread.
+ */
+void worker_pool_limit(Worker_Pool *pool, int pool_class, int busy_max, unsigned long queued_max) {
+    pthread_mutex_lock(&pool->mutex);
+    if ((busy_max < 1) || (busy_max > pool->thread_count)) {
+        busy_max = pool->thread_count;
+    }
+    pool->classes[pool_class].busy_max = busy_max;
+    pool->classes[pool_class].queued_max = queued_max;
+    pthread_cond_broadcast(&pool->task_queued);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * worker_pool_submit
+ *
+ * Queue function(arg) to be run by a thread of the pool, after the tasks of the
+ * classes before pool_class, e.g. POOL_CLASS_INTERACTIVE before POOL_CLASS_BATCH.
+ * pending is NULL, or a count of a batch of tasks: it is counted up now, and down
+ * when the task is done, see worker_pool_wait(). The tasks of a batch are part of
+ * work already taken on, so are never refused.
+ *
+ * Return 0 on success, 1 if out of memory, 2 if refused as too many tasks of the class are waiting.
+ */
+int worker_pool_submit(Worker_Pool *pool, int pool_class, Pool_Function function, void *arg, int *pending) {
+    Pool_Task *task = (Pool_Task *) malloc(sizeof(Pool_Task));
+    if (!task) {
+        return 1;
+    }
+    task->function = function;
+    task->arg = arg;
+    task->pending = pending;
+    task->pool_class = pool_class;
+    task->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &task->queued_at);
+    Pool_Class *queue = &pool->classes[pool_class];
+    pthread_mutex_lock(&pool->mutex);
+    if (!pending && queue->queued_max && (queue->queued >= queue->queued_max)) {
+        queue->refused++;
+        pthread_mutex_unlock(&pool->mutex);
+        free(task);
+        return 2;
+    }
+    if (queue->last) {
+        queue->last->next = task;
+    } else {
+        queue->first = task;
+    }
+    queue->last = task;
+    queue->queued++;
+    pool->queued++;
+    if (pending) {
+        (*pending)++;
+    }
+    pthread_cond_signal(&pool->task_queued);
+    pthread_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/*
+ * worker_pool_wait
+ *
+ * Wait until the batch counted by pending is done.
+ * Tasks of the batch still queued are run by the caller, so a task of the pool can
+ * wait for a batch of its own without every thread ending up waiting.
+ */
+void worker_pool_wait(Worker_Pool *pool, int *pending) {
+    pthread_mutex_lock(&pool->mutex);
+    while (*pending) {
+        Pool_Task *task = _worker_pool_take(pool, pending);
+        if (task) {
+            _worker_pool_run(pool, task, 1);
+        } else {
+            pthread_cond_wait(&pool->task_done, &pool->mutex);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+}
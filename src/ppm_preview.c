@@ -0,0 +1,441 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module finds JPEG previews embedded in image files, so that the
+ * full image need not be decoded just to be shrunk to a thumbnail.
+ * e.g. Camera RAW files such as Canon CR2 are TIFF based, and hold one or
+ * more JPEG previews as well as the raw sensor data.
+ * e.g. JPEG files often have an EXIF thumbnail, which is also TIFF based.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+#define PREVIEW_IFD_MAX       32  // Stop following IFDs after this many, in case of loops.
+#define PREVIEW_SUBIFD_MAX     8
+#define PREVIEW_ENTRY_MAX    512  // More entries than this in an IFD and the file is broken.
+#define PREVIEW_HEAD_MAX  262144  // How much of a JPEG to read looking for its frame header.
+
+#define TIFF_TAG_COMPRESSION      0x0103
+#define TIFF_TAG_STRIP_OFFSETS    0x0111
+#define TIFF_TAG_STRIP_BYTE_COUNTS 0x0117
+#define TIFF_TAG_SUB_IFDS         0x014A
+#define TIFF_TAG_JPEG_OFFSET      0x0201
+#define TIFF_TAG_JPEG_LENGTH      0x0202
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "dids.h"
+
+// Where in a file a TIFF structure is, and how to read it.
+typedef struct Tiff_Reader {
+    FILE *fp;
+    long base;       // File offset of the TIFF header. All TIFF offsets are relative to this.
+    long size;       // Bytes available from base.
+    int big_endian;  // "MM" byte order, otherwise "II".
+} Tiff_Reader;
+
+// The best JPEG found so far.
+typedef struct Preview_Candidate {
+    long offset;     // Relative to the TIFF header.
+    long length;
+    int width;
+    int height;
+} Preview_Candidate;
+
+// RAW formats that are TIFF containers. Lower case, without the dot.
+static const char *preview_raw_extensions[] = {
+    "cr2", "nef", "nrw", "arw", "srf", "sr2", "dng", "pef", "orf", "rw2",
+    "erf", "3fr", "mef", "iiq", NULL
+};
+
+/*
+ * Read count bytes at a TIFF offset.
+ * Return 0 on success, non-zero if out of range or unreadable.
+ */
+static int _tiff_read(Tiff_Reader *tr, long offset, unsigned char *buf, size_t count) {
+    if ((offset < 0) || (offset + (long) count > tr->size)) {
+        return 1;
+    }
+    if (fseek(tr->fp, tr->base + offset, SEEK_SET)) {
+        return 2;
+    }
+    if (fread(buf, 1, count, tr->fp) != count) {
+        return 3;
+    }
+    return 0;
+}
+
+static int _tiff_u16(Tiff_Reader *tr, long offset, unsigned int *value) {
+    unsigned char b[2];
+    if (_tiff_read(tr, offset, b, 2)) {
+        return 1;
+    }
+    *value = tr->big_endian ? (b[0] << 8) | b[1] : (b[1] << 8) | b[0];
+    return 0;
+}
+
+static int _tiff_u32(Tiff_Reader *tr, long offset, unsigned long *value) {
+    unsigned char b[4];
+    if (_tiff_read(tr, offset, b, 4)) {
+        return 1;
+    }
+    if (tr->big_endian) {
+        *value = ((unsigned long) b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+    } else {
+        *value = ((unsigned long) b[3] << 24) | (b[2] << 16) | (b[1] << 8) | b[0];
+    }
+    return 0;
+}
+
+/*
+ * Read the value of an IFD entry that holds one SHORT or LONG.
+ * Return 0 on success.
+ */
+static int _tiff_entry_value(Tiff_Reader *tr, long entry, unsigned long *value) {
+    unsigned int type;
+    unsigned int short_value;
+    if (_tiff_u16(tr, entry + 2, &type)) {
+        return 1;
+    }
+    if (type == 3) { // SHORT
+        if (_tiff_u16(tr, entry + 8, &short_value)) {
+            return 2;
+        }
+        *value = short_value;
+        return 0;
+    }
+    if ((type == 4) || (type == 13)) { // LONG or IFD
+        return _tiff_u32(tr, entry + 8, value);
+    }
+    return 3;
+}
+
+/*
+ * jpeg_dimensions
+ *
+ * Check a buffer is a JPEG that ImageMagick can decode, and get its size.
+ * Lossless JPEG (SOF3), as used for the raw sensor data in CR2 and DNG, is rejected.
+ *
+ * Return 0 on success, non-zero if not a usable JPEG.
+ */
+static int _jpeg_dimensions(unsigned char *buf, long length, int *width, int *height) {
+    if ((length < 4) || (buf[0] != 0xFF) || (buf[1] != 0xD8)) {
+        return 1;
+    }
+    long pos = 2;
+    while (pos + 4 <= length) {
+        if (buf[pos] != 0xFF) {
+            return 2;
+        }
+        unsigned char marker = buf[pos + 1];
+        // Fill bytes
+        if (marker == 0xFF) {
+            pos++;
+            continue;
+        }
+        long segment_length = (buf[pos + 2] << 8) | buf[pos + 3];
+        // Baseline, extended and progressive. The kinds of JPEG a camera uses for previews.
+        if ((marker == 0xC0) || (marker == 0xC1) || (marker == 0xC2)) {
+            if (pos + 9 > length) {
+                return 3;
+            }
+            *height = (buf[pos + 5] << 8) | buf[pos + 6];
+            *width = (buf[pos + 7] << 8) | buf[pos + 8];
+            return 0;
+        }
+        // Any other frame type, or start of scan before a frame.
+        if (((marker >= 0xC3) && (marker <= 0xCF) && (marker != 0xC4) && (marker != 0xC8)
+                && (marker != 0xCC)) || (marker == 0xDA)) {
+            return 4;
+        }
+        pos += 2 + segment_length;
+    }
+    return 5;
+}
+
+/*
+ * Consider the JPEG at offset as a preview. Keep it if it is the largest usable so far.
+ */
+static void _preview_consider(Tiff_Reader *tr, unsigned long offset, unsigned long length,
+        int min_size, Preview_Candidate *best) {
+    if ((length < 4) || ((long) (offset + length) > tr->size)) {
+        return;
+    }
+    // Enough of the start of the JPEG to find the frame header past any EXIF or tables.
+    size_t head_length = length < PREVIEW_HEAD_MAX ? length : PREVIEW_HEAD_MAX;
+    unsigned char *head = malloc(head_length);
+    if (!head) {
+        return;
+    }
+    int width = 0;
+    int height = 0;
+    int rc = _tiff_read(tr, offset, head, head_length)
+            || _jpeg_dimensions(head, head_length, &width, &height);
+    free(head);
+    if (rc) {
+        return;
+    }
+    if ((width < min_size) || (height < min_size)) {
+        return;
+    }
+    if ((long) width * height > (long) best->width * best->height) {
+        best->offset = offset;
+        best->length = length;
+        best->width = width;
+        best->height = height;
+    }
+}
+
+/*
+ * Look through one IFD for JPEGs, either as a JPEG interchange format pair or
+ * as a single JPEG compressed strip. Any SubIFDs are looked through as well.
+ *
+ * Return the offset of the next IFD, 0 if none.
+ */
+static unsigned long _preview_search_ifd(Tiff_Reader *tr, unsigned long ifd, int min_size,
+        Preview_Candidate *best, int depth) {
+    unsigned int entry_count;
+    if (_tiff_u16(tr, ifd, &entry_count) || (entry_count > PREVIEW_ENTRY_MAX)) {
+        return 0;
+    }
+    unsigned long compression = 0;
+    unsigned long jpeg_offset = 0, jpeg_length = 0;
+    unsigned long strip_offset = 0, strip_length = 0;
+    unsigned int strip_count = 0;
+    unsigned long sub_ifd_offset = 0;
+    unsigned long sub_ifd_count = 0;
+    unsigned int entry_index;
+    for (entry_index = 0; entry_index < entry_count; entry_index++) {
+        long entry = ifd + 2 + 12 * entry_index;
+        unsigned int tag;
+        unsigned long count;
+        if (_tiff_u16(tr, entry, &tag) || _tiff_u32(tr, entry + 4, &count)) {
+            return 0;
+        }
+        switch (tag) {
+        case TIFF_TAG_COMPRESSION:
+            _tiff_entry_value(tr, entry, &compression);
+            break;
+        case TIFF_TAG_JPEG_OFFSET:
+            _tiff_entry_value(tr, entry, &jpeg_offset);
+            break;
+        case TIFF_TAG_JPEG_LENGTH:
+            _tiff_entry_value(tr, entry, &jpeg_length);
+            break;
+        case TIFF_TAG_STRIP_OFFSETS:
+            strip_count = count;
+            _tiff_entry_value(tr, entry, &strip_offset);
+            break;
+        case TIFF_TAG_STRIP_BYTE_COUNTS:
+            _tiff_entry_value(tr, entry, &strip_length);
+            break;
+        case TIFF_TAG_SUB_IFDS:
+            sub_ifd_count = count;
+            if (count == 1) {
+                _tiff_entry_value(tr, entry, &sub_ifd_offset);
+            } else {
+                _tiff_u32(tr, entry + 8, &sub_ifd_offset);
+            }
+            break;
+        }
+    }
+
+    if (jpeg_offset && jpeg_length) {
+        _preview_consider(tr, jpeg_offset, jpeg_length, min_size, best);
+    }
+    // Old style (6) and new style (7) JPEG compression, as one strip.
+    if (((compression == 6) || (compression == 7)) && (strip_count == 1) && strip_length) {
+        _preview_consider(tr, strip_offset, strip_length, min_size, best);
+    }
+
+    if (sub_ifd_count && (depth == 0)) {
+        unsigned long sub_ifd_index;
+        for (sub_ifd_index = 0; (sub_ifd_index < sub_ifd_count) && (sub_ifd_index < PREVIEW_SUBIFD_MAX);
+                sub_ifd_index++) {
+            unsigned long sub_ifd = sub_ifd_offset;
+            if ((sub_ifd_count > 1) && _tiff_u32(tr, sub_ifd_offset + 4 * sub_ifd_index, &sub_ifd)) {
+                break;
+            }
+            _preview_search_ifd(tr, sub_ifd, min_size, best, depth + 1);
+        }
+    }
+
+    unsigned long next_ifd = 0;
+    if (_tiff_u32(tr, ifd + 2 + 12 * entry_count, &next_ifd)) {
+        return 0;
+    }
+    return next_ifd;
+}
+
+/*
+ * Find the largest usable JPEG within the TIFF structure, then read it into memory.
+ *
+ * Return the JPEG, or NULL if there isn't one. Caller frees.
+ */
+static unsigned char *_preview_from_tiff(Tiff_Reader *tr, int min_size, size_t *length_ptr) {
+    unsigned char header[4];
+    if (_tiff_read(tr, 0, header, 4)) {
+        return NULL;
+    }
+    if ((header[0] == 'I') && (header[1] == 'I')) {
+        tr->big_endian = 0;
+    } else if ((header[0] == 'M') && (header[1] == 'M')) {
+        tr->big_endian = 1;
+    } else {
+        return NULL;
+    }
+    // 42 for TIFF. Olympus ORF uses "RO" or "RS", Panasonic RW2 uses 0x55.
+    unsigned int magic;
+    _tiff_u16(tr, 2, &magic);
+    if ((magic != 42) && (magic != 0x4F52) && (magic != 0x5352) && (magic != 0x55)) {
+        return NULL;
+    }
+
+    Preview_Candidate best = { 0, 0, 0, 0 };
+    unsigned long ifd;
+    int ifd_count = 0;
+    if (_tiff_u32(tr, 4, &ifd)) {
+        return NULL;
+    }
+    while (ifd && (ifd_count++ < PREVIEW_IFD_MAX)) {
+        ifd = _preview_search_ifd(tr, ifd, min_size, &best, 0);
+    }
+    if (!best.length) {
+        return NULL;
+    }
+
+    unsigned char *jpeg = malloc(best.length);
+    if (!jpeg) {
+        return NULL;
+    }
+    if (_tiff_read(tr, best.offset, jpeg, best.length)) {
+        free(jpeg);
+        return NULL;
+    }
+    *length_ptr = best.length;
+    return jpeg;
+}
+
+/*
+ * preview_is_raw_filename
+ *
+ * Return true if the filename looks like a TIFF based camera RAW file.
+ */
+int preview_is_raw_filename(char *filename) {
+    char *extension = strrchr(filename, '.');
+    if (!extension) {
+        return 0;
+    }
+    extension++;
+    int index;
+    for (index = 0; preview_raw_extensions[index]; index++) {
+        if (strcasecmp(extension, preview_raw_extensions[index]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * preview_from_raw_filename
+ *
+ * Extract the largest embedded JPEG preview from a camera RAW file.
+ * Previews smaller than min_size in either dimension are not used.
+ *
+ * sock_fh    - error channel
+ * filename   - the RAW file
+ * min_size   - the size of the miniature that will be made from the preview.
+ * length_ptr - set to the length of the JPEG.
+ *
+ * Note: free the result when you are finished with it.
+ *
+ * Return the JPEG bytes, or NULL if there is no usable preview.
+ */
+unsigned char *preview_from_raw_filename(FILE *sock_fh, char *filename, int min_size, size_t *length_ptr) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        error(sock_fh, "preview_from_raw_filename: failed to open filename %s", filename);
+        return NULL;
+    }
+    Tiff_Reader tr;
+    tr.fp = fp;
+    tr.base = 0;
+    fseek(fp, 0, SEEK_END);
+    tr.size = ftell(fp);
+    unsigned char *jpeg = _preview_from_tiff(&tr, min_size, length_ptr);
+    fclose(fp);
+    return jpeg;
+}
+
+/*
+ * preview_from_exif_filename
+ *
+ * Extract the EXIF thumbnail from a JPEG file.
+ * Thumbnails smaller than min_size in either dimension are not used.
+ *
+ * Note: The EXIF thumbnail may be stale if the image was edited by software
+ * that didn't update it. Callers should report when it is used.
+ *
+ * sock_fh    - error channel
+ * filename   - the JPEG file
+ * min_size   - the size of the miniature that will be made from the thumbnail.
+ * length_ptr - set to the length of the thumbnail JPEG.
+ *
+ * Note: free the result when you are finished with it.
+ *
+ * Return the JPEG bytes, or NULL if there is no usable thumbnail.
+ */
+unsigned char *preview_from_exif_filename(FILE *sock_fh, char *filename, int min_size, size_t *length_ptr) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        error(sock_fh, "preview_from_exif_filename: failed to open filename %s", filename);
+        return NULL;
+    }
+    unsigned char *jpeg = NULL;
+    unsigned char marker[4];
+    long pos = 2;
+    if ((fread(marker, 1, 2, fp) != 2) || (marker[0] != 0xFF) || (marker[1] != 0xD8)) {
+        fclose(fp);
+        return NULL;
+    }
+    // The EXIF APP1 segment comes before the image data, so stop at the first frame or scan.
+    while (fread(marker, 1, 4, fp) == 4) {
+        if ((marker[0] != 0xFF) || (marker[1] == 0xDA) || ((marker[1] >= 0xC0) && (marker[1] <= 0xCF))) {
+            break;
+        }
+        long segment_length = (marker[2] << 8) | marker[3];
+        if (marker[1] == 0xE1) {
+            char exif_header[6];
+            if ((fread(exif_header, 1, 6, fp) == 6) && (memcmp(exif_header, "Exif\0\0", 6) == 0)) {
+                Tiff_Reader tr;
+                tr.fp = fp;
+                tr.base = pos + 10;
+                tr.size = segment_length - 8;
+                jpeg = _preview_from_tiff(&tr, min_size, length_ptr);
+                break;
+            }
+        }
+        pos += 2 + segment_length;
+        if (fseek(fp, pos, SEEK_SET)) {
+            break;
+        }
+    }
+    fclose(fp);
+    return jpeg;
+}
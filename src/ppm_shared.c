@@ -0,0 +1,495 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module keeps the images in a file mapped by several processes. The
+ * server writes it as the list changes, and reader processes compare with it,
+ * so there is one copy of the thumbnails however many processes read them.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dids.h"
+
+#define SHARED_ALIGN(bytes) (((bytes) + 7) & ~7UL)
+#define SHARED_RECORDS_START SHARED_ALIGN(sizeof(Shared_Header))
+
+// Bytes of the 'similar but different' external_refs of pic, each with a terminating 0.
+static unsigned long _shared_similar_but_different_bytes(PicInfo *pic) {
+    unsigned long bytes = 0;
+    Similar_but_different *sbd;
+    for (sbd = pic->similar_but_different; sbd; sbd = sbd->next) {
+        bytes += strlen(sbd->external_ref) + 1;
+    }
+    return bytes;
+}
+
+static unsigned long _shared_pixel_bytes(PicInfo *pic) {
+    return pic->picinf ? 3 * pic->picinf->width * pic->picinf->height : 0;
+}
+
+// Bytes of the record adding pic.
+static unsigned long _shared_add_size(PicInfo *pic) {
+    return SHARED_ALIGN(sizeof(Shared_Record) + strlen(pic->external_ref) + 1
+            + _shared_similar_but_different_bytes(pic))
+            + SHARED_ALIGN(_shared_pixel_bytes(pic) * (pic->compare_data ? 2 : 1));
+}
+
+// Bytes of the record deleting pic.
+static unsigned long _shared_delete_size(PicInfo *pic) {
+    return SHARED_ALIGN(sizeof(Shared_Record) + strlen(pic->external_ref) + 1);
+}
+
+// Write a record after those published, which the caller then publishes.
+// The caller has checked there is room.
+static void _shared_write(Shared_Header *header, PicInfo *pic, int type) {
+    Shared_Record *record = (Shared_Record *) ((char *) header + header->used);
+    memset(record, 0, sizeof(Shared_Record));
+    record->type = type;
+    record->external_ref_bytes = strlen(pic->external_ref) + 1;
+    char *bytes = (char *) (record + 1);
+    memcpy(bytes, pic->external_ref, record->external_ref_bytes);
+    record->pixel_hash = pic->pixel_hash;
+    if (type == SHARED_RECORD_DELETE) {
+        record->size = _shared_delete_size(pic);
+        return;
+    }
+    record->size = _shared_add_size(pic);
+    bytes += record->external_ref_bytes;
+    Similar_but_different *sbd;
+    for (sbd = pic->similar_but_different; sbd; sbd = sbd->next) {
+        int sbd_bytes = strlen(sbd->external_ref) + 1;
+        memcpy(bytes, sbd->external_ref, sbd_bytes);
+        bytes += sbd_bytes;
+        record->similar_but_different_bytes += sbd_bytes;
+    }
+    if (pic->picinf) {
+        record->width = pic->picinf->width;
+        record->height = pic->picinf->height;
+        unsigned char *pixels = (unsigned char *) record
+                + SHARED_ALIGN(sizeof(Shared_Record) + record->external_ref_bytes
+                        + record->similar_but_different_bytes);
+        memcpy(pixels, pic->picinf->data, _shared_pixel_bytes(pic));
+        if (pic->compare_data) {
+            record->has_compare_data = 1;
+            memcpy(pixels + _shared_pixel_bytes(pic), pic->compare_data, _shared_pixel_bytes(pic));
+        }
+    }
+    record->phash = pic->phash;
+    record->created = pic->created;
+    record->levels = pic->levels;
+}
+
+// Publish the records written, so readers see them, then the version they make.
+static void _shared_publish(Shared_Header *header, unsigned long used, unsigned long version) {
+    __atomic_store_n(&header->version, version, __ATOMIC_RELAXED);
+    __atomic_store_n(&header->used, used, __ATOMIC_RELEASE);
+}
+
+/*
+ * shared_corpus_create
+ *
+ * Write the list to a new file, with room for it to double, then rename it to
+ * filename, replacing any older file. The old shared corpus, if any, is marked
+ * replaced, so readers open the new file, and freed, whether or not this works.
+ * On failure the file is removed, so readers stop using the old one.
+ *
+ * Return the shared corpus, or NULL on failure, after reporting an error.
+ */
+Shared_Corpus *shared_corpus_create(FILE *sock_fh, char *filename, PicInfo *list, unsigned long version,
+        Shared_Corpus *old) {
+    unsigned long generation = old ? old->header->generation + 1 : 1;
+    unsigned long capacity = SHARED_RECORDS_START;
+    PicInfo *pic;
+    for (pic = list; pic; pic = pic->next) {
+        capacity += _shared_add_size(pic);
+    }
+    capacity *= 2;
+    if (capacity < SHARED_CORPUS_MIN_BYTES) {
+        capacity = SHARED_CORPUS_MIN_BYTES;
+    }
+
+    Shared_Corpus *shared = (Shared_Corpus *) calloc(1, sizeof(Shared_Corpus));
+    char new_filename[sizeof shared->filename + 4];
+    snprintf(new_filename, sizeof new_filename, "%s.new", filename);
+    int fd = -1;
+    void *base = MAP_FAILED;
+    if (!shared) {
+        error(sock_fh, "shared_corpus_create - out of memory");
+    } else if (((fd = open(new_filename, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+            || ftruncate(fd, capacity)
+            || ((base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)) {
+        error(sock_fh, "shared_corpus_create - failed to make '%s', errno=%d, error=%s", new_filename, errno,
+                strerror(errno));
+    } else {
+        snprintf(shared->filename, sizeof shared->filename, "%s", filename);
+        shared->fd = fd;
+        shared->header = (Shared_Header *) base;
+        shared->header->magic = SHARED_CORPUS_MAGIC;
+        shared->header->generation = generation;
+        shared->header->capacity = capacity;
+        shared->header->used = SHARED_RECORDS_START;
+        shared->header->version = version;
+        for (pic = list; pic; pic = pic->next) {
+            _shared_write(shared->header, pic, SHARED_RECORD_ADD);
+            shared->header->used += ((Shared_Record *) ((char *) base + shared->header->used))->size;
+        }
+        if (rename(new_filename, filename) == 0) {
+            if (old) {
+                __atomic_store_n(&old->header->replaced, 1, __ATOMIC_RELEASE);
+                shared_corpus_free(old, 0);
+            }
+            return shared;
+        }
+        error(sock_fh, "shared_corpus_create - failed to rename '%s', errno=%d, error=%s", new_filename, errno,
+                strerror(errno));
+    }
+    if (base != MAP_FAILED) {
+        munmap(base, capacity);
+    }
+    if (fd >= 0) {
+        close(fd);
+        unlink(new_filename);
+    }
+    free(shared);
+    if (old) {
+        __atomic_store_n(&old->header->replaced, 1, __ATOMIC_RELEASE);
+        shared_corpus_free(old, 1);
+    }
+    return NULL;
+}
+
+/*
+ * shared_corpus_add
+ *
+ * Publish an image just added to the list, as the new version of the list.
+ *
+ * Return 0 on success, non-zero if the file is full, so a new one must be made.
+ */
+int shared_corpus_add(FILE *sock_fh, Shared_Corpus *shared, PicInfo *pic, unsigned long version) {
+    Shared_Header *header = shared->header;
+    unsigned long size = _shared_add_size(pic);
+    if (header->used + size > header->capacity) {
+        debug(sock_fh, "shared_corpus_add - '%s' is full", shared->filename);
+        return 1;
+    }
+    _shared_write(header, pic, SHARED_RECORD_ADD);
+    _shared_publish(header, header->used + size, version);
+    return 0;
+}
+
+/*
+ * shared_corpus_delete
+ *
+ * Publish that an image is deleted from the list, as the new version of the list.
+ * Call before the image is freed.
+ *
+ * Return 0 on success, non-zero if a new file should be made: this one is full,
+ *        or mostly images since deleted.
+ */
+int shared_corpus_delete(FILE *sock_fh, Shared_Corpus *shared, PicInfo *pic, unsigned long version) {
+    Shared_Header *header = shared->header;
+    unsigned long size = _shared_delete_size(pic);
+    if (header->used + size > header->capacity) {
+        debug(sock_fh, "shared_corpus_delete - '%s' is full", shared->filename);
+        return 1;
+    }
+    _shared_write(header, pic, SHARED_RECORD_DELETE);
+    _shared_publish(header, header->used + size, version);
+    shared->deleted_bytes += _shared_add_size(pic) + size;
+    return shared->deleted_bytes * 2 > header->used;
+}
+
+/*
+ * shared_corpus_free
+ *
+ * Unmap the file, and with remove, delete it so no reader opens it again.
+ */
+void shared_corpus_free(Shared_Corpus *shared, int remove) {
+    if (!shared) {
+        return;
+    }
+    if (remove) {
+        unlink(shared->filename);
+    }
+    munmap(shared->header, shared->header->capacity);
+    close(shared->fd);
+    free(shared);
+}
+
+/*
+ * shared_reader_create
+ *
+ * A reader of the shared corpus in filename, with pivot_count pivots.
+ * The file is opened by shared_reader_refresh(), so need not exist yet.
+ *
+ * Return the reader, or NULL if out of memory.
+ */
+Shared_Reader *shared_reader_create(char *filename, int pivot_count) {
+    Shared_Reader *reader = (Shared_Reader *) calloc(1, sizeof(Shared_Reader));
+    if (!reader || !(reader->exact_index = exact_index_create())) {
+        free(reader);
+        return NULL;
+    }
+    snprintf(reader->filename, sizeof reader->filename, "%s", filename);
+    reader->fd = -1;
+    reader->pivot_count = pivot_count;
+    return reader;
+}
+
+// Free an image of the reader. Its pixels are in the file, so not free'ed.
+static void _shared_reader_picinfo_free(PicInfo *pic) {
+    if (pic->picinf) {
+        pic->picinf->data = NULL;
+    }
+    pic->compare_data = NULL;
+    PicInfoDelete(pic);
+}
+
+// Forget the images, and unmap the file.
+static void _shared_reader_close(Shared_Reader *reader) {
+    while (reader->list) {
+        PicInfo *next = reader->list->next;
+        _shared_reader_picinfo_free(reader->list);
+        reader->list = next;
+    }
+    reader->tail = NULL;
+    reader->count = 0;
+    reader->deleted = 0;
+    exact_index_clear(reader->exact_index);
+    pivot_table_free(reader->pivot_table);
+    reader->pivot_table = NULL;
+    if (reader->header) {
+        munmap(reader->header, reader->mapped);
+        reader->header = NULL;
+    }
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+// Where to link an image into the list, in external_ref order. The records of a new file are
+// in list order, so are added at the tail, without walking the list.
+// Return NULL if already in the list.
+static PicInfo **_shared_reader_link(Shared_Reader *reader, char *external_ref) {
+    if (!reader->tail || (strcmp(reader->tail->external_ref, external_ref) < 0)) {
+        return reader->tail ? &reader->tail->next : &reader->list;
+    }
+    PicInfo **link_ptr = &reader->list;
+    while (*link_ptr && (strcmp((*link_ptr)->external_ref, external_ref) < 0)) {
+        link_ptr = &(*link_ptr)->next;
+    }
+    if (*link_ptr && !(*link_ptr)->version_deleted && (strcmp((*link_ptr)->external_ref, external_ref) == 0)) {
+        return NULL;
+    }
+    return link_ptr;
+}
+
+// Add the image of a record to the reader's list, pointing to the pixels in the file.
+// Return non-zero if out of memory.
+static int _shared_reader_add(Shared_Reader *reader, Shared_Record *record) {
+    char *external_ref = (char *) (record + 1);
+    PicInfo **list_link_ptr = _shared_reader_link(reader, external_ref);
+    if (!list_link_ptr) {
+        return 0; // Already added.
+    }
+    PicInfo *pic = (PicInfo *) calloc(1, sizeof(PicInfo));
+    if (!pic || !(pic->external_ref = strdup(external_ref))) {
+        free(pic);
+        return 1;
+    }
+    pic->refs = 1;
+    if (record->width && record->height) {
+        if (!(pic->picinf = (PPM_Info *) malloc(sizeof(PPM_Info)))) {
+            _shared_reader_picinfo_free(pic);
+            return 1;
+        }
+        pic->picinf->width = record->width;
+        pic->picinf->height = record->height;
+        pic->picinf->modval = 3 * record->width; // Bytes per row.
+        pic->picinf->data = (unsigned char *) record
+                + SHARED_ALIGN(sizeof(Shared_Record) + record->external_ref_bytes
+                        + record->similar_but_different_bytes);
+        if (record->has_compare_data) {
+            pic->compare_data = pic->picinf->data + 3 * record->width * record->height;
+        }
+    }
+    // The 'similar but different' external_refs stay in the file too.
+    Similar_but_different **link_ptr = &pic->similar_but_different;
+    char *sbd_ref = external_ref + record->external_ref_bytes;
+    while (sbd_ref < external_ref + record->external_ref_bytes + record->similar_but_different_bytes) {
+        Similar_but_different *sbd = (Similar_but_different *) malloc(sizeof(Similar_but_different));
+        if (!sbd) {
+            _shared_reader_picinfo_free(pic);
+            return 1;
+        }
+        sbd->external_ref = sbd_ref;
+        sbd->next = NULL;
+        *link_ptr = sbd;
+        link_ptr = &sbd->next;
+        sbd_ref += strlen(sbd_ref) + 1;
+    }
+    pic->pixel_hash = record->pixel_hash;
+    pic->phash = record->phash;
+    pic->created = record->created;
+    pic->levels = record->levels;
+    if (exact_index_add(reader->exact_index, pic)) {
+        _shared_reader_picinfo_free(pic);
+        return 1;
+    }
+    if (reader->pivot_table) {
+        pivot_table_distances(reader->pivot_table, pic);
+    }
+    pic->next = *list_link_ptr;
+    *list_link_ptr = pic;
+    if (!pic->next) {
+        reader->tail = pic;
+    }
+    reader->count++;
+    return 0;
+}
+
+// Mark the image of a delete record as deleted, with version_deleted, found by its pixels in the exact index.
+// It stays in the list until _shared_reader_unlink_deleted(), so many deletes take one pass.
+static void _shared_reader_delete(Shared_Reader *reader, Shared_Record *record) {
+    char *external_ref = (char *) (record + 1);
+    PicInfo *pic = exact_index_find(reader->exact_index, record->pixel_hash, external_ref);
+    if (!pic) {
+        // Images without pixels are not in the exact index.
+        for (pic = reader->list; pic && (pic->version_deleted || strcmp(pic->external_ref, external_ref));
+                pic = pic->next) {
+            ;
+        }
+    }
+    if (!pic) {
+        return;
+    }
+    exact_index_remove(reader->exact_index, pic);
+    pic->version_deleted = 1;
+    reader->deleted++;
+    reader->count--;
+}
+
+// Unlink and free the images marked deleted, in one pass of the list.
+static void _shared_reader_unlink_deleted(Shared_Reader *reader) {
+    if (!reader->deleted) {
+        return;
+    }
+    PicInfo **link_ptr = &reader->list;
+    reader->tail = NULL;
+    while (*link_ptr) {
+        PicInfo *pic = *link_ptr;
+        if (pic->version_deleted) {
+            *link_ptr = pic->next;
+            _shared_reader_picinfo_free(pic);
+        } else {
+            reader->tail = pic;
+            link_ptr = &pic->next;
+        }
+    }
+    reader->deleted = 0;
+}
+
+/*
+ * shared_reader_refresh
+ *
+ * Bring the reader's list up to date with the records the server has published,
+ * opening the file again if a new one has replaced it.
+ *
+ * Return 0 on success, non-zero if the file can't be read, after reporting an error.
+ */
+int shared_reader_refresh(FILE *sock_fh, Shared_Reader *reader) {
+    if (reader->header && __atomic_load_n(&reader->header->replaced, __ATOMIC_ACQUIRE)) {
+        _shared_reader_close(reader);
+    }
+    if (!reader->header) {
+        struct stat file_stat;
+        void *base = MAP_FAILED;
+        if (((reader->fd = open(reader->filename, O_RDONLY)) < 0) || fstat(reader->fd, &file_stat)
+                || (file_stat.st_size < (off_t) SHARED_RECORDS_START)
+                || ((base = mmap(NULL, file_stat.st_size, PROT_READ, MAP_SHARED, reader->fd, 0)) == MAP_FAILED)) {
+            error(sock_fh, "shared_reader_refresh - failed to read '%s', errno=%d, error=%s", reader->filename,
+                    errno, strerror(errno));
+            _shared_reader_close(reader);
+            return 1;
+        }
+        reader->header = (Shared_Header *) base;
+        reader->mapped = file_stat.st_size;
+        reader->offset = SHARED_RECORDS_START;
+        if ((reader->header->magic != SHARED_CORPUS_MAGIC) || (reader->header->capacity != reader->mapped)) {
+            error(sock_fh, "shared_reader_refresh - '%s' is not a shared corpus", reader->filename);
+            _shared_reader_close(reader);
+            return 1;
+        }
+    }
+    unsigned long used = __atomic_load_n(&reader->header->used, __ATOMIC_ACQUIRE);
+    int pivots_due = !reader->pivot_table;
+    while (reader->offset < used) {
+        Shared_Record *record = (Shared_Record *) ((char *) reader->header + reader->offset);
+        if ((record->size < sizeof(Shared_Record)) || (reader->offset + record->size > used)) {
+            error(sock_fh, "shared_reader_refresh - bad record at offset %lu of '%s'", reader->offset,
+                    reader->filename);
+            _shared_reader_close(reader);
+            return 1;
+        }
+        if (record->type == SHARED_RECORD_ADD) {
+            if (_shared_reader_add(reader, record)) {
+                error(sock_fh, "shared_reader_refresh - out of memory");
+                _shared_reader_close(reader);
+                return 1;
+            }
+        } else if (record->type == SHARED_RECORD_DELETE) {
+            _shared_reader_delete(reader, record);
+        }
+        if (reader->pivot_table && pivot_table_changed(reader->pivot_table)) {
+            pivots_due = 1;
+        }
+        reader->offset += record->size;
+    }
+    _shared_reader_unlink_deleted(reader);
+    // As the server does, without pivots compares are just slower.
+    if (pivots_due && reader->pivot_count && reader->list) {
+        if (!reader->pivot_table) {
+            reader->pivot_table = pivot_table_create();
+        }
+        if (reader->pivot_table) {
+            pivot_table_build(sock_fh, reader->pivot_table, reader->list, reader->pivot_count);
+        }
+    }
+    return 0;
+}
+
+/*
+ * shared_reader_free
+ */
+void shared_reader_free(Shared_Reader *reader) {
+    if (!reader) {
+        return;
+    }
+    _shared_reader_close(reader);
+    exact_index_free(reader->exact_index);
+    free(reader);
+}
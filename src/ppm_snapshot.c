@@ -0,0 +1,327 @@
+/*
+ * This is a DIDS (Duplicate Image Detection System) helper module.
+ * This module keeps a corpus of copies of the images, which add and del update
+ * as they change the list, and snapshots: versions of the list pinned for
+ * compares on other threads, which are not affected by add and del.
+ * Please see the README file for further details.
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dids.h"
+
+// Once more than this many copies are deleted, and more than a quarter of those in the
+// corpus, compares spend longer skipping them than a new corpus takes to make.
+#define CORPUS_DELETED_MIN 64
+
+// Copy a chain of 'similar but different' refs, as refresh_similar_but_different frees the originals.
+// Return the copy, and set *failed_ptr if out of memory.
+static Similar_but_different *_corpus_copy_similar_but_different(Similar_but_different *sbd, int *failed_ptr) {
+    Similar_but_different *first = NULL;
+    Similar_but_different **link_ptr = &first;
+    for (; sbd; sbd = sbd->next) {
+        Similar_but_different *copy = (Similar_but_different *) malloc(sizeof(Similar_but_different));
+        if (!copy || !(copy->external_ref = strdup(sbd->external_ref))) {
+            free(copy);
+            *failed_ptr = 1;
+            break;
+        }
+        copy->next = NULL;
+        *link_ptr = copy;
+        link_ptr = &copy->next;
+    }
+    return first;
+}
+
+// Make copy a copy of pic, in the list from version on, holding a reference to pic.
+// Return non-zero if out of memory.
+static int _corpus_copy(PicInfo *copy, PicInfo *pic, unsigned long version) {
+    int failed = 0;
+    *copy = *pic;
+    copy->similar_but_different = _corpus_copy_similar_but_different(pic->similar_but_different, &failed);
+    copy->refs = 0; // The copy is freed with the corpus, not by PicInfoRelease().
+    copy->original = pic;
+    copy->version_added = version;
+    copy->version_deleted = 0;
+    copy->next = NULL;
+    __atomic_add_fetch(&pic->refs, 1, __ATOMIC_RELAXED);
+    return failed;
+}
+
+static void _corpus_copy_free(Corpus *corpus, PicInfo *copy) {
+    Similar_but_different *sbd = copy->similar_but_different;
+    while (sbd) {
+        Similar_but_different *next = sbd->next;
+        free(sbd->external_ref);
+        free(sbd);
+        sbd = next;
+    }
+    PicInfoRelease(copy->original);
+    if ((copy < corpus->copies) || (copy >= corpus->copies + corpus->copies_count)) {
+        free(copy);
+    }
+}
+
+static void _corpus_free(Corpus *corpus) {
+    PicInfo *copy = corpus->first;
+    while (copy) {
+        PicInfo *next = copy->next;
+        _corpus_copy_free(corpus, copy);
+        copy = next;
+    }
+    exact_index_free(corpus->exact_index);
+    pivot_table_free(corpus->pivot_table);
+    free(corpus->copies);
+    free(corpus);
+}
+
+/*
+ * corpus_create
+ *
+ * Copy the list, holding a reference to each image so its thumbnail stays
+ * valid after the image is deleted from the list. The copies have their own
+ * exact duplicate index, and pivots. The copies are the version of the list
+ * given, and corpus_add() and corpus_delete() make the versions after it.
+ * The caller holds the one reference to the corpus.
+ *
+ * This takes time in proportion to the number of images, so the server only
+ * makes a corpus when changes can't be made to the one it has.
+ *
+ * Return the corpus, or NULL if out of memory, after reporting an error.
+ */
+Corpus *corpus_create(FILE *sock_fh, PicInfo *list, Pivot_Table *pivot_table, unsigned long version) {
+    Corpus *corpus = (Corpus *) calloc(1, sizeof(Corpus));
+    if (!corpus) {
+        error(sock_fh, "corpus_create - out of memory");
+        return NULL;
+    }
+    corpus->refs = 1;
+    corpus->version = version;
+    PicInfo *pic;
+    unsigned long count = 0;
+    for (pic = list; pic; pic = pic->next) {
+        count++;
+    }
+    int failed = !(corpus->copies = (PicInfo *) calloc(count + 1, sizeof(PicInfo)))
+            || !(corpus->exact_index = exact_index_create())
+            || (pivot_table && !(corpus->pivot_table = pivot_table_copy(pivot_table)));
+    for (pic = list; pic && !failed; pic = pic->next) {
+        PicInfo *copy = &corpus->copies[corpus->copies_count];
+        failed = _corpus_copy(copy, pic, version);
+        copy->list_index = corpus->copies_count;
+        if (corpus->copies_count++) {
+            copy[-1].next = copy;
+        }
+    }
+    if (corpus->copies_count) {
+        corpus->first = corpus->copies;
+    }
+    corpus->count = corpus->copies_count;
+    if (!failed) {
+        failed = exact_index_build(corpus->exact_index, corpus->first);
+    }
+    if (failed) {
+        error(sock_fh, "corpus_create - out of memory");
+        _corpus_free(corpus);
+        return NULL;
+    }
+    return corpus;
+}
+
+/*
+ * corpus_add
+ *
+ * Add a copy of an image, just added to the list, as the new version of the list.
+ * Snapshots of earlier versions, being read by other threads, don't include it.
+ * The copy is linked in list order with atomic stores, once it is complete.
+ *
+ * Return 0 on success.
+ *        1 if the corpus can't be changed, so a new one must be made: the index is
+ *          full and must not grow while it is being read, or out of memory.
+ *        2 if an image with that external_ref is already in the corpus.
+ */
+int corpus_add(FILE *sock_fh, Corpus *corpus, PicInfo *pic, unsigned long version) {
+    // As exact_index_add() would grow the index.
+    if (corpus->exact_index->entry_count >= corpus->exact_index->bucket_count) {
+        return 1;
+    }
+    // Only this thread changes the corpus, so it can read the links without atomics.
+    PicInfo *previous = NULL;
+    PicInfo *next = corpus->first;
+    int cmp = -1;
+    while (next && ((cmp = strcmp(next->external_ref, pic->external_ref)) <= 0)) {
+        if ((cmp == 0) && !next->version_deleted) {
+            return 2;
+        }
+        previous = next;
+        next = next->next;
+    }
+    PicInfo *copy = (PicInfo *) malloc(sizeof(PicInfo));
+    if (!copy) {
+        error(sock_fh, "corpus_add - out of memory");
+        return 1;
+    }
+    int failed = _corpus_copy(copy, pic, version);
+    copy->next = next;
+    if (failed || exact_index_add(corpus->exact_index, copy)) {
+        error(sock_fh, "corpus_add - out of memory");
+        copy->next = NULL;
+        _corpus_copy_free(corpus, copy);
+        return 1;
+    }
+    __atomic_store_n(previous ? &previous->next : &corpus->first, copy, __ATOMIC_RELEASE);
+    corpus->count++;
+    corpus->version = version;
+    return 0;
+}
+
+/*
+ * corpus_delete
+ *
+ * Mark the copy of an image, just deleted from the list, as not in the new version
+ * of the list. Snapshots of earlier versions still include it, so it is kept until
+ * the corpus is freed.
+ *
+ * Return 0 on success.
+ *        1 if a new corpus should be made: the image is not in this one, or so many
+ *          copies are deleted that a new corpus would be quicker to compare with.
+ */
+int corpus_delete(Corpus *corpus, char *external_ref, unsigned long version) {
+    PicInfo *copy;
+    int cmp = -1;
+    for (copy = corpus->first; copy && ((cmp = strcmp(copy->external_ref, external_ref)) <= 0); copy = copy->next) {
+        if ((cmp == 0) && !copy->version_deleted) {
+            break;
+        }
+    }
+    if (!copy || cmp) {
+        return 1;
+    }
+    __atomic_store_n(&copy->version_deleted, version, __ATOMIC_RELAXED);
+    corpus->count--;
+    corpus->deleted++;
+    corpus->version = version;
+    return (corpus->deleted > CORPUS_DELETED_MIN) && (corpus->deleted > corpus->count / 3);
+}
+
+/*
+ * corpus_release
+ *
+ * Release a reference to the corpus, freeing it when the last is released.
+ * Safe to call from any thread.
+ */
+void corpus_release(Corpus *corpus) {
+    if (corpus && (__atomic_sub_fetch(&corpus->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+        _corpus_free(corpus);
+    }
+}
+
+/*
+ * snapshot_pin
+ *
+ * Pin the latest version of the list in the corpus, for a compare, e.g. on the
+ * worker pool. This takes a reference to the corpus, and copies nothing.
+ * Call from the thread that changes the corpus.
+ * Compares with the snapshot must pass its version in Compare_Options.
+ *
+ * Return the snapshot, or NULL if out of memory, after reporting an error.
+ */
+Snapshot *snapshot_pin(FILE *sock_fh, Corpus *corpus) {
+    Snapshot *snapshot = (Snapshot *) calloc(1, sizeof(Snapshot));
+    if (!snapshot) {
+        error(sock_fh, "snapshot_pin - out of memory");
+        return NULL;
+    }
+    __atomic_add_fetch(&corpus->refs, 1, __ATOMIC_RELAXED);
+    snapshot->corpus = corpus;
+    snapshot->version = corpus->version;
+    snapshot->count = corpus->count;
+    snapshot->list = corpus->first;
+    snapshot->exact_index = corpus->exact_index;
+    snapshot->pivot_table = corpus->pivot_table;
+    return snapshot;
+}
+
+/*
+ * snapshot_flatten
+ *
+ * Make a snapshot whose list is just the images in this one's version, numbered
+ * by list_index, with its own exact duplicate index. For fullcompare, which works
+ * through the list in order, and numbers the images for clusters.
+ * Safe to call from any thread holding the snapshot.
+ * This takes time in proportion to the number of images.
+ *
+ * Return the snapshot, version 0, or NULL if out of memory, after reporting an error.
+ */
+Snapshot *snapshot_flatten(FILE *sock_fh, Snapshot *snapshot) {
+    Snapshot *flat = (Snapshot *) calloc(1, sizeof(Snapshot));
+    if (!flat || !(flat->flat = (PicInfo *) calloc(snapshot->count + 1, sizeof(PicInfo)))
+            || !(flat->exact_index = exact_index_create())) {
+        error(sock_fh, "snapshot_flatten - out of memory");
+        if (flat) {
+            free(flat->flat);
+            free(flat);
+        }
+        return NULL;
+    }
+    __atomic_add_fetch(&snapshot->corpus->refs, 1, __ATOMIC_RELAXED);
+    flat->corpus = snapshot->corpus;
+    flat->pivot_table = snapshot->pivot_table;
+    PicInfo *copy;
+    for (copy = snapshot->list; copy && (flat->count < snapshot->count); copy = PICINFO_NEXT(copy)) {
+        if (PICINFO_IN_VERSION(copy, snapshot->version)) {
+            PicInfo *pic = &flat->flat[flat->count];
+            *pic = *copy;
+            pic->list_index = flat->count;
+            pic->next = NULL;
+            if (flat->count++) {
+                pic[-1].next = pic;
+            }
+        }
+    }
+    if (flat->count) {
+        flat->list = flat->flat;
+    }
+    if (exact_index_build(flat->exact_index, flat->list)) {
+        error(sock_fh, "snapshot_flatten - out of memory");
+        snapshot_release(flat);
+        return NULL;
+    }
+    return flat;
+}
+
+/*
+ * snapshot_release
+ *
+ * Unpin the snapshot, releasing its reference to the corpus.
+ * Safe to call from any thread.
+ */
+void snapshot_release(Snapshot *snapshot) {
+    if (!snapshot) {
+        return;
+    }
+    if (snapshot->flat) {
+        exact_index_free(snapshot->exact_index);
+        free(snapshot->flat);
+    }
+    corpus_release(snapshot->corpus);
+    free(snapshot);
+}
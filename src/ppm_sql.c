@@ -45,6 +45,7 @@ PGconn *ppm_sql_connect(FILE *sock_fh, char *sql_info) {
     }
     if (PQstatus(psql) != CONNECTION_OK) {
         fprintf(sock_fh, "libpq error: %s", PQerrorMessage(psql));
+        PQfinish(psql);
         return NULL;
     }
     return psql;
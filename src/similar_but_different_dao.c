@@ -169,6 +169,16 @@ Similar_but_different *similar_but_different_search(
     return NULL;
 }
 
+/*
+ * Return true if the two images have been marked as 'similar but different'.
+ * The relationship is recorded on the image with the lower external_ref,
+ * but either image may be given first.
+ */
+int similar_but_different_pair(PicInfo *pic, PicInfo *other) {
+    return similar_but_different_search(pic->similar_but_different, other->external_ref)
+            || similar_but_different_search(other->similar_but_different, pic->external_ref);
+}
+
 void _picinfo_remove_all_similar_but_different(FILE *sock_fh, PicInfo *picinfo) {
         Similar_but_different *sbd_link = picinfo->similar_but_different;
         Similar_but_different *sbd_link_current = NULL;
@@ -0,0 +1,1012 @@
+/*
+ *
+ * This program is designed to test the comparison of thumbnails already in
+ * memory. It makes its own small PPMs, so needs no image files or SQL.
+ *
+ *  ./dids_compare_test
+ *
+ * 1) the exact duplicate index finds, reports and forgets identical thumbnails.
+ * 2) CompareToList skips exact duplicates already reported from the index.
+ * 3) the perceptual hash screen skips pairs with different hashes.
+ * 4) comparing coarse-to-fine gives the same matches as comparing every pixel.
+ * 5) ruling out pairs with pivots gives the same matches as comparing every pixel.
+ * 6) the compare order holds the same pixels, so gives the same error.
+ * 7) mode=all reports every match, and topk=N the N closest, closest first.
+ * 8) fullcompare since= finds the same matches for the new images as a full fullcompare.
+ * 9) a fullcompare resumed from a checkpoint finds the same matches as one run straight through.
+ * 10) the shards of a fullcompare, merged, find the same matches as one fullcompare.
+ * 11) fullcompare clusters reports the connected groups of the matches.
+ * 12) fullcompare on a worker pool, and on a snapshot after images are deleted and added, finds the same matches.
+ * 13) quickcompare_ref compares an image in the list with the others, not itself or its 'similar but different'.
+ * 14) with deadline_ms, compares stop once it passes, the closest images compared first.
+ * 15) the worker pool runs interactive tasks before batch tasks, and refuses tasks when too many wait.
+ * 16) a snapshot keeps the images of its version while images are deleted and added.
+ * 17) add_compare reports an exact duplicate once, and not the image itself, from a snapshot before the add.
+ * 18) a reader process sees the images shared in a file, and the adds and dels to them.
+ * 19) a cancelled fullcompare compares nothing.
+ * 20) thumbnails and matches sent as frames arrive as they were.
+ * 21) the journal's adds and dels are applied, in order, to the images loaded from SQL.
+ *
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#define COMPARE_SIZE  16
+#define COMPARE_TRESHOLD 50000
+
+// Standard
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+
+// Custom
+#include "../src/dids.h"
+
+int error_count = 0;
+
+// Make a thumbnail, filled with a pattern depending on seed.
+PPM_Info *make_ppm(int seed) {
+    PPM_Info *ppm = ppm_info_allocate(COMPARE_SIZE, COMPARE_SIZE);
+    if (!ppm) {
+        printf("ERROR: ppm_info_allocate - Failed. Quitting\n");
+        exit(1);
+    }
+    int i;
+    for (i = 0; i < 3 * COMPARE_SIZE * COMPARE_SIZE; i++) {
+        ppm->data[i] = (unsigned char) (i * seed + seed);
+    }
+    return ppm;
+}
+
+// Make a thumbnail like the one for seed, with some noise added.
+PPM_Info *make_noisy_ppm(int seed, int noise) {
+    PPM_Info *ppm = make_ppm(seed);
+    int i;
+    for (i = 0; i < 3 * COMPARE_SIZE * COMPARE_SIZE; i++) {
+        int value = ppm->data[i] + (rand() % (2 * noise + 1)) - noise;
+        ppm->data[i] = value < 0 ? 0 : (value > 255 ? 255 : value);
+    }
+    return ppm;
+}
+
+// Return everything written to fh, which the caller must free. fh is closed.
+char *read_all(FILE *fh) {
+    fflush(fh);
+    long length = ftell(fh);
+    char *output = calloc(length + 1, 1);
+    rewind(fh);
+    if (fread(output, 1, length, fh) != (size_t) length) {
+        printf("ERROR: fread - Failed. Quitting\n");
+        exit(1);
+    }
+    fclose(fh);
+    return output;
+}
+
+// Return everything written to fh since it was last rewound, until the next call. fh is left as it was.
+char *read_lines(FILE *fh) {
+    static char lines[65536];
+    fflush(fh);
+    long length = ftell(fh);
+    rewind(fh);
+    if ((size_t) length >= sizeof lines) {
+        length = sizeof lines - 1;
+    }
+    lines[fread(lines, 1, length, fh)] = 0;
+    return lines;
+}
+
+// Compare every image in the list to those after it, as fullcompare does.
+// Return the output, which the caller must free.
+char *compare_all(PicInfo *list, Compare_Stats *stats, Pivot_Table *pivot_table) {
+    FILE *fh = tmpfile();
+    Compare_Options options;
+    compare_options_init(&options);
+    options.stats = stats;
+    options.pivot_table = pivot_table;
+    PicInfo *pic;
+    for (pic = list; pic && pic->next; pic = pic->next) {
+        CompareToList(fh, pic, pic->next, COMPARE_TRESHOLD, &options);
+    }
+    return read_all(fh);
+}
+
+// Count the "Match:" lines written to fh since it was last rewound.
+int count_matches(FILE *fh) {
+    char line[256];
+    int match_count = 0;
+    fflush(fh);
+    rewind(fh);
+    while (fgets(line, sizeof line, fh)) {
+        if (strncmp(line, "Match: ", 7) == 0) {
+            match_count++;
+        }
+    }
+    rewind(fh);
+    if (ftruncate(fileno(fh), 0)) {
+        printf("ERROR: ftruncate - Failed. Quitting\n");
+        exit(1);
+    }
+    return match_count;
+}
+
+static int _line_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// Run fullcompare, and return its matches one per line, lower external_ref first, sorted.
+// Only matches with an external_ref containing only_with are kept, if not NULL.
+// The caller must free the result.
+char *fullcompare_matches(PicInfo *list, Compare_Options *options, char *only_with) {
+    FILE *fh = tmpfile();
+    if (fullcompare(fh, list, COMPARE_TRESHOLD, 1, options)) {
+        printf("ERROR: fullcompare - Failed. Quitting\n");
+        exit(1);
+    }
+    rewind(fh);
+    char *lines[4096];
+    int line_count = 0;
+    char line[256];
+    while (fgets(line, sizeof line, fh) && (line_count < 4096)) {
+        char ref_1[100], ref_2[100];
+        unsigned int err;
+        if ((sscanf(line, "Match: %99[^,], %99[^,], %u", ref_1, ref_2, &err) != 3)
+                || (only_with && !strstr(ref_1, only_with) && !strstr(ref_2, only_with))) {
+            continue;
+        }
+        lines[line_count] = malloc(256);
+        int lower_first = strcmp(ref_1, ref_2) < 0;
+        snprintf(lines[line_count++], 256, "%s %s %u\n", lower_first ? ref_1 : ref_2, lower_first ? ref_2 : ref_1,
+                err);
+    }
+    fclose(fh);
+    qsort(lines, line_count, sizeof(char *), _line_cmp);
+    char *matches = calloc(line_count * 256 + 1, 1);
+    int i;
+    for (i = 0; i < line_count; i++) {
+        strcat(matches, lines[i]);
+        free(lines[i]);
+    }
+    return matches;
+}
+
+// Tasks for the worker pool: each adds its letter to pool_order, and 'w' first waits for pool_release.
+char pool_order[8];
+int pool_order_length = 0;
+int pool_release = 0;
+
+void *pool_order_task(void *arg) {
+    char letter = *(char *) arg;
+    while ((letter == 'w') && !__atomic_load_n(&pool_release, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    pool_order[__atomic_fetch_add(&pool_order_length, 1, __ATOMIC_ACQ_REL)] = letter;
+    return NULL;
+}
+
+void expect(char *what, long expected, long actual) {
+    if (expected != actual) {
+        error_count++;
+        printf("ERROR: %s - Expected %ld, but got %ld\n", what, expected, actual);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    printf("INFO: Start test\n");
+    FILE *sock_fh = tmpfile();
+    if (!sock_fh) {
+        printf("ERROR: tmpfile - Failed. Quitting\n");
+        exit(1);
+    }
+
+    // ref_a and ref_b are exact duplicates, ref_c is different.
+    PicInfo *list = NULL;
+    PicInfo *ref_a = PicInfoBuild("ref_a", make_ppm(3), NULL);
+    PicInfo *ref_b = PicInfoBuild("ref_b", make_ppm(3), NULL);
+    PicInfo *ref_c = PicInfoBuild("ref_c", make_ppm(5), NULL);
+    if (!ref_a || !ref_b || !ref_c) {
+        printf("ERROR: PicInfoBuild - Failed. Quitting\n");
+        exit(1);
+    }
+    PicInfoAddToList(sock_fh, &list, ref_a);
+    PicInfoAddToList(sock_fh, &list, ref_b);
+    PicInfoAddToList(sock_fh, &list, ref_c);
+    count_matches(sock_fh);
+
+    expect("pixel_hash of duplicates", 1, ref_a->pixel_hash == ref_b->pixel_hash);
+    expect("picinfo_exact_duplicate a, b", 1, picinfo_exact_duplicate(ref_a, ref_b));
+    expect("picinfo_exact_duplicate a, c", 0, picinfo_exact_duplicate(ref_a, ref_c));
+
+    Exact_Index *index = exact_index_create();
+    if (!index || exact_index_build(index, list)) {
+        printf("ERROR: exact_index_build - Failed. Quitting\n");
+        exit(1);
+    }
+    expect("exact_index_build entry_count", 3, index->entry_count);
+
+    // Each pair of exact duplicates is reported once.
+    expect("exact_index_report_groups", 1, exact_index_report_groups(sock_fh, index, list, 0, NULL));
+    expect("exact_index_report_groups output", 1, count_matches(sock_fh));
+
+    // A new image identical to ref_a matches both ref_a and ref_b.
+    PicInfo *query = PicInfoBuild("ref_query", make_ppm(3), NULL);
+    expect("exact_index_report", 2, exact_index_report(sock_fh, index, query, NULL));
+    count_matches(sock_fh);
+
+    // Without the index, CompareToList finds the duplicates itself.
+    CompareToList(sock_fh, query, list, COMPARE_TRESHOLD, NULL);
+    expect("CompareToList without index", 2, count_matches(sock_fh));
+
+    // With the index, they have already been reported so are skipped.
+    Compare_Options options;
+    compare_options_init(&options);
+    options.exact_index = index;
+    CompareToList(sock_fh, query, list, COMPARE_TRESHOLD, &options);
+    expect("CompareToList with index", 0, count_matches(sock_fh));
+
+    // An image in the list is compared with the others by external_ref, not with itself.
+    expect("quickcompare_ref", 0, quickcompare_ref(sock_fh, list, COMPARE_TRESHOLD, "ref_a", &options));
+    expect("quickcompare_ref matches", 1, strstr(read_lines(sock_fh), "Match: ref_a, ref_b, 0") != NULL);
+    expect("quickcompare_ref match count", 1, count_matches(sock_fh));
+    expect("quickcompare_ref not in list", 1, quickcompare_ref(sock_fh, list, COMPARE_TRESHOLD, "ref_x", &options));
+    count_matches(sock_fh);
+    // Nor with images it is similar but different to, from the index or comparing pixels.
+    Similar_but_different sbd_b = { "ref_b", NULL };
+    ref_a->similar_but_different = &sbd_b;
+    quickcompare_ref(sock_fh, list, COMPARE_TRESHOLD, "ref_a", &options);
+    expect("quickcompare_ref similar but different", 0, count_matches(sock_fh));
+    quickcompare_ref(sock_fh, list, COMPARE_TRESHOLD, "ref_a", NULL);
+    expect("quickcompare_ref similar but different, without index", 0, count_matches(sock_fh));
+    // The pair is stored on ref_a only, so is also ignored comparing the other way.
+    quickcompare_ref(sock_fh, list, COMPARE_TRESHOLD, "ref_b", NULL);
+    expect("quickcompare_ref similar but different, higher ref", 0, count_matches(sock_fh));
+    ref_a->similar_but_different = NULL;
+
+    // The perceptual hash screen keeps identical images, and skips different ones.
+    compare_options_init(&options);
+    options.phash_max_distance = 0;
+    expect("PHASH_DISTANCE of duplicates", 0, PHASH_DISTANCE(query->phash, ref_a->phash));
+    expect("PHASH_DISTANCE of different", 1, PHASH_DISTANCE(query->phash, ref_c->phash) > 0);
+    CompareToList(sock_fh, query, list, UINT_MAX, &options);
+    expect("CompareToList with phash screen", 2, count_matches(sock_fh));
+
+    // Coarse-to-fine must give the same matches, so compare with and without levels.
+    PicInfo *noisy_list = NULL;
+    int n;
+    srand(1);
+    for (n = 0; n < 60; n++) {
+        char external_ref[32];
+        sprintf(external_ref, "noisy_%02d", n);
+        PicInfoAddToList(sock_fh, &noisy_list, PicInfoBuild(external_ref, make_noisy_ppm(n % 6, n % 20), NULL));
+    }
+    count_matches(sock_fh);
+    Compare_Stats stats_levels = { 0 };
+    Compare_Stats stats_pixels = { 0 };
+    char *output_levels = compare_all(noisy_list, &stats_levels, NULL);
+    PicInfo *pic;
+    for (pic = noisy_list; pic; pic = pic->next) {
+        pic->levels.cell_pixels_4 = 0;
+    }
+    char *output_pixels = compare_all(noisy_list, &stats_pixels, NULL);
+    expect("coarse-to-fine output same as every pixel", 0, strcmp(output_levels, output_pixels));
+    expect("coarse-to-fine pairs", stats_pixels.pairs, stats_levels.pairs);
+    expect("coarse-to-fine rejected some pairs", 1,
+            stats_levels.level_4_rejected + stats_levels.level_8_rejected > 0);
+    expect("coarse-to-fine found some matches", 1, strstr(output_levels, "Match: ") != NULL);
+
+    // Compare order gives the same error, and reads fewer bytes before giving up.
+    unsigned long long bytes_raster = 0;
+    unsigned long long bytes_ordered = 0;
+    int order_mismatch = 0;
+    PicInfo *other;
+    for (pic = noisy_list; pic; pic = pic->next) {
+        for (other = pic->next; other; other = other->next) {
+            int length = 3 * COMPARE_SIZE * COMPARE_SIZE;
+            if (ppm_data_compare(pic->compare_data, other->compare_data, length, length, UINT_MAX, NULL)
+                    != PPM_compare(sock_fh, pic->picinf, other->picinf, UINT_MAX)) {
+                order_mismatch++;
+            }
+            ppm_data_compare(pic->picinf->data, other->picinf->data, length, 3 * COMPARE_SIZE,
+                    COMPARE_TRESHOLD, &bytes_raster);
+            ppm_data_compare(pic->compare_data, other->compare_data, length, COMPARE_CHECKPOINT_BYTES,
+                    COMPARE_TRESHOLD, &bytes_ordered);
+        }
+    }
+    expect("compare order error same as raster order", 0, order_mismatch);
+    expect("compare order reads fewer bytes", 1, bytes_ordered < bytes_raster);
+
+    // Pivots must also give the same matches.
+    Pivot_Table *pivot_table = pivot_table_create();
+    if (!pivot_table || pivot_table_build(sock_fh, pivot_table, noisy_list, 4)) {
+        printf("ERROR: pivot_table_build - Failed. Quitting\n");
+        exit(1);
+    }
+    expect("pivot_table_build count", 4, pivot_table->count);
+    Compare_Stats stats_pivots = { 0 };
+    char *output_pivots = compare_all(noisy_list, &stats_pivots, pivot_table);
+    expect("pivots output same as every pixel", 0, strcmp(output_pivots, output_pixels));
+    expect("pivots rejected some pairs", 1, stats_pivots.pivot_rejected > 0);
+    pivot_table_free(pivot_table);
+    free(output_pivots);
+    free(output_levels);
+    free(output_pixels);
+
+    // mode=all reports at least the matches mode=best does, topk=N at most N, closest first.
+    PicInfo *noisy_query = PicInfoBuild("noisy_query", make_noisy_ppm(2, 10), NULL);
+    CompareToList(sock_fh, noisy_query, noisy_list, COMPARE_TRESHOLD, NULL);
+    int best_count = count_matches(sock_fh);
+    compare_options_init(&options);
+    expect("compare_options_parse mode=all", 0, compare_options_parse(sock_fh, &options, "mode=all"));
+    CompareToList(sock_fh, noisy_query, noisy_list, COMPARE_TRESHOLD, &options);
+    int all_count = count_matches(sock_fh);
+    expect("mode=all reports more than mode=best", 1, all_count > best_count);
+    expect("compare_options_parse topk=3", 0, compare_options_parse(sock_fh, &options, "topk=3"));
+    CompareToList(sock_fh, noisy_query, noisy_list, COMPARE_TRESHOLD, &options);
+    fflush(sock_fh);
+    rewind(sock_fh);
+    char line[256];
+    unsigned int err_last = 0;
+    int topk_count = 0;
+    int topk_order_errors = 0;
+    while (fgets(line, sizeof line, sock_fh)) {
+        char *err_text = strrchr(line, ',');
+        if ((strncmp(line, "Match: ", 7) == 0) && err_text) {
+            unsigned int err = strtoul(err_text + 1, NULL, 10);
+            if (err < err_last) {
+                topk_order_errors++;
+            }
+            err_last = err;
+            topk_count++;
+        }
+    }
+    count_matches(sock_fh);
+    expect("topk=3 count", all_count < 3 ? all_count : 3, topk_count);
+    expect("topk=3 closest first", 0, topk_order_errors);
+    // fullcompare topk=N compares each image with those before it too, so a similar but different pair stored
+    // on the lower external_ref is still ignored.
+    ref_a->similar_but_different = &sbd_b;
+    char *matches_sbd = fullcompare_matches(list, &options, NULL);
+    expect("fullcompare topk=3 similar but different", 0, strlen(matches_sbd));
+    free(matches_sbd);
+    ref_a->similar_but_different = NULL;
+    expect("compare_options_parse topk=0", 2, compare_options_parse(sock_fh, &options, "topk=0"));
+    expect("compare_options_parse mode=worst", 2, compare_options_parse(sock_fh, &options, "mode=worst"));
+    expect("compare_options_parse not an option", 1, compare_options_parse(sock_fh, &options, "ref_a"));
+
+    // With a deadline not reached, the same matches, compared in another order.
+    compare_options_init(&options);
+    Compare_Stats stats_deadline = { 0 };
+    options.stats = &stats_deadline;
+    options.mode = COMPARE_MODE_ALL;
+    expect("compare_options_parse deadline_ms=60000", 0, compare_options_parse(sock_fh, &options, "deadline_ms=60000"));
+    CompareToList(sock_fh, noisy_query, noisy_list, COMPARE_TRESHOLD, &options);
+    expect("deadline report", 1, strstr(read_lines(sock_fh), "reached=0 examined=60 candidates=60 ") != NULL);
+    expect("deadline not reached, all matches", all_count, count_matches(sock_fh));
+    // Once the deadline has passed, nothing more is compared.
+    options.deadline.tv_sec = 0;
+    CompareToList(sock_fh, noisy_query, noisy_list, COMPARE_TRESHOLD, &options);
+    expect("deadline passed report", 1, strstr(read_lines(sock_fh), "reached=1 examined=0 candidates=60 ") != NULL);
+    expect("deadline passed, no matches", 0, count_matches(sock_fh));
+    expect("deadline_skipped", 60, stats_deadline.deadline_skipped);
+    expect("fullcompare with deadline_ms", 2, fullcompare(sock_fh, noisy_list, COMPARE_TRESHOLD, 1, &options));
+    count_matches(sock_fh);
+    expect("compare_options_parse deadline_ms=0", 2, compare_options_parse(sock_fh, &options, "deadline_ms=0"));
+    // With a deadline reached part way, the closest image was still found, as it was compared first.
+    // The deadline is a little later each time, until it is reached after some, but not all, images.
+    PicInfo *closest = CompareToList(sock_fh, noisy_query, noisy_list, COMPARE_TRESHOLD, NULL);
+    count_matches(sock_fh);
+    compare_options_init(&options);
+    options.deadline_ms = 1;
+    long deadline_ns;
+    int deadline_part_way = 0;
+    for (deadline_ns = 1000; (deadline_ns < 10000000) && !deadline_part_way; deadline_ns += deadline_ns / 4) {
+        clock_gettime(CLOCK_MONOTONIC, &options.deadline);
+        options.deadline.tv_nsec += deadline_ns;
+        if (options.deadline.tv_nsec >= 1000000000) {
+            options.deadline.tv_sec++;
+            options.deadline.tv_nsec -= 1000000000;
+        }
+        PicInfo *closest_part_way = CompareToList(sock_fh, noisy_query, noisy_list, COMPARE_TRESHOLD, &options);
+        char *report = strstr(read_lines(sock_fh), "quickcompare_deadline: ");
+        unsigned long examined = 0;
+        if (report && (sscanf(report, "quickcompare_deadline: deadline_ms=1 reached=1 examined=%lu", &examined) == 1)
+                && (examined > 0)) {
+            deadline_part_way = 1;
+            expect("deadline part way, closest compared first", 1, closest_part_way == closest);
+        }
+        count_matches(sock_fh);
+    }
+    expect("deadline reached part way", 1, deadline_part_way);
+    PicInfoDelete(noisy_query);
+
+    // fullcompare since= compares the new images, here noisy_?7 created later, with all the others.
+    for (pic = noisy_list; pic; pic = pic->next) {
+        pic->created = (pic->external_ref[strlen(pic->external_ref) - 1] == '7') ? 2000 : 1000;
+    }
+    compare_options_init(&options);
+    options.mode = COMPARE_MODE_ALL;
+    char *matches_all = fullcompare_matches(noisy_list, &options, "7");
+    Compare_Stats stats_since = { 0 };
+    options.stats = &stats_since;
+    expect("compare_options_parse since=2000", 0, compare_options_parse(sock_fh, &options, "since=2000"));
+    char *matches_since = fullcompare_matches(noisy_list, &options, NULL);
+    expect("fullcompare since= same matches for new images", 0, strcmp(matches_all, matches_since));
+    expect("fullcompare since= found some matches", 1, strlen(matches_since) > 0);
+    // 6 new images, each compared with the 59 others, less the 15 pairs of new images compared twice.
+    expect("fullcompare since= pairs", 6 * 59 - 15, stats_since.pairs);
+    expect("fullcompare_pairs since=", 6 * 59 - 15, (long) fullcompare_pairs(noisy_list, &options));
+    expect("compare_options_parse since=soon", 2, compare_options_parse(sock_fh, &options, "since=soon"));
+    free(matches_all);
+    free(matches_since);
+    for (pic = noisy_list; pic; pic = pic->next) {
+        pic->created = 1000;
+    }
+    // Nor are the new images reported with those they are similar but different to, here the pair stored on
+    // the lower external_ref, near_a, and only near_b new. They are close, but not exact duplicates.
+    PicInfo *near_list = NULL;
+    PicInfo *near_a = PicInfoBuild("near_a", make_noisy_ppm(1, 5), NULL);
+    PicInfo *near_b = PicInfoBuild("near_b", make_noisy_ppm(1, 5), NULL);
+    PicInfoAddToList(sock_fh, &near_list, near_a);
+    PicInfoAddToList(sock_fh, &near_list, near_b);
+    count_matches(sock_fh);
+    near_a->created = 1000;
+    near_b->created = 2000;
+    matches_since = fullcompare_matches(near_list, &options, NULL);
+    expect("fullcompare since= near pair", 0, strncmp(matches_since, "near_a near_b ", 14));
+    free(matches_since);
+    Similar_but_different sbd_near_b = { "near_b", NULL };
+    near_a->similar_but_different = &sbd_near_b;
+    matches_since = fullcompare_matches(near_list, &options, NULL);
+    expect("fullcompare since= similar but different", 0, strlen(matches_since));
+    free(matches_since);
+    near_a->similar_but_different = NULL;
+    while (near_list) {
+        PicInfoDeleteFromList(&near_list, near_list->external_ref);
+    }
+
+    // Write a checkpoint as a fullcompare would, stopped part way through writing unit 30.
+    compare_options_init(&options);
+    options.mode = COMPARE_MODE_ALL;
+    char *matches_straight = fullcompare_matches(noisy_list, &options, NULL);
+    char checkpoint_id[CHECKPOINT_ID_MAX];
+    char checkpoint_filename[256];
+    snprintf(checkpoint_id, sizeof checkpoint_id, "test_%d", (int) getpid());
+    snprintf(checkpoint_filename, sizeof checkpoint_filename, CHECKPOINT_FILE_TEMPLATE, checkpoint_id);
+    Checkpoint *checkpoint = checkpoint_open(sock_fh, checkpoint_id,
+            checkpoint_fingerprint(noisy_list, COMPARE_TRESHOLD, &options), 60, 0);
+    if (!checkpoint) {
+        printf("ERROR: checkpoint_open - Failed. Quitting\n");
+        exit(1);
+    }
+    unsigned long unit;
+    for (pic = noisy_list, unit = 0; unit < 30; pic = pic->next, unit++) {
+        char *unit_output = NULL;
+        size_t unit_output_length = 0;
+        FILE *unit_fh = open_memstream(&unit_output, &unit_output_length);
+        CompareToList(unit_fh, pic, pic->next, COMPARE_TRESHOLD, &options);
+        fclose(unit_fh);
+        checkpoint_unit(checkpoint, sock_fh, unit, unit_output, unit_output_length);
+        free(unit_output);
+    }
+    fprintf(checkpoint->fh, "unit 30 2\nMatch: noisy_30, noisy_31, 1\n");
+    checkpoint_close(checkpoint, 0);
+    count_matches(sock_fh);
+
+    // Different options would report different matches, so can't resume.
+    Compare_Options options_changed = options;
+    options_changed.mode = COMPARE_MODE_BEST;
+    strcpy(options_changed.checkpoint_id, checkpoint_id);
+    options_changed.resume = 1;
+    expect("fullcompare resume with changed options", 3,
+            fullcompare(sock_fh, noisy_list, COMPARE_TRESHOLD, 1, &options_changed));
+    count_matches(sock_fh);
+
+    // Resume reports the 30 units done again, then does the rest.
+    char resume_word[64];
+    snprintf(resume_word, sizeof resume_word, "resume=%s", checkpoint_id);
+    expect("compare_options_parse resume=", 0, compare_options_parse(sock_fh, &options, resume_word));
+    expect("compare_options_parse resume=../", 2, compare_options_parse(sock_fh, &options, "resume=../x"));
+    Compare_Stats stats_resumed = { 0 };
+    options.stats = &stats_resumed;
+    char *matches_resumed = fullcompare_matches(noisy_list, &options, NULL);
+    expect("fullcompare resumed same matches", 0, strcmp(matches_straight, matches_resumed));
+    // Units 30 to 59 compare 29, 28, ... 0 pairs.
+    expect("fullcompare resumed pairs", 29 * 30 / 2, stats_resumed.pairs);
+    expect("checkpoint removed when done", -1, access(checkpoint_filename, F_OK));
+    free(matches_straight);
+    free(matches_resumed);
+
+    // A unit with a line longer than BUFFER_SIZE, e.g. a large group, is replayed whole.
+    checkpoint = checkpoint_open(sock_fh, checkpoint_id, 1, 3, 0);
+    if (!checkpoint) {
+        printf("ERROR: checkpoint_open - Failed. Quitting\n");
+        exit(1);
+    }
+    char long_line[3 * BUFFER_SIZE];
+    memset(long_line, 'g', sizeof long_line - 2);
+    long_line[sizeof long_line - 2] = '\n';
+    long_line[sizeof long_line - 1] = 0;
+    checkpoint_unit(checkpoint, sock_fh, 0, long_line, strlen(long_line));
+    checkpoint_unit(checkpoint, sock_fh, 1, "Match: noisy_01, noisy_02, 1\n", 29);
+    checkpoint_close(checkpoint, 0);
+    count_matches(sock_fh);
+    checkpoint = checkpoint_open(sock_fh, checkpoint_id, 1, 3, 1);
+    expect("checkpoint long line resumed", 1, checkpoint != NULL);
+    if (checkpoint) {
+        expect("checkpoint long line units done", 2, checkpoint->units_done_count);
+        expect("checkpoint long line replayed", 1, strstr(read_lines(sock_fh), long_line) != NULL);
+        expect("checkpoint long line matches", 1, count_matches(sock_fh));
+        checkpoint_close(checkpoint, 1);
+    }
+
+    // The shards of a fullcompare, merged, are the same as one fullcompare.
+    int shard_count;
+    for (shard_count = 3; shard_count <= 7; shard_count += 4) {
+        compare_options_init(&options);
+        Compare_Stats stats_single = { 0 };
+        options.stats = &stats_single;
+        FILE *single_fh = tmpfile();
+        fullcompare(single_fh, noisy_list, COMPARE_TRESHOLD, 2, &options);
+        rewind(single_fh);
+        FILE *shard_fhs[7];
+        Compare_Stats stats_shards = { 0 };
+        unsigned long long shard_pairs_max = 0;
+        int shard;
+        for (shard = 0; shard < shard_count; shard++) {
+            char shard_word[32];
+            snprintf(shard_word, sizeof shard_word, "shard=%d/%d", shard, shard_count);
+            expect("compare_options_parse shard=", 0, compare_options_parse(sock_fh, &options, shard_word));
+            Compare_Stats stats_shard = { 0 };
+            options.stats = &stats_shard;
+            shard_fhs[shard] = tmpfile();
+            fullcompare(shard_fhs[shard], noisy_list, COMPARE_TRESHOLD, 2, &options);
+            rewind(shard_fhs[shard]);
+            compare_stats_add(&stats_shards, &stats_shard);
+            expect("fullcompare_pairs shard=", stats_shard.pairs, (long) fullcompare_pairs(noisy_list, &options));
+            if (stats_shard.pairs > shard_pairs_max) {
+                shard_pairs_max = stats_shard.pairs;
+            }
+        }
+        FILE *merged_single_fh = tmpfile();
+        FILE *merged_shards_fh = tmpfile();
+        long match_count = match_merge(sock_fh, merged_single_fh, &single_fh, 1);
+        expect("match_merge shards count", match_count,
+                match_merge(sock_fh, merged_shards_fh, shard_fhs, shard_count));
+        expect("match_merge found some matches", 1, match_count > 0);
+        char *merged_single = read_all(merged_single_fh);
+        char *merged_shards = read_all(merged_shards_fh);
+        expect("shards merged same as fullcompare", 0, strcmp(merged_single, merged_shards));
+        expect("shards compare every pair once", stats_single.pairs, stats_shards.pairs);
+        // Units are whole, so a shard may have up to one unit (59 pairs) more than its share.
+        expect("shards about the same work", 1, shard_pairs_max <= stats_single.pairs / shard_count + 59);
+        free(merged_single);
+        free(merged_shards);
+        fclose(single_fh);
+        for (shard = 0; shard < shard_count; shard++) {
+            fclose(shard_fhs[shard]);
+        }
+    }
+    expect("compare_options_parse shard=4/4", 2, compare_options_parse(sock_fh, &options, "shard=4/4"));
+    expect("compare_options_parse shard=1/2x", 2, compare_options_parse(sock_fh, &options, "shard=1/2x"));
+
+    // Clusters are the groups of images joined by the matches, here labelled the slow way.
+    compare_options_init(&options);
+    options.mode = COMPARE_MODE_ALL;
+    FILE *pairs_fh = tmpfile();
+    fullcompare(pairs_fh, noisy_list, COMPARE_TRESHOLD, 4, &options);
+    int label[60];
+    unsigned int label_err_min[60], label_err_max[60];
+    int label_size[60] = { 0 };
+    int changed = 1;
+    for (n = 0; n < 60; n++) {
+        label[n] = n;
+        label_err_min[n] = UINT_MAX;
+        label_err_max[n] = 0;
+    }
+    while (changed) {
+        changed = 0;
+        rewind(pairs_fh);
+        char line[256];
+        int image_1, image_2;
+        unsigned int err;
+        while (fgets(line, sizeof line, pairs_fh)) {
+            if ((sscanf(line, "Match: noisy_%d, noisy_%d, %u", &image_1, &image_2, &err) == 3)
+                    && (label[image_1] != label[image_2])) {
+                label[image_1] = label[image_2] = label[image_1] < label[image_2] ? label[image_1] : label[image_2];
+                changed = 1;
+            }
+        }
+    }
+    rewind(pairs_fh);
+    int image_1, image_2;
+    unsigned int err;
+    while (fgets(line, sizeof line, pairs_fh)) {
+        if (sscanf(line, "Match: noisy_%d, noisy_%d, %u", &image_1, &image_2, &err) == 3) {
+            int root = label[image_1];
+            label_err_min[root] = err < label_err_min[root] ? err : label_err_min[root];
+            label_err_max[root] = err > label_err_max[root] ? err : label_err_max[root];
+        }
+    }
+    fclose(pairs_fh);
+    int label_groups = 0;
+    for (n = 0; n < 60; n++) {
+        if (label_size[label[n]]++ == 1) {
+            label_groups++;
+        }
+    }
+
+    expect("compare_options_parse clusters", 0, compare_options_parse(sock_fh, &options, "clusters"));
+    FILE *clusters_fh = tmpfile();
+    fullcompare(clusters_fh, noisy_list, COMPARE_TRESHOLD, 4, &options);
+    rewind(clusters_fh);
+    int group_count = 0;
+    int group_errors = 0;
+    while (fgets(line, sizeof line, clusters_fh)) {
+        int size, offset;
+        unsigned int err_min, err_max;
+        if (sscanf(line, "Group: %d, %u, %u%n", &size, &err_min, &err_max, &offset) != 3) {
+            continue;
+        }
+        group_count++;
+        int members = 0;
+        int root = -1;
+        char *member;
+        for (member = strstr(line + offset, "noisy_"); member; member = strstr(member + 1, "noisy_")) {
+            int image = atoi(member + 6);
+            root = (root < 0) ? label[image] : root;
+            group_errors += label[image] != root;
+            members++;
+        }
+        group_errors += (members != size) || (root < 0) || (label_size[root] != size)
+                || (label_err_min[root] != err_min) || (label_err_max[root] != err_max);
+    }
+    char *clusters_output = read_all(clusters_fh);
+    expect("clusters found some groups", 1, group_count > 0);
+    expect("clusters group count", label_groups, group_count);
+    expect("clusters groups are the labelled groups", 0, group_errors);
+    clusters_fh = tmpfile();
+    fullcompare(clusters_fh, noisy_list, COMPARE_TRESHOLD, 4, &options);
+    char *clusters_again = read_all(clusters_fh);
+    expect("clusters same on every run", 0, strcmp(strstr(clusters_output, "Group: "), strstr(clusters_again, "Group: ")));
+    free(clusters_output);
+    free(clusters_again);
+
+    // The same matches from the threads of a worker pool.
+    compare_options_init(&options);
+    options.mode = COMPARE_MODE_ALL;
+    char *matches_threads = fullcompare_matches(noisy_list, &options, NULL);
+    Worker_Pool *pool = worker_pool_create(sock_fh, 3);
+    expect("worker_pool_create", 1, pool != NULL);
+    options.worker_pool = pool;
+    char *matches_pool = fullcompare_matches(noisy_list, &options, NULL);
+    expect("worker pool same as threads", 0, strcmp(matches_threads, matches_pool));
+    expect("worker pool ran the tasks asked for", 1, pool->tasks_run);
+    FILE *pool_fh = tmpfile();
+    expect("fullcompare on the pool", 0, fullcompare(pool_fh, noisy_list, COMPARE_TRESHOLD, 8, &options));
+    expect("worker pool ran a task for each thread at most", 1 + 3, pool->tasks_run);
+    fclose(pool_fh);
+
+    // Interactive tasks are run before batch tasks queued earlier, and refused when too many are waiting.
+    Worker_Pool *ordered_pool = worker_pool_create(sock_fh, 1);
+    worker_pool_limit(ordered_pool, POOL_CLASS_INTERACTIVE, 0, 1);
+    expect("worker_pool_submit wait", 0,
+            worker_pool_submit(ordered_pool, POOL_CLASS_INTERACTIVE, pool_order_task, "w", NULL));
+    while (!__atomic_load_n(&ordered_pool->busy, __ATOMIC_ACQUIRE)) {
+        usleep(1000);
+    }
+    expect("worker_pool_submit batch", 0,
+            worker_pool_submit(ordered_pool, POOL_CLASS_BATCH, pool_order_task, "b", NULL));
+    expect("worker_pool_submit interactive", 0,
+            worker_pool_submit(ordered_pool, POOL_CLASS_INTERACTIVE, pool_order_task, "i", NULL));
+    expect("worker_pool_submit refused", 2,
+            worker_pool_submit(ordered_pool, POOL_CLASS_INTERACTIVE, pool_order_task, "x", NULL));
+    __atomic_store_n(&pool_release, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&pool_order_length, __ATOMIC_ACQUIRE) < 3) {
+        usleep(1000);
+    }
+    expect("worker pool interactive first", 0, strncmp("wib", pool_order, 3));
+    expect("worker pool refused count", 1, ordered_pool->classes[POOL_CLASS_INTERACTIVE].refused);
+    worker_pool_free(ordered_pool);
+
+    // A snapshot is not changed by deleting and adding images, which are freed with the corpus.
+    Corpus *corpus = corpus_create(sock_fh, noisy_list, NULL, 1);
+    expect("corpus_create", 1, corpus != NULL);
+    expect("corpus count", 60, corpus->count);
+    expect("corpus holds the images", 2, noisy_list->refs);
+    Snapshot *snapshot = snapshot_pin(sock_fh, corpus);
+    unsigned long version = 1;
+    for (n = 0; n < 60; n += 3) {
+        char external_ref[32];
+        sprintf(external_ref, "noisy_%02d", n);
+        PicInfoDeleteFromList(&noisy_list, external_ref);
+        expect("corpus_delete", 0, corpus_delete(corpus, external_ref, ++version));
+    }
+    PicInfo *noisy_added = PicInfoBuild("noisy_60", make_noisy_ppm(0, 10), NULL);
+    PicInfoAddToList(sock_fh, &noisy_list, noisy_added);
+    expect("corpus_add", 0, corpus_add(sock_fh, corpus, noisy_added, ++version));
+    expect("corpus_add already added", 2, corpus_add(sock_fh, corpus, noisy_added, version));
+    expect("corpus count after changes", 41, corpus->count);
+    expect("corpus deleted", 20, corpus->deleted);
+    Snapshot *snapshot_after = snapshot_pin(sock_fh, corpus);
+    expect("snapshot_pin version", version, snapshot_after->version);
+    expect("snapshot pinned", 3, corpus->refs);
+
+    // Each version compares with its own images, from the same copies.
+    Compare_Options version_options;
+    compare_options_init(&version_options);
+    version_options.mode = COMPARE_MODE_ALL;
+    PicInfo *version_query = PicInfoBuild("noisy_query", make_noisy_ppm(0, 10), NULL);
+    FILE *version_fh = tmpfile();
+    version_options.version = snapshot->version;
+    CompareToList(version_fh, version_query, snapshot->list, COMPARE_TRESHOLD, &version_options);
+    int matches_before = count_matches(version_fh);
+    version_options.version = snapshot_after->version;
+    CompareToList(version_fh, version_query, snapshot_after->list, COMPARE_TRESHOLD, &version_options);
+    int matches_after = count_matches(version_fh);
+    version_options.version = 0;
+    CompareToList(version_fh, version_query, noisy_list, COMPARE_TRESHOLD, &version_options);
+    expect("snapshot compares as the list after", count_matches(version_fh), matches_after);
+    expect("snapshot compares with the deleted images", 1, matches_before > matches_after);
+    fclose(version_fh);
+    PicInfoDelete(version_query);
+
+    Snapshot *flat = snapshot_flatten(sock_fh, snapshot);
+    expect("snapshot_flatten", 1, flat != NULL);
+    expect("snapshot_flatten count", 60, flat->count);
+    char *matches_snapshot = fullcompare_matches(flat->list, &options, NULL);
+    expect("snapshot same as before the changes", 0, strcmp(matches_threads, matches_snapshot));
+    Snapshot *flat_after = snapshot_flatten(sock_fh, snapshot_after);
+    expect("snapshot_flatten count after changes", 41, flat_after->count);
+    char *matches_list = fullcompare_matches(noisy_list, &options, NULL);
+    char *matches_snapshot_after = fullcompare_matches(flat_after->list, &options, NULL);
+    expect("snapshot after the changes same as the list", 0, strcmp(matches_list, matches_snapshot_after));
+
+    // add_compare compares with a snapshot from before the image is added, so an exact duplicate is
+    // reported once, with the index, and the image is not matched with itself.
+    Snapshot *snapshot_add = snapshot_pin(sock_fh, corpus);
+    PPM_Info *add_ppm = make_ppm(0);
+    memcpy(add_ppm->data, noisy_added->picinf->data, 3 * COMPARE_SIZE * COMPARE_SIZE);
+    PPM_Info *add_stored = make_ppm(0);
+    memcpy(add_stored->data, add_ppm->data, 3 * COMPARE_SIZE * COMPARE_SIZE);
+    PicInfo *add_pic = PicInfoBuild("noisy_61", add_stored, NULL);
+    PicInfoAddToList(sock_fh, &noisy_list, add_pic);
+    expect("corpus_add add_compare", 0, corpus_add(sock_fh, corpus, add_pic, ++version));
+    Compare_Options add_options;
+    compare_options_init(&add_options);
+    add_options.mode = COMPARE_MODE_ALL;
+    add_options.exact_index = snapshot_add->exact_index;
+    add_options.version = snapshot_add->version;
+    FILE *add_fh = tmpfile();
+    expect("add_compare quickcompare_ppm", 0,
+            quickcompare_ppm(add_fh, snapshot_add->list, COMPARE_TRESHOLD, add_ppm, "noisy_61", &add_options));
+    char *add_output = read_all(add_fh);
+    char *add_duplicate = strstr(add_output, "Match: noisy_61, noisy_60, 0\n");
+    expect("add_compare exact duplicate", 1, add_duplicate != NULL);
+    expect("add_compare exact duplicate once", 1,
+            add_duplicate && !strstr(strchr(add_duplicate, '\n'), "noisy_61, noisy_60"));
+    expect("add_compare not matched with itself", 0, strstr(add_output, "noisy_61, noisy_61") != NULL);
+    free(add_output);
+    ppm_info_free(add_ppm);
+    snapshot_release(snapshot_add);
+    PicInfoDeleteFromList(&noisy_list, "noisy_61");
+    expect("corpus_delete add_compare", 0, corpus_delete(corpus, "noisy_61", ++version));
+
+    snapshot_release(flat);
+    snapshot_release(flat_after);
+    snapshot_release(snapshot);
+    snapshot_release(snapshot_after);
+    expect("snapshots released", 1, corpus->refs);
+    corpus_release(corpus);
+    expect("corpus released the images", 1, noisy_list->refs);
+    free(matches_list);
+    free(matches_snapshot_after);
+
+    // A reader process compares with the images shared in a file, as the server does with its list.
+    char shared_filename[64];
+    sprintf(shared_filename, "/tmp/dids_compare_test_shared_%d", (int) getpid());
+    Shared_Corpus *shared = shared_corpus_create(sock_fh, shared_filename, noisy_list, 1, NULL);
+    expect("shared_corpus_create", 1, shared != NULL);
+    Shared_Reader *reader = shared_reader_create(shared_filename, 4);
+    expect("shared_reader_refresh", 0, shared_reader_refresh(sock_fh, reader));
+    expect("shared reader count", 41, reader->count);
+    expect("shared reader pivots", 1, reader->pivot_table != NULL);
+    Compare_Stats stats_shared = { 0 };
+    char *output_list = compare_all(noisy_list, &stats_shared, NULL);
+    char *output_shared = compare_all(reader->list, &stats_shared, reader->pivot_table);
+    expect("shared reader compares as the list", 0, strcmp(output_list, output_shared));
+    free(output_shared);
+
+    // The reader sees adds and dels once it refreshes.
+    PicInfo *shared_added = PicInfoBuild("noisy_61", make_noisy_ppm(1, 10), NULL);
+    PicInfoAddToList(sock_fh, &noisy_list, shared_added);
+    expect("shared_corpus_add", 0, shared_corpus_add(sock_fh, shared, shared_added, 2));
+    expect("shared_corpus_delete", 0,
+            shared_corpus_delete(sock_fh, shared, PicInfoFindInList(noisy_list, "noisy_01"), 3));
+    PicInfoDeleteFromList(&noisy_list, "noisy_01");
+    expect("shared reader not refreshed", 41, reader->count);
+    expect("shared_reader_refresh after changes", 0, shared_reader_refresh(sock_fh, reader));
+    expect("shared reader count after changes", 41, reader->count);
+    expect("shared reader added", 1, PicInfoFindInList(reader->list, "noisy_61") != NULL);
+    expect("shared reader deleted", 1, PicInfoFindInList(reader->list, "noisy_01") == NULL);
+    expect("shared reader version", 3, reader->header->version);
+    free(output_list);
+    output_list = compare_all(noisy_list, &stats_shared, NULL);
+    output_shared = compare_all(reader->list, &stats_shared, reader->pivot_table);
+    expect("shared reader compares as the list after changes", 0, strcmp(output_list, output_shared));
+    free(output_shared);
+    // Records out of order are added in external_ref order, and deleting the last image moves the tail.
+    PicInfo *shared_middle = PicInfoBuild("noisy_015", make_noisy_ppm(2, 10), NULL);
+    PicInfoAddToList(sock_fh, &noisy_list, shared_middle);
+    expect("shared_corpus_add middle", 0, shared_corpus_add(sock_fh, shared, shared_middle, 4));
+    expect("shared_corpus_delete last", 0, shared_corpus_delete(sock_fh, shared, shared_added, 5));
+    PicInfoDeleteFromList(&noisy_list, "noisy_61");
+    expect("shared_reader_refresh out of order", 0, shared_reader_refresh(sock_fh, reader));
+    expect("shared reader count out of order", 41, reader->count);
+    int shared_order_errors = 0;
+    PicInfo *shared_last = NULL;
+    for (pic = reader->list; pic; pic = pic->next) {
+        if (shared_last && (strcmp(shared_last->external_ref, pic->external_ref) >= 0)) {
+            shared_order_errors++;
+        }
+        shared_last = pic;
+    }
+    expect("shared reader in external_ref order", 0, shared_order_errors);
+    expect("shared reader tail", 1, reader->tail == shared_last);
+    free(output_list);
+    output_list = compare_all(noisy_list, &stats_shared, NULL);
+
+    // A new file replaces the old one, and the reader opens it.
+    shared = shared_corpus_create(sock_fh, shared_filename, noisy_list, 6, shared);
+    expect("shared_corpus_create again", 1, shared != NULL);
+    expect("shared corpus generation", 2, shared->header->generation);
+    expect("shared_reader_refresh new file", 0, shared_reader_refresh(sock_fh, reader));
+    expect("shared reader generation", 2, reader->header->generation);
+    expect("shared reader count in new file", 41, reader->count);
+    output_shared = compare_all(reader->list, &stats_shared, reader->pivot_table);
+    expect("shared reader compares as the list in new file", 0, strcmp(output_list, output_shared));
+    free(output_shared);
+    free(output_list);
+    shared_reader_free(reader);
+    shared_corpus_free(shared, 1);
+    expect("shared corpus removed", -1, access(shared_filename, F_OK));
+
+    // Cancelled before it starts, a fullcompare compares nothing.
+    int cancel = 1;
+    options.cancel = &cancel;
+    Compare_Stats stats_cancelled = { 0 };
+    options.stats = &stats_cancelled;
+    FILE *cancelled_fh = tmpfile();
+    expect("fullcompare cancelled", 6, fullcompare(cancelled_fh, noisy_list, COMPARE_TRESHOLD, 1, &options));
+    expect("fullcompare cancelled pairs", 0, stats_cancelled.pairs);
+    fclose(cancelled_fh);
+    worker_pool_free(pool);
+    free(matches_threads);
+    free(matches_pool);
+    free(matches_snapshot);
+
+    // A thumbnail sent in a frame arrives as it was.
+    unsigned char header_bytes[FRAME_HEADER_BYTES];
+    Frame_Header header = { FRAME_ERROR, 2, 7, 100 }, header_read;
+    frame_header_encode(header_bytes, &header);
+    expect("frame_header_decode", 0, frame_header_decode(header_bytes, &header_read));
+    expect("frame header type", FRAME_ERROR, header_read.type);
+    expect("frame header status", 2, header_read.status);
+    expect("frame header request_id", 7, header_read.request_id);
+    expect("frame header length", 100, header_read.length);
+    expect("frame_header_decode of text", 1, frame_header_decode((unsigned char *) "quickcompare ref", &header_read));
+    Frame_Thumb thumb = { COMPARE_MODE_TOPK, 3, "ref_frame", make_ppm(5) }, thumb_read;
+    unsigned int payload_length = 0;
+    unsigned char *thumb_payload = frame_thumb_encode(&thumb, &payload_length);
+    expect("frame_thumb_encode length", 8 + 9 + 3 * COMPARE_SIZE * COMPARE_SIZE, payload_length);
+    expect("frame_thumb_decode", 0, frame_thumb_decode(thumb_payload, payload_length, &thumb_read));
+    expect("frame thumb topk", 3, thumb_read.topk);
+    expect("frame thumb external_ref", 0, strcmp("ref_frame", thumb_read.external_ref));
+    expect("frame thumb pixels", 0, memcmp(thumb.ppm->data, thumb_read.ppm->data, 3 * COMPARE_SIZE * COMPARE_SIZE));
+    frame_thumb_free(&thumb_read);
+    expect("frame_thumb_decode short", 1, frame_thumb_decode(thumb_payload, payload_length - 1, &thumb_read));
+    free(thumb_payload);
+    ppm_info_free(thumb.ppm);
+
+    // With a frame_reply, the matches are replied as frames, not text.
+    int frame_pipe[2];
+    if (pipe(frame_pipe)) {
+        printf("ERROR: pipe - Failed. Quitting\n");
+        exit(1);
+    }
+    Frame_Connection *connection = frame_connection_create(frame_pipe[1]);
+    close(frame_pipe[1]);
+    Frame_Reply reply = { connection, 9 };
+    Compare_Options frame_options;
+    compare_options_init(&frame_options);
+    frame_options.frame_reply = &reply;
+    expect("exact_index_report with frames", 2, exact_index_report(sock_fh, index, query, &frame_options));
+    expect("exact_index_report with frames, no text", 0, count_matches(sock_fh));
+    expect("frame_reply_done", 0, frame_reply_done(&reply, 3, "Some text\nERROR: no such image\n"));
+    frame_connection_release(connection);
+    unsigned char frame_payload[FRAME_PAYLOAD_MAX + 1];
+    expect("frame_read match", 0, frame_read(frame_pipe[0], &header_read, frame_payload));
+    expect("frame match type", FRAME_MATCH, header_read.type);
+    expect("frame match request_id", 9, header_read.request_id);
+    expect("frame match external_ref", 1, !strcmp("ref_a", (char *) frame_payload + 4)
+            || !strcmp("ref_b", (char *) frame_payload + 4));
+    expect("frame_read second match", 0, frame_read(frame_pipe[0], &header_read, frame_payload));
+    expect("frame_read error", 0, frame_read(frame_pipe[0], &header_read, frame_payload));
+    expect("frame error type", FRAME_ERROR, header_read.type);
+    expect("frame error status", 3, header_read.status);
+    expect("frame error text", 0, strcmp("no such image\n", (char *) frame_payload));
+    expect("frame_read at the end", 1, frame_read(frame_pipe[0], &header_read, frame_payload));
+    close(frame_pipe[0]);
+
+    // Forget ref_b.
+    exact_index_remove(index, ref_b);
+    expect("exact_index_remove entry_count", 2, index->entry_count);
+    expect("exact_index_report after remove", 1, exact_index_report(sock_fh, index, query, NULL));
+    count_matches(sock_fh);
+
+    // The journal: its adds and dels are applied, in order, to the images loaded from SQL.
+    // There is no SQL here, so the writer thread only retries, and every entry is kept.
+    char journal_filename[64];
+    snprintf(journal_filename, sizeof journal_filename, "/tmp/dids_compare_test_%d.journal", (int) getpid());
+    unlink(journal_filename);
+    char *no_sql = "host=/nonexistent_dids_test connect_timeout=1";
+    Journal *journal = journal_open(sock_fh, journal_filename, no_sql);
+    expect("journal_open", 1, journal != NULL);
+    PPM_Info *journal_ppm = make_ppm(7);
+    expect("journal_add", 0, journal_add(sock_fh, journal, "ref_j1", journal_ppm, 1000));
+    expect("journal_add second", 0, journal_add(sock_fh, journal, "ref_j2", journal_ppm, 2000));
+    expect("journal_del", 0, journal_del(sock_fh, journal, "ref_j1"));
+    expect("journal_del with a space", 2, journal_del(sock_fh, journal, "ref j1"));
+    expect("journal_add with a control character", 2, journal_add(sock_fh, journal, "ref\001j4", journal_ppm, 4000));
+    expect("journal_refused_take, none refused", 1, journal_refused_take(journal) == NULL);
+    journal_close(journal);
+
+    // An entry only partly written, as when the server stopped, is dropped on open.
+    FILE *journal_fh = fopen(journal_filename, "a");
+    fprintf(journal_fh, "add ref_j3 3000 16 16 00ff");
+    fclose(journal_fh);
+    journal = journal_open(sock_fh, journal_filename, no_sql);
+    expect("journal_open again", 1, journal != NULL);
+    PicInfo *journal_list = NULL;
+    PicInfoAddToList(sock_fh, &journal_list, PicInfoBuild("ref_j1", make_ppm(2), NULL));
+    expect("journal_replay", 0, journal_replay(sock_fh, journal, journal_hold(journal), &journal_list));
+    expect("journal_replay del", 1, PicInfoFindInList(journal_list, "ref_j1") == NULL);
+    PicInfo *journal_pic = PicInfoFindInList(journal_list, "ref_j2");
+    expect("journal_replay add", 1, journal_pic != NULL);
+    expect("journal_replay created", 2000, journal_pic ? journal_pic->created : 0);
+    expect("journal_replay pixels", 0, journal_pic ? memcmp(journal_ppm->data, journal_pic->picinf->data,
+            3 * COMPARE_SIZE * COMPARE_SIZE) : 1);
+    expect("journal_replay partly written", 1, PicInfoFindInList(journal_list, "ref_j3") == NULL);
+    journal_close(journal);
+    while (journal_list) {
+        PicInfoDeleteFromList(&journal_list, journal_list->external_ref);
+    }
+    ppm_info_free(journal_ppm);
+    unlink(journal_filename);
+
+    exact_index_free(index);
+    fclose(sock_fh);
+    if (error_count) {
+        printf("ERROR: %d tests failed\n", error_count);
+        exit(1);
+    }
+    printf("INFO: End test. All tests passed.\n");
+    exit(0);
+}
@@ -0,0 +1,192 @@
+/*
+ *
+ * This program times how long it takes to make thumbnails from image files,
+ * for each image format (by file extension).
+ *
+ * Each file is decoded with the shortcuts enabled (the JPEG preview inside
+ * camera RAW files, and the EXIF thumbnail of JPEG files) and again with them
+ * disabled, so the speed up can be seen.
+ * The two thumbnails are compared to show how well the shortcut matches,
+ * i.e. the percentage still matched is the match rate against a full decode.
+ *
+ * Usage:
+ *
+ *  ./dids_decode_benchmark <IMAGE_FILENAME> ...
+ *
+ *  ./dids_decode_benchmark IMG_0001.CR2 IMG_0002.NEF holiday.jpg
+ *
+ *
+ *    Copyright (C) 2000-2022  Michael John Bruins, BSc.
+ *
+ *    This program is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License along
+ *    with this program; if not, write to the Free Software Foundation, Inc.,
+ *    51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ */
+
+#define COMPARE_SIZE  16
+#define COMPARE_THRESHOLD 70000
+#define BENCHMARK_REPEAT 3
+#define BENCHMARK_FORMAT_MAX 64
+
+// Standard
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <time.h>
+#include <wand/MagickWand.h>
+
+// Custom
+#include "../src/dids.h"
+
+// Totals for one image format.
+typedef struct Format_Stats {
+    char extension[16];
+    int files;
+    int failed;
+    double seconds_fast;         // Shortcuts enabled.
+    double seconds_full;         // Shortcuts disabled.
+    unsigned long long ssd_total; // Error between the fast and full thumbnails.
+    int matched;                 // Fast and full thumbnails within COMPARE_THRESHOLD.
+} Format_Stats;
+
+Format_Stats format_stats[BENCHMARK_FORMAT_MAX];
+int format_count = 0;
+
+// Find or create the stats for the extension of filename.
+Format_Stats *format_stats_for(char *filename) {
+    char extension[16] = "(none)";
+    char *dot = strrchr(filename, '.');
+    if (dot && strlen(dot + 1) < sizeof extension) {
+        int index;
+        for (index = 0; dot[index + 1]; index++) {
+            extension[index] = tolower((unsigned char) dot[index + 1]);
+        }
+        extension[index] = 0;
+    }
+    int index;
+    for (index = 0; index < format_count; index++) {
+        if (strcmp(format_stats[index].extension, extension) == 0) {
+            return &format_stats[index];
+        }
+    }
+    if (format_count >= BENCHMARK_FORMAT_MAX) {
+        return NULL;
+    }
+    Format_Stats *stats = &format_stats[format_count++];
+    memset(stats, 0, sizeof(Format_Stats));
+    strcpy(stats->extension, extension);
+    return stats;
+}
+
+double seconds_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Make the thumbnail BENCHMARK_REPEAT times, adding the time taken to seconds_ptr.
+// Return the last thumbnail made, or NULL on failure.
+PPM_Info *timed_miniature(FILE *sock_fh, char *filename, double *seconds_ptr) {
+    PPM_Info *ppm = NULL;
+    int repeat;
+    for (repeat = 0; repeat < BENCHMARK_REPEAT; repeat++) {
+        if (ppm) {
+            ppm_info_free(ppm);
+        }
+        double start = seconds_now();
+        ppm = ppm_miniature_from_filename(sock_fh, filename, COMPARE_SIZE);
+        *seconds_ptr += seconds_now() - start;
+        if (!ppm) {
+            return NULL;
+        }
+    }
+    return ppm;
+}
+
+void set_shortcuts(int enabled) {
+    ppm_set_raw_preview(enabled);
+    ppm_set_exif_thumbnail(enabled);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "ERROR: Not enough arguments. Quitting\n");
+        fprintf(stderr, "Usage:\n\n  %s <IMAGE_FILENAME> ...\n\n", argv[0]);
+        exit(1);
+    }
+    // Errors and per image reports from decoding are not part of the results.
+    FILE *sock_fh = fopen("/dev/null", "w");
+    if (!sock_fh) {
+        sock_fh = stderr;
+    }
+
+    MagickWandGenesis();
+    int arg;
+    for (arg = 1; arg < argc; arg++) {
+        char *filename = argv[arg];
+        Format_Stats *stats = format_stats_for(filename);
+        if (!stats) {
+            fprintf(stderr, "ERROR: Too many formats, skipping %s\n", filename);
+            continue;
+        }
+        stats->files++;
+
+        double seconds_fast = 0;
+        double seconds_full = 0;
+        set_shortcuts(1);
+        PPM_Info *ppm_fast = timed_miniature(sock_fh, filename, &seconds_fast);
+        set_shortcuts(0);
+        PPM_Info *ppm_full = timed_miniature(sock_fh, filename, &seconds_full);
+        if (!ppm_fast || !ppm_full) {
+            fprintf(stderr, "ERROR: Failed to make thumbnail from %s\n", filename);
+            stats->failed++;
+        } else {
+            unsigned int ssd = PPM_compare(sock_fh, ppm_fast, ppm_full, UINT_MAX);
+            stats->seconds_fast += seconds_fast;
+            stats->seconds_full += seconds_full;
+            stats->ssd_total += ssd;
+            if (ssd < COMPARE_THRESHOLD) {
+                stats->matched++;
+            }
+        }
+        if (ppm_fast) {
+            ppm_info_free(ppm_fast);
+        }
+        if (ppm_full) {
+            ppm_info_free(ppm_full);
+        }
+    }
+    MagickWandTerminus();
+
+    printf("%-8s %6s %6s %12s %12s %8s %12s %8s\n", "format", "files", "failed", "fast_ms",
+            "full_ms", "speedup", "mean_ssd", "matched");
+    int index;
+    for (index = 0; index < format_count; index++) {
+        Format_Stats *stats = &format_stats[index];
+        int decoded = stats->files - stats->failed;
+        if (decoded == 0) {
+            printf("%-8s %6d %6d\n", stats->extension, stats->files, stats->failed);
+            continue;
+        }
+        double fast_ms = stats->seconds_fast * 1000 / (decoded * BENCHMARK_REPEAT);
+        double full_ms = stats->seconds_full * 1000 / (decoded * BENCHMARK_REPEAT);
+        printf("%-8s %6d %6d %12.2f %12.2f %7.1fx %12llu %7.1f%%\n", stats->extension, stats->files,
+                stats->failed, fast_ms, full_ms, fast_ms > 0 ? full_ms / fast_ms : 0,
+                stats->ssd_total / decoded, 100.0 * stats->matched / decoded);
+    }
+    exit(0);
+}
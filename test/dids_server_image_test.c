@@ -80,6 +80,11 @@ int main(int argc, char *argv[]) {
                 sql_info);
         exit(1);
     }
+    if (ppm_sql_prepare(sock_fh, psql)) {
+        fprintf(sock_fh, "ERROR: ppm_sql_prepare - Failed. Quitting\n");
+        ppm_sql_disconnect(sock_fh, psql);
+        exit(1);
+    }
 
     MagickWandGenesis();
 
@@ -105,7 +110,7 @@ int main(int argc, char *argv[]) {
     // Look for the same ppm image as we have just added to the list.
     // Of course it should find the image in the list.
     PicInfo *pic = PicInfoBuild("ref-2", ppm,NULL);
-    PicInfo *closest = CompareToList(sock_fh, pic, list, maxerr);
+    PicInfo *closest = CompareToList(sock_fh, pic, list, maxerr, NULL);
     if (closest) {
         fprintf(sock_fh, "SUCCESS: CompareToList - We found a similar image.\n");
     } else {
@@ -121,6 +126,30 @@ int main(int argc, char *argv[]) {
     }
     fprintf(sock_fh, "SUCCESS: ppm_store - Storing PPM in SQL.\n");
 
+    // A batch, in one transaction: replace ref-1, add ref-2, then delete ref-1.
+    char *hexdata = ppm_to_hexdata(ppm);
+    PPM_Write writes[] = {
+        { 1, "ref-1", 1000, ppm->width, ppm->height, hexdata },
+        { 1, "ref-2", 2000, ppm->width, ppm->height, hexdata },
+        { 0, "ref-1", 0, 0, 0, NULL },
+    };
+    status = ppm_write_batch(sock_fh, psql, writes, 3);
+    free(hexdata);
+    if (status != 0) {
+        fprintf(sock_fh, "ERROR: ppm_write_batch - Failed with code %d. Quitting\n", status);
+        ppm_sql_disconnect(sock_fh, psql);
+        exit(1);
+    }
+    PPM_Info *ppm_ref_1 = ppm_load_from_sql(sock_fh, psql, "ref-1");
+    PPM_Info *ppm_ref_2 = ppm_load_from_sql(sock_fh, psql, "ref-2");
+    if (ppm_ref_1 || !ppm_ref_2) {
+        fprintf(sock_fh, "ERROR: ppm_write_batch - ref-1 should be deleted, and ref-2 added.\n");
+        ppm_sql_disconnect(sock_fh, psql);
+        exit(1);
+    }
+    ppm_info_free(ppm_ref_2);
+    fprintf(sock_fh, "SUCCESS: ppm_write_batch - Writing a batch to SQL.\n");
+
     // Finished testing
     MagickWandTerminus();
     fprintf(sock_fh, "INFO: disconnecting SQL\n");